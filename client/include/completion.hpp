@@ -0,0 +1,27 @@
+#pragma once
+#include <asio.hpp>
+
+// one-shot event for coroutines on the client's io thread: wait() completes once set() was called,
+// at once when it already was. any number of coroutines may wait
+class Completion {
+public:
+    explicit Completion(asio::io_context &io) : _timer(io, asio::steady_timer::time_point::max()), _set(false) {}
+
+    void set() {
+        _set = true;
+        _timer.cancel();
+    }
+    inline bool isSet() const {return _set;}
+
+    asio::awaitable<void> wait() {
+        // the timer never expires, set() cancels it
+        while (!_set) {
+            asio::error_code ec;
+            co_await _timer.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+        }
+    }
+
+private:
+    asio::steady_timer _timer;
+    bool _set;
+};
@@ -0,0 +1,130 @@
+#pragma once
+#include <asio.hpp>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <chrono>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+#include "minidrive/async_socket.hpp"
+#include "minidrive/transfer.hpp"
+#include "completion.hpp"
+
+// client side of an UPLOAD or DOWNLOAD striped over the control connection and
+// extra data connections; streams are added while they raise the measured throughput.
+// lives on the client's single io thread, like everything else in the client
+class StripedTransfer : public std::enable_shared_from_this<StripedTransfer> {
+public:
+    enum class direction {UPLOAD, DOWNLOAD};
+    // where data connections go: the server's resolved TCP addresses or its Unix domain socket
+    using Endpoints = std::vector<asio::generic::stream_protocol::endpoint>;
+
+    StripedTransfer(asio::io_context &io, AsyncSocket &control, Endpoints endpoints,
+        direction dir, int fd, uint64_t size, size_t maxStreams, bool compression, bool sparse);
+    ~StripedTransfer();
+    // before begin(): moves only `chunks`, the others are already the same on both sides and `tags`
+    // holds the local tags of all chunks, to hash the whole file
+    void setChunks(std::vector<uint64_t> chunks, std::vector<minidrive::ChunkTag> tags);
+    // before begin() of an upload: sorted indices of the chunks in holes of the local file, announced
+    // in UPLOAD and never read or sent
+    void setHoles(std::vector<uint64_t> holes);
+
+    // io thread: the server's reply to UPLOAD/DOWNLOAD, starts the transfer
+    void begin(const nlohmann::json &reply);
+    // io thread: a DATA frame arrived on any connection
+    void onChunk(const MsgPayload &payload);
+    // the control connection has room for more chunks
+    void onControlWriteDone();
+    // io thread: TRANSFER event from the server
+    void onEvent(const nlohmann::json &event);
+    // io thread: RESEND event, the server got a damaged chunk of an upload
+    void onResend(const nlohmann::json &event);
+
+    // completes once the transfer finished, true on success
+    asio::awaitable<bool> wait();
+    inline bool started() const {return _started;}
+    inline bool done() const {return _done;}
+    inline uint32_t id() const {return _id;}
+    inline uint32_t code() const {return _code;}
+    inline const std::string& message() const {return _message;}
+    inline uint64_t size() const {return _size;}
+    // bytes received, or handed to the sockets for an upload
+    inline uint64_t bytesDone() const {return _bytesDone;}
+    inline size_t streams() const {return _maxUsedStreams;}
+    // chunk bytes sent or received, less than size() when chunks were compressed
+    inline uint64_t wireBytes() const {return _wireBytes;}
+    // bytes of zeros that were neither sent nor written, left as holes on the receiving side
+    inline uint64_t holeBytes() const {return _holeBytes;}
+    // hash of the file, computed from the chunk tags while they were sent or received
+    inline const std::string& hash() const {return _hash;}
+    double seconds() const;
+
+private:
+    // a data connection; streams never outlive their transfer
+    struct Stream : SocketListener {
+        StripedTransfer *transfer = nullptr;
+        std::unique_ptr<AsyncSocket> socket;
+        bool joined = false;
+        bool compression = false;
+
+        void onMessage(data_type type, std::shared_ptr<MsgPayload> payload) override;
+        void onReadError(const asio::error_code &ec) override;
+        void onWriteError(const asio::error_code &ec) override;
+        void onWriteDone() override;
+    };
+
+    void _pump(AsyncSocket &socket, bool compression);
+    void _addStream();
+    void _adapt(const asio::error_code &ec);
+    void _finish(uint32_t code, const std::string &message);
+
+    inline static const std::chrono::milliseconds ADAPT_PERIOD{500};
+    // streams are added only while the last one raised throughput by this factor
+    inline static const double ADAPT_GAIN = 1.1;
+
+    asio::io_context &_io;
+    AsyncSocket &_control;
+    Endpoints _endpoints;
+    asio::steady_timer _adaptTimer;
+
+    direction _direction;
+    int _fd;
+    uint64_t _size;
+    size_t _maxStreams;
+    uint32_t _id;
+    uint32_t _chunkSize;
+    std::string _token;
+    // negotiated on the control connection, data connections negotiate in JOIN
+    bool _compression;
+    // chunks of zeros are sent as just their header and received ones punched as holes
+    bool _sparse;
+
+    std::vector<std::shared_ptr<Stream>> _streams;
+    size_t _maxUsedStreams;
+    // set by setChunks(), _nextChunk then indexes _chunks
+    bool _partial;
+    std::vector<uint64_t> _chunks;
+    std::vector<minidrive::ChunkTag> _localTags;
+    std::vector<uint64_t> _holes;
+    uint64_t _nextChunk;
+    std::vector<bool> _received;
+    // offsets of damaged upload chunks, sent before new ones
+    std::deque<uint64_t> _resend;
+    unsigned _damaged;
+    minidrive::FileHasher _hasher;
+    std::string _hash;
+    uint64_t _bytesDone;
+    uint64_t _wireBytes;
+    uint64_t _holeBytes;
+    uint64_t _lastBytes;
+    double _lastRate;
+    bool _growing;
+    std::chrono::steady_clock::time_point _startTime, _endTime;
+
+    bool _started;
+    bool _done;
+    Completion _completed;
+    uint32_t _code;
+    std::string _message;
+};
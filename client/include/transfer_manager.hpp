@@ -0,0 +1,67 @@
+#pragma once
+#include <asio.hpp>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <chrono>
+#include <nlohmann/json.hpp>
+#include "minidrive/async_socket.hpp"
+#include "completion.hpp"
+#include "transfer.hpp"
+
+// runs the client's commands as concurrent jobs on the io thread. a job first waits for every earlier
+// job that touches the same remote path, one of its ancestors or descendants, or the same local file,
+// so a script gives the same result as running its lines one by one while unrelated transfers overlap.
+// routes DATA frames and events of the control connection to the running transfers
+class TransferManager {
+public:
+    struct Job {
+        Job(asio::io_context &io) : finished(io) {}
+
+        unsigned number = 0;
+        std::string description;
+        std::vector<std::string> remote;
+        std::vector<std::string> local;
+        // set while the job moves a file
+        std::shared_ptr<StripedTransfer> transfer;
+        std::chrono::steady_clock::time_point startTime;
+        bool running = false;
+        Completion finished;
+    };
+
+    TransferManager(asio::io_context &io);
+
+    // registers a job touching `remote` paths on the server and `local` files, in command order
+    std::shared_ptr<Job> add(std::string description, std::vector<std::string> remote, std::vector<std::string> local);
+    // runs `body` once the job's turn came, the job is gone when it returns or throws
+    void start(std::shared_ptr<Job> job, asio::awaitable<void> body);
+    // completes once every job registered so far finished
+    asio::awaitable<void> waitAll();
+    inline size_t size() const {return _jobs.size();}
+
+    // a DATA frame on the control connection
+    void onChunk(const MsgPayload &payload);
+    // a TRANSFER or RESEND event
+    void onEvent(const nlohmann::json &event);
+    // the control connection has room for more upload chunks
+    void onControlWriteDone();
+
+    // one line per job: what it does and how far its transfer got
+    void printJobs() const;
+    // prints the progress of running transfers every `period` while there are any
+    asio::awaitable<void> reportProgress(std::chrono::milliseconds period);
+
+private:
+    asio::awaitable<void> _run(std::shared_ptr<Job> job, asio::awaitable<void> body);
+    bool _conflicts(const Job &a, const Job &b) const;
+    StripedTransfer* _find(uint32_t id) const;
+    void _printProgress(const Job &job) const;
+
+    asio::io_context &_io;
+    // in command order
+    std::deque<std::shared_ptr<Job>> _jobs;
+    unsigned _nextNumber;
+    // uploads share the control connection's window, each write wakes them starting from a different one
+    size_t _rotation;
+};
@@ -1,11 +1,19 @@
 #include <iostream>
 #include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
 #include <optional>
+#include <functional>
 #include <sstream>
-#include <thread>
-#include <mutex>
-#include <condition_variable>
-#include <atomic>
+#include <memory>
+#include <chrono>
+#include <filesystem>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <asio.hpp>
 #include <spdlog/spdlog.h>
 #include <spdlog/sinks/stdout_color_sinks.h>
@@ -14,40 +22,56 @@
 #include "minidrive/version.hpp"
 #include "minidrive/error_codes.hpp"
 #include "minidrive/async_socket.hpp"
+#include "minidrive/transfer.hpp"
+#include "minidrive/merkle.hpp"
+#include "minidrive/rate_limit.hpp"
+#include "completion.hpp"
+#include "transfer.hpp"
+#include "transfer_manager.hpp"
 
 using json = nlohmann::json;
 using asio::ip::tcp;
+using Job = TransferManager::Job;
 
 struct Args {
     std::string username{};
     std::string host{};
     std::string port{};
+    // set instead of host and port for a server on this host
+    std::string unixPath{};
 };
 
-enum class State {AUTH, REG, COMMAND};
-
-
-State state;
-std::atomic<bool> _running;
-std::mutex _mutex;
-std::condition_variable _cv;
-std::atomic<bool> _waitForReply, _replyArrived;
-json _lastReply;
-
+// everything below runs on the one thread that runs _io, only local files are hashed on _workers
 asio::io_context *_io;
+asio::thread_pool *_workers;
+StripedTransfer::Endpoints _endpoints;
+AsyncSocket *_client;
+TransferManager *_transfers;
+// maximum number of extra data connections per transfer
+size_t _maxStreams = 4;
+// offer compressed DATA at AUTH, and whether the server agreed
+bool _offerCompression = true;
+bool _compression = false;
+// skip holes and chunks of zeros instead of sending them, and leave them as holes when receiving
+bool _sparse = true;
+
+// a command waiting for its reply; the server answers the commands of a connection in order
+struct PendingReply {
+    explicit PendingReply(asio::io_context &io) : arrived(io) {}
+
+    json reply;
+    // runs as soon as the reply was read, before the next frame
+    std::function<void(const json&)> onReply;
+    Completion arrived;
+};
+std::deque<std::shared_ptr<PendingReply>> _pendingReplies;
+
+const std::chrono::milliseconds PROGRESS_PERIOD{2000};
 
 void stop() {
-    _running = false;
     _io->stop();
 }
 
-void sendMessage(AsyncSocket &client, const std::string &cmd, json &&args) {
-    json msg;
-    msg["cmd"] = cmd;
-    msg["args"] = std::move(args);
-    client.sendMessage(msg.dump());
-}
-
 void processMessage(const MsgPayload &payload) {
     json data;
     try {
@@ -59,133 +83,502 @@ void processMessage(const MsgPayload &payload) {
     
     spdlog::debug("msg: '{}'", data.dump());
 
-    std::lock_guard lock(_mutex);
-    if (!_waitForReply) {
+    if (data.contains("event")) {
+        if (data["event"] == "PROGRESS") {
+            const json &progress = data["data"];
+            std::cout << "... " << progress.value("files", 0) << " files, " << progress.value("bytes", 0)
+                      << " bytes" << std::endl;
+        } else {
+            _transfers->onEvent(data);
+        }
+        return;
+    }
+    if (_pendingReplies.empty()) {
         spdlog::warn("unwanted message arrived");
         return;
     }
+    auto pending = std::move(_pendingReplies.front());
+    _pendingReplies.pop_front();
+    // the reply to UPLOAD/DOWNLOAD starts the transfer here, before the next frame is read
+    if (pending->onReply) pending->onReply(data);
+    pending->reply = std::move(data);
+    pending->arrived.set();
+}
+
+// events of the control connection
+struct ControlListener : SocketListener {
+    void onMessage(data_type type, std::shared_ptr<MsgPayload> payload) override {
+        switch(type) {
+        case data_type::COMMAND:
+            spdlog::debug("msg type: {}, payload length: {}", static_cast<uint32_t>(type), payload->size());
+            processMessage(*payload);
+            break;
+        case data_type::DATA:
+            _transfers->onChunk(*payload);
+            break;
+        default:
+            break;
+        }
+    }
+    void onReadError(const asio::error_code &ec) override {
+        if (ec == asio::error::eof) {
+            spdlog::info("server disconnected");
+        } else {
+            spdlog::error("{}", ec.message());
+        }
+        stop();
+    }
+    void onWriteError(const asio::error_code &ec) override {
+        onReadError(ec);
+    }
+    void onWriteDone() override {
+        _transfers->onControlWriteDone();
+    }
+};
+
+// sends a message and completes with its reply
+asio::awaitable<json> roundTrip(json msg, std::function<void(const json&)> onReply = nullptr) {
+    auto pending = std::make_shared<PendingReply>(*_io);
+    pending->onReply = std::move(onReply);
+    _pendingReplies.push_back(pending);
+    _client->sendMessage(msg.dump());
+    co_await pending->arrived.wait();
+    co_return std::move(pending->reply);
+}
 
-    _replyArrived = true;
-    _waitForReply = false;
-    _lastReply = std::move(data);
-    _cv.notify_one();
+asio::awaitable<json> request(std::string cmd, json args, std::function<void(const json&)> onReply = nullptr) {
+    json msg;
+    msg["cmd"] = std::move(cmd);
+    msg["args"] = std::move(args);
+    co_return co_await roundTrip(std::move(msg), std::move(onReply));
 }
 
-// bool handleAuth(AsyncSocket &client, const Args &args) {
-//     if (args.username.empty()) { // public mode
-//         spdlog::warn("operating in public mode - files are visible to everyone");
+void printReply(const json &reply) {
+    int code = reply.value("code", -1);
+    std::string message = reply.value("message", std::string());
+    if (code == 0) {
+        std::cout << "OK\n";
+        std::cout << message << std::endl;
+    } else {
+        std::cout << "ERROR: " << code << '\n';
+        std::cout << "primary message\n";
+        std::cout << message << std::endl;
+    }
+}
 
-//     }
-// }
+// a command with a plain reply
+asio::awaitable<void> runCommand(std::string cmd, json args) {
+    printReply(co_await request(std::move(cmd), std::move(args)));
+}
 
-void userThread(AsyncSocket &client, const Args &args) {
-    while (_running) {
+// what the user stores on the server and the quota
+asio::awaitable<void> runUsage() {
+    json reply = co_await request("USAGE", json::object());
+    printReply(reply);
+    const json &data = reply.contains("data") ? reply["data"] : json::object();
+    if (reply.value("code", -1) != 0 || !data.is_object()) co_return;
+    uint64_t quota = data.value("quota", uint64_t(0));
+    std::cout << data.value("bytes", int64_t(0)) << " bytes in " << data.value("files", int64_t(0)) << " files, quota "
+              << (quota ? std::to_string(quota) + " bytes" : std::string("unlimited")) << std::endl;
+}
 
-        std::unique_lock lock(_mutex);
-        if (_waitForReply) {
-            _cv.wait(lock, [] {return _replyArrived.operator bool();});
+// server counters, one line per group
+asio::awaitable<void> runStats() {
+    json reply = co_await request("STATS", json::object());
+    printReply(reply);
+    const json &data = reply.contains("data") ? reply["data"] : json::object();
+    if (reply.value("code", -1) != 0 || !data.is_object()) co_return;
+    for (const auto &[group, counters] : data.items()) {
+        std::cout << group << ':';
+        for (const auto &[name, value] : counters.items()) {
+            std::cout << ' ' << name << '=' << (value.is_string() ? value.get<std::string>() : value.dump());
         }
+        std::cout << '\n';
+    }
+    std::cout << std::flush;
+}
 
-        if (_replyArrived) {
-            // react to reply
-            _replyArrived = false;
+// entries below `path` whose name matches `pattern`, directories end in '/'
+asio::awaitable<void> runFind(std::string pattern, std::string path) {
+    json args = { {"pattern", pattern}, {"path", path} };
+    json reply = co_await request("FIND", std::move(args));
+    const json &data = reply.contains("data") ? reply["data"] : json::object();
+    if (reply.value("code", -1) != 0 || !data.is_object() || !data.contains("matches")) {
+        printReply(reply);
+        co_return;
+    }
+    std::cout << "OK" << std::endl;
+    for (const auto &match : data["matches"]) {
+        bool dir = match.value("type", 0) == static_cast<int>(std::filesystem::file_type::directory);
+        std::cout << match.value("path", std::string()) << (dir ? "/" : "") << '\n';
+    }
+    if (data.value("truncated", false)) std::cout << "(more matches not shown)\n";
+    std::cout << std::flush;
+}
 
-            std::string status = _lastReply["status"];
-            int code = _lastReply["code"];
-            std::string message = _lastReply["message"];
+// chunks that differ between a local file and its remote copy, found by comparing hash trees
+struct Delta {
+    uint64_t remoteSize = 0;
+    uint32_t chunkSize = 0;
+    std::string root;
+    // remote chunks that are missing or different locally
+    std::vector<uint64_t> differing;
+    // the local file's tags, cut into chunkSize chunks
+    std::vector<minidrive::ChunkTag> localTags;
+    uint64_t localSize = 0;
+};
 
-            if (code == 0) {
-                std::cout << "OK\n";
-                std::cout << message << std::endl;
-            } else {
-                std::cout << "ERROR: " << code << '\n';
-                std::cout << "primary message\n";
-                std::cout << message << std::endl;
-            }
+// fills in the local size and tags of `delta`, on the worker pool; returns an error message
+asio::awaitable<std::string> hashLocal(std::string local, Delta *delta) {
+    int fd = open(local.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        std::string error = local + ": " + std::strerror(errno);
+        if (fd >= 0) close(fd);
+        co_return error;
+    }
+    delta->localSize = static_cast<uint64_t>(st.st_size);
+    std::vector<uint8_t> chunk(delta->chunkSize);
+    for (uint64_t offset = 0; offset < delta->localSize; offset += delta->chunkSize) {
+        uint32_t len = minidrive::chunkLength(delta->localSize, delta->chunkSize, offset);
+        size_t done = 0;
+        while (done < len) {
+            ssize_t n = pread(fd, chunk.data() + done, len - done, static_cast<off_t>(offset + done));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            done += static_cast<size_t>(n);
+        }
+        if (done < len) {
+            close(fd);
+            co_return local + ": read failed";
+        }
+        delta->localTags.push_back(minidrive::chunkTag(chunk.data(), len));
+    }
+    close(fd);
+    co_return std::string();
+}
 
-            switch(state) {
-            case State::AUTH:
-            {
-                if (code == 0) {
-                    spdlog::info("auth success");
-                    state = State::COMMAND;
-                } else if (code == minidrive::error::USER_NOT_FOUND.code()) {
-                    spdlog::info("user not found");
-                    state = State::REG;   
-                }
-            }
-                break;
-            
-            
-            case State::COMMAND:
-                spdlog::info("received this shit: {}", _lastReply.dump());
-                break;
-
-            
+asio::awaitable<std::optional<Delta>> compareTrees(std::string local, std::string remote) {
+    json args = { {"path", remote} };
+    json reply = co_await request("TREE", std::move(args));
+    if (reply["code"] != 0) {
+        std::cout << "ERROR: " << reply["code"] << '\n' << reply.value("message", std::string()) << std::endl;
+        co_return std::nullopt;
+    }
+    Delta delta;
+    const json &data = reply["data"];
+    delta.remoteSize = data["size"];
+    delta.chunkSize = data["chunk_size"];
+    delta.root = data["root"];
+
+    // reading a large file would stall every other job on the io thread
+    std::string error = co_await asio::co_spawn(*_workers, hashLocal(local, &delta), asio::use_awaitable);
+    if (!error.empty()) {
+        std::cout << "ERROR: " << minidrive::error::TRANSFER_FAILED.code() << '\n' << error << std::endl;
+        co_return std::nullopt;
+    }
+
+    // the local tree takes the remote's shape, chunks past the local end never match
+    std::vector<minidrive::ChunkTag> leaves(minidrive::chunkCount(delta.remoteSize, delta.chunkSize));
+    std::copy_n(delta.localTags.begin(), std::min(leaves.size(), delta.localTags.size()), leaves.begin());
+    minidrive::MerkleTree tree(std::move(leaves));
+    minidrive::TreeDiff diff(tree);
+    bool changed = false;
+    while (!diff.done() && !changed) {
+        const auto &indices = diff.suspects();
+        std::vector<minidrive::ChunkTag> hashes;
+        for (size_t first = 0; first < indices.size(); first += minidrive::MAX_TREE_QUERY) {
+            size_t count = std::min(minidrive::MAX_TREE_QUERY, indices.size() - first);
+            json nodes(std::vector<uint64_t>(indices.begin() + static_cast<std::ptrdiff_t>(first),
+                indices.begin() + static_cast<std::ptrdiff_t>(first + count)));
+            json query = { {"path", remote}, {"level", diff.level()}, {"nodes", std::move(nodes)} };
+            json part = co_await request("TREE", std::move(query));
+            changed = part["code"] != 0 || part["data"].value("root", std::string()) != delta.root;
+            if (changed) break;
+            for (const auto &hex : part["data"]["hashes"]) {
+                auto tag = minidrive::tagFromHex(hex.get<std::string>());
+                if (tag) hashes.push_back(*tag);
             }
-            
+        }
+        changed = changed || !diff.next(hashes);
+    }
+    if (changed) {
+        std::cout << "ERROR: " << minidrive::error::TRANSFER_FAILED.code() << "\nremote file changed while comparing" << std::endl;
+        co_return std::nullopt;
+    }
+    delta.differing = diff.differing();
+    co_return delta;
+}
 
+asio::awaitable<void> runVerify(std::string local, std::string remote) {
+    auto delta = co_await compareTrees(local, remote);
+    if (!delta) co_return;
+    std::cout << "OK\n";
+    if (delta->differing.empty() && delta->localSize == delta->remoteSize) {
+        std::cout << "identical, root " << delta->root << std::endl;
+        co_return;
+    }
+    if (delta->localSize != delta->remoteSize) {
+        std::cout << "size differs: " << delta->localSize << " local, " << delta->remoteSize << " remote\n";
+    }
+    // consecutive chunks are reported as one byte range
+    const auto &chunks = delta->differing;
+    std::cout << chunks.size() << " of " << minidrive::chunkCount(delta->remoteSize, delta->chunkSize) << " chunks differ";
+    for (size_t i = 0; i < chunks.size();) {
+        size_t j = i;
+        while (j + 1 < chunks.size() && chunks[j + 1] == chunks[j] + 1) ++j;
+        uint64_t end = std::min(delta->remoteSize, (chunks[j] + 1) * delta->chunkSize);
+        std::cout << (i == 0 ? ": " : ", ") << chunks[i] * delta->chunkSize << "-" << end;
+        i = j + 1;
+    }
+    std::cout << std::endl;
+}
+
+asio::awaitable<void> runTransfer(std::shared_ptr<Job> job, StripedTransfer::direction dir, std::string local,
+        std::string remote, std::optional<Delta> delta = std::nullopt) {
+    bool upload = dir == StripedTransfer::direction::UPLOAD;
+    int fd = upload ? open(local.c_str(), O_RDONLY | O_CLOEXEC)
+         : delta ? open(local.c_str(), O_WRONLY | O_CLOEXEC)
+                 : open(local.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cout << '[' << job->number << "] ERROR: " << minidrive::error::TRANSFER_FAILED.code() << '\n';
+        std::cout << local << ": " << std::strerror(errno) << std::endl;
+        co_return;
+    }
+    uint64_t size = 0;
+    if (upload) {
+        struct stat st;
+        fstat(fd, &st);
+        size = static_cast<uint64_t>(st.st_size);
+    }
+
+    auto transfer = std::make_shared<StripedTransfer>(*_io, *_client, _endpoints, dir, fd, size, _maxStreams, _compression, _sparse);
+    json args = { {"path", remote} };
+    if (upload) args["size"] = size;
+    if (upload && !delta && _sparse) {
+        auto holes = minidrive::holeChunks(fd, size, minidrive::CHUNK_SIZE);
+        if (!holes.empty()) {
+            args["holes"] = minidrive::toRanges(holes);
+            transfer->setHoles(std::move(holes));
         }
-        else {
-            // just proccess commands
-            switch(state) {
-            case State::AUTH:
-            {
-                json msg;
-                msg["cmd"] = "AUTH";
-                msg["mode"] = "private";
-                msg["args"] = { {"username", args.username}, {"password", "1234"} };
-                client.sendMessage(msg.dump());
-                _waitForReply = true;
-            }
-                break;
-            case State::REG:
-            {
-                std::cout << "user not found, register?" << std::endl;
-                state = State::COMMAND;
+    }
+    if (delta) {
+        transfer->setChunks(delta->differing, delta->localTags);
+        args["chunks"] = delta->differing;
+        args["root"] = delta->root;
+    }
+    job->transfer = transfer;
+    // named, gcc 12 destroys the captures of a lambda converted inside a co_await expression twice
+    std::function<void(const json&)> begin = [transfer](const json &reply) {transfer->begin(reply);};
+    co_await request(upload ? "UPLOAD" : "DOWNLOAD", std::move(args), std::move(begin));
+    bool ok = co_await transfer->wait();
+
+    if (ok) {
+        // a repair or resume moves only the differing chunks
+        uint64_t bytes = transfer->size();
+        if (delta) {
+            bytes = 0;
+            for (uint64_t chunk : delta->differing) {
+                bytes += minidrive::chunkLength(transfer->size(), delta->chunkSize, chunk * delta->chunkSize);
             }
-                break;
-
-            case State::COMMAND:
-            {
-                std::cout << "> ";
-
-                std::string line;
-                std::getline(std::cin, line);
-                    
-                std::stringstream ss;
-                ss << line;
-        
-                std::string cmd;
-                ss >> cmd;
-                spdlog::debug("requested cmd: {}", cmd);
-                if (cmd == "LIST") {
-                    json msg;
-                    msg["cmd"] = "LIST";
-                    msg["args"] = { {"path", ""}};
-                    client.sendMessage(msg.dump());
-                    _waitForReply = true;
-                }
-                else if (cmd == "EXIT") {
-                    stop();
-                }
-                else {
-                    spdlog::warn("unknown command");
-                }
+        }
+        double mib = static_cast<double>(bytes) / (1024 * 1024);
+        std::cout << '[' << job->number << "] OK\n";
+        std::cout << (upload ? "uploaded " : "downloaded ") << bytes << " bytes in "
+                  << transfer->seconds() << " s (" << mib / std::max(transfer->seconds(), 1e-9) << " MiB/s, "
+                  << transfer->streams() + 1 << " connections";
+        if (delta) std::cout << ", " << delta->differing.size() << " chunks";
+        if (transfer->wireBytes() + transfer->holeBytes() < bytes) std::cout << ", " << transfer->wireBytes() << " bytes compressed";
+        if (transfer->holeBytes() > 0) std::cout << ", " << transfer->holeBytes() << " bytes of holes";
+        std::cout << ")\n";
+        std::cout << "hash " << transfer->hash() << std::endl;
+    } else {
+        std::cout << '[' << job->number << "] ERROR: " << transfer->code() << '\n';
+        std::cout << transfer->message() << std::endl;
+        // a partial download is kept for the next RESUME
+        if (!upload && !delta) unlink(local.c_str());
+    }
+}
 
-            }
-                break;
-            
-            }
+// uploads or downloads only the chunks that differ from the other side
+asio::awaitable<void> runRepair(std::shared_ptr<Job> job, StripedTransfer::direction dir, std::string local, std::string remote) {
+    auto delta = co_await compareTrees(local, remote);
+    if (!delta) co_return;
+    if (dir == StripedTransfer::direction::UPLOAD) {
+        // the remote file takes the local size, chunks past its old end are all new
+        uint64_t localChunks = minidrive::chunkCount(delta->localSize, delta->chunkSize);
+        std::vector<uint64_t> chunks;
+        for (uint64_t index : delta->differing) {
+            if (index < localChunks) chunks.push_back(index);
+        }
+        for (uint64_t index = minidrive::chunkCount(delta->remoteSize, delta->chunkSize); index < localChunks; ++index) {
+            chunks.push_back(index);
         }
+        delta->differing = std::move(chunks);
+    }
+    if (delta->differing.empty() && delta->localSize == delta->remoteSize) {
+        std::cout << "OK\nidentical, nothing to transfer" << std::endl;
+        co_return;
+    }
+    co_await runTransfer(std::move(job), dir, std::move(local), std::move(remote), std::move(delta));
+}
 
+// the next line of stdin without its newline, nullopt at the end of input
+asio::awaitable<std::optional<std::string>> readLine(asio::posix::stream_descriptor &input, std::string &buffer) {
+    asio::error_code ec;
+    size_t n = co_await asio::async_read_until(input, asio::dynamic_buffer(buffer), '\n',
+        asio::redirect_error(asio::use_awaitable, ec));
+    if (ec) {
+        // the last line may lack its newline
+        if (ec != asio::error::eof || buffer.empty()) co_return std::nullopt;
+        n = buffer.size();
+    }
+    std::string line = buffer.substr(0, n);
+    buffer.erase(0, n);
+    if (!line.empty() && line.back() == '\n') line.pop_back();
+    co_return line;
+}
 
+// reads commands and starts each one as a job, the prompt comes back while transfers run
+asio::awaitable<void> commandLoop(Args args) {
+    json msg;
+    msg["cmd"] = "AUTH";
+    if (args.username.empty()) {
+        std::cout << "[warning] operating in public mode - files are visible to everyone" << std::endl;
+        msg["mode"] = "public";
+    } else {
+        msg["mode"] = "private";
+        msg["args"] = { {"username", args.username}, {"password", "1234"} };
+    }
+    if (_offerCompression) msg["compression"] = json::array({minidrive::COMPRESSION_LZ});
+    json reply = co_await roundTrip(std::move(msg));
+    printReply(reply);
+    int code = reply.value("code", -1);
+    if (code == 0) {
+        spdlog::info("auth success");
+        const json &data = reply.contains("data") ? reply["data"] : json::object();
+        _compression = data.is_object() && data.value("compression", "") == minidrive::COMPRESSION_LZ;
+    } else if (reply["code"] == minidrive::error::USER_NOT_FOUND.code()) {
+        spdlog::info("user not found");
+        std::cout << "user not found, register?" << std::endl;
+    } else {
+        stop();
+        co_return;
+    }
 
+    // also works when stdin is a regular file, asio then treats it as always ready
+    asio::posix::stream_descriptor input(*_io, dup(STDIN_FILENO));
+    std::string buffer;
+    while (true) {
+        std::cout << "> " << std::flush;
+        auto line = co_await readLine(input, buffer);
+        if (!line) break;
+
+        std::stringstream ss;
+        ss << *line;
+
+        std::string cmd;
+        ss >> cmd;
+        spdlog::debug("requested cmd: {}", cmd);
+        if (cmd == "LIST") {
+            auto job = _transfers->add(*line, {""}, {});
+            _transfers->start(job, runCommand("LIST", { {"path", ""} }));
+        }
+        else if (cmd == "UPLOAD" || cmd == "DOWNLOAD") {
+            std::string src, dst;
+            ss >> src >> dst;
+            if (src.empty()) {
+                spdlog::warn("usage: {} <source> [destination]", cmd);
+                continue;
+            }
+            if (dst.empty()) dst = std::filesystem::path(src).filename().string();
+            if (cmd == "UPLOAD") {
+                auto job = _transfers->add(*line, {dst}, {src});
+                _transfers->start(job, runTransfer(job, StripedTransfer::direction::UPLOAD, src, dst));
+            } else {
+                auto job = _transfers->add(*line, {src}, {dst});
+                _transfers->start(job, runTransfer(job, StripedTransfer::direction::DOWNLOAD, dst, src));
+            }
+        }
+        else if (cmd == "VERIFY" || cmd == "REPAIR" || cmd == "RESUME") {
+            // VERIFY and REPAIR take <local> [remote], RESUME takes <remote> [local] like DOWNLOAD
+            std::string src, dst;
+            ss >> src >> dst;
+            if (src.empty()) {
+                spdlog::warn("usage: {} <source> [destination]", cmd);
+                continue;
+            }
+            if (dst.empty()) dst = std::filesystem::path(src).filename().string();
+            std::string local = cmd == "RESUME" ? dst : src;
+            std::string remote = cmd == "RESUME" ? src : dst;
+            auto job = _transfers->add(*line, {remote}, {local});
+            if (cmd == "VERIFY") _transfers->start(job, runVerify(local, remote));
+            else if (cmd == "REPAIR") _transfers->start(job, runRepair(job, StripedTransfer::direction::UPLOAD, local, remote));
+            else _transfers->start(job, runRepair(job, StripedTransfer::direction::DOWNLOAD, local, remote));
+        }
+        else if (cmd == "MOVE" || cmd == "COPY") {
+            std::string src, dst;
+            ss >> src >> dst;
+            if (dst.empty()) {
+                spdlog::warn("usage: {} <source> <destination>", cmd);
+                continue;
+            }
+            auto job = _transfers->add(*line, {src, dst}, {});
+            _transfers->start(job, runCommand(cmd, { {"src", src}, {"dst", dst} }));
+        }
+        else if (cmd == "STATS") {
+            auto job = _transfers->add(*line, {""}, {});
+            _transfers->start(job, runStats());
+        }
+        else if (cmd == "FIND") {
+            std::string pattern, path;
+            ss >> pattern >> path;
+            if (pattern.empty()) {
+                spdlog::warn("usage: FIND <pattern> [path]");
+                continue;
+            }
+            auto job = _transfers->add(*line, {""}, {});
+            _transfers->start(job, runFind(pattern, path));
+        }
+        else if (cmd == "USAGE") {
+            // waits for earlier jobs, like LIST
+            auto job = _transfers->add(*line, {""}, {});
+            _transfers->start(job, runUsage());
+        }
+        else if (cmd == "JOBS") {
+            _transfers->printJobs();
+        }
+        else if (cmd == "WAIT") {
+            co_await _transfers->waitAll();
+        }
+        else if (cmd == "EXIT") {
+            break;
+        }
+        else {
+            spdlog::warn("unknown command");
+        }
+    }
 
+    // the end of input is like EXIT, started jobs still finish
+    while (_transfers->size() > 0) {
+        std::cout << "waiting for " << _transfers->size() << " jobs" << std::endl;
+        co_await _transfers->waitAll();
     }
+    stop();
 }
 
 static std::optional<Args> parseArgs(const std::string& input) {
+    // [username@]unix:<path> is the Unix domain socket of a server on this host
+    const std::string UNIX_PREFIX = "unix:";
+    size_t unixStart = input.rfind(UNIX_PREFIX, 0) == 0 ? 0 : input.find("@" + UNIX_PREFIX);
+    if (unixStart != std::string::npos) {
+        Args result;
+        if (unixStart > 0) result.username = input.substr(0, unixStart++);
+        result.unixPath = input.substr(unixStart + UNIX_PREFIX.size());
+        if (result.unixPath.empty()) return std::optional<Args>();
+        return std::optional<Args>(std::move(result));
+    }
+
     auto colon = input.rfind(':');
     if (colon == std::string::npos) return std::optional<Args>();
 
@@ -222,75 +615,93 @@ int main(int argc, char* argv[]) {
     }
     std::cout << std::endl;
 
-    if (argc < 2) {
-        spdlog::error("Usage: {} <host>:<port>", argv[0]);
+    std::string endpoint;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--no-compression") {
+            _offerCompression = false;
+        }
+        else if (arg == "--no-sparse") {
+            _sparse = false;
+        }
+        else if (arg == "--streams" && i + 1 < argc) {
+            try {
+                _maxStreams = static_cast<size_t>(std::stoul(argv[++i]));
+            } catch (const std::exception &e) {
+                spdlog::error(e.what());
+                return 1;
+            }
+        }
+        else if (arg == "--socket-buffer" && i + 1 < argc) {
+            std::string value = argv[++i];
+            minidrive::SocketTuning tuning;
+            if (value != "auto") {
+                auto bytes = minidrive::parseBytes(value);
+                if (!bytes || *bytes < 1) {
+                    spdlog::error("invalid socket buffer size '{}'", value);
+                    return 1;
+                }
+                tuning.bufferBytes = static_cast<size_t>(*bytes);
+            }
+            AsyncSocket::setTuning(tuning);
+        }
+        else {
+            endpoint = arg;
+        }
+    }
+    if (endpoint.empty()) {
+        spdlog::error("Usage: {} [username@]<host>:<port>|[username@]unix:<path> [--streams <n>] [--no-compression] "
+            "[--no-sparse] [--socket-buffer <bytes>|auto]", argv[0]);
         return 1;
     }
 
-    auto args = parseArgs(argv[1]);
+    auto args = parseArgs(endpoint);
     if (!args) {
-        spdlog::error("Invalid endpoint format: {}", argv[1]);
+        spdlog::error("Invalid endpoint format: {}", endpoint);
         return 1;
     }
 
     spdlog::info("MiniDrive client (version {})", minidrive::version());
-    spdlog::info("Connecting to {}:{}", args->host, args->port);
-
     asio::io_context io;
-    tcp::resolver resolver(io);
-    tcp::resolver::results_type results;
-    try {
-        results = resolver.resolve(args->host, args->port);
-    } catch (const asio::system_error &e) {
-        spdlog::error("failed to resolve endpoint: {}", e.what());
-        return 1;
+    if (!args->unixPath.empty()) {
+        spdlog::info("Connecting to {}", args->unixPath);
+        _endpoints.push_back(asio::local::stream_protocol::endpoint(args->unixPath));
+    }
+    else {
+        spdlog::info("Connecting to {}:{}", args->host, args->port);
+        tcp::resolver resolver(io);
+        try {
+            for (const auto &result : resolver.resolve(args->host, args->port)) _endpoints.push_back(result.endpoint());
+        } catch (const asio::system_error &e) {
+            spdlog::error("failed to resolve endpoint: {}", e.what());
+            return 1;
+        }
     }
-    tcp::socket socket(io);
+    AsyncSocket::Stream socket(io);
     try {
-        asio::connect(socket, results);
+        asio::connect(socket, _endpoints);
     } catch (const asio::system_error &e) {
         spdlog::error("failed to connect: {}", e.what());
         return 1;
     }
     spdlog::info("connected");
-    _running = true;
     _io = &io;
+    asio::thread_pool workers(1);
+    _workers = &workers;
+    TransferManager transfers(io);
+    _transfers = &transfers;
 
     AsyncSocket client(std::move(socket));
-    client.start(
-        [&](data_type type, std::shared_ptr<MsgPayload> payload) {
-            switch(type) {
-            case data_type::COMMAND:
-                spdlog::debug("msg type: {}, payload length: {}", static_cast<uint32_t>(type), payload->size());
-                processMessage(*payload);
-                break;
-            default:
-                break;
-            }
-        },
-        [&](const asio::error_code &ec) {
-            if (ec == asio::error::eof) {
-                spdlog::info("server disconnected");
-            } else {
-                spdlog::error("{}", ec.message());
-            }
-            stop();
-        },
-        [&](const asio::error_code &ec) {
-            if (ec == asio::error::eof) {
-                spdlog::info("server disconnected");
-            } else {
-                spdlog::error("{}", ec.message());
-            }
-            stop();
-        }
-    );
-
+    _client = &client;
+    ControlListener listener;
+    client.start(listener);
 
-    std::thread th([&]() {userThread(client, *args);});
+    asio::co_spawn(io, commandLoop(*args), asio::detached);
+    // on a terminal running transfers report their progress between the commands
+    if (isatty(STDOUT_FILENO)) asio::co_spawn(io, transfers.reportProgress(PROGRESS_PERIOD), asio::detached);
 
     io.run();
-    th.join();
+    workers.join();
     spdlog::info("client exited");
     return 0;
 }
@@ -0,0 +1,364 @@
+#include "transfer.hpp"
+#include <asio.hpp>
+#include <string>
+#include <cstring>
+#include <algorithm>
+#include <cerrno>
+#include <unistd.h>
+#include <spdlog/spdlog.h>
+#include <nlohmann/json.hpp>
+#include "minidrive/transfer.hpp"
+#include "minidrive/error_codes.hpp"
+
+using json = nlohmann::json;
+using asio::ip::tcp;
+using minidrive::ChunkHeader;
+
+StripedTransfer::StripedTransfer(asio::io_context &io, AsyncSocket &control, Endpoints endpoints,
+        direction dir, int fd, uint64_t size, size_t maxStreams, bool compression, bool sparse)
+    : _io(io), _control(control), _endpoints(std::move(endpoints)), _adaptTimer(io), _direction(dir), _fd(fd),
+      _size(size), _maxStreams(maxStreams), _id(0), _chunkSize(minidrive::CHUNK_SIZE), _compression(compression), _sparse(sparse),
+      _maxUsedStreams(0), _partial(false), _nextChunk(0), _damaged(0), _bytesDone(0), _wireBytes(0), _holeBytes(0), _lastBytes(0), _lastRate(0), _growing(true), _started(false), _done(false),
+      _completed(io), _code(minidrive::error::SUCCESS.code()) {
+}
+
+StripedTransfer::~StripedTransfer() {
+    if (_fd >= 0) close(_fd);
+}
+
+void StripedTransfer::setChunks(std::vector<uint64_t> chunks, std::vector<minidrive::ChunkTag> tags) {
+    _partial = true;
+    _chunks = std::move(chunks);
+    _localTags = std::move(tags);
+}
+
+void StripedTransfer::setHoles(std::vector<uint64_t> holes) {
+    _holes = std::move(holes);
+}
+
+void StripedTransfer::begin(const json &reply) {
+    _started = true;
+    if (reply["code"] != 0) {
+        _finish(reply["code"], reply.value("message", std::string()));
+        return;
+    }
+    const json &data = reply["data"];
+    _id = data["id"];
+    _token = data["token"];
+    _chunkSize = data["chunk_size"];
+    _hasher.reset(minidrive::chunkCount(_size, _chunkSize));
+    if (_direction == direction::DOWNLOAD) {
+        _size = data["size"];
+        _received.resize(minidrive::chunkCount(_size, _chunkSize));
+        _hasher.reset(_received.size());
+        if (ftruncate(_fd, static_cast<off_t>(_size)) != 0) {
+            spdlog::error("ftruncate: {}", std::strerror(errno));
+        }
+    }
+    _startTime = std::chrono::steady_clock::now();
+    spdlog::debug("transfer {} started: {}B in {}B chunks", _id, _size, _chunkSize);
+    if (_partial) {
+        std::vector<bool> moved(minidrive::chunkCount(_size, _chunkSize));
+        for (uint64_t index : _chunks) moved[index] = true;
+        for (uint64_t i = 0; i < moved.size() && i < _localTags.size(); ++i) {
+            if (moved[i]) continue;
+            _hasher.add(i, _localTags[i]);
+            if (_direction == direction::DOWNLOAD) {
+                _received[i] = true;
+                _bytesDone += minidrive::chunkLength(_size, _chunkSize, i * _chunkSize);
+            }
+        }
+    }
+    if (_direction == direction::DOWNLOAD && data.contains("holes")
+            && !minidrive::fromRanges(data["holes"].get<minidrive::ChunkRanges>(), _received.size(), _holes)) {
+        _finish(minidrive::error::TRANSFER_FAILED.code(), "invalid holes in the reply");
+        return;
+    }
+    for (uint64_t index : _holes) {
+        uint64_t offset = index * _chunkSize;
+        uint32_t len = minidrive::chunkLength(_size, _chunkSize, offset);
+        if (_direction == direction::DOWNLOAD && _received[index]) continue;
+        _hasher.add(index, minidrive::zeroTag(len));
+        _holeBytes += len;
+        if (_direction == direction::UPLOAD) continue;
+        // a new file is all hole after the ftruncate, a resumed one may hold old data there
+        if (_partial && !minidrive::punchHole(_fd, offset, len)) {
+            _finish(minidrive::error::TRANSFER_FAILED.code(), std::string("could not write local file: ") + std::strerror(errno));
+            return;
+        }
+        _received[index] = true;
+        _bytesDone += len;
+    }
+    if (_direction == direction::UPLOAD && !_holes.empty()) {
+        // only the data is sent
+        _chunks.clear();
+        for (uint64_t i = 0, h = 0; i < minidrive::chunkCount(_size, _chunkSize); ++i) {
+            if (h < _holes.size() && _holes[h] == i) ++h;
+            else _chunks.push_back(i);
+        }
+        _partial = true;
+    }
+    _lastBytes = _bytesDone;
+    if (_direction == direction::DOWNLOAD && (_partial || !_holes.empty()) && _bytesDone == _size) {
+        _hash = _hasher.hex();
+        _finish(minidrive::error::SUCCESS.code(), "");
+        return;
+    }
+    if (_size == 0) {
+        // an empty upload still waits for the server to commit it
+        if (_direction == direction::DOWNLOAD) {
+            _hash = _hasher.hex();
+            _finish(minidrive::error::SUCCESS.code(), "");
+        }
+        return;
+    }
+    if (_direction == direction::UPLOAD) {
+        _pump(_control, _compression);
+    }
+    if (_maxStreams > 0) {
+        _adaptTimer.expires_after(ADAPT_PERIOD);
+        _adaptTimer.async_wait([self = shared_from_this()](const asio::error_code &ec) {self->_adapt(ec);});
+    }
+}
+
+void StripedTransfer::_pump(AsyncSocket &socket, bool compression) {
+    if (_done || _direction != direction::UPLOAD) return;
+    uint64_t chunks = _partial ? _chunks.size() : minidrive::chunkCount(_size, _chunkSize);
+    while ((_nextChunk < chunks || !_resend.empty()) && !socket.isDead()
+            && socket.queuedMessages() < minidrive::TRANSFER_WINDOW) {
+        uint64_t offset;
+        if (!_resend.empty()) {
+            offset = _resend.front();
+            _resend.pop_front();
+        } else {
+            uint64_t index = _nextChunk++;
+            offset = (_partial ? _chunks[index] : index) * _chunkSize;
+        }
+        uint32_t len = minidrive::chunkLength(_size, _chunkSize, offset);
+        MsgPayload frame = minidrive::makeChunkFrame(ChunkHeader{_id, offset}, len);
+        uint8_t *out = minidrive::chunkData(frame);
+        size_t done = 0;
+        while (done < len) {
+            ssize_t n = pread(_fd, out + done, len - done, static_cast<off_t>(offset + done));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                _finish(minidrive::error::TRANSFER_FAILED.code(), std::string("could not read local file: ") + (n < 0 ? std::strerror(errno) : "file shrank"));
+                return;
+            }
+            done += static_cast<size_t>(n);
+        }
+        // progress of an upload is what the sockets took, they only queue a few chunks each
+        _bytesDone = std::min(_size, _bytesDone + len);
+        if (_sparse && minidrive::isZero(out, len)) {
+            // zeros go as just the header, the server punches a hole for them
+            auto tag = minidrive::zeroTag(len);
+            _hasher.add(offset / _chunkSize, tag);
+            _holeBytes += len;
+            socket.sendFrame(minidrive::makeChunkFrame(ChunkHeader{_id, offset, tag}, 0), _id);
+            continue;
+        }
+        _hasher.add(offset / _chunkSize, minidrive::tagChunkFrame(frame.data(), frame.size()));
+        MsgPayload packed;
+        if (compression && minidrive::compressChunkFrame(frame.data(), frame.size(), packed)) frame = std::move(packed);
+        _wireBytes += frame.size() - minidrive::chunkFrameSize(0);
+        socket.sendFrame(std::move(frame), _id);
+    }
+}
+
+void StripedTransfer::onControlWriteDone() {
+    if (!_started || _done) return;
+    _pump(_control, _compression);
+}
+
+void StripedTransfer::onChunk(const MsgPayload &payload) {
+    if (_done || _direction != direction::DOWNLOAD || payload.size() < ChunkHeader::SIZE) return;
+    auto header = ChunkHeader::decode(payload.data());
+    size_t len = payload.size() - ChunkHeader::SIZE;
+    if (header.transferId != _id || header.offset % _chunkSize != 0 || header.offset >= _size
+            || len > minidrive::chunkLength(_size, _chunkSize, header.offset)
+            || (len < minidrive::chunkLength(_size, _chunkSize, header.offset) && !_compression)) {
+        spdlog::warn("unexpected chunk: transfer {}, offset {}", header.transferId, header.offset);
+        return;
+    }
+    size_t index = header.offset / _chunkSize;
+    if (_received[index]) return;
+    _wireBytes += len;
+
+    const uint8_t *data = payload.data() + ChunkHeader::SIZE;
+    MsgPayload chunk;
+    if (len < minidrive::chunkLength(_size, _chunkSize, header.offset)) {
+        len = minidrive::chunkLength(_size, _chunkSize, header.offset);
+        if (!minidrive::decompressChunk(payload.data(), payload.size(), static_cast<uint32_t>(len), chunk)) {
+            _finish(minidrive::error::TRANSFER_FAILED.code(), "corrupt compressed chunk");
+            return;
+        }
+        data = chunk.data() + ChunkHeader::SIZE;
+    }
+    if (minidrive::chunkTag(data, len) != header.tag) {
+        spdlog::warn("transfer {}: damaged chunk at offset {}, asking again", _id, header.offset);
+        if (++_damaged > minidrive::MAX_RESENDS) {
+            _finish(minidrive::error::TRANSFER_FAILED.code(), "too many damaged chunks");
+            return;
+        }
+        json msg = { {"cmd", "RESEND"}, {"args", { {"id", _id}, {"offset", header.offset} }} };
+        _control.sendMessage(msg.dump());
+        return;
+    }
+    bool zeros = _sparse && minidrive::isZero(data, len);
+    if (zeros) {
+        // zeros the server stored as data still become a hole here
+        if (!minidrive::punchHole(_fd, header.offset, len)) {
+            _finish(minidrive::error::TRANSFER_FAILED.code(), std::string("could not write local file: ") + std::strerror(errno));
+            return;
+        }
+        _holeBytes += len;
+    }
+    size_t written = zeros ? len : 0;
+    while (written < len) {
+        ssize_t n = pwrite(_fd, data + written, len - written, static_cast<off_t>(header.offset + written));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            _finish(minidrive::error::TRANSFER_FAILED.code(), std::string("could not write local file: ") + std::strerror(errno));
+            return;
+        }
+        written += static_cast<size_t>(n);
+    }
+    _received[index] = true;
+    _hasher.add(index, header.tag);
+    _bytesDone += len;
+    if (_bytesDone == _size) {
+        _hash = _hasher.hex();
+        _finish(minidrive::error::SUCCESS.code(), "");
+    }
+}
+
+void StripedTransfer::onEvent(const json &event) {
+    const json &data = event.contains("data") ? event["data"] : json::object();
+    if (!data.is_object() || data.value("id", 0u) != _id) return;
+    if (event["code"] == 0 && _direction == direction::UPLOAD) {
+        // the server hashed the tags of what it wrote, the same tags we computed from what we read
+        _hash = _hasher.hex();
+        if (data.value("hash", std::string()) != _hash) {
+            _finish(minidrive::error::TRANSFER_FAILED.code(), "uploaded file hash does not match");
+            return;
+        }
+    }
+    _finish(event["code"], event.value("message", std::string()));
+}
+
+void StripedTransfer::onResend(const json &event) {
+    const json &data = event.contains("data") ? event["data"] : json::object();
+    if (_done || _direction != direction::UPLOAD || !data.is_object() || data.value("id", 0u) != _id) return;
+    uint64_t offset = data.value("offset", uint64_t(0));
+    if (offset % _chunkSize != 0 || offset >= _size) return;
+    spdlog::warn("transfer {}: server got a damaged chunk at offset {}, sending it again", _id, offset);
+    _resend.push_back(offset);
+    _pump(_control, _compression);
+}
+
+void StripedTransfer::_addStream() {
+    auto stream = std::make_shared<Stream>();
+    _streams.push_back(stream);
+    _maxUsedStreams = std::max(_maxUsedStreams, _streams.size());
+    auto self = shared_from_this();
+    // AsyncSocket only exposes a const socket, connect a fresh one and hand it over
+    auto socket = std::make_shared<AsyncSocket::Stream>(_io);
+    asio::async_connect(*socket, _endpoints, [this, self, stream, socket](const asio::error_code &ec, const auto&) {
+        if (ec || _done) {
+            if (ec) spdlog::warn("data connection failed: {}", ec.message());
+            return;
+        }
+        stream->socket = std::make_unique<AsyncSocket>(std::move(*socket));
+        AsyncSocket &s = *stream->socket;
+        stream->transfer = this;
+        s.start(*stream);
+        json msg = { {"cmd", "JOIN"}, {"args", { {"token", _token} }} };
+        if (_compression) msg["args"]["compression"] = json::array({minidrive::COMPRESSION_LZ});
+        s.sendMessage(msg.dump());
+    });
+}
+
+void StripedTransfer::Stream::onMessage(data_type type, std::shared_ptr<MsgPayload> payload) {
+    if (type == data_type::DATA) {
+        transfer->onChunk(*payload);
+        return;
+    }
+    json reply = json::parse(payload->begin(), payload->end(), nullptr, false);
+    if (joined && reply.is_object() && reply.contains("event")) {
+        if (reply["event"] == "RESEND") transfer->onResend(reply);
+        return;
+    }
+    if (reply.is_discarded() || reply.value("code", -1) != 0) {
+        spdlog::warn("data connection was not accepted");
+        socket->close();
+        return;
+    }
+    joined = true;
+    const json &data = reply.contains("data") ? reply["data"] : json::object();
+    compression = data.is_object() && data.value("compression", "") == minidrive::COMPRESSION_LZ;
+    transfer->_pump(*socket, compression);
+}
+
+void StripedTransfer::Stream::onReadError(const asio::error_code &ec) {
+    if (ec != asio::error::eof && ec != asio::error::operation_aborted) {
+        spdlog::debug("data connection: {}", ec.message());
+    }
+}
+
+void StripedTransfer::Stream::onWriteError(const asio::error_code &ec) {
+    spdlog::debug("data connection (write): {}", ec.message());
+}
+
+void StripedTransfer::Stream::onWriteDone() {
+    if (transfer->_done || !joined) return;
+    transfer->_pump(*socket, compression);
+}
+
+void StripedTransfer::_adapt(const asio::error_code &ec) {
+    if (ec || _done) return;
+    double rate = static_cast<double>(_bytesDone - _lastBytes) / std::chrono::duration<double>(ADAPT_PERIOD).count();
+    _lastBytes = _bytesDone;
+    if (_growing) {
+        if (_streams.size() < _maxStreams && (_streams.empty() || rate > _lastRate * ADAPT_GAIN)) {
+            spdlog::debug("transfer {}: {:.1f} MiB/s with {} streams, adding one", _id, rate / (1024 * 1024), _streams.size() + 1);
+            _lastRate = rate;
+            _addStream();
+        } else {
+            spdlog::debug("transfer {}: {:.1f} MiB/s, staying at {} streams", _id, rate / (1024 * 1024), _streams.size() + 1);
+            _growing = false;
+        }
+    }
+    _adaptTimer.expires_after(ADAPT_PERIOD);
+    _adaptTimer.async_wait([self = shared_from_this()](const asio::error_code &ec) {self->_adapt(ec);});
+}
+
+void StripedTransfer::_finish(uint32_t code, const std::string &message) {
+    if (_done) return;
+    _done = true;
+    _endTime = std::chrono::steady_clock::now();
+    _adaptTimer.cancel();
+    // the server keeps a download open for RESEND until told we are done with it
+    if (_direction == direction::DOWNLOAD && !_token.empty() && _size > 0) {
+        json msg = { {"cmd", "DONE"}, {"args", { {"id", _id} }} };
+        _control.sendMessage(msg.dump());
+    }
+    for (auto &stream : _streams) {
+        if (stream->socket) stream->socket->close();
+    }
+    // release the data connections once their aborted handlers ran
+    asio::post(_io, [self = shared_from_this(), streams = std::move(_streams)]() {});
+    _streams.clear();
+
+    _code = code;
+    _message = message;
+    _completed.set();
+}
+
+asio::awaitable<bool> StripedTransfer::wait() {
+    co_await _completed.wait();
+    co_return _code == minidrive::error::SUCCESS.code();
+}
+
+double StripedTransfer::seconds() const {
+    return std::chrono::duration<double>(_endTime - _startTime).count();
+}
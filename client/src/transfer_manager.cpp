@@ -0,0 +1,171 @@
+#include "transfer_manager.hpp"
+#include <asio.hpp>
+#include <string>
+#include <iostream>
+#include <filesystem>
+#include <exception>
+#include <algorithm>
+#include <spdlog/spdlog.h>
+#include <nlohmann/json.hpp>
+#include "minidrive/transfer.hpp"
+
+using json = nlohmann::json;
+namespace fs = std::filesystem;
+
+namespace {
+
+// paths relative to the user's root, "" is the root itself
+std::string normalizeRemote(const std::string &path) {
+    std::string p = fs::path(path).lexically_normal().generic_string();
+    while (!p.empty() && p.front() == '/') p.erase(0, 1);
+    while (!p.empty() && p.back() == '/') p.pop_back();
+    return p == "." ? std::string() : p;
+}
+
+std::string normalizeLocal(const std::string &path) {
+    std::error_code ec;
+    fs::path p = fs::absolute(path, ec);
+    return (ec ? fs::path(path) : p).lexically_normal().string();
+}
+
+// equal, or one is a directory above the other
+bool related(const std::string &a, const std::string &b) {
+    if (a.empty() || b.empty() || a == b) return true;
+    const std::string &shorter = a.size() < b.size() ? a : b;
+    const std::string &longer = a.size() < b.size() ? b : a;
+    return longer.compare(0, shorter.size(), shorter) == 0 && longer[shorter.size()] == '/';
+}
+
+} // namespace
+
+TransferManager::TransferManager(asio::io_context &io) : _io(io), _nextNumber(1), _rotation(0) {}
+
+std::shared_ptr<TransferManager::Job> TransferManager::add(std::string description, std::vector<std::string> remote,
+        std::vector<std::string> local) {
+    auto job = std::make_shared<Job>(_io);
+    job->number = _nextNumber++;
+    job->description = std::move(description);
+    for (const auto &path : remote) job->remote.push_back(normalizeRemote(path));
+    for (const auto &path : local) job->local.push_back(normalizeLocal(path));
+    _jobs.push_back(job);
+    return job;
+}
+
+void TransferManager::start(std::shared_ptr<Job> job, asio::awaitable<void> body) {
+    asio::co_spawn(_io, _run(std::move(job), std::move(body)), asio::detached);
+}
+
+asio::awaitable<void> TransferManager::_run(std::shared_ptr<Job> job, asio::awaitable<void> body) {
+    // only earlier jobs are waited for, so this cannot deadlock
+    while (true) {
+        auto self = std::find(_jobs.begin(), _jobs.end(), job);
+        auto earlier = std::find_if(_jobs.begin(), self, [&](const auto &other) {return _conflicts(*other, *job);});
+        if (earlier == self) break;
+        auto blocking = *earlier;
+        co_await blocking->finished.wait();
+    }
+    job->running = true;
+    job->startTime = std::chrono::steady_clock::now();
+    try {
+        co_await std::move(body);
+    } catch (const std::exception &e) {
+        spdlog::error("{}: {}", job->description, e.what());
+    }
+    job->running = false;
+    job->transfer.reset();
+    std::erase(_jobs, job);
+    job->finished.set();
+}
+
+bool TransferManager::_conflicts(const Job &a, const Job &b) const {
+    for (const auto &x : a.remote) {
+        for (const auto &y : b.remote) {
+            if (related(x, y)) return true;
+        }
+    }
+    for (const auto &x : a.local) {
+        for (const auto &y : b.local) {
+            if (x == y) return true;
+        }
+    }
+    return false;
+}
+
+asio::awaitable<void> TransferManager::waitAll() {
+    if (_jobs.empty()) co_return;
+    // jobs added later wait for this one if they conflict, the caller decides whether to wait again
+    auto last = _jobs;
+    for (auto &job : last) co_await job->finished.wait();
+}
+
+StripedTransfer* TransferManager::_find(uint32_t id) const {
+    for (const auto &job : _jobs) {
+        if (job->transfer && job->transfer->started() && job->transfer->id() == id) return job->transfer.get();
+    }
+    return nullptr;
+}
+
+void TransferManager::onChunk(const MsgPayload &payload) {
+    if (payload.size() < minidrive::ChunkHeader::SIZE) return;
+    auto header = minidrive::ChunkHeader::decode(payload.data());
+    if (auto *transfer = _find(header.transferId)) transfer->onChunk(payload);
+    else spdlog::debug("chunk of an unknown transfer {}", header.transferId);
+}
+
+void TransferManager::onEvent(const json &event) {
+    const json &data = event.contains("data") ? event["data"] : json::object();
+    if (!data.is_object()) return;
+    auto *transfer = _find(data.value("id", 0u));
+    if (!transfer) return;
+    if (event["event"] == "TRANSFER") transfer->onEvent(event);
+    else if (event["event"] == "RESEND") transfer->onResend(event);
+}
+
+void TransferManager::onControlWriteDone() {
+    if (_jobs.empty()) return;
+    // a transfer may finish in the loop, but jobs only leave the list on a later turn of the io loop
+    size_t first = _rotation++ % _jobs.size();
+    for (size_t i = 0; i < _jobs.size(); ++i) {
+        const auto &job = _jobs[(first + i) % _jobs.size()];
+        if (job->transfer) job->transfer->onControlWriteDone();
+    }
+}
+
+void TransferManager::printJobs() const {
+    if (_jobs.empty()) {
+        std::cout << "no jobs" << std::endl;
+        return;
+    }
+    for (const auto &job : _jobs) {
+        if (job->transfer && job->transfer->started()) {
+            _printProgress(*job);
+        } else {
+            std::cout << '[' << job->number << "] " << job->description << (job->running ? " (running)" : " (waiting)") << '\n';
+        }
+    }
+    std::cout << std::flush;
+}
+
+void TransferManager::_printProgress(const Job &job) const {
+    const auto &transfer = *job.transfer;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - job.startTime).count();
+    double percent = transfer.size() ? 100.0 * static_cast<double>(transfer.bytesDone()) / static_cast<double>(transfer.size()) : 100.0;
+    double mib = static_cast<double>(transfer.bytesDone()) / (1024 * 1024);
+    std::cout << '[' << job.number << "] " << job.description << ": " << static_cast<int>(percent) << "% of "
+              << transfer.size() << " bytes, " << mib / std::max(seconds, 1e-9) << " MiB/s\n";
+}
+
+asio::awaitable<void> TransferManager::reportProgress(std::chrono::milliseconds period) {
+    asio::steady_timer timer(_io);
+    while (true) {
+        timer.expires_after(period);
+        co_await timer.async_wait(asio::use_awaitable);
+        bool any = false;
+        for (const auto &job : _jobs) {
+            if (!job->transfer || !job->transfer->started() || job->transfer->done()) continue;
+            _printProgress(*job);
+            any = true;
+        }
+        if (any) std::cout << std::flush;
+    }
+}
@@ -1,7 +1,9 @@
 #pragma once
 #include <string>
 #include <filesystem>
+#include <optional>
 #include <nlohmann/json.hpp>
+#include "minidrive/rate_limit.hpp"
 
 class AuthModule {
 public:
@@ -11,6 +13,11 @@ public:
     bool userExists(const std::string &username) const;
     bool verifyPassword(const std::string &username, const std::string &password) const;
     bool createUser(const std::string &username, const std::string &password);
+    // a user's own limit, from {"rate": {"commands": ..., "bytes": ...}} in the users file
+    std::optional<minidrive::RateLimit> rateLimit(const std::string &username) const;
+    bool hasRateLimits() const;
+    // bytes the user may store, from {"quota": ...} in the users file
+    std::optional<uint64_t> quota(const std::string &username) const;
 
 private:
     nlohmann::json _config;
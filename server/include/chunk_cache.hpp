@@ -0,0 +1,120 @@
+#pragma once
+#include <array>
+#include <list>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <unordered_map>
+#include <cstddef>
+#include <cstdint>
+#include "minidrive/transfer.hpp"
+
+// chunks read for downloads, shared by all sessions so a file many clients fetch at once comes from disk once.
+// a chunk is keyed by its file's device, inode and mtime, so a changed file gets new keys and its old chunks
+// age out; in place writes and removals also drop them right away. each shard is a segmented LRU: a chunk
+// starts on probation and is protected once read again, so one large download can't flush what is popular
+class ChunkCache {
+public:
+    struct Key {
+        uint64_t dev = 0;
+        uint64_t ino = 0;
+        // nanoseconds
+        int64_t mtime = 0;
+        uint64_t offset = 0;
+
+        inline bool operator==(const Key &other) const {
+            return dev == other.dev && ino == other.ino && mtime == other.mtime && offset == other.offset;
+        }
+    };
+
+    struct Chunk {
+        std::vector<uint8_t> data;
+        minidrive::ChunkTag tag{};
+    };
+
+    using ChunkPtr = std::shared_ptr<const Chunk>;
+    // gets the chunk, null when the reader's own load could not read it
+    using Ready = std::function<void(ChunkPtr)>;
+    // reads the chunk and passes it to the handler, exactly once
+    using Load = std::function<void(Ready)>;
+
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        // readers that waited for a load another reader started
+        uint64_t joined = 0;
+        uint64_t evictions = 0;
+        size_t chunks = 0;
+        size_t bytes = 0;
+        size_t capacity = 0;
+    };
+
+    ChunkCache() = default;
+    ChunkCache(const ChunkCache&) = delete;
+    ChunkCache& operator=(const ChunkCache&) = delete;
+
+    // before the cache is used; 0 disables it
+    inline void setCapacity(size_t bytes) {_capacity = bytes;}
+    inline bool enabled() const {return _capacity > 0;}
+
+    // passes the chunk to `ready`, from memory or once `load` read it; readers of a chunk being loaded
+    // wait for that load instead of starting their own, and run their own `load` if it fails.
+    // `ready` may run before get() returns
+    void get(const Key &key, Load load, Ready ready);
+    // drops every chunk of the file
+    void invalidate(uint64_t dev, uint64_t ino);
+    Stats stats();
+
+    inline const static size_t DEFAULT_CAPACITY = 128 * 1024 * 1024;
+
+private:
+    struct KeyHash {
+        size_t operator()(const Key &key) const;
+    };
+
+    struct Waiter {
+        Load load;
+        Ready ready;
+    };
+
+    struct Entry {
+        ChunkPtr chunk;
+        // readers waiting for the load
+        std::vector<Waiter> waiters;
+        bool loading = true;
+        // invalidated while loading, handed to the waiters but not kept
+        bool stale = false;
+        bool isProtected = false;
+        std::list<Key>::iterator position;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<Key, Entry, KeyHash> entries;
+        // most recently used first
+        std::list<Key> probation;
+        std::list<Key> protectedList;
+        size_t bytes = 0;
+        size_t protectedBytes = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t joined = 0;
+        uint64_t evictions = 0;
+    };
+
+    inline size_t _shardCapacity() const {return _capacity / SHARDS;}
+    Shard& _shard(const Key &key);
+    void _loaded(Shard &shard, const Key &key, ChunkPtr chunk, Ready ready);
+    // a hit moves the chunk to the front of the protected segment
+    void _touch(Shard &shard, Entry &entry);
+    void _evict(Shard &shard);
+    void _erase(Shard &shard, std::unordered_map<Key, Entry, KeyHash>::iterator it);
+
+    inline const static size_t SHARDS = 16;
+    // share of a shard the protected segment may fill, in percent
+    inline const static size_t PROTECTED_SHARE = 80;
+
+    size_t _capacity = DEFAULT_CAPACITY;
+    std::array<Shard, SHARDS> _shards;
+};
@@ -0,0 +1,69 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <optional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <cstdint>
+
+// how committed uploads reach the disk. NONE publishes them without syncing, a crash may lose what was
+// committed shortly before; FILE syncs each file before it is linked and its directory after; GROUP gives
+// the same guarantee, but a background thread syncs everything queued while its previous batch ran
+// together, so many small uploads finishing at once don't each wait for the disk on their own
+class CommitSync {
+public:
+    enum class policy : uint8_t {NONE, FILE, GROUP};
+    // 0 or the errno of the failed sync
+    using Completion = std::function<void(int)>;
+
+    // GROUP only
+    struct Stats {
+        // files and directories synced by the batching thread
+        uint64_t syncs = 0;
+        uint64_t batches = 0;
+    };
+
+    CommitSync() = default;
+    ~CommitSync();
+    CommitSync(const CommitSync&) = delete;
+    CommitSync& operator=(const CommitSync&) = delete;
+
+    // "none", "file" or "group"
+    static std::optional<policy> parse(std::string_view name);
+    static std::string_view name(policy p);
+
+    // before start()
+    inline void setPolicy(policy p) {_policy = p;}
+    inline policy getPolicy() const {return _policy;}
+    // starts the batching thread for GROUP
+    void start();
+    // returns once the queued syncs are done
+    void stop();
+
+    // GROUP: queues the sync, `done` runs on the batching thread; the fd must stay open until then.
+    // other policies sync on the calling thread
+    void sync(int fd, Completion done);
+    Stats stats() const;
+
+private:
+    struct Request {
+        int fd;
+        Completion done;
+    };
+
+    void _run();
+    void _syncBatch(std::vector<Request> &batch);
+
+    policy _policy = policy::FILE;
+    std::thread _thread;
+    bool _running = false;
+    std::vector<Request> _queue;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::atomic<uint64_t> _syncs{0};
+    std::atomic<uint64_t> _batches{0};
+};
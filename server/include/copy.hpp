@@ -0,0 +1,105 @@
+#pragma once
+#include <asio.hpp>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+#include <sys/types.h>
+#include "minidrive/error_codes.hpp"
+#include "fs_module.hpp"
+
+// server-side copy of a file or a directory tree within a root, through the root's storage engine. file
+// data is reflinked where the filesystem allows it, else copied inside the kernel with copy_file_range,
+// else through a buffer; directories are walked by several workers that steal queued entries from each other
+class TreeCopy : public std::enable_shared_from_this<TreeCopy> {
+public:
+    struct Progress {
+        // regular files, what usage counts
+        uint64_t files = 0;
+        uint64_t links = 0;
+        uint64_t dirs = 0;
+        uint64_t bytes = 0;
+        // files reflinked instead of copied
+        uint64_t cloned = 0;
+    };
+    using ProgressHandler = std::function<void(const Progress&)>;
+    using CompletionHandler = std::function<void(TreeCopy&, const minidrive::error_code&, const std::string&)>;
+    // takes space for a file of a directory before it is copied, false fails the copy with QUOTA_EXCEEDED
+    using ReserveHandler = std::function<bool(uint64_t bytes)>;
+
+    static std::shared_ptr<TreeCopy> create(ResolvedPath &&src, ResolvedPath &&dst, const FsEntry &entry);
+    TreeCopy(const TreeCopy&) = delete;
+    TreeCopy& operator=(const TreeCopy&) = delete;
+
+    // called every PROGRESS_PERIOD while the copy runs, from one of the workers
+    void setProgressHandler(ProgressHandler handler);
+    void setReserveHandler(ReserveHandler handler);
+    // runs `workers` workers on the pool, which they occupy until the copy is done; the handler is called
+    // once by the last one to finish
+    void start(asio::thread_pool &pool, size_t workers, CompletionHandler handler);
+
+    Progress progress() const;
+    inline const ResolvedPath& destination() const {return _dst;}
+    // false if the copy failed before creating the destination, which then belongs to someone else
+    inline bool createdDestination() const {return _createdDestination;}
+
+private:
+    struct Dir;
+    struct Item;
+    struct Worker;
+
+    TreeCopy(ResolvedPath &&src, ResolvedPath &&dst, const FsEntry &entry);
+    void _work(size_t index);
+    void _push(size_t index, Item &&item);
+    bool _take(size_t index, Item &item);
+    // wakes idle workers after queueing an entry or finishing the last one
+    void _wake(bool all);
+    void _copyDir(size_t index, const Item &item);
+    void _copyFile(const Item &item);
+    // copies the data of an open file, 1 when reflinked, 0 when copied, -1 on error
+    int _copyData(int srcFd, int dstFd);
+    void _fail(const minidrive::error_code &err, const std::string &message);
+    void _report();
+
+    inline const static std::chrono::milliseconds PROGRESS_PERIOD{500};
+    // bytes per copy_file_range call, bounds the time between progress reports
+    inline const static size_t COPY_STEP = 64 * 1024 * 1024;
+    inline const static size_t BUFFER_SIZE = 1024 * 1024;
+
+    ResolvedPath _src;
+    ResolvedPath _dst;
+    bool _isDir;
+    mode_t _mode;
+    bool _createdDestination;
+
+    std::vector<std::unique_ptr<Worker>> _workers;
+    // entries queued or being copied, the copy is done when it drops to zero
+    std::atomic<size_t> _pending;
+    // entries waiting in the queues, idle workers sleep while there are none
+    std::atomic<size_t> _queued;
+    std::atomic<size_t> _running;
+    std::mutex _idleMutex;
+    std::condition_variable _idleCv;
+
+    std::atomic<uint64_t> _files;
+    std::atomic<uint64_t> _links;
+    std::atomic<uint64_t> _dirs;
+    std::atomic<uint64_t> _bytes;
+    std::atomic<uint64_t> _cloned;
+    std::atomic<int64_t> _nextReport;
+
+    std::atomic<bool> _failed;
+    minidrive::error_code _error;
+    std::string _message;
+    std::mutex _errorMutex;
+
+    ProgressHandler _progressHandler;
+    ReserveHandler _reserveHandler;
+    CompletionHandler _completionHandler;
+};
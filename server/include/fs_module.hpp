@@ -1,7 +1,83 @@
 #pragma once
 #include <filesystem>
-#include <nlohmann/json.hpp>
+#include <string>
+#include <optional>
+#include <memory>
+#include <cstdint>
+#include <ctime>
+#include <cerrno>
+#include "name_index.hpp"
 
-bool fs_validatePath(std::filesystem::path startLocation, std::filesystem::path other);
-std::filesystem::path fs_resolvePath(std::filesystem::path startPath, std::filesystem::path uwd, std::filesystem::path other);
-nlohmann::json fs_listFiles(std::filesystem::path path, bool includeHash);
+class StorageEngine;
+
+// handle to a storage root (_public or user_data/<user>), every path operation
+// of a session is done relative to it; opened by the storage engine, which for
+// POSIX keeps the directory open here so paths resolve with *at() syscalls
+class RootDir {
+public:
+    RootDir(StorageEngine &storage, const std::filesystem::path &path, int fd = -1);
+    ~RootDir();
+    RootDir(const RootDir&) = delete;
+    RootDir& operator=(const RootDir&) = delete;
+
+    inline StorageEngine& storage() const {return _storage;}
+    // -1 for engines without directories on disk
+    inline int fd() const {return _fd;}
+    inline const std::filesystem::path& path() const {return _path;}
+    inline NameIndex& names() {return _names;}
+
+private:
+    StorageEngine &_storage;
+    int _fd;
+    std::filesystem::path _path;
+    NameIndex _names;
+};
+
+// result of the one metadata lookup done per request
+struct FsEntry {
+    std::filesystem::file_type type = std::filesystem::file_type::not_found;
+    uintmax_t size = 0;
+    uint64_t dev = 0;
+    uint64_t ino = 0;
+    uint64_t links = 0;
+    // permission bits
+    uint32_t mode = 0;
+    timespec mtime{};
+
+    inline bool exists() const {return type != std::filesystem::file_type::not_found;}
+};
+
+// a path inside a root, with its parent directory opened beneath the root by the root's engine
+class ResolvedPath {
+public:
+    ResolvedPath() = default;
+    ResolvedPath(std::shared_ptr<RootDir> root, std::filesystem::path rel);
+    ~ResolvedPath();
+    ResolvedPath(ResolvedPath &&other) noexcept;
+    ResolvedPath& operator=(ResolvedPath &&other) noexcept;
+
+    // false if the path escapes the root or its parent can't be opened,
+    // error() then holds the errno (ENOENT/ENOTDIR for a missing parent)
+    inline bool valid() const {return _error == 0;}
+    inline int error() const {return _error;}
+    inline bool isRoot() const {return _rel.empty();}
+    inline const std::filesystem::path& rel() const {return _rel;}
+    inline const std::shared_ptr<RootDir>& root() const {return _root;}
+    // parent directory fd and the name inside it, for *at() calls; -1 for engines without directories on disk
+    inline int parentFd() const {return _parentFd;}
+    inline const std::string& name() const {return _name;}
+    std::filesystem::path absolute() const;
+
+private:
+    void _close();
+
+    std::shared_ptr<RootDir> _root;
+    std::filesystem::path _rel;
+    std::string _name;
+    int _parentFd = -1;
+    bool _ownsParent = false;
+    int _error = EACCES;
+};
+
+// lexically joins uwd and other, nullopt if the result escapes the root or points into its trash
+std::optional<std::filesystem::path> fs_resolveRelative(std::filesystem::path uwd, std::filesystem::path other);
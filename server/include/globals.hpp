@@ -5,6 +5,12 @@
 inline const std::string USERS_FILE = "users.json";
 inline const std::string USERDATA_DIR = "user_data";
 inline const std::string PUBLIC_DIR = "_public";
+// bytes and files stored under each root, see UsageTracker
+inline const std::string USAGE_FILE = "usage.json";
+// per-root directory holding removed trees until the reaper deletes them, hidden from clients
+inline const std::string TRASH_DIR = ".minidrive-trash";
+// per-root directory holding the hash trees of files, hidden from clients
+inline const std::string TREES_DIR = ".minidrive-trees";
 
 
 inline std::filesystem::path ROOT_DIR_PATH;
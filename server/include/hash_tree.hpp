@@ -0,0 +1,19 @@
+#pragma once
+#include <optional>
+#include <cstdint>
+#include "minidrive/merkle.hpp"
+#include "fs_module.hpp"
+
+// hash trees of files are kept by the root's storage engine, on disk in a hidden directory of the root,
+// by the file's inode so that renames keep them. a stored tree only counts while the file's size and mtime
+// match the ones it was saved with; anything else that touched the file makes it stale and it is built again
+// when needed
+
+// the tree of the regular file open at `fd`, nullopt when there is none or it is stale
+std::optional<minidrive::MerkleTree> tree_load(const RootDir &root, int fd);
+std::optional<minidrive::MerkleTree> tree_load(const ResolvedPath &path);
+// stores the tree of the file open at `fd` as it is now
+bool tree_save(const RootDir &root, int fd, const minidrive::MerkleTree &tree);
+// hashes the file chunk by chunk and stores its tree, nullopt if it failed or the file changed meanwhile
+std::optional<minidrive::MerkleTree> tree_build(const RootDir &root, int fd);
+void tree_remove(const RootDir &root, uint64_t ino);
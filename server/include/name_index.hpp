@@ -0,0 +1,128 @@
+#pragma once
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <shared_mutex>
+#include <cstddef>
+#include <cstdint>
+
+class RootDir;
+
+// names of the files and directories below a root, for FIND. built on first use by walking the root and kept
+// up to date afterwards by the operations that change the tree, which leave it alone until then. changes made
+// behind the server's back are only seen by the next index of the root
+class NameIndex {
+public:
+    struct Match {
+        // relative to the root
+        std::string path;
+        bool dir;
+    };
+
+    struct Query {
+        // a glob (*, ?, [a-z], [!a]) matched against the name, or against the path relative to the root when it
+        // holds a '/'; `*` matches any run of characters, '/' included. without wildcards a substring of the name
+        std::string pattern;
+        // subtree searched, empty for the whole root
+        std::filesystem::path under;
+        size_t limit = 0;
+    };
+
+    NameIndex() = default;
+    NameIndex(const NameIndex&) = delete;
+    NameIndex& operator=(const NameIndex&) = delete;
+
+    // whether the walk succeeded; false if the root couldn't be read, a later build() tries again
+    using BuildHandler = std::function<void(bool)>;
+
+    bool built();
+    // walks the root through its storage engine and calls `handler`, at once if the index is already built. a
+    // concurrent caller returns without walking and its handler is called by the first one once the walk is
+    // done; changes made meanwhile are applied then
+    void build(const RootDir &root, BuildHandler handler);
+    // matches sorted by path, at most query.limit of them; `truncated` tells whether there were more
+    std::vector<Match> find(const Query &query, bool &truncated);
+    size_t size();
+
+    // missing parents are added as directories
+    void add(const std::filesystem::path &rel, bool dir);
+    // removes the entry and everything below it
+    void remove(const std::filesystem::path &rel);
+    // replaces `to` if it is in the index
+    void move(const std::filesystem::path &from, const std::filesystem::path &to);
+    // adds a directory created with its contents in one go, by a copy, by walking it in `root`
+    void addTree(const RootDir &root, const std::filesystem::path &rel);
+
+private:
+    // the index itself; nodes refer to their parent and to their name in one arena, the children of a
+    // directory are kept sorted by name for lookups
+    class Tree {
+    public:
+        Tree();
+        uint32_t lookup(const std::filesystem::path &rel) const;
+        uint32_t add(const std::filesystem::path &rel, bool dir);
+        void remove(uint32_t id);
+        void move(const std::filesystem::path &from, const std::filesystem::path &to);
+        // indexes the contents of the directory `rel` of the root below node `id`
+        bool walk(const RootDir &root, const std::filesystem::path &rel, uint32_t id, bool top);
+        // leaves the query.limit smallest matching paths in `matches` as a heap, largest first
+        void find(uint32_t under, const Query &query, std::vector<Match> &matches, bool &truncated) const;
+        inline size_t size() const {return _nodes.size() - _freeNodes.size();}
+
+        inline const static uint32_t NONE = UINT32_MAX;
+
+    private:
+        struct Node {
+            uint32_t parent;
+            uint32_t name;
+            // index into _children for directories, NONE for files
+            uint32_t children;
+            uint16_t length;
+            bool dir;
+            bool live;
+        };
+
+        inline std::string_view _name(const Node &node) const {return {_names.data() + node.name, node.length};}
+        uint32_t _child(uint32_t parent, std::string_view name) const;
+        // the position of `name` in the sorted children of `parent`
+        size_t _slot(uint32_t parent, std::string_view name) const;
+        uint32_t _insert(uint32_t parent, std::string_view name, bool dir);
+        void _detach(uint32_t id);
+        void _free(uint32_t id);
+        void _setName(Node &node, std::string_view name);
+        std::string _path(uint32_t id) const;
+        void _compact();
+
+        std::vector<Node> _nodes;
+        std::string _names;
+        std::vector<std::vector<uint32_t>> _children;
+        std::vector<uint32_t> _freeNodes;
+        std::vector<uint32_t> _freeChildren;
+        // arena bytes of removed and renamed entries
+        size_t _garbage;
+    };
+
+    // a change made while the index was being built
+    struct Change {
+        enum class kind {ADD, REMOVE, MOVE, ADD_TREE};
+        kind what;
+        std::filesystem::path from;
+        std::filesystem::path to;
+        bool dir;
+    };
+
+    enum class state {EMPTY, BUILDING, BUILT};
+
+    // applies the change to a built index, records it while the index is built and ignores it before
+    void _change(Change change, const RootDir *root);
+    static void _apply(Tree &tree, const Change &change, const RootDir *root);
+
+    std::shared_mutex _mutex;
+    state _state = state::EMPTY;
+    // handlers of callers that came while the index was being built
+    std::vector<BuildHandler> _waiting;
+    Tree _tree;
+    std::vector<Change> _pending;
+};
@@ -0,0 +1,72 @@
+#pragma once
+#include <filesystem>
+#include <string>
+#include <vector>
+#include <array>
+#include <atomic>
+#include <utility>
+#include <shared_mutex>
+#include <cstddef>
+#include <cstdint>
+
+// reader/writer locks on paths inside a root, for the check-then-change sections of commands that modify the
+// tree. an operation locks its targets exclusively and every ancestor shared, so changes to disjoint subtrees
+// run in parallel while a change and anything below or above it are ordered. paths hash onto a fixed set of
+// lock stripes, which are always taken in ascending order; a section must not wait for an asynchronous
+// completion or take a second guard while it holds one
+class PathLocks {
+public:
+    enum class mode : uint8_t {SHARED, EXCLUSIVE};
+
+    // releases the stripes when destroyed
+    class Guard {
+    public:
+        Guard() = default;
+        ~Guard();
+        Guard(Guard &&other) noexcept;
+        Guard& operator=(Guard &&other) noexcept;
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+
+        void unlock();
+
+    private:
+        friend class PathLocks;
+        PathLocks *_locks = nullptr;
+        std::vector<std::pair<uint32_t, mode>> _held;
+    };
+
+    struct Stats {
+        uint64_t acquired = 0;
+        // acquisitions that had to wait for another section
+        uint64_t contended = 0;
+        uint64_t waitMicros = 0;
+        uint64_t maxWaitMicros = 0;
+    };
+
+    PathLocks() = default;
+    PathLocks(const PathLocks&) = delete;
+    PathLocks& operator=(const PathLocks&) = delete;
+
+    // `exclusive` and `shared` are relative to `root`; ancestors of both are taken shared
+    Guard lock(const std::filesystem::path &root, const std::vector<std::filesystem::path> &exclusive,
+        const std::vector<std::filesystem::path> &shared = {});
+    Stats stats() const;
+
+    inline const static size_t STRIPES = 256;
+
+private:
+    struct alignas(64) Stripe {
+        std::shared_mutex mutex;
+    };
+
+    // adds the stripes of `rel` and its ancestors, `rel` itself in `target` mode
+    static void _collect(size_t rootHash, const std::filesystem::path &rel, mode target,
+        std::vector<std::pair<uint32_t, mode>> &stripes);
+
+    std::array<Stripe, STRIPES> _stripes;
+    std::atomic<uint64_t> _acquired{0};
+    std::atomic<uint64_t> _contended{0};
+    std::atomic<uint64_t> _waitMicros{0};
+    std::atomic<uint64_t> _maxWaitMicros{0};
+};
@@ -1,52 +1,208 @@
 #pragma once
 #include <asio.hpp>
 #include <string>
-#include <list>
+#include <vector>
 #include <memory>
 #include <mutex>
 #include <utility>
+#include <chrono>
+#include <unordered_map>
 #include <nlohmann/json.hpp>
 #include "auth.hpp"
 #include "session.hpp"
+#include "fs_module.hpp"
+#include "transfer.hpp"
+#include "uring_io.hpp"
+#include "chunk_cache.hpp"
+#include "path_locks.hpp"
+#include "commit_sync.hpp"
+#include "storage.hpp"
+#include "usage.hpp"
+#include "timer_wheel.hpp"
+#include "session_registry.hpp"
+#include "minidrive/rate_limit.hpp"
 
 // class Session;
 
+// all limits are off by default
+struct ServerLimits {
+    minidrive::RateLimit global;
+    minidrive::RateLimit perIp;
+    // users may have their own limit in the users file
+    minidrive::RateLimit perUser;
+    // concurrent connections from one address, data connections included; 0 is unlimited
+    size_t connectionsPerIp = 0;
+    // bytes a user may store, 0 is unlimited; users may have their own quota in the users file
+    uint64_t quota = 0;
+};
+
 class MiniDriveServer {
 public:
     MiniDriveServer(asio::io_context &io, uint16_t port);
+    // also listen on a Unix domain socket at `path`, before start(); same protocol and auth as TCP
+    inline void setUnixSocket(std::string path) {_unixPath = std::move(path);}
     void start();
     void stop();
-    void accept();
+    // 0 disables the timeout
+    void setTimeouts(std::chrono::seconds idle, std::chrono::seconds keepalive);
+    inline std::chrono::milliseconds idleTimeout() const {return _idleTimeout;}
+    inline std::chrono::milliseconds keepaliveInterval() const {return _keepaliveInterval;}
+    void setLimits(const ServerLimits &limits);
+    // whether sessions may agree to compressed DATA, on by default
+    inline void setCompression(bool enabled) {_compression = enabled;}
+    inline bool compressionEnabled() const {return _compression;}
+    // bytes of file chunks kept for downloads, before start(); 0 disables the cache
+    inline void setChunkCache(size_t bytes) {_chunkCache.setCapacity(bytes);}
+    // how committed uploads are synced to disk, before start(); FILE by default
+    inline void setDurability(CommitSync::policy policy) {_commitSync.setPolicy(policy);}
+    // where the roots are kept, before start(); the POSIX engine by default
+    inline void setStorage(std::unique_ptr<StorageEngine> storage) {_storage = std::move(storage);}
+
+    // sessions whose connection was accepted and not yet reaped
+    inline size_t sessionCount() const {return _sessions.size();}
+    // called once by a session whose connection is gone, it is freed when its last handler returned
+    void removeSession(uint64_t id);
+    void setSessionUser(uint64_t id, const std::string &username);
+    std::vector<std::shared_ptr<Session>> sessionsOf(const std::string &username);
+    // calls Session::onTimer() after `delay` if the session still exists
+    void scheduleSessionTimer(uint64_t id, std::chrono::milliseconds delay);
+
+    inline asio::thread_pool& getWorkers() {return _workers;}
+    // runs COPY workers, which hold their thread for the whole copy
+    inline asio::thread_pool& getCopyWorkers() {return _copyWorkers;}
+    inline UringIo& getFileIo() {return _fileIo;}
+    inline ChunkCache& getChunkCache() {return _chunkCache;}
+    inline PathLocks& getPathLocks() {return _pathLocks;}
+    inline CommitSync& getCommitSync() {return _commitSync;}
+    inline StorageEngine& getStorage() {return *_storage;}
 
     inline bool auth_userExists(const std::string &username) const {return _authModule.userExists(username);}
     inline bool auth_verifyPassword(const std::string &username, const std::string &password) const {return _authModule.verifyPassword(username, password);}
     inline bool auth_createUser(const std::string &username, const std::string &password) {return _authModule.createUser(username, password);}
 
-    std::pair<std::filesystem::path, bool> fs_resolvePath(Session *session, std::string other);
-    nlohmann::json fs_listFiles(std::filesystem::path path, bool includeHash = false);
-    bool fs_createDir(std::filesystem::path path, bool createParent = true);
-    bool fs_removeDir(std::filesystem::path path);
-    bool fs_exists(std::filesystem::path path);
-    bool fs_remove(std::filesystem::path path);
-    std::filesystem::file_type fs_getFileType(std::filesystem::path path);
+    std::shared_ptr<RootDir> fs_openRoot(const std::filesystem::path &path);
+    ResolvedPath fs_resolvePath(Session *session, const std::string &other);
+    FsEntry fs_stat(const ResolvedPath &path);
+    nlohmann::json fs_listFiles(const ResolvedPath &path, bool includeHash = false);
+    // creates a root and its missing parents
+    bool fs_createDir(const std::filesystem::path &path);
+    bool fs_createDir(const ResolvedPath &path);
+    // the engine frees the space of the directory, possibly in the background
+    bool fs_removeDir(const ResolvedPath &path);
+    bool fs_remove(const ResolvedPath &path);
+    // atomic rename inside the root, fails if dst exists
+    bool fs_move(const ResolvedPath &src, const ResolvedPath &dst);
+    // an existing file opened for transfers, -1 on failure
+    int fs_openFile(const ResolvedPath &path, int flags);
+
+    // the quota of the session's root, 0 when unlimited; the public directory has none
+    uint64_t usage_quota(const Session *session) const;
+    UsageTracker::Usage usage_get(const Session *session);
+    // takes `bytes` of the session's quota for an upload or copy, null when it would be exceeded
+    std::shared_ptr<UsageTracker::Hold> usage_reserve(const Session *session, int64_t bytes);
+
+    // true when any rate limit applies, sessions only charge their traffic then
+    inline bool rate_enabled() const {return _rateEnabled;}
+    inline minidrive::RateBuckets* rate_global() {return _globalRate.get();}
+    // the buckets shared by all sessions of the user, null if the user is unlimited
+    std::shared_ptr<minidrive::RateBuckets> rate_forUser(const std::string &username);
+
+    uint32_t tr_nextId();
+    // makes the transfer joinable by its token for TRANSFER_TOKEN_TTL seconds after the last join
+    // `rate` are the owner's buckets, data connections joining the transfer are charged to them
+    void tr_register(const std::shared_ptr<Transfer> &transfer, std::shared_ptr<minidrive::RateBuckets> rate);
+    void tr_unregister(const std::string &token);
+    std::shared_ptr<Transfer> tr_join(const std::string &token, std::shared_ptr<minidrive::RateBuckets> &rate);
 
 private:
-    void _addSession(std::unique_ptr<Session> session);
-    void _cleanupSessions();
-    void _timerHandler(const asio::error_code& ec);
+    using Acceptor = asio::basic_socket_acceptor<asio::generic::stream_protocol>;
 
+    // logs and returns false on failure
+    bool _listen(Acceptor &acceptor, const Acceptor::endpoint_type &endpoint);
+    void _accept(Acceptor &acceptor);
+    void _reapSession(uint64_t id);
+    // counts a connection from the address against its cap, and finds the address's buckets
+    bool _admit(const std::string &address, std::shared_ptr<minidrive::RateBuckets> &rate);
+    void _release(const std::string &address);
+    // forgets addresses and users without sessions
+    void _purgeRates();
+    void _housekeeping();
+    void _purgeTransferTokens();
+    // all roots the engine has, the public one first
+    std::vector<std::filesystem::path> _allRoots();
+    // lets the engine finish what an earlier run left in any root
+    void _recoverRoots();
+    // queues a usage scan of roots that are due for one
+    void _reconcileUsage();
 
-    inline const static int TIMER_PERIOD = 60;
+    struct AddressEntry {
+        size_t connections = 0;
+        std::shared_ptr<minidrive::RateBuckets> rate;
+    };
+
+    struct TransferToken {
+        std::weak_ptr<Transfer> transfer;
+        std::chrono::steady_clock::time_point expires;
+        std::shared_ptr<minidrive::RateBuckets> rate;
+    };
+
+
+    inline const static std::chrono::seconds TIMER_PERIOD{60};
+    inline const static std::chrono::milliseconds TIMER_TICK{100};
+    inline const static std::chrono::seconds IDLE_TIMEOUT{300};
+    inline const static std::chrono::seconds KEEPALIVE_INTERVAL{30};
+    inline const static int TRANSFER_TOKEN_TTL = 30;
+    inline const static unsigned URING_ENTRIES = 256;
+    // registered buffers for download reads, one chunk frame each
+    inline const static size_t URING_BUFFERS = 64;
+    inline const static size_t COPY_THREADS = 4;
 
     std::atomic<bool> _running;
     uint16_t _port;
+    std::string _unixPath;
     asio::io_context &_io;
-    asio::ip::tcp::acceptor _acceptor;
-    std::list<std::unique_ptr<Session>> _sessions;
-    std::mutex _listMutex;
+    // outlives the sessions, whose roots and transfers use it
+    std::unique_ptr<StorageEngine> _storage;
+    Acceptor _acceptor;
+    Acceptor _unixAcceptor;
+    // outlives the sessions, which hold its buffers
+    UringIo _fileIo;
+    // outlives the sessions, whose transfers read through it
+    ChunkCache _chunkCache;
+    // outlives the sessions, whose uploads lock their target to commit
+    PathLocks _pathLocks;
+    // outlives the sessions, whose uploads queue their syncs on it
+    CommitSync _commitSync;
+    // outlives the sessions, whose transfers hold quota
+    UsageTracker _usage;
+    std::atomic<uint32_t> _nextTransferId;
+    std::unordered_map<std::string, TransferToken> _transferTokens;
+    std::mutex _transferTokensMutex;
 
-    asio::steady_timer _timer;
-    std::function<void(const asio::error_code&)> _timerFunc;
+    // idle and keepalive timers of all sessions and the periodic housekeeping
+    TimerWheel _timers;
+    std::chrono::milliseconds _idleTimeout;
+    std::chrono::milliseconds _keepaliveInterval;
+    bool _compression;
+    std::atomic<uint64_t> _nextSessionId;
+    SessionRegistry _sessions;
+
+    ServerLimits _limits;
+    bool _rateEnabled;
+    std::unique_ptr<minidrive::RateBuckets> _globalRate;
+    // only tracked while a per-address limit is set
+    std::unordered_map<std::string, AddressEntry> _addresses;
+    std::mutex _addressesMutex;
+    std::unordered_map<std::string, std::shared_ptr<minidrive::RateBuckets>> _userRates;
+    std::mutex _userRatesMutex;
+
+    asio::thread_pool _workers;
+    // copies queue here instead of taking threads of _workers from BATCH, FIND and TREE
+    asio::thread_pool _copyWorkers;
 
     AuthModule _authModule;
+
+    // one open handle per root directory, shared by all sessions using it
+    std::unordered_map<std::string, std::weak_ptr<RootDir>> _roots;
+    std::mutex _rootsMutex;
 };
\ No newline at end of file
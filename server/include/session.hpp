@@ -3,49 +3,167 @@
 #include <string>
 #include <queue>
 #include <mutex>
+#include <atomic>
 #include <filesystem>
+#include <vector>
+#include <unordered_map>
 #include <nlohmann/json.hpp>
 #include "minidrive/async_socket.hpp"
+#include "minidrive/error_codes.hpp"
+#include "minidrive/rate_limit.hpp"
+#include "fs_module.hpp"
+#include "transfer.hpp"
+#include "usage.hpp"
 // #include "server.hpp"
 
 class MiniDriveServer;
+struct BatchState;
 
-class Session {
+class Session : public SocketListener, public SocketLimiter {
 public:
-    Session(MiniDriveServer *server, asio::ip::tcp::socket &&cmdSocket);
+    Session(MiniDriveServer *server, uint64_t id, AsyncSocket::Stream &&cmdSocket);
     ~Session();
+    // the connection is gone and no handler refers to the session anymore, it can be freed
     bool isDead() const;
+    // the buckets of the client's address, before start()
+    void setRateLimits(std::shared_ptr<minidrive::RateBuckets> addressRate);
     void start();
+    // idle and keepalive check, scheduled on the server's timer wheel
+    void onTimer();
     
     void processMessage(const MsgPayload &payload);
+    void processData(std::shared_ptr<MsgPayload> payload);
     // void handleMessage(const std::string &cmd, const nlohmann::json &data);
+
+    // handlers return the reply for the client, or null if the reply is sent asynchronously
+    nlohmann::json dispatch(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data);
     
-    void handleLIST(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data);
-    void handleREMOVE(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data);
-    void handleCD(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data);
-    void handleMKDIR(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data);
-    void handleRMDIR(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data);
-    void handleAUTH(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data);
-    void handleREGISTER(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data);
+    nlohmann::json handleLIST(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data);
+    nlohmann::json handleREMOVE(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data);
+    nlohmann::json handleCD(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data);
+    nlohmann::json handleMKDIR(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data);
+    nlohmann::json handleRMDIR(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data);
+    nlohmann::json handleMOVE(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data);
+    nlohmann::json handleCOPY(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data);
+    nlohmann::json handleAUTH(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data);
+    nlohmann::json handleREGISTER(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data);
+    nlohmann::json handleBATCH(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data);
+    nlohmann::json handleUPLOAD(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data);
+    nlohmann::json handleDOWNLOAD(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data);
+    nlohmann::json handleJOIN(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data);
+    nlohmann::json handleTREE(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data);
+    nlohmann::json handleRESEND(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data);
+    nlohmann::json handleDONE(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data);
+    nlohmann::json handleUSAGE(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data);
+    nlohmann::json handleFIND(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data);
+    nlohmann::json handleSTATS(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data);
     
 
     nlohmann::json makeOkReply(const std::string &msg, const nlohmann::json &data = nlohmann::json::object());
     nlohmann::json makeFailReply(uint32_t code, const std::string &msg);
+    nlohmann::json makeFailReply(const minidrive::error_code &err, const std::string &msg);
 
+    void sendReply(const nlohmann::json &reply);
     void sendOkReply(const std::string &msg, const nlohmann::json &data = nlohmann::json::object());
     void sendFailReply(uint32_t code, const std::string &msg);
+    // unsolicited message, not an answer to the last request
+    void sendEvent(const std::string &event, nlohmann::json reply);
 
-    enum class mode {NOT_AUTHENTICATED, PUBLIC, PRIVATE};
+    // DATA: extra connection joined to a transfer of another session, carries only chunks
+    enum class mode {NOT_AUTHENTICATED, PUBLIC, PRIVATE, DATA};
 
+    inline uint64_t id() const {return _id;}
     inline mode getMode() const {return _mode;}
     inline std::string getUsername() const {return _username;}
-    inline std::filesystem::path getUWD() const {return _uwd;}
+    inline std::filesystem::path getUWD() const {return std::filesystem::path(_uwd);}
+    inline const std::shared_ptr<RootDir>& getRoot() const {return _root;}
+    // the client's IP address, "unix" for a local client
+    inline const std::string& peerAddress() const {return _peerAddress;}
 
 private:
+    // transfer bookkeeping, allocated by the first transfer so that idle sessions don't carry it
+    struct Transfers {
+        // transfers started by this session, and the one a DATA session joined
+        std::unordered_map<uint32_t, std::shared_ptr<Transfer>> started;
+        std::shared_ptr<Transfer> joined;
+        std::mutex mutex;
+
+        std::vector<std::shared_ptr<Transfer>> downloads;
+        size_t nextDownload = 0;
+        size_t chunkReads = 0;
+        std::mutex pumpMutex;
+
+        size_t chunkWrites = 0;
+        std::mutex chunkWritesMutex;
+    };
+
+    void onMessage(data_type type, std::shared_ptr<MsgPayload> payload) override;
+    void onReadError(const asio::error_code &ec) override;
+    void onWriteError(const asio::error_code &ec) override;
+    void onWriteDone() override;
+    std::chrono::nanoseconds chargeRead(data_type type, size_t bytes) override;
+    std::chrono::nanoseconds chargeWrite(size_t bytes) override;
+    // the longest delay of the global, address and user buckets
+    std::chrono::nanoseconds _chargeRates(double commands, size_t bytes);
+
+    // an asynchronous command holds the read loop until its reply is sent,
+    // so replies keep the order of requests and the session outlives the work
+    void _beginAsync();
+    void _endAsync(const nlohmann::json &reply);
+    // every ++_pendingOps is matched by _endPendingOp(), the last one of a dead session unregisters it
+    void _endPendingOp();
+    void _checkDead();
+    // no command, transfer or copy in progress
+    bool _isIdle();
+    void _runBatchLevel(std::shared_ptr<BatchState> state);
+    nlohmann::json _makePathFailReply(const ResolvedPath &path, const std::string &requested);
+    // TREE reply: size and root, and the hashes of the requested nodes of one level
+    nlohmann::json _makeTreeReply(const minidrive::MerkleTree &tree, uint64_t size, const nlohmann::json &args);
+    nlohmann::json _makeFindReply(NameIndex &names, const NameIndex::Query &query);
+    // picks the DATA compression from the client's offer, returns the reply data announcing it
+    nlohmann::json _negotiate(const nlohmann::json &offer);
+
+    // creates the transfer state, only called from the read loop
+    Transfers& _transfersState();
+    // `hold` is the quota taken by a new file, charged with the file once the upload commits
+    void _startTransfer(const std::shared_ptr<Transfer> &transfer, std::shared_ptr<UsageTracker::Hold> hold = nullptr);
+    std::shared_ptr<Transfer> _findTransfer(uint32_t id);
+    void _addDownload(const std::shared_ptr<Transfer> &transfer);
+    // asks the client to send a chunk again that failed its tag check
+    void _requestResend(const minidrive::ChunkHeader &header);
+    // keeps up to TRANSFER_WINDOW chunks of the active downloads being read or queued on the socket
+    void _pumpDownloads();
+    // io_uring writes of received chunks, reading stops while TRANSFER_WINDOW of them are in flight
+    void _beginChunkWrite();
+    void _endChunkWrite();
+
+    // longest COMMAND payload a client may send, a BATCH of thousands of operations fits
+    inline const static size_t MAX_COMMAND = 1024 * 1024;
+
     mode _mode;
+    // DATA frames may be compressed, agreed on at AUTH or JOIN
+    bool _compression;
     std::string _username;
-    std::filesystem::path _uwd;
+    // a string, a path would also keep its parsed components
+    std::string _uwd;
+    std::shared_ptr<RootDir> _root;
 
     MiniDriveServer *_server;
+    uint64_t _id;
+    // the client, for logging after the socket was closed
+    std::string _peerAddress;
+    std::string _peerName;
     AsyncSocket _cmdSocket;
-};
\ No newline at end of file
+    std::atomic<int> _pendingOps;
+    std::atomic<bool> _unregistered;
+    // steady clock milliseconds of the last message received and the last write completed
+    std::atomic<int64_t> _lastReceived;
+    std::atomic<int64_t> _lastSent;
+
+    // null where the scope is unlimited; the user's are set by AUTH or JOIN
+    std::shared_ptr<minidrive::RateBuckets> _addressRate;
+    std::atomic<std::shared_ptr<minidrive::RateBuckets>> _userRate;
+
+    // null until the first transfer, owned by the session
+    std::atomic<Transfers*> _transfers;
+};
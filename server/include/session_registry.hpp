@@ -0,0 +1,49 @@
+#pragma once
+#include <array>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+#include <cstdint>
+
+class Session;
+
+// live sessions by id, and the sessions of each user by username. both maps are sharded so that
+// accepts, lookups and removals of unrelated sessions rarely wait for each other
+class SessionRegistry {
+public:
+    void add(uint64_t id, std::shared_ptr<Session> session);
+    // forgets the session, the caller may drop the last reference
+    std::shared_ptr<Session> remove(uint64_t id);
+    std::shared_ptr<Session> find(uint64_t id);
+    // indexes an authenticated session under its username
+    void setUser(uint64_t id, const std::string &username);
+    std::vector<std::shared_ptr<Session>> forUser(const std::string &username);
+    inline size_t size() const {return _size;}
+
+private:
+    inline const static size_t SHARDS = 16;
+
+    struct SessionShard {
+        std::unordered_map<uint64_t, std::shared_ptr<Session>> sessions;
+        // username each session was indexed under
+        std::unordered_map<uint64_t, std::string> users;
+        std::mutex mutex;
+    };
+    struct UserShard {
+        std::unordered_map<std::string, std::unordered_map<uint64_t, std::weak_ptr<Session>>> sessions;
+        std::mutex mutex;
+    };
+
+    inline SessionShard& _shard(uint64_t id) {return _sessionShards[id % SHARDS];}
+    inline UserShard& _userShard(const std::string &username) {
+        return _userShards[std::hash<std::string>()(username) % SHARDS];
+    }
+
+    std::array<SessionShard, SHARDS> _sessionShards;
+    std::array<UserShard, SHARDS> _userShards;
+    std::atomic<size_t> _size{0};
+};
@@ -0,0 +1,83 @@
+#pragma once
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <cstdint>
+#include <sys/types.h>
+#include "fs_module.hpp"
+
+// where the files of the roots are kept. sessions, transfers and the background threads reach them only
+// through a root opened here and paths relative to it, so other layouts need no change to the handlers.
+// file data is handed out as descriptors that transfers read and write with positional I/O. failing calls
+// leave the errno set, EEXIST where a name is taken and ENOENT/ENOTDIR where a path is missing
+class StorageEngine {
+public:
+    struct DirEntry {
+        std::string name;
+        FsEntry entry;
+    };
+    // bytes and regular files a removal freed in a root, possibly later and on another thread
+    using FreedHandler = std::function<void(const std::filesystem::path &root, int64_t bytes, int64_t files)>;
+
+    virtual ~StorageEngine() = default;
+
+    // "posix" or "memory", null for any other name
+    static std::unique_ptr<StorageEngine> create(std::string_view name);
+    virtual std::string_view name() const = 0;
+    // false when the files are gone with the process, nothing needs syncing then
+    virtual bool durable() const = 0;
+
+    // before start()
+    inline void setFreedHandler(FreedHandler handler) {_freedHandler = std::move(handler);}
+    virtual void start() {}
+    virtual void stop() {}
+
+    // creates the directory and its missing parents, true if it exists afterwards
+    virtual bool createRoot(const std::filesystem::path &path) = 0;
+    virtual std::shared_ptr<RootDir> openRoot(const std::filesystem::path &path) = 0;
+    // the roots directly below `parent`
+    virtual std::vector<std::filesystem::path> roots(const std::filesystem::path &parent) = 0;
+    // finishes what an earlier run left undone in the root
+    virtual void recover(const std::filesystem::path &) {}
+
+    // opens the directory a ResolvedPath lives in: 0 and its descriptor in `fd` (-1 where the engine has
+    // none), or the errno
+    virtual int openParent(const RootDir &root, const std::filesystem::path &rel, int &fd) = 0;
+    virtual FsEntry stat(const ResolvedPath &path) = 0;
+    // the entries of the directory `rel` of the root; without `details` only names and types are filled in
+    virtual bool list(const RootDir &root, const std::filesystem::path &rel, std::vector<DirEntry> &entries,
+        bool details) = 0;
+    virtual bool createDir(const ResolvedPath &path, mode_t mode = 0777) = 0;
+    virtual bool setMode(const ResolvedPath &path, mode_t mode) = 0;
+    // unlinks a file or symlink, `removed` is what it was
+    virtual bool remove(const ResolvedPath &path, FsEntry &removed) = 0;
+    // removes a directory with everything below it; the space goes to the freed handler once it is deleted
+    virtual bool removeDir(const ResolvedPath &path) = 0;
+    // never replaces `dst`
+    virtual bool move(const ResolvedPath &src, const ResolvedPath &dst) = 0;
+    // copies a symlink itself, not what it points to
+    virtual bool copyLink(const ResolvedPath &src, const ResolvedPath &dst) = 0;
+
+    // opens an existing file, `flags` O_RDONLY or O_WRONLY; -1 on failure
+    virtual int open(const ResolvedPath &path, int flags) = 0;
+    // a new regular file, fails if the name is taken
+    virtual int createFile(const ResolvedPath &path, mode_t mode) = 0;
+    // a new file for upload `id` to `target` that nobody sees before publish(); `tmpName` is set to the
+    // hidden name it has meanwhile, if it has one
+    virtual int createTemporary(const ResolvedPath &target, uint32_t id, std::string &tmpName) = 0;
+    // gives a file from createTemporary() the target's name: 0 or the errno
+    virtual int publish(int fd, const ResolvedPath &target, const std::string &tmpName) = 0;
+    // drops an unpublished file that has a hidden name
+    virtual void discard(const ResolvedPath &target, const std::string &tmpName) = 0;
+
+    // the stored hash trees of the root's files by inode, see hash_tree.hpp
+    virtual bool loadTree(const RootDir &root, uint64_t ino, std::string &data) = 0;
+    virtual bool storeTree(const RootDir &root, uint64_t ino, const std::string &data) = 0;
+    virtual void removeTree(const RootDir &root, uint64_t ino) = 0;
+
+protected:
+    FreedHandler _freedHandler;
+};
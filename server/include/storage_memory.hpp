@@ -0,0 +1,83 @@
+#pragma once
+#include <map>
+#include <unordered_map>
+#include <shared_mutex>
+#include "storage.hpp"
+
+// keeps every root in memory, for measuring the server and the protocol without a disk. directories are
+// nodes of a tree behind one reader/writer lock, file data lives in memfds, so transfers, io_uring and the
+// chunk cache work on them as on files; everything is gone when the server exits. there are no symlinks
+// and no hard links, and a removed tree is freed at once
+class MemoryStorage : public StorageEngine {
+public:
+    MemoryStorage() = default;
+    MemoryStorage(const MemoryStorage&) = delete;
+    MemoryStorage& operator=(const MemoryStorage&) = delete;
+
+    std::string_view name() const override {return "memory";}
+    bool durable() const override {return false;}
+
+    bool createRoot(const std::filesystem::path &path) override;
+    std::shared_ptr<RootDir> openRoot(const std::filesystem::path &path) override;
+    std::vector<std::filesystem::path> roots(const std::filesystem::path &parent) override;
+
+    int openParent(const RootDir &root, const std::filesystem::path &rel, int &fd) override;
+    FsEntry stat(const ResolvedPath &path) override;
+    bool list(const RootDir &root, const std::filesystem::path &rel, std::vector<DirEntry> &entries,
+        bool details) override;
+    bool createDir(const ResolvedPath &path, mode_t mode = 0777) override;
+    bool setMode(const ResolvedPath &path, mode_t mode) override;
+    bool remove(const ResolvedPath &path, FsEntry &removed) override;
+    bool removeDir(const ResolvedPath &path) override;
+    bool move(const ResolvedPath &src, const ResolvedPath &dst) override;
+    bool copyLink(const ResolvedPath &src, const ResolvedPath &dst) override;
+
+    int open(const ResolvedPath &path, int flags) override;
+    int createFile(const ResolvedPath &path, mode_t mode) override;
+    // an unlinked memfd, published by adding a node that shares it
+    int createTemporary(const ResolvedPath &target, uint32_t id, std::string &tmpName) override;
+    int publish(int fd, const ResolvedPath &target, const std::string &tmpName) override;
+    void discard(const ResolvedPath &target, const std::string &tmpName) override;
+
+    bool loadTree(const RootDir &root, uint64_t ino, std::string &data) override;
+    bool storeTree(const RootDir &root, uint64_t ino, const std::string &data) override;
+    void removeTree(const RootDir &root, uint64_t ino) override;
+
+private:
+    struct Node {
+        Node() = default;
+        ~Node();
+        Node(const Node&) = delete;
+        Node& operator=(const Node&) = delete;
+
+        bool dir = false;
+        // the memfd of a file, -1 for directories
+        int fd = -1;
+        // directories only, files report their memfd's
+        mode_t mode = 0;
+        uint64_t ino = 0;
+        timespec mtime{};
+        std::map<std::string, std::unique_ptr<Node>, std::less<>> children;
+    };
+
+    struct Root {
+        Node top;
+        // serialized hash trees by inode
+        std::unordered_map<uint64_t, std::string> trees;
+    };
+
+    std::unique_ptr<Node> _makeDir(mode_t mode);
+    std::unique_ptr<Node> _makeFile(int fd);
+    // with _mutex held; null and errno set when missing
+    Root* _root(const RootDir &root);
+    Node* _find(const RootDir &root, const std::filesystem::path &rel);
+    // the directory holding `path`
+    Node* _parent(const ResolvedPath &path);
+    static FsEntry _entry(const Node &node);
+    // the regular files below `node`
+    static void _collect(const Node &node, int64_t &bytes, int64_t &files, std::vector<uint64_t> &inos);
+
+    std::map<std::string, std::unique_ptr<Root>> _roots;
+    uint64_t _nextIno = 1;
+    std::shared_mutex _mutex;
+};
@@ -0,0 +1,49 @@
+#pragma once
+#include "storage.hpp"
+#include "trash.hpp"
+
+// roots are directories below the server root. paths are opened beneath the root's descriptor, with
+// openat2() refusing to leave it where the kernel has it; removed trees go to the trash of their root,
+// hash trees are files in its hidden trees directory
+class PosixStorage : public StorageEngine {
+public:
+    PosixStorage() = default;
+
+    std::string_view name() const override {return "posix";}
+    bool durable() const override {return true;}
+    // runs the trash reaper
+    void start() override;
+    void stop() override;
+
+    bool createRoot(const std::filesystem::path &path) override;
+    std::shared_ptr<RootDir> openRoot(const std::filesystem::path &path) override;
+    std::vector<std::filesystem::path> roots(const std::filesystem::path &parent) override;
+    // queues the trash left by an earlier run
+    void recover(const std::filesystem::path &root) override;
+
+    int openParent(const RootDir &root, const std::filesystem::path &rel, int &fd) override;
+    FsEntry stat(const ResolvedPath &path) override;
+    bool list(const RootDir &root, const std::filesystem::path &rel, std::vector<DirEntry> &entries,
+        bool details) override;
+    bool createDir(const ResolvedPath &path, mode_t mode = 0777) override;
+    bool setMode(const ResolvedPath &path, mode_t mode) override;
+    bool remove(const ResolvedPath &path, FsEntry &removed) override;
+    bool removeDir(const ResolvedPath &path) override;
+    bool move(const ResolvedPath &src, const ResolvedPath &dst) override;
+    bool copyLink(const ResolvedPath &src, const ResolvedPath &dst) override;
+
+    int open(const ResolvedPath &path, int flags) override;
+    int createFile(const ResolvedPath &path, mode_t mode) override;
+    // an anonymous O_TMPFILE inode in the target's directory, or a hidden temporary file where the
+    // filesystem has none; published with linkat, which fails rather than replace a file
+    int createTemporary(const ResolvedPath &target, uint32_t id, std::string &tmpName) override;
+    int publish(int fd, const ResolvedPath &target, const std::string &tmpName) override;
+    void discard(const ResolvedPath &target, const std::string &tmpName) override;
+
+    bool loadTree(const RootDir &root, uint64_t ino, std::string &data) override;
+    bool storeTree(const RootDir &root, uint64_t ino, const std::string &data) override;
+    void removeTree(const RootDir &root, uint64_t ino) override;
+
+private:
+    TrashReaper _reaper;
+};
@@ -0,0 +1,48 @@
+#pragma once
+#include <asio.hpp>
+#include <array>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <functional>
+#include <cstdint>
+
+// hierarchical timer wheel driven by a single asio timer; scheduling is O(1) and every entry is moved
+// down at most once per level. entries can't be cancelled, callbacks check whether they still apply
+class TimerWheel {
+public:
+    using Callback = std::function<void()>;
+
+    TimerWheel(asio::io_context &io, std::chrono::milliseconds tick);
+    void start();
+    void stop();
+
+    // runs callback on the io_context after at least `delay`, rounded up to whole ticks
+    void schedule(std::chrono::milliseconds delay, Callback callback);
+    inline std::chrono::milliseconds tick() const {return _tickLength;}
+
+private:
+    struct Entry {
+        uint64_t deadline;
+        Callback callback;
+    };
+
+    void _arm();
+    void _advance(std::vector<Callback> &due);
+    void _insert(Entry &&entry);
+
+    static constexpr unsigned SLOT_BITS = 6;
+    static constexpr unsigned SLOTS = 1u << SLOT_BITS;
+    static constexpr unsigned LEVELS = 4;
+    // 64^4 ticks, 19 days with 100 ms ticks; longer delays are clamped
+    static constexpr uint64_t MAX_TICKS = (uint64_t(1) << (SLOT_BITS * LEVELS)) - 1;
+
+    asio::steady_timer _timer;
+    std::chrono::milliseconds _tickLength;
+    std::chrono::steady_clock::time_point _nextTick;
+    // ticks elapsed since start()
+    uint64_t _now;
+    std::array<std::array<std::vector<Entry>, SLOTS>, LEVELS> _slots;
+    bool _running;
+    std::mutex _mutex;
+};
@@ -0,0 +1,158 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <functional>
+#include <cstdint>
+#include "minidrive/async_socket.hpp"
+#include "minidrive/error_codes.hpp"
+#include "minidrive/transfer.hpp"
+#include "minidrive/merkle.hpp"
+#include "fs_module.hpp"
+#include "uring_io.hpp"
+#include "chunk_cache.hpp"
+#include "path_locks.hpp"
+#include "commit_sync.hpp"
+
+// a file being uploaded or downloaded, possibly striped over several connections;
+// chunks are written and read with positional I/O so connections don't coordinate
+class Transfer : public std::enable_shared_from_this<Transfer> {
+public:
+    enum class direction {UPLOAD, DOWNLOAD};
+    using CompletionHandler = std::function<void(Transfer&, const minidrive::error_code&)>;
+    using ChunkHandler = std::function<void(const minidrive::error_code&)>;
+
+    // uploads are written into a preallocated file the root's storage engine keeps out of sight (on disk an
+    // anonymous O_TMPFILE in the target's directory) and published under the target's name when complete.
+    // `holes` are the sorted indices of chunks the client won't send, they stay unallocated
+    static std::shared_ptr<Transfer> createUpload(uint32_t id, ResolvedPath &&target, uint64_t size,
+        const std::vector<uint64_t> &holes, minidrive::error_code &err);
+    // repairs an existing file in place: only `chunks` are sent, every other chunk must be unchanged
+    // by the new size and keeps its leaf of `tree`, the file's current hash tree
+    static std::shared_ptr<Transfer> createRepair(uint32_t id, ResolvedPath &&target, uint64_t size,
+        const minidrive::MerkleTree &tree, const std::vector<uint64_t> &chunks, minidrive::error_code &err);
+    static std::shared_ptr<Transfer> createDownload(uint32_t id, ResolvedPath &&source,
+        minidrive::error_code &err);
+    // the hidden file an upload is written to without O_TMPFILE, ".<name>.minidrive-<id>"
+    static std::string temporaryName(const std::string &name, uint32_t id);
+    static bool isTemporaryName(std::string_view name);
+    ~Transfer();
+    Transfer(const Transfer&) = delete;
+    Transfer& operator=(const Transfer&) = delete;
+
+    inline uint32_t id() const {return _id;}
+    inline direction dir() const {return _direction;}
+    inline uint64_t size() const {return _size;}
+    inline uint32_t chunkSize() const {return _chunkSize;}
+    inline const std::string& token() const {return _token;}
+    inline const ResolvedPath& path() const {return _path;}
+    // downloads read their chunks through the cache, repairs drop the file's chunks from it when committed
+    inline void setCache(ChunkCache *cache) {_cache = cache;}
+    inline bool cached() const {return _cache && _cache->enabled();}
+    // uploads commit with their target locked
+    inline void setLocks(PathLocks *locks) {_locks = locks;}
+    // uploads sync their data and new name by its policy; without it each commit is synced on its own
+    inline void setSync(CommitSync *sync) {_commitSync = sync;}
+    bool finished();
+    // hex hash of the whole file (see minidrive::FileHasher), empty until every chunk was written or read
+    std::string hash();
+
+    // called once, when the transfer completes or fails
+    void setCompletionHandler(CompletionHandler handler);
+    // drops the completion handler, waits for a running one to return
+    void abort();
+    // completes transfers that need no chunk, of empty files or repairs that only resize
+    void begin(UringIo &io);
+
+    // upload: stores a received chunk, commits the file once every chunk arrived. a chunk that doesn't
+    // match its tag is dropped with CORRUPT_CHUNK, for the client to send again; a chunk of zeros, or one
+    // sent without data, is punched as a hole instead of written. without io_uring, `io` only carries the
+    // completion of a grouped commit back to its event loop
+    minidrive::error_code writeChunk(UringIo &io, const minidrive::ChunkHeader &header, const uint8_t *data, size_t len);
+    // upload through io_uring: `frame` is the DATA payload and stays referenced until the write is done;
+    // `done` runs exactly once, after the commit when this was the last chunk
+    void writeChunk(UringIo &io, std::shared_ptr<MsgPayload> frame, ChunkHandler done);
+
+    // download: sends only these chunks instead of the whole file
+    bool setChunks(std::vector<uint64_t> chunks);
+    // download: sorted indices of the chunks in holes of the file, never sent
+    inline const std::vector<uint64_t>& holes() const {return _holes;}
+    // download: offset of the next chunk to send, chunks asked for again first;
+    // nullopt once every chunk was handed out
+    std::optional<uint64_t> nextChunk();
+    // download: the client received a damaged chunk, it is read and sent again
+    bool resend(uint64_t offset);
+    // download: the client has every chunk or gave up, completes the transfer
+    void acknowledge();
+    inline size_t frameSize(uint64_t offset) const {
+        return minidrive::chunkFrameSize(minidrive::chunkLength(_size, _chunkSize, offset));
+    }
+    // download: builds the tagged DATA frame for the chunk at offset, for a transfer that isn't cached()
+    bool readChunk(uint64_t offset, MsgPayload &frame);
+    // download through io_uring, or the cache where it isn't available: fills frameSize(offset) bytes at
+    // `frame`, which must stay valid until `done`; `done` never runs before this returns, even when the
+    // chunk was cached
+    void readChunk(UringIo &io, uint64_t offset, uint8_t *frame, ChunkHandler done);
+
+private:
+    Transfer(uint32_t id, direction dir, ResolvedPath &&path, int fd, uint64_t size);
+    bool _validChunk(uint64_t offset, size_t len);
+    // a received chunk of zeros, true once its hole is punched
+    bool _writeZeros(uint64_t offset, uint32_t len);
+    // reads `len` bytes at `offset`, completes the transfer with FS_ERROR if it can't
+    bool _read(uint64_t offset, uint8_t *out, uint32_t len);
+    // CORRUPT_CHUNK, or TRANSFER_FAILED once too many chunks were damaged
+    minidrive::error_code _damaged(uint64_t offset);
+    // marks the chunk as stored, true when it was the last one
+    bool _markReceived(size_t index, const minidrive::ChunkTag &tag);
+    // syncs and links the file, then completes the transfer and calls `done`
+    void _commit(UringIo &io, ChunkHandler done);
+    minidrive::error_code _commitInPlace();
+    // syncs the file or directory by the durability policy and passes 0 or an errno to `done`, which runs
+    // on io's event loop or, when the sync needs no wait for another thread, on this one
+    void _sync(UringIo &io, int fd, std::function<void(int)> done);
+    // stores the hash tree of the written file, built from the chunk tags
+    void _saveTree();
+    minidrive::error_code _link();
+    minidrive::error_code _linked(int err);
+    void _complete(const minidrive::error_code &err);
+
+    uint32_t _id;
+    direction _direction;
+    // a repair writes into the target itself
+    bool _inPlace;
+    ResolvedPath _path;
+    // the hidden name of the upload's file until it is published, usually none
+    std::string _tmpName;
+    std::string _token;
+    int _fd;
+    uint64_t _size;
+    uint32_t _chunkSize;
+    ChunkCache *_cache;
+    PathLocks *_locks;
+    CommitSync *_commitSync;
+    // the file's identity in the cache, offset left 0
+    ChunkCache::Key _cacheKey;
+
+    std::mutex _mutex;
+    std::vector<bool> _received;
+    uint64_t _receivedCount;
+    std::atomic<uint64_t> _nextChunk;
+    // chunk indices of a partial download, or of the data of a sparse one
+    std::vector<uint64_t> _chunks;
+    std::vector<uint64_t> _holes;
+    bool _partial;
+    std::deque<uint64_t> _resend;
+    unsigned _damagedCount;
+    minidrive::FileHasher _hasher;
+    bool _finished;
+    bool _committed;
+
+    std::mutex _handlerMutex;
+    CompletionHandler _completionHandler;
+};
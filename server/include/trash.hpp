@@ -0,0 +1,61 @@
+#pragma once
+#include <filesystem>
+#include <string>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+#include "fs_module.hpp"
+
+// removed trees are renamed into the trash directory of their root, which is instant,
+// and deleted later by a background thread that throttles itself to keep the disk usable
+class TrashReaper {
+public:
+    // bytes and regular files deleted from the trash of a root
+    using FreedHandler = std::function<void(const std::filesystem::path &root, int64_t bytes, int64_t files)>;
+
+    TrashReaper() = default;
+    ~TrashReaper();
+    TrashReaper(const TrashReaper&) = delete;
+    TrashReaper& operator=(const TrashReaper&) = delete;
+
+    // before start(), called from the reaper thread after each root it worked on
+    void setFreedHandler(FreedHandler handler);
+    void start();
+    // returns once the thread finished its current unlink, the rest stays for the next start
+    void stop();
+
+    // moves path into the trash of its root and queues it for deletion; false if it couldn't be moved
+    // (errno is set, EXDEV for a mount point)
+    bool moveToTrash(const ResolvedPath &path);
+    // queues what's left in the trash of a root, e.g. from before a restart
+    void reclaim(const std::filesystem::path &root);
+
+private:
+    void _run();
+    // deletes everything inside dirFd and closes it, false when stopped midway
+    bool _removeContents(int dirFd);
+    bool _throttle();
+
+    // unlinks done before the reaper sleeps for REAP_PAUSE
+    inline const static size_t REAP_BATCH = 256;
+    inline const static std::chrono::milliseconds REAP_PAUSE{5};
+
+    std::thread _thread;
+    bool _running = false;
+    std::set<std::filesystem::path> _queue;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    size_t _unlinks = 0;
+    FreedHandler _freedHandler;
+    // deleted by the current pass, only touched by the reaper thread
+    int64_t _freedBytes = 0;
+    int64_t _freedFiles = 0;
+    // the hash trees of the root being reclaimed, -1 if it has none
+    int _treesFd = -1;
+    uint64_t _nextId = 0;
+};
@@ -0,0 +1,90 @@
+#pragma once
+#include <asio.hpp>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// file I/O through an io_uring; submissions made while handling one event go to the kernel together
+// and completions run on the io_context. available() is false when the build or the kernel lacks
+// io_uring, callers then use the synchronous syscalls
+class UringIo {
+public:
+    // bytes transferred or -errno
+    using Completion = std::function<void(int)>;
+
+    UringIo(asio::io_context &io);
+    ~UringIo();
+    UringIo(const UringIo&) = delete;
+    UringIo& operator=(const UringIo&) = delete;
+
+    // sets up the ring and registers up to `buffers` buffers of `bufferSize` bytes
+    bool start(unsigned entries, size_t buffers, size_t bufferSize);
+    void stop();
+    inline bool available() const {return _ringFd >= 0;}
+    // the io_context completions run on
+    inline asio::io_context& context() {return _io;}
+
+    // transfer all `len` bytes unless an error or the end of the file comes first;
+    // reads into a buffer from acquireBuffer() use the registered buffer
+    void read(int fd, uint8_t *buf, uint32_t len, uint64_t offset, Completion completion);
+    void write(int fd, const uint8_t *buf, uint32_t len, uint64_t offset, Completion completion);
+    void fsync(int fd, Completion completion);
+
+    // a registered buffer of bufferSize() bytes, back in the pool once the last reference is gone;
+    // null if every buffer is in use
+    std::shared_ptr<uint8_t> acquireBuffer();
+    inline size_t bufferSize() const {return _bufferSize;}
+
+private:
+    struct Op;
+
+    void _submit(std::unique_ptr<Op> op);
+    bool _pushSqe(Op *op);
+    void _enter();
+    void _flush();
+    void _waitCompletions();
+    void _reap();
+    void _finish(Op *op, int res);
+    void _teardown();
+
+    asio::io_context &_io;
+    int _ringFd;
+    asio::posix::stream_descriptor _eventFd;
+
+    void *_sqRing;
+    void *_cqRing;
+    size_t _sqRingSize;
+    size_t _cqRingSize;
+    io_uring_sqe *_sqes;
+    size_t _sqesSize;
+    unsigned *_sqHead;
+    unsigned *_sqTail;
+    unsigned *_sqArray;
+    unsigned _sqMask;
+    unsigned _sqEntries;
+    unsigned *_cqHead;
+    unsigned *_cqTail;
+    unsigned _cqMask;
+    io_uring_cqe *_cqes;
+
+    // ops that didn't fit into the submission queue
+    std::deque<std::unique_ptr<Op>> _backlog;
+    unsigned _toSubmit;
+    bool _flushScheduled;
+    std::mutex _sqMutex;
+
+    uint8_t *_arena;
+    size_t _arenaSize;
+    size_t _bufferSize;
+    size_t _bufferCount;
+    std::vector<uint32_t> _freeBuffers;
+    std::mutex _buffersMutex;
+};
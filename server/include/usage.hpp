@@ -0,0 +1,112 @@
+#pragma once
+#include <filesystem>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+class StorageEngine;
+class RootDir;
+
+// bytes and regular files stored under each root, kept up to date by the operations that change them
+// instead of walking the tree. the counters are written to the usage file by housekeeping; a background
+// thread rescans a root that was never scanned or not for RESCAN_PERIOD and corrects the drift a crash or
+// a change behind the server's back left. removed trees count until their storage engine freed them
+class UsageTracker {
+public:
+    struct Usage {
+        int64_t bytes = 0;
+        int64_t files = 0;
+    };
+
+    // quota taken by an upload or copy in progress; commit() turns it into usage, destroying it gives it back
+    class Hold {
+    public:
+        Hold(UsageTracker &tracker, std::string key, int64_t bytes, uint64_t quota);
+        ~Hold();
+        Hold(const Hold&) = delete;
+        Hold& operator=(const Hold&) = delete;
+
+        // takes `bytes` more, false when they would exceed the quota or the hold was committed
+        bool grow(int64_t bytes);
+        // charges what the operation really stored, once
+        void commit(int64_t bytes, int64_t files);
+
+    private:
+        UsageTracker &_tracker;
+        std::string _key;
+        int64_t _bytes;
+        uint64_t _quota;
+        bool _committed;
+    };
+
+    UsageTracker() = default;
+    ~UsageTracker();
+    UsageTracker(const UsageTracker&) = delete;
+    UsageTracker& operator=(const UsageTracker&) = delete;
+
+    // the engine roots are scanned through, before start()
+    inline void setStorage(StorageEngine *storage) {_storage = storage;}
+    // reads the usage file, a missing one leaves every root to be scanned
+    bool load(const std::filesystem::path &file);
+    // writes the usage file if a counter changed since the last save
+    bool save();
+    void start();
+    // returns once the thread finished its current entry, an interrupted scan is started over later
+    void stop();
+
+    Usage usage(const std::filesystem::path &root);
+    void charge(const std::filesystem::path &root, int64_t bytes, int64_t files);
+    // holds `bytes` of the root's quota, null when its usage and the holds of other operations would
+    // exceed `quota` with them; a quota of 0 is unlimited
+    std::shared_ptr<Hold> reserve(const std::filesystem::path &root, int64_t bytes, uint64_t quota);
+    // queues a scan of each root that was never scanned or not for RESCAN_PERIOD
+    void reconcile(const std::vector<std::filesystem::path> &roots);
+
+private:
+    struct Entry {
+        Usage usage;
+        // quota taken by holds
+        int64_t held = 0;
+        // system clock seconds of the last finished scan, 0 if there was none
+        int64_t scanned = 0;
+        bool queued = false;
+        bool scanning = false;
+        // charged while the root is scanned, added to the scanned totals
+        Usage sinceScan;
+    };
+
+    // roots are kept relative to the server's root directory, so the file survives moving it
+    static std::string _key(const std::filesystem::path &root);
+    void _charge(const std::string &key, int64_t bytes, int64_t files);
+    void _chargeLocked(const std::string &key, int64_t bytes, int64_t files);
+    void _run();
+    void _scan(const std::string &key);
+    // adds up the regular files below the directory `rel` of the root, false when stopped midway
+    bool _scanDir(const RootDir &root, const std::filesystem::path &rel, Usage &usage);
+    bool _throttle();
+
+    inline const static std::chrono::hours RESCAN_PERIOD{24};
+    // entries looked at before the scan sleeps for SCAN_PAUSE
+    inline const static size_t SCAN_BATCH = 256;
+    inline const static std::chrono::milliseconds SCAN_PAUSE{5};
+
+    StorageEngine *_storage = nullptr;
+    std::filesystem::path _file;
+    std::unordered_map<std::string, Entry> _entries;
+    bool _dirty = false;
+    std::mutex _mutex;
+
+    std::thread _thread;
+    bool _running = false;
+    std::deque<std::string> _queue;
+    std::condition_variable _cv;
+    size_t _visited = 0;
+};
@@ -98,3 +98,35 @@ bool AuthModule::createUser(const std::string &username, const std::string &pass
     _config["users"].push_back(entry);
     return true;
 }
+
+std::optional<minidrive::RateLimit> AuthModule::rateLimit(const std::string &username) const {
+    for (const auto &entry : _config["users"]) {
+        if (!entry.contains("username") || !entry.contains("rate")) continue;
+        json userName = entry["username"];
+        const json &rate = entry["rate"];
+        if (!userName.is_string() || userName.get<std::string>() != username || !rate.is_object()) continue;
+        minidrive::RateLimit limit;
+        limit.commands = rate.value("commands", 0.0);
+        limit.bytes = rate.value("bytes", 0.0);
+        return limit;
+    }
+    return std::nullopt;
+}
+
+std::optional<uint64_t> AuthModule::quota(const std::string &username) const {
+    for (const auto &entry : _config["users"]) {
+        if (!entry.contains("username") || !entry.contains("quota")) continue;
+        json userName = entry["username"];
+        const json &quota = entry["quota"];
+        if (!userName.is_string() || userName.get<std::string>() != username || !quota.is_number_unsigned()) continue;
+        return quota.get<uint64_t>();
+    }
+    return std::nullopt;
+}
+
+bool AuthModule::hasRateLimits() const {
+    for (const auto &entry : _config["users"]) {
+        if (entry.contains("rate")) return true;
+    }
+    return false;
+}
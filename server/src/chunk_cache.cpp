@@ -0,0 +1,145 @@
+#include "chunk_cache.hpp"
+#include <utility>
+
+size_t ChunkCache::KeyHash::operator()(const Key &key) const {
+    // splitmix64 finalizer over the fields
+    uint64_t h = key.dev * 0x9e3779b97f4a7c15ULL ^ key.ino;
+    h = (h ^ static_cast<uint64_t>(key.mtime)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (key.offset >> 20) ^ key.offset) * 0x94d049bb133111ebULL;
+    return static_cast<size_t>(h ^ (h >> 31));
+}
+
+ChunkCache::Shard& ChunkCache::_shard(const Key &key) {
+    return _shards[(KeyHash{}(key) >> 7) % SHARDS];
+}
+
+void ChunkCache::get(const Key &key, Load load, Ready ready) {
+    if (!enabled()) {
+        load(std::move(ready));
+        return;
+    }
+    Shard &shard = _shard(key);
+    {
+        std::unique_lock lock(shard.mutex);
+        auto it = shard.entries.find(key);
+        if (it != shard.entries.end()) {
+            Entry &entry = it->second;
+            if (entry.loading) {
+                ++shard.joined;
+                entry.waiters.push_back(Waiter{std::move(load), std::move(ready)});
+                return;
+            }
+            ++shard.hits;
+            _touch(shard, entry);
+            ChunkPtr chunk = entry.chunk;
+            lock.unlock();
+            ready(std::move(chunk));
+            return;
+        }
+        ++shard.misses;
+        shard.entries.emplace(key, Entry{});
+    }
+    load([this, &shard, key, ready = std::move(ready)](ChunkPtr chunk) mutable {
+        _loaded(shard, key, std::move(chunk), std::move(ready));
+    });
+}
+
+void ChunkCache::_loaded(Shard &shard, const Key &key, ChunkPtr chunk, Ready ready) {
+    std::vector<Waiter> waiters;
+    {
+        std::lock_guard g(shard.mutex);
+        auto it = shard.entries.find(key);
+        if (it != shard.entries.end()) {
+            Entry &entry = it->second;
+            waiters = std::move(entry.waiters);
+            if (!chunk || entry.stale || chunk->data.size() > _shardCapacity()) {
+                shard.entries.erase(it);
+            } else {
+                entry.chunk = chunk;
+                entry.loading = false;
+                shard.probation.push_front(key);
+                entry.position = shard.probation.begin();
+                shard.bytes += chunk->data.size();
+                _evict(shard);
+            }
+        }
+    }
+    ready(chunk);
+    for (auto &waiter : waiters) {
+        // another reader's failure is not theirs, each reads the chunk itself
+        if (chunk) waiter.ready(chunk);
+        else waiter.load(std::move(waiter.ready));
+    }
+}
+
+void ChunkCache::_touch(Shard &shard, Entry &entry) {
+    size_t size = entry.chunk->data.size();
+    if (entry.isProtected) {
+        shard.protectedList.splice(shard.protectedList.begin(), shard.protectedList, entry.position);
+        return;
+    }
+    shard.protectedList.splice(shard.protectedList.begin(), shard.probation, entry.position);
+    entry.isProtected = true;
+    shard.protectedBytes += size;
+    // the least recently used protected chunks get another chance on probation
+    while (shard.protectedBytes > _shardCapacity() * PROTECTED_SHARE / 100 && shard.protectedList.size() > 1) {
+        auto last = std::prev(shard.protectedList.end());
+        Entry &demoted = shard.entries.find(*last)->second;
+        shard.probation.splice(shard.probation.begin(), shard.protectedList, last);
+        demoted.isProtected = false;
+        shard.protectedBytes -= demoted.chunk->data.size();
+    }
+}
+
+void ChunkCache::_evict(Shard &shard) {
+    while (shard.bytes > _shardCapacity()) {
+        auto &list = shard.probation.empty() ? shard.protectedList : shard.probation;
+        if (list.empty()) return;
+        _erase(shard, shard.entries.find(list.back()));
+        ++shard.evictions;
+    }
+}
+
+void ChunkCache::_erase(Shard &shard, std::unordered_map<Key, Entry, KeyHash>::iterator it) {
+    Entry &entry = it->second;
+    size_t size = entry.chunk->data.size();
+    shard.bytes -= size;
+    if (entry.isProtected) {
+        shard.protectedBytes -= size;
+        shard.protectedList.erase(entry.position);
+    } else {
+        shard.probation.erase(entry.position);
+    }
+    shard.entries.erase(it);
+}
+
+void ChunkCache::invalidate(uint64_t dev, uint64_t ino) {
+    if (!enabled()) return;
+    // the chunks of one file are spread over every shard
+    for (auto &shard : _shards) {
+        std::lock_guard g(shard.mutex);
+        for (auto it = shard.entries.begin(); it != shard.entries.end();) {
+            auto next = std::next(it);
+            if (it->first.dev == dev && it->first.ino == ino) {
+                if (it->second.loading) it->second.stale = true;
+                else _erase(shard, it);
+            }
+            it = next;
+        }
+    }
+}
+
+ChunkCache::Stats ChunkCache::stats() {
+    Stats stats;
+    stats.capacity = _capacity;
+    for (auto &shard : _shards) {
+        std::lock_guard g(shard.mutex);
+        stats.hits += shard.hits;
+        stats.misses += shard.misses;
+        stats.joined += shard.joined;
+        stats.evictions += shard.evictions;
+        stats.chunks += shard.probation.size() + shard.protectedList.size();
+        stats.bytes += shard.bytes;
+    }
+    return stats;
+}
@@ -1,233 +1,739 @@
 #include "session.hpp"
 #include <asio.hpp>
 #include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
 #include <filesystem>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <spdlog/spdlog.h>
 #include <nlohmann/json.hpp>
 
 #include "minidrive/error_codes.hpp"
+#include "minidrive/transfer.hpp"
 #include "server.hpp"
+#include "copy.hpp"
+#include "hash_tree.hpp"
 #include "globals.hpp"
 
 using asio::ip::tcp;
 using nlohmann::json;
 namespace fs = std::filesystem;
 
-void Session::handleLIST(const std::string &cmd, const json &args, const json &data) {
+namespace {
+
+// commands that may appear inside a BATCH
+const std::unordered_set<std::string> BATCH_COMMANDS = {"LIST", "REMOVE", "CD", "MKDIR", "RMDIR", "MOVE"};
+// workers walking a tree in one COPY
+const size_t COPY_WORKERS = 4;
+// matches a FIND returns unless it asks for a limit, and the most it may ask for
+const size_t FIND_LIMIT = 1000;
+const size_t MAX_FIND_LIMIT = 10000;
+// arguments holding paths, used to find entries that depend on each other
+const char *const BATCH_PATH_ARGS[] = {"path", "src", "dst"};
+
+json batchResult(const json &reply) {
+    json result = { {"code", reply["code"]}, {"message", reply["message"]} };
+    if (reply.contains("data") && !reply["data"].empty()) {
+        result["data"] = reply["data"];
+    }
+    return result;
+}
+
+} // namespace
+
+struct BatchState {
+    json ops;
+    json results;
+    std::vector<std::vector<size_t>> levels;
+    size_t level = 0;
+    std::atomic<size_t> remaining = 0;
+};
+
+json Session::_makePathFailReply(const ResolvedPath &path, const std::string &requested) {
+    if (path.error() == ENOENT || path.error() == ENOTDIR) {
+        spdlog::warn("parent of target does not exist: {}", requested);
+        return makeFailReply(minidrive::error::TARGET_NOT_FOUND.code(), requested);
+    }
+    spdlog::warn("access denied: {}", requested);
+    return makeFailReply(minidrive::error::ACCESS_DENIED.code(), requested);
+}
+
+json Session::_negotiate(const json &offer) {
+    _compression = false;
+    if (!_server->compressionEnabled() || !offer.contains("compression") || !offer["compression"].is_array()) {
+        return json::object();
+    }
+    for (const auto &name : offer["compression"]) {
+        if (name == minidrive::COMPRESSION_LZ) {
+            _compression = true;
+            return { {"compression", minidrive::COMPRESSION_LZ} };
+        }
+    }
+    return json::object();
+}
+
+json Session::handleLIST(const std::string &cmd, const json &args, const json &data) {
     if (_mode == mode::NOT_AUTHENTICATED) {
         spdlog::warn("session is not authenticated");
-        sendFailReply(minidrive::error::ACCESS_DENIED.code(), "not authenticated");
-        return;
+        return makeFailReply(minidrive::error::ACCESS_DENIED.code(), "not authenticated");
     }
     if (!args.contains("path")) {
         spdlog::warn("request does not contain 'path'");
-        sendFailReply(minidrive::error::MISSING_ARGUMENT, "path");
-        return;
+        return makeFailReply(minidrive::error::MISSING_ARGUMENT, "path");
     }
     std::string path = args["path"];
-    auto[result, valid] = _server->fs_resolvePath(this, path);
+    auto target = _server->fs_resolvePath(this, path);
     spdlog::debug("requested path: {}", path);
-    spdlog::debug("uwd: {}", _uwd.string());
-    spdlog::debug("resolved path: {}", result.string());
-    spdlog::debug("valid: {}", valid);
-    if (!valid) {
-        spdlog::warn("access denied: {}", result.string());
-        sendFailReply(minidrive::error::ACCESS_DENIED.code(), result.string());
-        return;
-    }
-    spdlog::info("listing path: {}", result.string());
-    json replyData = { {"files", _server->fs_listFiles(result)} };
+    spdlog::debug("uwd: {}", _uwd);
+    spdlog::debug("resolved path: {}", target.rel().string());
+    spdlog::debug("valid: {}", target.valid());
+    if (!target.valid()) {
+        return _makePathFailReply(target, path);
+    }
+    auto entry = _server->fs_stat(target);
+    if (!entry.exists()) {
+        spdlog::warn("target does not exist: {}", target.absolute().string());
+        return makeFailReply(minidrive::error::TARGET_NOT_FOUND.code(), target.absolute().string());
+    }
+    if (entry.type != fs::file_type::directory) {
+        spdlog::warn("target is not a directory: {}", target.absolute().string());
+        return makeFailReply(minidrive::error::FS_ERROR.code(), std::string("target is not a directory: ") + target.absolute().string());
+    }
+    spdlog::info("listing path: {}", target.absolute().string());
+    json replyData = { {"files", _server->fs_listFiles(target)} };
     spdlog::debug("json: {}", replyData.dump());
-    sendOkReply(result.string(), replyData);
+    return makeOkReply(target.absolute().string(), replyData);
+}
+
+json Session::handleREMOVE(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data) {
+    if (_mode == mode::NOT_AUTHENTICATED) {
+        spdlog::warn("session is not authenticated");
+        return makeFailReply(minidrive::error::ACCESS_DENIED.code(), "not authenticated");
+    }
+    if (!args.contains("path")) {
+        spdlog::warn("request does not contain 'path'");
+        return makeFailReply(minidrive::error::MISSING_ARGUMENT.code(), "path");
+    }
+    std::string path = args["path"];
+    auto target = _server->fs_resolvePath(this, path);
+    if (!target.valid()) {
+        return _makePathFailReply(target, path);
+    }
+    auto lock = _server->getPathLocks().lock(target.root()->path(), {target.rel()});
+    auto entry = _server->fs_stat(target);
+    if (!entry.exists()) {
+        spdlog::warn("target does not exist: {}", target.absolute().string());
+        return makeFailReply(minidrive::error::TARGET_NOT_FOUND.code(), target.absolute().string());
+    }
+    if (entry.type != fs::file_type::regular) {
+        spdlog::warn("target is not a regular file: {}", target.absolute().string());
+        return makeFailReply(minidrive::error::FS_ERROR.code(), std::string("target is not a regular file: ") + target.absolute().string());
+    }
+    if (!_server->fs_remove(target)) {
+        spdlog::warn("could not remove file: {}", target.absolute().string());
+        return makeFailReply(minidrive::error::FS_ERROR.code(), std::string("could not remove file: ") + target.absolute().string());
+    }
+
+    return makeOkReply("file removed");
 }
 
-void Session::handleREMOVE(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data) {
+json Session::handleCD(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data) {
     if (_mode == mode::NOT_AUTHENTICATED) {
         spdlog::warn("session is not authenticated");
-        sendFailReply(minidrive::error::ACCESS_DENIED.code(), "not authenticated");
-        return;
+        return makeFailReply(minidrive::error::ACCESS_DENIED.code(), "not authenticated");
     }
     if (!args.contains("path")) {
         spdlog::warn("request does not contain 'path'");
-        sendFailReply(minidrive::error::MISSING_ARGUMENT.code(), "path");
-        return;
+        return makeFailReply(minidrive::error::MISSING_ARGUMENT.code(), "path");
     }
     std::string path = args["path"];
-    auto[result, valid] = _server->fs_resolvePath(this, path);
-    if (!valid) {
-        spdlog::warn("access denied: {}", result.string());
-        sendFailReply(minidrive::error::ACCESS_DENIED.code(), result.string());
-        return;
-    }
-    if (!_server->fs_exists(result)) {
-        spdlog::warn("target does not exist: {}", result.string());
-        sendFailReply(minidrive::error::TARGET_NOT_FOUND.code(), result.string());
-        return;
-    }
-    auto type = _server->fs_getFileType(result);
-    if (type != fs::file_type::regular) {
-        spdlog::warn("target is not a regular file: {}", result.string());
-        sendFailReply(minidrive::error::FS_ERROR.code(), std::string("target is not a regular file: ") + result.string());
-        return;
-    }
-    if (!_server->fs_remove(result)) {
-        spdlog::warn("could not remove file: {}", result.string());
-        sendFailReply(minidrive::error::FS_ERROR.code(), std::string("could not remove file: ") + result.string());
-        return;
-    }
-
-    sendOkReply("file removed");
+    auto target = _server->fs_resolvePath(this, path);
+    if (!target.valid()) {
+        return _makePathFailReply(target, path);
+    }
+    auto entry = _server->fs_stat(target);
+    if (!entry.exists()) {
+        spdlog::warn("target does not exist: {}", target.absolute().string());
+        return makeFailReply(minidrive::error::TARGET_NOT_FOUND.code(), target.absolute().string());
+    }
+    if (entry.type != fs::file_type::directory) {
+        spdlog::warn("target is not a directory: {}", target.absolute().string());
+        return makeFailReply(minidrive::error::FS_ERROR.code(), std::string("target is not a directory: ") + target.absolute().string());
+    }
+
+    _uwd = target.rel().string();
+    spdlog::info("changed UWD: {}", _uwd);
+    return makeOkReply("");
 }
 
-void Session::handleCD(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data) {
+json Session::handleMKDIR(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data) {
     if (_mode == mode::NOT_AUTHENTICATED) {
         spdlog::warn("session is not authenticated");
-        sendFailReply(minidrive::error::ACCESS_DENIED.code(), "not authenticated");
-        return;
+        return makeFailReply(minidrive::error::ACCESS_DENIED.code(), "not authenticated");
     }
     if (!args.contains("path")) {
         spdlog::warn("request does not contain 'path'");
-        sendFailReply(minidrive::error::MISSING_ARGUMENT.code(), "path");
-        return;
+        return makeFailReply(minidrive::error::MISSING_ARGUMENT.code(), "path");
     }
     std::string path = args["path"];
-    auto[result, valid] = _server->fs_resolvePath(this, path);
-    if (!valid) {
-        spdlog::warn("access denied: {}", result.string());
-        sendFailReply(minidrive::error::ACCESS_DENIED.code(), result.string());
-        return;
-    }
-    if (!_server->fs_exists(result)) {
-        spdlog::warn("target does not exist: {}", result.string());
-        sendFailReply(minidrive::error::TARGET_NOT_FOUND.code(), result.string());
-        return;
-    }
-    auto type = _server->fs_getFileType(result);
-    if (type != fs::file_type::directory) {
-        spdlog::warn("target is not a directory: {}", result.string());
-        sendFailReply(minidrive::error::FS_ERROR.code(), std::string("target is not a directory: ") + result.string());
-        return;
-    }
-
-    try {
-        _uwd = fs::relative(result, USERDATA_DIR_PATH / _username);
-        spdlog::info("changed UWD: {}", _uwd.string());
-        sendOkReply("");
-    } catch (const fs::filesystem_error &e) {
-        spdlog::error("fs::relative(): {}", e.what());
-        sendFailReply(minidrive::error::FS_ERROR.code(), "filesystem error");
+    auto target = _server->fs_resolvePath(this, path);
+    if (!target.valid()) {
+        return _makePathFailReply(target, path);
     }
+    auto lock = _server->getPathLocks().lock(target.root()->path(), {target.rel()});
+    if (_server->fs_stat(target).exists()) {
+        spdlog::warn("target already exists: {}", target.absolute().string());
+        return makeFailReply(minidrive::error::TARGET_ALREADY_EXISTS.code(), target.absolute().string());
+    }
+
+    if (!_server->fs_createDir(target)) {
+        spdlog::error("failed to create directory: {}", target.absolute().string());
+        return makeFailReply(minidrive::error::FS_ERROR.code(), std::string("failed to create directory: ") + target.absolute().string());
+    }
+
+    return makeOkReply("");
 }
 
-void Session::handleMKDIR(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data) {
+json Session::handleRMDIR(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data) {
     if (_mode == mode::NOT_AUTHENTICATED) {
         spdlog::warn("session is not authenticated");
-        sendFailReply(minidrive::error::ACCESS_DENIED.code(), "not authenticated");
-        return;
+        return makeFailReply(minidrive::error::ACCESS_DENIED.code(), "not authenticated");
     }
     if (!args.contains("path")) {
         spdlog::warn("request does not contain 'path'");
-        sendFailReply(minidrive::error::MISSING_ARGUMENT.code(), "path");
-        return;
+        return makeFailReply(minidrive::error::MISSING_ARGUMENT.code(), "path");
     }
     std::string path = args["path"];
-    auto[result, valid] = _server->fs_resolvePath(this, path);
-    if (!valid) {
-        spdlog::warn("access denied: {}", result.string());
-        sendFailReply(minidrive::error::ACCESS_DENIED.code(), result.string());
-        return;
+    auto target = _server->fs_resolvePath(this, path);
+    if (!target.valid()) {
+        return _makePathFailReply(target, path);
+    }
+    auto lock = _server->getPathLocks().lock(target.root()->path(), {target.rel()});
+    if (target.isRoot()) {
+        spdlog::warn("refusing to remove the root directory");
+        return makeFailReply(minidrive::error::ACCESS_DENIED.code(), "cannot remove the root directory");
     }
-    if (_server->fs_exists(result)) {
-        spdlog::warn("target already exists: {}", result.string());
-        sendFailReply(minidrive::error::TARGET_ALREADY_EXISTS.code(), result.string());
-        return;
+    auto entry = _server->fs_stat(target);
+    if (!entry.exists()) {
+        spdlog::warn("target does not exist: {}", target.absolute().string());
+        return makeFailReply(minidrive::error::TARGET_NOT_FOUND.code(), target.absolute().string());
+    }
+    if (entry.type != fs::file_type::directory) {
+        spdlog::warn("target is not a directory: {}", target.absolute().string());
+        return makeFailReply(minidrive::error::FS_ERROR.code(), std::string("target is not a directory: ") + target.absolute().string());
     }
 
-    if (!_server->fs_createDir(result, false)) {
-        spdlog::error("failed to create directory: {}", result.string());
-        sendFailReply(minidrive::error::FS_ERROR.code(), std::string("failed to create directory: ") + result.string());
-        return;
+    if (!_server->fs_removeDir(target)) {
+        spdlog::error("failed to remove directory: {}", target.absolute().string());
+        return makeFailReply(minidrive::error::FS_ERROR.code(), std::string("failed to remove directory: ") + target.absolute().string());
     }
 
-    sendOkReply("");
+    return makeOkReply("");
+}
+
+
+json Session::handleMOVE(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data) {
+    if (_mode == mode::NOT_AUTHENTICATED) {
+        spdlog::warn("session is not authenticated");
+        return makeFailReply(minidrive::error::ACCESS_DENIED.code(), "not authenticated");
+    }
+    for (const char *name : {"src", "dst"}) {
+        if (!args.contains(name)) {
+            spdlog::warn("request does not contain '{}'", name);
+            return makeFailReply(minidrive::error::MISSING_ARGUMENT.code(), name);
+        }
+    }
+    std::string srcPath = args["src"], dstPath = args["dst"];
+    auto source = _server->fs_resolvePath(this, srcPath);
+    if (!source.valid()) {
+        return _makePathFailReply(source, srcPath);
+    }
+    auto target = _server->fs_resolvePath(this, dstPath);
+    if (!target.valid()) {
+        return _makePathFailReply(target, dstPath);
+    }
+    auto lock = _server->getPathLocks().lock(source.root()->path(), {source.rel(), target.rel()});
+    if (source.isRoot() || target.isRoot()) {
+        spdlog::warn("refusing to move the root directory");
+        return makeFailReply(minidrive::error::ACCESS_DENIED.code(), "cannot move the root directory");
+    }
+    if (!_server->fs_stat(source).exists()) {
+        spdlog::warn("source does not exist: {}", source.absolute().string());
+        return makeFailReply(minidrive::error::TARGET_NOT_FOUND.code(), source.absolute().string());
+    }
+    if (_server->fs_stat(target).exists()) {
+        spdlog::warn("target already exists: {}", target.absolute().string());
+        return makeFailReply(minidrive::error::TARGET_ALREADY_EXISTS.code(), target.absolute().string());
+    }
+
+    if (!_server->fs_move(source, target)) {
+        int err = errno;
+        spdlog::error("failed to move {} to {}: {}", source.absolute().string(), target.absolute().string(), std::strerror(err));
+        if (err == EEXIST || err == ENOTEMPTY) {
+            return makeFailReply(minidrive::error::TARGET_ALREADY_EXISTS.code(), target.absolute().string());
+        }
+        return makeFailReply(minidrive::error::FS_ERROR.code(), std::string("failed to move: ") + std::strerror(err));
+    }
+
+    return makeOkReply("");
+}
+
+json Session::handleCOPY(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data) {
+    if (_mode == mode::NOT_AUTHENTICATED) {
+        spdlog::warn("session is not authenticated");
+        return makeFailReply(minidrive::error::ACCESS_DENIED.code(), "not authenticated");
+    }
+    for (const char *name : {"src", "dst"}) {
+        if (!args.contains(name)) {
+            spdlog::warn("request does not contain '{}'", name);
+            return makeFailReply(minidrive::error::MISSING_ARGUMENT.code(), name);
+        }
+    }
+    std::string srcPath = args["src"], dstPath = args["dst"];
+    auto source = _server->fs_resolvePath(this, srcPath);
+    if (!source.valid()) {
+        return _makePathFailReply(source, srcPath);
+    }
+    auto target = _server->fs_resolvePath(this, dstPath);
+    if (!target.valid()) {
+        return _makePathFailReply(target, dstPath);
+    }
+    // held while the paths are checked, the copy itself fills the new tree gradually
+    auto lock = _server->getPathLocks().lock(source.root()->path(), {target.rel()}, {source.rel()});
+    auto entry = _server->fs_stat(source);
+    if (!entry.exists()) {
+        spdlog::warn("source does not exist: {}", source.absolute().string());
+        return makeFailReply(minidrive::error::TARGET_NOT_FOUND.code(), source.absolute().string());
+    }
+    if (entry.type != fs::file_type::regular && entry.type != fs::file_type::directory) {
+        spdlog::warn("source is not a file or directory: {}", source.absolute().string());
+        return makeFailReply(minidrive::error::FS_ERROR.code(), std::string("cannot copy: ") + source.absolute().string());
+    }
+    if (_server->fs_stat(target).exists()) {
+        spdlog::warn("target already exists: {}", target.absolute().string());
+        return makeFailReply(minidrive::error::TARGET_ALREADY_EXISTS.code(), target.absolute().string());
+    }
+    auto [mismatch, _] = std::mismatch(source.rel().begin(), source.rel().end(), target.rel().begin(), target.rel().end());
+    if (entry.type == fs::file_type::directory && mismatch == source.rel().end()) {
+        spdlog::warn("refusing to copy {} into itself", source.absolute().string());
+        return makeFailReply(minidrive::error::FS_ERROR.code(), "cannot copy a directory into itself");
+    }
+
+    // a directory's files are reserved one by one as the copy reaches them
+    auto hold = _server->usage_reserve(this, entry.type == fs::file_type::regular ? static_cast<int64_t>(entry.size) : 0);
+    if (!hold) {
+        spdlog::warn("copy of {} exceeds the quota", source.absolute().string());
+        return makeFailReply(minidrive::error::QUOTA_EXCEEDED, srcPath);
+    }
+
+    auto copy = TreeCopy::create(std::move(source), std::move(target), entry);
+    copy->setProgressHandler([this](const TreeCopy::Progress &progress) {
+        sendEvent("PROGRESS", makeOkReply("copying", { {"files", progress.files}, {"links", progress.links},
+            {"dirs", progress.dirs}, {"bytes", progress.bytes} }));
+    });
+    bool isDir = entry.type == fs::file_type::directory;
+    if (isDir) copy->setReserveHandler([hold](uint64_t bytes) {return hold->grow(static_cast<int64_t>(bytes));});
+    _beginAsync();
+    copy->start(_server->getCopyWorkers(), COPY_WORKERS,
+        [this, hold, isDir](TreeCopy &copy, const minidrive::error_code &err, const std::string &message) {
+            // what was copied counts, a failed copy's cleanup below takes it off again
+            auto progress = copy.progress();
+            hold->commit(static_cast<int64_t>(progress.bytes), static_cast<int64_t>(progress.files));
+            if (!err) {
+                const auto &target = copy.destination();
+                auto &names = target.root()->names();
+                isDir ? names.addTree(*target.root(), target.rel()) : names.add(target.rel(), false);
+                _endAsync(makeOkReply("", { {"files", progress.files}, {"links", progress.links},
+                    {"dirs", progress.dirs}, {"bytes", progress.bytes}, {"cloned", progress.cloned} }));
+                return;
+            }
+            // don't leave half a copy behind
+            if (copy.createdDestination()) {
+                const auto &target = copy.destination();
+                bool isDir = _server->fs_stat(target).type == fs::file_type::directory;
+                isDir ? _server->fs_removeDir(target) : _server->fs_remove(target);
+            }
+            _endAsync(makeFailReply(err, message));
+        });
+    return nullptr;
+}
+
+
+json Session::handleUPLOAD(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data) {
+    if (_mode == mode::NOT_AUTHENTICATED) {
+        spdlog::warn("session is not authenticated");
+        return makeFailReply(minidrive::error::ACCESS_DENIED.code(), "not authenticated");
+    }
+    if (!args.contains("path")) {
+        spdlog::warn("request does not contain 'path'");
+        return makeFailReply(minidrive::error::MISSING_ARGUMENT.code(), "path");
+    }
+    if (!args.contains("size")) {
+        spdlog::warn("request does not contain 'size'");
+        return makeFailReply(minidrive::error::MISSING_ARGUMENT.code(), "size");
+    }
+    std::string path = args["path"];
+    uint64_t size = args["size"];
+    auto target = _server->fs_resolvePath(this, path);
+    if (!target.valid()) {
+        return _makePathFailReply(target, path);
+    }
+    auto lock = _server->getPathLocks().lock(target.root()->path(), {target.rel()});
+    minidrive::error_code err = minidrive::error::SUCCESS;
+    std::shared_ptr<Transfer> transfer;
+    std::shared_ptr<UsageTracker::Hold> hold;
+    if (args.contains("chunks")) {
+        // repair: only the listed chunks are sent, into the existing file
+        auto entry = _server->fs_stat(target);
+        if (entry.type != fs::file_type::regular) {
+            spdlog::warn("target is not a regular file: {}", target.absolute().string());
+            return makeFailReply(minidrive::error::TARGET_NOT_FOUND.code(), target.absolute().string());
+        }
+        auto tree = tree_load(target);
+        if (!tree || minidrive::tagToHex(tree->root()) != args.value("root", std::string())) {
+            spdlog::warn("repair of {} against an outdated tree", target.absolute().string());
+            return makeFailReply(minidrive::error::TRANSFER_FAILED.code(), "file changed since its tree was read");
+        }
+        int64_t growth = static_cast<int64_t>(size) - static_cast<int64_t>(entry.size);
+        hold = _server->usage_reserve(this, growth);
+        if (!hold) {
+            spdlog::warn("repair of {} to {}B exceeds the quota", target.absolute().string(), size);
+            return makeFailReply(minidrive::error::QUOTA_EXCEEDED, path);
+        }
+        auto chunks = args["chunks"].get<std::vector<uint64_t>>();
+        transfer = Transfer::createRepair(_server->tr_nextId(), std::move(target), size, *tree, chunks, err);
+        // the file is resized right away, whether the repair completes or not
+        if (transfer) hold->commit(growth, 0);
+        hold = nullptr;
+    } else {
+        if (target.isRoot() || _server->fs_stat(target).exists()) {
+            spdlog::warn("target already exists: {}", target.absolute().string());
+            return makeFailReply(minidrive::error::TARGET_ALREADY_EXISTS.code(), target.absolute().string());
+        }
+        // chunks in holes of the client's file, never sent
+        std::vector<uint64_t> holes;
+        if (args.contains("holes") && !minidrive::fromRanges(args["holes"].get<minidrive::ChunkRanges>(),
+                minidrive::chunkCount(size, minidrive::CHUNK_SIZE), holes)) {
+            return makeFailReply(minidrive::error::INVALID_CHUNK, path);
+        }
+        // checked before any byte is sent, concurrent uploads can't overshoot together
+        hold = _server->usage_reserve(this, static_cast<int64_t>(size));
+        if (!hold) {
+            spdlog::warn("upload of {} ({}B) exceeds the quota", target.absolute().string(), size);
+            return makeFailReply(minidrive::error::QUOTA_EXCEEDED, path);
+        }
+        transfer = Transfer::createUpload(_server->tr_nextId(), std::move(target), size, holes, err);
+    }
+    // the commit locks the target again, an empty file commits in begin()
+    lock.unlock();
+    if (!transfer) {
+        return makeFailReply(err, path);
+    }
+    transfer->setCache(&_server->getChunkCache());
+    transfer->setLocks(&_server->getPathLocks());
+    transfer->setSync(&_server->getCommitSync());
+    _startTransfer(transfer, std::move(hold));
+    spdlog::info("upload {} started: {} ({}B)", transfer->id(), transfer->path().rel().string(), size);
+    // the OK reply must precede the completion event of an empty file
+    sendOkReply("upload started", { {"id", transfer->id()}, {"token", transfer->token()},
+        {"chunk_size", transfer->chunkSize()} });
+    transfer->begin(_server->getFileIo());
+    return nullptr;
 }
 
-void Session::handleRMDIR(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data) {
+json Session::handleDOWNLOAD(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data) {
     if (_mode == mode::NOT_AUTHENTICATED) {
         spdlog::warn("session is not authenticated");
-        sendFailReply(minidrive::error::ACCESS_DENIED.code(), "not authenticated");
-        return;
+        return makeFailReply(minidrive::error::ACCESS_DENIED.code(), "not authenticated");
     }
     if (!args.contains("path")) {
         spdlog::warn("request does not contain 'path'");
-        sendFailReply(minidrive::error::MISSING_ARGUMENT.code(), "path");
-        return;
+        return makeFailReply(minidrive::error::MISSING_ARGUMENT.code(), "path");
     }
     std::string path = args["path"];
-    auto[result, valid] = _server->fs_resolvePath(this, path);
-    if (!valid) {
-        spdlog::warn("access denied: {}", result.string());
-        sendFailReply(minidrive::error::ACCESS_DENIED.code(), result.string());
-        return;
+    auto source = _server->fs_resolvePath(this, path);
+    if (!source.valid()) {
+        return _makePathFailReply(source, path);
     }
-    if (!_server->fs_exists(result)) {
-        spdlog::warn("target does not exist: {}", result.string());
-        sendFailReply(minidrive::error::TARGET_NOT_FOUND.code(), result.string());
-        return;
+    auto entry = _server->fs_stat(source);
+    if (!entry.exists()) {
+        spdlog::warn("target does not exist: {}", source.absolute().string());
+        return makeFailReply(minidrive::error::TARGET_NOT_FOUND.code(), source.absolute().string());
     }
-    auto type = _server->fs_getFileType(result);
-    if (type != fs::file_type::directory) {
-        spdlog::warn("target is not a directory: {}", result.string());
-        sendFailReply(minidrive::error::FS_ERROR.code(), std::string("target is not a directory: ") + result.string());
-        return;
+    if (entry.type != fs::file_type::regular) {
+        spdlog::warn("target is not a regular file: {}", source.absolute().string());
+        return makeFailReply(minidrive::error::FS_ERROR.code(), std::string("target is not a regular file: ") + source.absolute().string());
     }
 
-    if (!_server->fs_removeDir(result)) {
-        spdlog::error("failed to remove directory: {}", result.string());
-        sendFailReply(minidrive::error::FS_ERROR.code(), std::string("failed to remove directory: ") + result.string());
-        return;
+    // resume: only the listed chunks, those the client found missing or different
+    if (args.contains("chunks")) {
+        auto tree = tree_load(source);
+        if (!tree || minidrive::tagToHex(tree->root()) != args.value("root", std::string())) {
+            spdlog::warn("resume of {} against an outdated tree", source.absolute().string());
+            return makeFailReply(minidrive::error::TRANSFER_FAILED.code(), "file changed since its tree was read");
+        }
+    }
+    minidrive::error_code err = minidrive::error::SUCCESS;
+    auto transfer = Transfer::createDownload(_server->tr_nextId(), std::move(source), err);
+    if (!transfer) {
+        return makeFailReply(err, path);
+    }
+    if (args.contains("chunks") && !transfer->setChunks(args["chunks"].get<std::vector<uint64_t>>())) {
+        return makeFailReply(minidrive::error::INVALID_CHUNK, path);
+    }
+    transfer->setCache(&_server->getChunkCache());
+    _startTransfer(transfer);
+    spdlog::info("download {} started: {} ({}B)", transfer->id(), transfer->path().rel().string(), transfer->size());
+    // chunks follow the reply on this connection and on every joined one
+    json reply = { {"id", transfer->id()}, {"token", transfer->token()}, {"size", transfer->size()},
+        {"chunk_size", transfer->chunkSize()} };
+    if (!transfer->holes().empty()) reply["holes"] = minidrive::toRanges(transfer->holes());
+    sendOkReply("download started", reply);
+    transfer->begin(_server->getFileIo());
+    _addDownload(transfer);
+    return nullptr;
+}
+
+json Session::handleJOIN(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data) {
+    if (_mode != mode::NOT_AUTHENTICATED) {
+        spdlog::warn("session already authenticated");
+        return makeFailReply(minidrive::error::ALREADY_AUTHENTICATED.code(), "");
+    }
+    if (!args.contains("token")) {
+        spdlog::warn("request does not contain 'token'");
+        return makeFailReply(minidrive::error::MISSING_ARGUMENT.code(), "token");
+    }
+    const std::string &token = args["token"];
+    std::shared_ptr<minidrive::RateBuckets> rate;
+    auto transfer = _server->tr_join(token, rate);
+    if (!transfer) {
+        spdlog::warn("invalid transfer token");
+        return makeFailReply(minidrive::error::INVALID_TOKEN, "");
+    }
+    {
+        auto &state = _transfersState();
+        std::lock_guard g(state.mutex);
+        state.joined = transfer;
+    }
+    _mode = mode::DATA;
+    _userRate.store(std::move(rate));
+    spdlog::info("data connection joined transfer {}", transfer->id());
+    json reply = { {"id", transfer->id()}, {"size", transfer->size()}, {"chunk_size", transfer->chunkSize()} };
+    reply.update(_negotiate(args));
+    sendOkReply("joined", reply);
+    if (transfer->dir() == Transfer::direction::DOWNLOAD) {
+        _addDownload(transfer);
+    }
+    return nullptr;
+}
+
+json Session::handleTREE(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data) {
+    if (_mode == mode::NOT_AUTHENTICATED) {
+        spdlog::warn("session is not authenticated");
+        return makeFailReply(minidrive::error::ACCESS_DENIED.code(), "not authenticated");
+    }
+    if (!args.contains("path")) {
+        spdlog::warn("request does not contain 'path'");
+        return makeFailReply(minidrive::error::MISSING_ARGUMENT.code(), "path");
     }
+    std::string path = args["path"];
+    auto source = _server->fs_resolvePath(this, path);
+    if (!source.valid()) {
+        return _makePathFailReply(source, path);
+    }
+    int fd = _server->fs_openFile(source, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        bool missing = fd < 0 && errno == ENOENT;
+        if (fd >= 0) close(fd);
+        spdlog::warn("no regular file at {}", source.absolute().string());
+        return makeFailReply(missing ? minidrive::error::TARGET_NOT_FOUND : minidrive::error::FS_ERROR, source.absolute().string());
+    }
+    uint64_t size = static_cast<uint64_t>(st.st_size);
+    if (auto tree = tree_load(*source.root(), fd)) {
+        close(fd);
+        return _makeTreeReply(*tree, size, args);
+    }
+    // files from before trees were kept, or changed behind the server's back, are hashed once
+    _beginAsync();
+    asio::post(_server->getWorkers(), [this, root = source.root(), fd, size, args]() {
+        auto tree = tree_build(*root, fd);
+        close(fd);
+        json reply;
+        try {
+            reply = tree ? _makeTreeReply(*tree, size, args) : makeFailReply(minidrive::error::FS_ERROR, "could not hash the file");
+        } catch (const json::type_error &e) {
+            reply = makeFailReply(minidrive::error::JSON_TYPE_ERROR.code(), e.what());
+        }
+        _endAsync(reply);
+    });
+    return nullptr;
+}
 
-    sendOkReply("");
+json Session::_makeTreeReply(const minidrive::MerkleTree &tree, uint64_t size, const json &args) {
+    json data = { {"size", size}, {"chunk_size", minidrive::CHUNK_SIZE}, {"levels", tree.levels()},
+        {"root", minidrive::tagToHex(tree.root())} };
+    if (!args.contains("nodes")) return makeOkReply("", data);
+    size_t level = args.value("level", size_t(0));
+    const json &nodes = args["nodes"];
+    if (level >= tree.levels() || !nodes.is_array() || nodes.size() > minidrive::MAX_TREE_QUERY) {
+        return makeFailReply(minidrive::error::INVALID_CHUNK, "no such nodes");
+    }
+    json hashes = json::array();
+    for (const auto &node : nodes) {
+        uint64_t index = node.get<uint64_t>();
+        if (index >= tree.width(level)) return makeFailReply(minidrive::error::INVALID_CHUNK, "no such nodes");
+        hashes.push_back(minidrive::tagToHex(tree.node(level, index)));
+    }
+    data["level"] = level;
+    data["hashes"] = std::move(hashes);
+    return makeOkReply("", data);
 }
 
+json Session::handleRESEND(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data) {
+    // sent by the client in the middle of a download, never answered
+    if (!args.contains("id") || !args.contains("offset")) {
+        spdlog::warn("RESEND without 'id' or 'offset'");
+        return nullptr;
+    }
+    uint64_t offset = args["offset"];
+    auto transfer = _findTransfer(args["id"]);
+    if (!transfer || !transfer->resend(offset)) {
+        spdlog::warn("cannot resend chunk at offset {} of transfer {}", offset, args["id"].dump());
+        return nullptr;
+    }
+    _addDownload(transfer);
+    return nullptr;
+}
+
+json Session::handleDONE(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data) {
+    // ends a download, never answered; until then the file stays open for RESEND
+    if (!args.contains("id")) {
+        spdlog::warn("DONE without 'id'");
+        return nullptr;
+    }
+    auto transfer = _findTransfer(args["id"]);
+    if (transfer) transfer->acknowledge();
+    return nullptr;
+}
+
+
+json Session::handleSTATS(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data) {
+    if (_mode == mode::NOT_AUTHENTICATED) {
+        spdlog::warn("session is not authenticated");
+        return makeFailReply(minidrive::error::ACCESS_DENIED.code(), "not authenticated");
+    }
+    auto cache = _server->getChunkCache().stats();
+    auto locks = _server->getPathLocks().stats();
+    auto sync = _server->getCommitSync().stats();
+    return makeOkReply("", { {"chunk_cache", { {"hits", cache.hits}, {"misses", cache.misses}, {"joined", cache.joined},
+        {"evictions", cache.evictions}, {"chunks", cache.chunks}, {"bytes", cache.bytes}, {"capacity", cache.capacity} }},
+        {"path_locks", { {"acquired", locks.acquired}, {"contended", locks.contended}, {"wait_us", locks.waitMicros},
+        {"max_wait_us", locks.maxWaitMicros} }},
+        {"commit_sync", { {"policy", std::string(CommitSync::name(_server->getCommitSync().getPolicy()))}, {"syncs", sync.syncs},
+        {"batches", sync.batches} }} });
+}
 
-void Session::handleAUTH(const std::string &cmd, const json &args, const json &data) {
+json Session::handleFIND(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data) {
+    if (_mode == mode::NOT_AUTHENTICATED) {
+        spdlog::warn("session is not authenticated");
+        return makeFailReply(minidrive::error::ACCESS_DENIED.code(), "not authenticated");
+    }
+    if (!args.contains("pattern") || !args["pattern"].is_string() || args["pattern"].get<std::string>().empty()) {
+        spdlog::warn("request does not contain 'pattern'");
+        return makeFailReply(minidrive::error::MISSING_ARGUMENT.code(), "pattern");
+    }
+    std::string path = args.value("path", std::string());
+    auto target = _server->fs_resolvePath(this, path);
+    if (!target.valid()) {
+        return _makePathFailReply(target, path);
+    }
+    auto entry = _server->fs_stat(target);
+    if (!entry.exists()) {
+        spdlog::warn("target does not exist: {}", target.absolute().string());
+        return makeFailReply(minidrive::error::TARGET_NOT_FOUND.code(), target.absolute().string());
+    }
+    if (entry.type != fs::file_type::directory) {
+        spdlog::warn("target is not a directory: {}", target.absolute().string());
+        return makeFailReply(minidrive::error::FS_ERROR.code(), std::string("target is not a directory: ") + target.absolute().string());
+    }
+    NameIndex::Query query{args["pattern"], target.rel(), std::min(args.value("limit", FIND_LIMIT), MAX_FIND_LIMIT)};
+    auto root = target.root();
+    if (root->names().built()) return _makeFindReply(root->names(), query);
+    // the first FIND of a root walks it, on a worker; FINDs coming meanwhile are answered by that worker
+    _beginAsync();
+    asio::post(_server->getWorkers(), [this, root, query]() {
+        root->names().build(*root, [this, root, query](bool done) {
+            _endAsync(done ? _makeFindReply(root->names(), query)
+                : makeFailReply(minidrive::error::FS_ERROR, "could not index the directory"));
+        });
+    });
+    return nullptr;
+}
+
+json Session::_makeFindReply(NameIndex &names, const NameIndex::Query &query) {
+    bool truncated = false;
+    json matches = json::array();
+    for (auto &match : names.find(query, truncated)) {
+        matches.push_back({ {"path", "/" + match.path},
+            {"type", match.dir ? fs::file_type::directory : fs::file_type::regular} });
+    }
+    return makeOkReply("", { {"matches", std::move(matches)}, {"truncated", truncated} });
+}
+
+json Session::handleUSAGE(const std::string &cmd, const nlohmann::json &args, const nlohmann::json &data) {
+    if (_mode == mode::NOT_AUTHENTICATED) {
+        spdlog::warn("session is not authenticated");
+        return makeFailReply(minidrive::error::ACCESS_DENIED.code(), "not authenticated");
+    }
+    auto usage = _server->usage_get(this);
+    return makeOkReply("", { {"bytes", usage.bytes}, {"files", usage.files}, {"quota", _server->usage_quota(this)} });
+}
+
+
+json Session::handleAUTH(const std::string &cmd, const json &args, const json &data) {
     // TODO error if already authenticated
     if (_mode != mode::NOT_AUTHENTICATED) {
         spdlog::warn("session already authenticated");
-        sendFailReply(minidrive::error::ALREADY_AUTHENTICATED.code(), "");
-        return;
+        return makeFailReply(minidrive::error::ALREADY_AUTHENTICATED.code(), "");
     }
     if (!data.contains("mode")) { // check if request contains 'mode' argument
         spdlog::warn("request does not contain 'mode'");
-        sendFailReply(minidrive::error::MISSING_ARGUMENT.code(), "mode");
-        return;
+        return makeFailReply(minidrive::error::MISSING_ARGUMENT.code(), "mode");
     }
     const std::string &mode = data["mode"];
     // public mode
     if (mode == "public") {
         if (!_server->fs_createDir(PUBLIC_DIR_PATH)) {
             spdlog::error("failed to create public directory");
-            sendFailReply(minidrive::error::FS_ERROR.code(), "failed to create public directory");
-            return;
+            return makeFailReply(minidrive::error::FS_ERROR.code(), "failed to create public directory");
+        }
+        _root = _server->fs_openRoot(PUBLIC_DIR_PATH);
+        if (!_root) {
+            return makeFailReply(minidrive::error::FS_ERROR.code(), "failed to open public directory");
         }
         _mode = mode::PUBLIC;
         spdlog::info("authenticated as public user");
-        sendOkReply("running as public user");
+        return makeOkReply("running as public user", _negotiate(data));
     }
     // private mode
     else if (mode == "private") {
         spdlog::info("attempting authentication as private user");
         if (!args.contains("username")) {
             spdlog::warn("request does not contain 'username'");
-            sendFailReply(minidrive::error::MISSING_ARGUMENT, "username");
-            return;
+            return makeFailReply(minidrive::error::MISSING_ARGUMENT, "username");
         }
         if (!args.contains("password")) {
             spdlog::warn("request does not contain 'password'");
-            sendFailReply(minidrive::error::MISSING_ARGUMENT, "password");
-            return;
+            return makeFailReply(minidrive::error::MISSING_ARGUMENT, "password");
         }
         const std::string &username = args["username"];
         const std::string &password = args["password"];
@@ -235,53 +741,187 @@ void Session::handleAUTH(const std::string &cmd, const json &args, const json &d
             if (_server->auth_verifyPassword(username, password)) {
                 if (!_server->fs_createDir(USERDATA_DIR_PATH / username)) {
                     spdlog::error("failed to create user directory");
-                    sendFailReply(minidrive::error::FS_ERROR.code(), "failed to create user directory");
-                    return;
+                    return makeFailReply(minidrive::error::FS_ERROR.code(), "failed to create user directory");
+                }
+                _root = _server->fs_openRoot(USERDATA_DIR_PATH / username);
+                if (!_root) {
+                    return makeFailReply(minidrive::error::FS_ERROR.code(), "failed to open user directory");
                 }
                 _mode = mode::PRIVATE;
                 _username = username;
-                spdlog::info("authentication success, user: '{}'", username);
-                sendOkReply("");
+                _server->setSessionUser(_id, username);
+                _userRate.store(_server->rate_forUser(username));
+                spdlog::info("authentication success, user: '{}', sessions: {}", username,
+                    _server->sessionsOf(username).size());
+                return makeOkReply("", _negotiate(data));
             } else {
                 spdlog::warn("incorrect password for user '{}'", username);
-                sendFailReply(minidrive::error::INCORRECT_PASSWORD.code(), "");
+                return makeFailReply(minidrive::error::INCORRECT_PASSWORD.code(), "");
             }
         } else {
             spdlog::warn("user '{}' does not exist", username);
-            sendFailReply(minidrive::error::USER_NOT_FOUND.code(), username);
+            return makeFailReply(minidrive::error::USER_NOT_FOUND.code(), username);
         }
         
     }
     else { // incorrect (not public nor private)
         spdlog::warn("uknown mode: '{}'", mode);
-        sendFailReply(minidrive::error::MISSING_ARGUMENT, "mode must be 'public' or 'private'");
-        return;
+        return makeFailReply(minidrive::error::MISSING_ARGUMENT, "mode must be 'public' or 'private'");
     }
 }
 
-void Session::handleREGISTER(const std::string &cmd, const json &args, const json &data) {
+json Session::handleREGISTER(const std::string &cmd, const json &args, const json &data) {
     if (!args.contains("username")) {
         spdlog::warn("request does not contain 'username'");
-        sendFailReply(minidrive::error::MISSING_ARGUMENT, "username");
-        return;
+        return makeFailReply(minidrive::error::MISSING_ARGUMENT, "username");
     }
     if (!args.contains("password")) {
         spdlog::warn("request does not contain 'password'");
-        sendFailReply(minidrive::error::MISSING_ARGUMENT, "password");
-        return;
+        return makeFailReply(minidrive::error::MISSING_ARGUMENT, "password");
     }
     const std::string &username = args["username"];
     const std::string &password = args["password"];
     if (_server->auth_userExists(username)) {
         spdlog::warn("user '{}' already exists", username);
-        sendFailReply(minidrive::error::USER_ALREADY_EXISTS.code(), username);
-        return;
+        return makeFailReply(minidrive::error::USER_ALREADY_EXISTS.code(), username);
     }
     if (_server->auth_createUser(username, password)) {
         spdlog::info("user 'username' was registered");
-        sendOkReply("user registered");
+        return makeOkReply("user registered");
     } else {
         spdlog::warn("failed to register user 'username', password hashing failed (probably)");
-        sendFailReply(minidrive::error::USER_REGISTER.code(), "password hashing failed somehow :(");
+        return makeFailReply(minidrive::error::USER_REGISTER.code(), "password hashing failed somehow :(");
+    }
+}
+
+json Session::handleBATCH(const std::string &cmd, const json &args, const json &data) {
+    if (_mode == mode::NOT_AUTHENTICATED) {
+        spdlog::warn("session is not authenticated");
+        return makeFailReply(minidrive::error::ACCESS_DENIED.code(), "not authenticated");
+    }
+    if (!args.contains("ops")) {
+        spdlog::warn("request does not contain 'ops'");
+        return makeFailReply(minidrive::error::MISSING_ARGUMENT, "ops");
+    }
+    const json &ops = args["ops"];
+    if (!ops.is_array()) {
+        return makeFailReply(minidrive::error::JSON_TYPE_ERROR, "ops must be array");
     }
-}
\ No newline at end of file
+    const std::string onError = args.value("onError", std::string("stop"));
+    if (onError != "stop" && onError != "continue") {
+        return makeFailReply(minidrive::error::JSON_TYPE_ERROR, "onError must be 'stop' or 'continue'");
+    }
+    bool stopOnError = onError == "stop";
+    bool parallel = args.value("parallel", false);
+
+    for (const auto &op : ops) {
+        if (!op.is_object() || !op.contains("cmd") || !op["cmd"].is_string()) {
+            return makeFailReply(minidrive::error::JSON_TYPE_ERROR, "every op must be an object with a string 'cmd'");
+        }
+        const std::string &opCmd = op["cmd"];
+        if (!BATCH_COMMANDS.contains(opCmd)) {
+            return makeFailReply(minidrive::error::UNKNOWN_COMMAND, "not allowed in batch: " + opCmd);
+        }
+        // CD changes how every later path resolves, entries can't be reordered around it
+        if (opCmd == "CD") parallel = false;
+    }
+    // stop-on-error needs entries to finish in order
+    if (stopOnError) parallel = false;
+
+    spdlog::info("batch: {} ops, onError: {}, parallel: {}", ops.size(), onError, parallel);
+
+    if (!parallel) {
+        json results = json::array();
+        size_t failed = 0;
+        for (const auto &op : ops) {
+            json reply;
+            const json &opArgs = op.contains("args") ? op["args"] : json::object();
+            try {
+                reply = dispatch(op["cmd"], opArgs, op);
+            } catch (const json::type_error &e) {
+                reply = makeFailReply(minidrive::error::JSON_TYPE_ERROR, e.what());
+            }
+            results.push_back(batchResult(reply));
+            if (reply["code"] != minidrive::error::SUCCESS.code()) {
+                ++failed;
+                if (stopOnError) break;
+            }
+        }
+        return makeOkReply("batch", { {"results", results}, {"failed", failed} });
+    }
+
+    // group entries into levels, an entry runs after every earlier entry touching
+    // the same path, one of its ancestors or descendants; a level runs in parallel
+    auto state = std::make_shared<BatchState>();
+    state->ops = ops;
+    state->results = json::array();
+    std::unordered_map<std::string, size_t> exactLevel, subtreeLevel;
+    for (size_t i = 0; i < ops.size(); ++i) {
+        const json &opArgs = ops[i].contains("args") ? ops[i]["args"] : json::object();
+        std::vector<std::string> paths;
+        for (const char *name : BATCH_PATH_ARGS) {
+            if (opArgs.is_object() && opArgs.contains(name) && opArgs[name].is_string()) {
+                auto rel = fs_resolveRelative(getUWD(), opArgs[name].get<std::string>());
+                paths.push_back((fs::path("/") / rel.value_or("..")).string());
+            }
+        }
+        size_t level = 0;
+        for (const auto &p : paths) {
+            if (auto it = subtreeLevel.find(p); it != subtreeLevel.end()) {
+                level = std::max(level, it->second + 1);
+            }
+            for (fs::path a = p; !a.empty(); a = a.parent_path()) {
+                if (auto it = exactLevel.find(a.string()); it != exactLevel.end()) {
+                    level = std::max(level, it->second + 1);
+                }
+                if (a == a.parent_path()) break;
+            }
+        }
+        for (const auto &p : paths) {
+            exactLevel[p] = std::max(exactLevel[p], level);
+            for (fs::path a = p; !a.empty(); a = a.parent_path()) {
+                auto &l = subtreeLevel[a.string()];
+                l = std::max(l, level);
+                if (a == a.parent_path()) break;
+            }
+        }
+        if (state->levels.size() <= level) state->levels.resize(level + 1);
+        state->levels[level].push_back(i);
+        state->results.push_back(nullptr);
+    }
+
+    if (ops.empty()) {
+        return makeOkReply("batch", { {"results", json::array()}, {"failed", 0} });
+    }
+    _beginAsync();
+    _runBatchLevel(state);
+    return nullptr;
+}
+
+void Session::_runBatchLevel(std::shared_ptr<BatchState> state) {
+    const auto &level = state->levels[state->level];
+    state->remaining = level.size();
+    for (size_t index : level) {
+        asio::post(_server->getWorkers(), [this, state, index]() {
+            const json &op = state->ops[index];
+            const json &opArgs = op.contains("args") ? op["args"] : json::object();
+            json reply;
+            try {
+                reply = dispatch(op["cmd"], opArgs, op);
+            } catch (const json::type_error &e) {
+                reply = makeFailReply(minidrive::error::JSON_TYPE_ERROR, e.what());
+            }
+            state->results[index] = batchResult(reply);
+            if (--state->remaining > 0) return;
+
+            // last entry of the level
+            if (++state->level < state->levels.size()) {
+                _runBatchLevel(state);
+                return;
+            }
+            size_t failed = static_cast<size_t>(std::count_if(state->results.begin(), state->results.end(),
+                [](const json &r) {return r["code"] != minidrive::error::SUCCESS.code();}));
+            _endAsync(makeOkReply("batch", { {"results", std::move(state->results)}, {"failed", failed} }));
+        });
+    }
+}
@@ -0,0 +1,127 @@
+#include "commit_sync.hpp"
+#include <map>
+#include <vector>
+#include <utility>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace {
+
+// fdatasync keeps the size and blocks of a file, a directory needs its entries
+int syncOne(int fd, bool directory) {
+    int rc = directory ? fsync(fd) : fdatasync(fd);
+    return rc == 0 ? 0 : errno;
+}
+
+bool isDirectory(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+} // namespace
+
+CommitSync::~CommitSync() {
+    stop();
+}
+
+std::optional<CommitSync::policy> CommitSync::parse(std::string_view name) {
+    if (name == "none") return policy::NONE;
+    if (name == "file") return policy::FILE;
+    if (name == "group") return policy::GROUP;
+    return std::nullopt;
+}
+
+std::string_view CommitSync::name(policy p) {
+    switch (p) {
+        case policy::NONE: return "none";
+        case policy::FILE: return "file";
+        case policy::GROUP: return "group";
+    }
+    return "";
+}
+
+void CommitSync::start() {
+    std::lock_guard g(_mutex);
+    if (_running || _policy != policy::GROUP) return;
+    _running = true;
+    _thread = std::thread([this]() {_run();});
+}
+
+void CommitSync::stop() {
+    {
+        std::lock_guard g(_mutex);
+        _running = false;
+    }
+    _cv.notify_all();
+    if (_thread.joinable()) _thread.join();
+}
+
+void CommitSync::sync(int fd, Completion done) {
+    if (_policy == policy::GROUP) {
+        std::unique_lock lock(_mutex);
+        if (_running) {
+            _queue.push_back({fd, std::move(done)});
+            lock.unlock();
+            _cv.notify_one();
+            return;
+        }
+    }
+    // stopped, or not batching at all
+    done(_policy == policy::NONE ? 0 : syncOne(fd, isDirectory(fd)));
+}
+
+void CommitSync::_run() {
+    std::unique_lock lock(_mutex);
+    while (_running || !_queue.empty()) {
+        if (_queue.empty()) {
+            _cv.wait(lock);
+            continue;
+        }
+        // whatever queued up while the last batch synced goes together
+        std::vector<Request> batch = std::move(_queue);
+        _queue.clear();
+        lock.unlock();
+        _syncBatch(batch);
+        lock.lock();
+    }
+}
+
+void CommitSync::_syncBatch(std::vector<Request> &batch) {
+    // one sync per inode, several uploads often land in the same directory
+    struct Target {
+        int fd;
+        bool directory;
+        int err = 0;
+    };
+    std::map<std::pair<dev_t, ino_t>, Target> targets;
+    std::vector<std::pair<dev_t, ino_t>> keys;
+    keys.reserve(batch.size());
+    for (const auto &request : batch) {
+        struct stat st;
+        if (fstat(request.fd, &st) != 0) {
+            // synced on its own below, which reports the error
+            st.st_dev = 0;
+            st.st_ino = static_cast<ino_t>(request.fd);
+            st.st_mode = 0;
+        }
+        keys.emplace_back(st.st_dev, st.st_ino);
+        targets.try_emplace(keys.back(), Target{request.fd, S_ISDIR(st.st_mode)});
+    }
+#ifdef SYNC_FILE_RANGE_WRITE
+    // start the writeback of every file first so the disk works on all of them at once; the journal commit
+    // the first fdatasync forces then usually carries the metadata of the rest
+    for (auto &[key, target] : targets) {
+        if (!target.directory) sync_file_range(target.fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    }
+#endif
+    for (auto &[key, target] : targets) target.err = syncOne(target.fd, target.directory);
+    _syncs += targets.size();
+    ++_batches;
+    for (size_t i = 0; i < batch.size(); ++i) batch[i].done(targets.at(keys[i]).err);
+}
+
+CommitSync::Stats CommitSync::stats() const {
+    return {_syncs.load(), _batches.load()};
+}
@@ -0,0 +1,326 @@
+#include "copy.hpp"
+#include <asio.hpp>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+#include <spdlog/spdlog.h>
+#include "storage.hpp"
+
+namespace fs = std::filesystem;
+namespace error = minidrive::error;
+
+// copied directory shared by the entries queued from it; it gets its final mode once the last entry
+// below it is done, until then it and its parents stay writable
+struct TreeCopy::Dir {
+    std::shared_ptr<RootDir> root;
+    fs::path rel;
+    std::shared_ptr<Dir> parent;
+    int finalMode = -1;
+    ~Dir() {
+        if (finalMode < 0) return;
+        ResolvedPath path(root, rel);
+        if (path.valid()) root->storage().setMode(path, static_cast<mode_t>(finalMode));
+    }
+};
+
+struct TreeCopy::Item {
+    bool dir = false;
+    // the source and destination given in the command
+    bool top = false;
+    fs::path srcRel;
+    fs::path dstRel;
+    std::shared_ptr<Dir> dstParent;
+    mode_t mode = 0;
+    // of a file, as listed
+    uint64_t size = 0;
+};
+
+// the owner takes entries from the back, idle workers steal from the front
+struct TreeCopy::Worker {
+    std::deque<Item> queue;
+    std::mutex mutex;
+};
+
+namespace {
+
+// the errno of a failed call on `path`, or why it couldn't be resolved
+int failure(const ResolvedPath &path) {
+    return path.valid() ? errno : path.error();
+}
+
+int64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+
+TreeCopy::TreeCopy(ResolvedPath &&src, ResolvedPath &&dst, const FsEntry &entry)
+    : _src(std::move(src)), _dst(std::move(dst)), _isDir(entry.type == fs::file_type::directory),
+      _mode(static_cast<mode_t>(entry.mode)), _createdDestination(false), _pending(0), _queued(0), _running(0),
+      _files(0), _links(0), _dirs(0), _bytes(0), _cloned(0), _nextReport(0), _failed(false), _error(error::SUCCESS) {}
+
+std::shared_ptr<TreeCopy> TreeCopy::create(ResolvedPath &&src, ResolvedPath &&dst, const FsEntry &entry) {
+    return std::shared_ptr<TreeCopy>(new TreeCopy(std::move(src), std::move(dst), entry));
+}
+
+void TreeCopy::setProgressHandler(ProgressHandler handler) {
+    _progressHandler = std::move(handler);
+}
+
+void TreeCopy::setReserveHandler(ReserveHandler handler) {
+    _reserveHandler = std::move(handler);
+}
+
+TreeCopy::Progress TreeCopy::progress() const {
+    return Progress{_files, _links, _dirs, _bytes, _cloned};
+}
+
+void TreeCopy::start(asio::thread_pool &pool, size_t workers, CompletionHandler handler) {
+    _completionHandler = std::move(handler);
+    workers = _isDir ? std::max<size_t>(1, workers) : 1;
+    for (size_t i = 0; i < workers; ++i) _workers.push_back(std::make_unique<Worker>());
+    _running = workers;
+    _nextReport = nowNs() + std::chrono::nanoseconds(PROGRESS_PERIOD).count();
+
+    Item top;
+    top.dir = _isDir;
+    top.top = true;
+    top.srcRel = _src.rel();
+    top.dstRel = _dst.rel();
+    top.mode = _mode;
+    _push(0, std::move(top));
+
+    for (size_t i = 0; i < workers; ++i) {
+        asio::post(pool, [self = shared_from_this(), i]() {self->_work(i);});
+    }
+}
+
+void TreeCopy::_push(size_t index, Item &&item) {
+    ++_pending;
+    {
+        std::lock_guard g(_workers[index]->mutex);
+        _workers[index]->queue.push_back(std::move(item));
+        ++_queued;
+    }
+    _wake(false);
+}
+
+void TreeCopy::_wake(bool all) {
+    // a worker between checking and waiting holds the mutex, so it can't miss the notification
+    { std::lock_guard g(_idleMutex); }
+    all ? _idleCv.notify_all() : _idleCv.notify_one();
+}
+
+bool TreeCopy::_take(size_t index, Item &item) {
+    {
+        auto &own = *_workers[index];
+        std::lock_guard g(own.mutex);
+        if (!own.queue.empty()) {
+            item = std::move(own.queue.back());
+            own.queue.pop_back();
+            --_queued;
+            return true;
+        }
+    }
+    for (size_t i = 1; i < _workers.size(); ++i) {
+        auto &victim = *_workers[(index + i) % _workers.size()];
+        std::lock_guard g(victim.mutex);
+        if (!victim.queue.empty()) {
+            item = std::move(victim.queue.front());
+            victim.queue.pop_front();
+            --_queued;
+            return true;
+        }
+    }
+    return false;
+}
+
+void TreeCopy::_work(size_t index) {
+    while (true) {
+        Item item;
+        if (_take(index, item)) {
+            if (!_failed) {
+                if (item.dir) _copyDir(index, item);
+                else _copyFile(item);
+                _report();
+            }
+            item = Item();
+            if (--_pending == 0) _wake(true);
+            continue;
+        }
+        // nothing to steal, sleep until an entry being copied queues more or the last one is done
+        std::unique_lock lock(_idleMutex);
+        _idleCv.wait(lock, [this]() {return _queued > 0 || _pending == 0;});
+        if (_pending == 0) break;
+    }
+    if (--_running > 0) return;
+
+    std::string message;
+    {
+        std::lock_guard g(_errorMutex);
+        message = _message;
+    }
+    if (_failed) {
+        spdlog::warn("copy {} -> {} failed: {}", _src.rel().string(), _dst.rel().string(), message);
+    } else {
+        spdlog::info("copied {} -> {}: {} files, {} links, {} directories, {}B, {} reflinked", _src.rel().string(),
+            _dst.rel().string(), _files.load(), _links.load(), _dirs.load(), _bytes.load(), _cloned.load());
+    }
+    auto handler = std::move(_completionHandler);
+    if (handler) handler(*this, _failed ? _error : error::SUCCESS, message);
+}
+
+void TreeCopy::_copyDir(size_t index, const Item &item) {
+    auto &storage = _dst.root()->storage();
+    std::string dstName = item.dstRel.filename().string();
+    // keep the directory writable until its entries are copied
+    ResolvedPath dst(_dst.root(), item.dstRel);
+    if (!dst.valid() || !storage.createDir(dst, item.mode | 0700)) {
+        int err = failure(dst);
+        _fail(item.top && err == EEXIST ? error::TARGET_ALREADY_EXISTS : error::FS_ERROR,
+            dstName + ": " + std::strerror(err));
+        return;
+    }
+    if (item.top) _createdDestination = true;
+    auto dstDir = std::make_shared<Dir>();
+    dstDir->root = _dst.root();
+    dstDir->rel = item.dstRel;
+    dstDir->parent = item.dstParent;
+    std::vector<StorageEngine::DirEntry> entries;
+    if (!_src.root()->storage().list(*_src.root(), item.srcRel, entries, true)) {
+        _fail(error::FS_ERROR, item.srcRel.filename().string() + ": " + std::strerror(errno));
+        return;
+    }
+    for (const auto &entry : entries) {
+        auto type = entry.entry.type;
+        if (type == fs::file_type::directory || type == fs::file_type::regular) {
+            Item child;
+            child.dir = type == fs::file_type::directory;
+            child.srcRel = item.srcRel / entry.name;
+            child.dstRel = item.dstRel / entry.name;
+            child.dstParent = dstDir;
+            child.mode = static_cast<mode_t>(entry.entry.mode);
+            child.size = entry.entry.size;
+            _push(index, std::move(child));
+        } else if (type == fs::file_type::symlink) {
+            // the link itself is copied, never what it points to
+            ResolvedPath linkSrc(_src.root(), item.srcRel / entry.name);
+            ResolvedPath linkDst(_dst.root(), item.dstRel / entry.name);
+            if (!linkSrc.valid() || !linkDst.valid() || !storage.copyLink(linkSrc, linkDst)) {
+                int err = linkSrc.valid() ? failure(linkDst) : linkSrc.error();
+                _fail(error::FS_ERROR, entry.name + ": " + std::strerror(err));
+                break;
+            }
+            ++_links;
+        } else {
+            spdlog::warn("copy: skipping special file {}", entry.name);
+        }
+    }
+    if ((item.mode | 0700) != item.mode) dstDir->finalMode = static_cast<int>(item.mode);
+    ++_dirs;
+}
+
+void TreeCopy::_copyFile(const Item &item) {
+    auto &storage = _dst.root()->storage();
+    if (!item.top && _reserveHandler && !_reserveHandler(item.size)) {
+        _fail(error::QUOTA_EXCEEDED, item.srcRel.string());
+        return;
+    }
+    ResolvedPath src(_src.root(), item.srcRel);
+    int srcFd = src.valid() ? _src.root()->storage().open(src, O_RDONLY) : -1;
+    if (srcFd < 0) {
+        int err = failure(src);
+        _fail(err == ENOENT ? error::TARGET_NOT_FOUND : error::FS_ERROR,
+            item.srcRel.filename().string() + ": " + std::strerror(err));
+        return;
+    }
+    ResolvedPath dst(_dst.root(), item.dstRel);
+    int dstFd = dst.valid() ? storage.createFile(dst, item.mode) : -1;
+    if (dstFd < 0) {
+        int err = failure(dst);
+        _fail(item.top && err == EEXIST ? error::TARGET_ALREADY_EXISTS : error::FS_ERROR,
+            item.dstRel.filename().string() + ": " + std::strerror(err));
+        close(srcFd);
+        return;
+    }
+    if (item.top) _createdDestination = true;
+    int rc = _copyData(srcFd, dstFd);
+    if (rc < 0) {
+        _fail(error::FS_ERROR, item.srcRel.filename().string() + ": " + std::strerror(errno));
+    } else {
+        ++_files;
+        if (rc == 1) ++_cloned;
+    }
+    close(srcFd);
+    close(dstFd);
+}
+
+int TreeCopy::_copyData(int srcFd, int dstFd) {
+#ifdef FICLONE
+    // copy-on-write filesystems share the extents, nothing is copied
+    if (ioctl(dstFd, FICLONE, srcFd) == 0) {
+        struct stat st;
+        if (fstat(dstFd, &st) == 0) _bytes += static_cast<uint64_t>(st.st_size);
+        return 1;
+    }
+#endif
+    bool inKernel = true;
+    std::vector<uint8_t> buffer;
+    off_t offset = 0;
+    while (!_failed) {
+        ssize_t n;
+        if (inKernel) {
+            off_t in = offset, out = offset;
+            n = copy_file_range(srcFd, &in, dstFd, &out, COPY_STEP, 0);
+            if (n < 0 && offset == 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                inKernel = false;
+                continue;
+            }
+        } else {
+            if (buffer.empty()) buffer.resize(BUFFER_SIZE);
+            n = pread(srcFd, buffer.data(), buffer.size(), offset);
+            for (ssize_t written = 0; n > 0 && written < n;) {
+                ssize_t w = pwrite(dstFd, buffer.data() + written, static_cast<size_t>(n - written), offset + written);
+                if (w < 0 && errno == EINTR) continue;
+                if (w < 0) return -1;
+                written += w;
+            }
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        offset += n;
+        _bytes += static_cast<uint64_t>(n);
+        _report();
+    }
+    return 0;
+}
+
+void TreeCopy::_fail(const minidrive::error_code &err, const std::string &message) {
+    std::lock_guard g(_errorMutex);
+    if (_failed) return;
+    _error = err;
+    _message = message;
+    _failed = true;
+}
+
+void TreeCopy::_report() {
+    int64_t now = nowNs();
+    int64_t next = _nextReport;
+    if (now < next || !_progressHandler) return;
+    // one worker wins the report for this period
+    if (!_nextReport.compare_exchange_strong(next, now + std::chrono::nanoseconds(PROGRESS_PERIOD).count())) return;
+    _progressHandler(progress());
+}
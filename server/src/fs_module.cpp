@@ -1,51 +1,99 @@
 #include "fs_module.hpp"
 #include <filesystem>
 #include <string>
-#include <spdlog/spdlog.h>
-#include <nlohmann/json.hpp>
+#include <cerrno>
+#include <unistd.h>
 #include "globals.hpp"
+#include "storage.hpp"
 
 namespace fs = std::filesystem;
-using json = nlohmann::json;
-
-bool fs_validatePath(fs::path startLocation, fs::path other) {
-    auto it = startLocation.begin(), it2 = other.begin();
-    for (; it != startLocation.end(); ++it, ++it2) {
-        if (it2 == other.end() || *it != *it2) {
-            return false;
-        }
+
+
+RootDir::RootDir(StorageEngine &storage, const fs::path &path, int fd)
+    : _storage(storage), _fd(fd), _path(path) {}
+
+RootDir::~RootDir() {
+    if (_fd >= 0) close(_fd);
+}
+
+
+ResolvedPath::ResolvedPath(std::shared_ptr<RootDir> root, fs::path rel)
+    : _root(std::move(root)), _rel(std::move(rel)) {
+    if (!_root) {
+        _error = EBADF;
+        return;
+    }
+    fs::path parent = _rel.parent_path();
+    _name = _rel.empty() ? "." : _rel.filename().string();
+    if (parent.empty()) {
+        _parentFd = _root->fd();
+        _error = 0;
+        return;
     }
-    return true;
+    _error = _root->storage().openParent(*_root, parent, _parentFd);
+    _ownsParent = _error == 0 && _parentFd >= 0;
+}
+
+ResolvedPath::~ResolvedPath() {
+    _close();
+}
+
+ResolvedPath::ResolvedPath(ResolvedPath &&other) noexcept
+    : _root(std::move(other._root)), _rel(std::move(other._rel)), _name(std::move(other._name)),
+      _parentFd(other._parentFd), _ownsParent(other._ownsParent), _error(other._error) {
+    other._parentFd = -1;
+    other._ownsParent = false;
+    other._error = EBADF;
+}
+
+ResolvedPath& ResolvedPath::operator=(ResolvedPath &&other) noexcept {
+    if (this == &other) return *this;
+    _close();
+    _root = std::move(other._root);
+    _rel = std::move(other._rel);
+    _name = std::move(other._name);
+    _parentFd = other._parentFd;
+    _ownsParent = other._ownsParent;
+    _error = other._error;
+    other._parentFd = -1;
+    other._ownsParent = false;
+    other._error = EBADF;
+    return *this;
+}
+
+fs::path ResolvedPath::absolute() const {
+    if (!_root) return _rel;
+    return _rel.empty() ? _root->path() : _root->path() / _rel;
+}
+
+void ResolvedPath::_close() {
+    if (_ownsParent && _parentFd >= 0) close(_parentFd);
+    _parentFd = -1;
+    _ownsParent = false;
 }
 
-fs::path fs_resolvePath(fs::path startPath, fs::path uwd, fs::path other) {
-    fs::path result = startPath;
+
+std::optional<fs::path> fs_resolveRelative(fs::path uwd, fs::path other) {
+    fs::path result;
 
     // if other is absolute, remove leading slash and don't prepend uwd
     if (other.is_absolute()) {
         other = other.lexically_relative(other.root_path());
     } else {
-        result /= uwd;
+        result = uwd;
     }
     result /= other;
 
     result = result.lexically_normal();
-
-    // if (!fs_validatePath(startPath, result)) {
-    //     result.clear();
-    // }
-
-    return result;
-}
-
-json fs_listFiles(fs::path path, bool includeHash) {
-    json result = json::array();
-    for (const auto &entry : fs::directory_iterator(path)) {
-        json file;
-        file["name"] = entry.path();
-        file["size"] = entry.file_size();
-        file["type"] = entry.status().type();
-        result.push_back(file);
+    if (!result.empty() && (*result.begin() == ".." || *result.begin() == TRASH_DIR || *result.begin() == TREES_DIR)) {
+        return std::nullopt;
+    }
+    if (result == ".") {
+        result.clear();
+    }
+    // "dir/" -> "dir"
+    if (!result.empty() && result.filename().empty()) {
+        result = result.parent_path();
     }
     return result;
-}
\ No newline at end of file
+}
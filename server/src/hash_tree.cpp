@@ -0,0 +1,154 @@
+#include "hash_tree.hpp"
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <spdlog/spdlog.h>
+#include "minidrive/transfer.hpp"
+#include "storage.hpp"
+
+using minidrive::ChunkTag;
+
+namespace {
+
+constexpr char MAGIC[8] = {'M', 'D', 'T', 'R', 'E', 'E', '0', '1'};
+// magic, chunk size, size, mtime (s, ns), inode, number of leaves
+constexpr size_t HEADER_SIZE = 8 + 4 + 8 * 5;
+
+struct TreeHeader {
+    uint32_t chunkSize = 0;
+    uint64_t size = 0;
+    uint64_t mtimeSec = 0;
+    uint64_t mtimeNsec = 0;
+    uint64_t ino = 0;
+    uint64_t leaves = 0;
+
+    static TreeHeader of(const struct stat &st) {
+        TreeHeader header;
+        header.chunkSize = minidrive::CHUNK_SIZE;
+        header.size = static_cast<uint64_t>(st.st_size);
+        header.mtimeSec = static_cast<uint64_t>(st.st_mtim.tv_sec);
+        header.mtimeNsec = static_cast<uint64_t>(st.st_mtim.tv_nsec);
+        header.ino = static_cast<uint64_t>(st.st_ino);
+        header.leaves = minidrive::chunkCount(header.size, header.chunkSize);
+        return header;
+    }
+    bool operator==(const TreeHeader&) const = default;
+};
+
+void put(uint8_t *&out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i) *out++ = static_cast<uint8_t>(value >> (8 * i));
+}
+
+uint64_t get(const uint8_t *&in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) value |= static_cast<uint64_t>(*in++) << (8 * i);
+    return value;
+}
+
+bool readAll(int fd, uint8_t *out, size_t len, uint64_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, out + done, len - done, static_cast<off_t>(offset + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+} // namespace
+
+
+std::optional<minidrive::MerkleTree> tree_load(const RootDir &root, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return std::nullopt;
+    std::string data;
+    if (!root.storage().loadTree(root, static_cast<uint64_t>(st.st_ino), data)) return std::nullopt;
+
+    TreeHeader expected = TreeHeader::of(st);
+    const auto *raw = reinterpret_cast<const uint8_t*>(data.data());
+    bool ok = data.size() >= HEADER_SIZE && std::memcmp(raw, MAGIC, sizeof(MAGIC)) == 0;
+    TreeHeader header;
+    if (ok) {
+        const uint8_t *in = raw + sizeof(MAGIC);
+        header.chunkSize = static_cast<uint32_t>(get(in, 4));
+        header.size = get(in, 8);
+        header.mtimeSec = get(in, 8);
+        header.mtimeNsec = get(in, 8);
+        header.ino = get(in, 8);
+        header.leaves = get(in, 8);
+        ok = header == expected && data.size() - HEADER_SIZE == header.leaves * sizeof(ChunkTag);
+    }
+    if (!ok) {
+        spdlog::debug("hash tree of inode {} is stale", st.st_ino);
+        return std::nullopt;
+    }
+    std::vector<ChunkTag> leaves(header.leaves);
+    std::memcpy(leaves.data(), raw + HEADER_SIZE, leaves.size() * sizeof(ChunkTag));
+    return minidrive::MerkleTree(std::move(leaves));
+}
+
+std::optional<minidrive::MerkleTree> tree_load(const ResolvedPath &path) {
+    int fd = path.root()->storage().open(path, O_RDONLY);
+    if (fd < 0) return std::nullopt;
+    auto tree = tree_load(*path.root(), fd);
+    close(fd);
+    return tree;
+}
+
+bool tree_save(const RootDir &root, int fd, const minidrive::MerkleTree &tree) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+    TreeHeader header = TreeHeader::of(st);
+    if (tree.leaves().size() != header.leaves) return false;
+    const auto &leaves = tree.leaves();
+    std::string data(HEADER_SIZE + leaves.size() * sizeof(ChunkTag), '\0');
+    auto *raw = reinterpret_cast<uint8_t*>(data.data());
+    std::memcpy(raw, MAGIC, sizeof(MAGIC));
+    uint8_t *out = raw + sizeof(MAGIC);
+    put(out, header.chunkSize, 4);
+    put(out, header.size, 8);
+    put(out, header.mtimeSec, 8);
+    put(out, header.mtimeNsec, 8);
+    put(out, header.ino, 8);
+    put(out, header.leaves, 8);
+    std::memcpy(raw + HEADER_SIZE, leaves.data(), leaves.size() * sizeof(ChunkTag));
+    if (!root.storage().storeTree(root, header.ino, data)) {
+        spdlog::error("hash tree: could not store the tree of inode {}: {}", st.st_ino, std::strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+std::optional<minidrive::MerkleTree> tree_build(const RootDir &root, int fd) {
+    struct stat before;
+    if (fstat(fd, &before) != 0 || !S_ISREG(before.st_mode)) return std::nullopt;
+    uint64_t size = static_cast<uint64_t>(before.st_size);
+    std::vector<ChunkTag> leaves(minidrive::chunkCount(size, minidrive::CHUNK_SIZE));
+    std::vector<uint8_t> chunk(minidrive::CHUNK_SIZE);
+    for (uint64_t i = 0; i < leaves.size(); ++i) {
+        uint64_t offset = i * minidrive::CHUNK_SIZE;
+        uint32_t len = minidrive::chunkLength(size, minidrive::CHUNK_SIZE, offset);
+        if (!readAll(fd, chunk.data(), len, offset)) {
+            spdlog::error("hash tree: read: {}", std::strerror(errno));
+            return std::nullopt;
+        }
+        leaves[i] = minidrive::chunkTag(chunk.data(), len);
+    }
+    struct stat after;
+    if (fstat(fd, &after) != 0 || TreeHeader::of(after) != TreeHeader::of(before)) {
+        spdlog::warn("hash tree: inode {} changed while it was hashed", before.st_ino);
+        return std::nullopt;
+    }
+    minidrive::MerkleTree tree(std::move(leaves));
+    tree_save(root, fd, tree);
+    return tree;
+}
+
+void tree_remove(const RootDir &root, uint64_t ino) {
+    root.storage().removeTree(root, ino);
+}
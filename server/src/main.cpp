@@ -1,6 +1,8 @@
 #include <iostream>
 #include <string>
 #include <cstdint>
+#include <chrono>
+#include <optional>
 
 #include <spdlog/spdlog.h>
 #include <spdlog/sinks/stdout_color_sinks.h>
@@ -10,6 +12,7 @@
 #include "minidrive/version.hpp"
 #include "globals.hpp"
 #include "server.hpp"
+#include "storage.hpp"
 
 int main(int argc, char* argv[]) {
     spdlog::set_default_logger(spdlog::stdout_color_mt("my_logger"));
@@ -24,7 +27,15 @@ int main(int argc, char* argv[]) {
 
     // parse arguments
     uint16_t port = 9000;
+    std::string unixSocket;
     std::string rootDir = "server_root";
+    std::optional<std::chrono::seconds> idleTimeout;
+    std::optional<std::chrono::seconds> keepalive;
+    ServerLimits limits;
+    bool compression = true;
+    size_t chunkCache = ChunkCache::DEFAULT_CAPACITY;
+    CommitSync::policy durability = CommitSync::policy::FILE;
+    std::string storage = "posix";
     for (int i = 1; i < argc; ++i) {
         std::string arg = argv[i];
         if (arg == "--port" && i + 1 < argc) {
@@ -39,6 +50,84 @@ int main(int argc, char* argv[]) {
         else if (arg == "--root" && i + 1 < argc) {
             rootDir = argv[++i];
         }
+        else if (arg == "--unix-socket" && i + 1 < argc) {
+            unixSocket = argv[++i];
+        }
+        else if ((arg == "--idle-timeout" || arg == "--keepalive") && i + 1 < argc) {
+            // seconds, 0 disables
+            try {
+                auto seconds = std::chrono::seconds(std::stoul(argv[++i]));
+                (arg == "--idle-timeout" ? idleTimeout : keepalive) = seconds;
+            } catch (const std::exception &e) {
+                spdlog::error(e.what());
+                return 1;
+            }
+        }
+        else if ((arg == "--rate-global" || arg == "--rate-ip" || arg == "--rate-user") && i + 1 < argc) {
+            // COMMANDS:BYTES per second, e.g. 20:10M
+            auto rate = minidrive::parseRateLimit(argv[++i]);
+            if (!rate) {
+                spdlog::error("invalid rate '{}', expected COMMANDS:BYTES", argv[i]);
+                return 1;
+            }
+            (arg == "--rate-global" ? limits.global : arg == "--rate-ip" ? limits.perIp : limits.perUser) = *rate;
+        }
+        else if (arg == "--quota" && i + 1 < argc) {
+            // bytes per user with an optional K, M or G suffix, 0 is unlimited
+            auto bytes = minidrive::parseBytes(argv[++i]);
+            if (!bytes) {
+                spdlog::error("invalid quota '{}'", argv[i]);
+                return 1;
+            }
+            limits.quota = static_cast<uint64_t>(*bytes);
+        }
+        else if (arg == "--socket-buffer" && i + 1 < argc) {
+            // bytes with an optional K, M or G suffix, "auto" sizes the buffers from each connection's rtt
+            std::string value = argv[++i];
+            minidrive::SocketTuning tuning;
+            if (value != "auto") {
+                auto bytes = minidrive::parseBytes(value);
+                if (!bytes || *bytes < 1) {
+                    spdlog::error("invalid socket buffer size '{}'", value);
+                    return 1;
+                }
+                tuning.bufferBytes = static_cast<size_t>(*bytes);
+            }
+            AsyncSocket::setTuning(tuning);
+        }
+        else if (arg == "--chunk-cache" && i + 1 < argc) {
+            // bytes with an optional K, M or G suffix, 0 disables the cache
+            auto bytes = minidrive::parseBytes(argv[++i]);
+            if (!bytes) {
+                spdlog::error("invalid chunk cache size '{}'", argv[i]);
+                return 1;
+            }
+            chunkCache = static_cast<size_t>(*bytes);
+        }
+        else if (arg == "--durability" && i + 1 < argc) {
+            // none, file or group
+            auto policy = CommitSync::parse(argv[++i]);
+            if (!policy) {
+                spdlog::error("invalid durability '{}', expected none, file or group", argv[i]);
+                return 1;
+            }
+            durability = *policy;
+        }
+        else if (arg == "--storage" && i + 1 < argc) {
+            // posix or memory
+            storage = argv[++i];
+        }
+        else if (arg == "--no-compression") {
+            compression = false;
+        }
+        else if (arg == "--max-conns-per-ip" && i + 1 < argc) {
+            try {
+                limits.connectionsPerIp = static_cast<size_t>(std::stoul(argv[++i]));
+            } catch (const std::exception &e) {
+                spdlog::error(e.what());
+                return 1;
+            }
+        }
     }
 
     // set up paths
@@ -52,10 +141,27 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    auto engine = StorageEngine::create(storage);
+    if (!engine) {
+        spdlog::error("invalid storage '{}', expected posix or memory", storage);
+        return 1;
+    }
+    if (!engine->durable()) spdlog::warn("storage engine '{}' keeps files in memory, they are lost on exit", storage);
+
     asio::io_context io;
 
     // create the server
     MiniDriveServer server(io, port);
+    if (idleTimeout || keepalive) {
+        server.setTimeouts(idleTimeout.value_or(std::chrono::duration_cast<std::chrono::seconds>(server.idleTimeout())),
+            keepalive.value_or(std::chrono::duration_cast<std::chrono::seconds>(server.keepaliveInterval())));
+    }
+    server.setLimits(limits);
+    if (!unixSocket.empty()) server.setUnixSocket(unixSocket);
+    server.setCompression(compression);
+    server.setChunkCache(chunkCache);
+    server.setDurability(durability);
+    server.setStorage(std::move(engine));
 
     // set up signal handler
     asio::signal_set signals(io, SIGINT, SIGTERM, SIGHUP);
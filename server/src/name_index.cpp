@@ -0,0 +1,457 @@
+#include "name_index.hpp"
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <utility>
+#include <cerrno>
+#include <cstring>
+#include <spdlog/spdlog.h>
+#include "globals.hpp"
+#include "transfer.hpp"
+#include "storage.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// arena garbage tolerated before the names are copied into a new one
+const size_t COMPACT_MIN_GARBAGE = 1 << 20;
+
+bool isWildcard(char c) {
+    return c == '*' || c == '?' || c == '[';
+}
+
+class Matcher {
+public:
+    explicit Matcher(std::string_view pattern) : _pattern(pattern), _byPath(false), _glob(false) {
+        if (_pattern.find('/') != std::string::npos) {
+            _byPath = true;
+            while (!_pattern.empty() && _pattern.front() == '/') _pattern.erase(0, 1);
+        }
+        _glob = std::any_of(_pattern.begin(), _pattern.end(), isWildcard);
+        // the longest run without wildcards, looked for before the glob is matched
+        size_t start = 0;
+        for (size_t i = 0; i <= _pattern.size(); ++i) {
+            if (i < _pattern.size() && !isWildcard(_pattern[i])) continue;
+            if (i - start > _literal.size()) _literal = _pattern.substr(start, i - start);
+            if (i < _pattern.size() && _pattern[i] == '[') {
+                size_t end = _classEnd(i);
+                if (end != std::string::npos) i = end;
+            }
+            start = i + 1;
+        }
+    }
+
+    inline bool byPath() const {return _byPath;}
+
+    bool operator()(std::string_view text) const {
+        if (!_literal.empty() && text.find(_literal) == std::string_view::npos) return false;
+        return !_glob || _match(text);
+    }
+
+private:
+    // the position of the ']' closing the class opened at `open`, npos when it is a plain '['
+    size_t _classEnd(size_t open) const {
+        size_t i = open + 1;
+        if (i < _pattern.size() && _pattern[i] == '!') ++i;
+        if (i < _pattern.size() && _pattern[i] == ']') ++i;
+        while (i < _pattern.size() && _pattern[i] != ']') ++i;
+        return i < _pattern.size() ? i : std::string::npos;
+    }
+
+    // whether the wildcard or character at `pos` matches `c`, `next` is where the pattern continues
+    bool _matchOne(size_t pos, char c, size_t &next) const {
+        char p = _pattern[pos];
+        next = pos + 1;
+        if (p == '?') return true;
+        if (p != '[') return p == c;
+        size_t end = _classEnd(pos);
+        if (end == std::string::npos) return c == '[';
+        next = end + 1;
+        size_t i = pos + 1;
+        bool negated = _pattern[i] == '!';
+        if (negated) ++i;
+        bool found = false;
+        for (bool first = true; i < end; first = false) {
+            if (_pattern[i] == ']' && !first) break;
+            if (i + 2 < end && _pattern[i + 1] == '-') {
+                found = found || (c >= _pattern[i] && c <= _pattern[i + 2]);
+                i += 3;
+            } else {
+                found = found || c == _pattern[i];
+                ++i;
+            }
+        }
+        return found != negated;
+    }
+
+    // `*` backtracks to the last star only, which is enough as each star matches any run
+    bool _match(std::string_view text) const {
+        size_t p = 0, t = 0;
+        size_t star = std::string::npos, mark = 0;
+        while (t < text.size()) {
+            size_t next;
+            if (p < _pattern.size() && _pattern[p] == '*') {
+                star = p++;
+                mark = t;
+            } else if (p < _pattern.size() && _matchOne(p, text[t], next)) {
+                p = next;
+                ++t;
+            } else if (star != std::string::npos) {
+                p = star + 1;
+                t = ++mark;
+            } else {
+                return false;
+            }
+        }
+        while (p < _pattern.size() && _pattern[p] == '*') ++p;
+        return p == _pattern.size();
+    }
+
+    std::string _pattern;
+    std::string _literal;
+    bool _byPath;
+    bool _glob;
+};
+
+} // namespace
+
+
+NameIndex::Tree::Tree() : _garbage(0) {
+    _nodes.push_back(Node{NONE, 0, 0, 0, true, true});
+    _children.emplace_back();
+}
+
+uint32_t NameIndex::Tree::lookup(const fs::path &rel) const {
+    uint32_t id = 0;
+    for (const auto &part : rel) {
+        id = _child(id, part.native());
+        if (id == NONE) return NONE;
+    }
+    return id;
+}
+
+uint32_t NameIndex::Tree::add(const fs::path &rel, bool dir) {
+    uint32_t id = 0;
+    for (auto it = rel.begin(); it != rel.end() && id != NONE; ++it) {
+        bool last = std::next(it) == rel.end();
+        id = _insert(id, it->native(), last ? dir : true);
+    }
+    return id;
+}
+
+void NameIndex::Tree::remove(uint32_t id) {
+    if (id == 0 || id == NONE) return;
+    _detach(id);
+    _free(id);
+    if (_garbage > COMPACT_MIN_GARBAGE && _garbage > _names.size() / 2) _compact();
+}
+
+void NameIndex::Tree::move(const fs::path &from, const fs::path &to) {
+    uint32_t id = lookup(from);
+    if (id == 0 || id == NONE) return;
+    std::string name = to.filename().string();
+    uint32_t parent = add(to.parent_path(), true);
+    if (parent == NONE) return;
+    uint32_t existing = _child(parent, name);
+    if (existing == id) return;
+    if (existing != NONE) remove(existing);
+    _detach(id);
+    _nodes[id].parent = parent;
+    if (_name(_nodes[id]) != name) _setName(_nodes[id], name);
+    size_t slot = _slot(parent, name);
+    auto &list = _children[_nodes[parent].children];
+    list.insert(list.begin() + static_cast<ptrdiff_t>(slot), id);
+}
+
+bool NameIndex::Tree::walk(const RootDir &root, const fs::path &rel, uint32_t id, bool top) {
+    std::vector<StorageEngine::DirEntry> entries;
+    if (!root.storage().list(root, rel, entries, false)) return false;
+    // a new directory is filled in listing order and sorted once, one indexed before is merged into
+    bool merge = !_children[_nodes[id].children].empty();
+    std::vector<uint32_t> dirs;
+    for (const auto &entry : entries) {
+        const std::string &name = entry.name;
+        if ((top && (name == TRASH_DIR || name == TREES_DIR)) || Transfer::isTemporaryName(name)) continue;
+        bool isDir = entry.entry.type == fs::file_type::directory;
+        uint32_t child;
+        if (merge) {
+            child = _insert(id, name, isDir);
+        } else {
+            child = _insert(NONE, name, isDir);
+            _nodes[child].parent = id;
+            _children[_nodes[id].children].push_back(child);
+        }
+        if (isDir) dirs.push_back(child);
+    }
+    if (!merge) {
+        auto &list = _children[_nodes[id].children];
+        std::sort(list.begin(), list.end(), [this](uint32_t a, uint32_t b) {return _name(_nodes[a]) < _name(_nodes[b]);});
+    }
+    for (uint32_t child : dirs) {
+        // a directory gone since it was listed is left empty
+        walk(root, rel / std::string(_name(_nodes[child])), child, false);
+    }
+    return true;
+}
+
+void NameIndex::Tree::find(uint32_t under, const Query &query, std::vector<Match> &matches, bool &truncated) const {
+    Matcher matcher(query.pattern);
+    // a max-heap of the query.limit smallest paths, every match is seen so the cut doesn't depend on the arena
+    auto byPath = [](const Match &a, const Match &b) {return a.path < b.path;};
+    auto emit = [&](uint32_t id, std::string_view path) {
+        if (matches.size() < query.limit) {
+            matches.push_back({std::string(path), _nodes[id].dir});
+            std::push_heap(matches.begin(), matches.end(), byPath);
+            return;
+        }
+        truncated = true;
+        if (matches.empty() || path >= matches.front().path) return;
+        std::pop_heap(matches.begin(), matches.end(), byPath);
+        matches.back() = {std::string(path), _nodes[id].dir};
+        std::push_heap(matches.begin(), matches.end(), byPath);
+    };
+
+    // names alone are matched straight from the node array, paths are only built for the matches
+    if (under == 0 && !matcher.byPath()) {
+        for (uint32_t id = 1; id < _nodes.size(); ++id) {
+            const Node &node = _nodes[id];
+            if (!node.live || !matcher(_name(node))) continue;
+            emit(id, _path(id));
+        }
+        return;
+    }
+
+    // depth first below `under`, building the path of each entry on the way
+    std::string path = _path(under);
+    std::vector<std::pair<uint32_t, size_t>> stack;
+    for (uint32_t child : _children[_nodes[under].children]) stack.emplace_back(child, path.size());
+    while (!stack.empty()) {
+        auto [id, length] = stack.back();
+        stack.pop_back();
+        const Node &node = _nodes[id];
+        path.resize(length);
+        if (!path.empty()) path += '/';
+        path += _name(node);
+        if (matcher(matcher.byPath() ? std::string_view(path) : _name(node))) emit(id, path);
+        if (!node.dir) continue;
+        for (uint32_t child : _children[node.children]) stack.emplace_back(child, path.size());
+    }
+}
+
+uint32_t NameIndex::Tree::_child(uint32_t parent, std::string_view name) const {
+    const Node &node = _nodes[parent];
+    if (!node.dir) return NONE;
+    const auto &list = _children[node.children];
+    size_t slot = _slot(parent, name);
+    return slot < list.size() && _name(_nodes[list[slot]]) == name ? list[slot] : NONE;
+}
+
+size_t NameIndex::Tree::_slot(uint32_t parent, std::string_view name) const {
+    const auto &list = _children[_nodes[parent].children];
+    auto it = std::lower_bound(list.begin(), list.end(), name,
+        [this](uint32_t id, std::string_view value) {return _name(_nodes[id]) < value;});
+    return static_cast<size_t>(it - list.begin());
+}
+
+uint32_t NameIndex::Tree::_insert(uint32_t parent, std::string_view name, bool dir) {
+    if (parent != NONE) {
+        // a file standing where a directory is expected, or the other way round, is replaced
+        if (!_nodes[parent].dir) return NONE;
+        uint32_t existing = _child(parent, name);
+        if (existing != NONE) {
+            if (_nodes[existing].dir == dir) return existing;
+            remove(existing);
+        }
+    }
+
+    uint32_t id;
+    if (_freeNodes.empty()) {
+        id = static_cast<uint32_t>(_nodes.size());
+        _nodes.emplace_back();
+    } else {
+        id = _freeNodes.back();
+        _freeNodes.pop_back();
+    }
+    Node node{parent, 0, NONE, 0, dir, true};
+    _setName(node, name);
+    if (dir) {
+        if (_freeChildren.empty()) {
+            node.children = static_cast<uint32_t>(_children.size());
+            _children.emplace_back();
+        } else {
+            node.children = _freeChildren.back();
+            _freeChildren.pop_back();
+        }
+    }
+    _nodes[id] = node;
+
+    if (parent != NONE) {
+        size_t slot = _slot(parent, name);
+        auto &list = _children[_nodes[parent].children];
+        list.insert(list.begin() + static_cast<ptrdiff_t>(slot), id);
+    }
+    return id;
+}
+
+void NameIndex::Tree::_detach(uint32_t id) {
+    uint32_t parent = _nodes[id].parent;
+    if (parent == NONE) return;
+    auto &list = _children[_nodes[parent].children];
+    size_t slot = _slot(parent, _name(_nodes[id]));
+    if (slot < list.size() && list[slot] == id) list.erase(list.begin() + static_cast<ptrdiff_t>(slot));
+    _nodes[id].parent = NONE;
+}
+
+void NameIndex::Tree::_free(uint32_t id) {
+    if (_nodes[id].dir) {
+        uint32_t children = _nodes[id].children;
+        std::vector<uint32_t> list = std::move(_children[children]);
+        _children[children].clear();
+        _freeChildren.push_back(children);
+        for (uint32_t child : list) _free(child);
+    }
+    Node &node = _nodes[id];
+    node.live = false;
+    node.children = NONE;
+    _garbage += node.length;
+    _freeNodes.push_back(id);
+}
+
+void NameIndex::Tree::_setName(Node &node, std::string_view name) {
+    if (node.live) _garbage += node.length;
+    node.name = static_cast<uint32_t>(_names.size());
+    node.length = static_cast<uint16_t>(name.size());
+    _names.append(name);
+}
+
+std::string NameIndex::Tree::_path(uint32_t id) const {
+    std::vector<std::string_view> parts;
+    for (; id != 0 && id != NONE; id = _nodes[id].parent) parts.push_back(_name(_nodes[id]));
+    std::string path;
+    for (auto it = parts.rbegin(); it != parts.rend(); ++it) {
+        if (!path.empty()) path += '/';
+        path += *it;
+    }
+    return path;
+}
+
+void NameIndex::Tree::_compact() {
+    std::string names;
+    names.reserve(_names.size() - _garbage);
+    for (auto &node : _nodes) {
+        if (!node.live) continue;
+        std::string_view name = _name(node);
+        node.name = static_cast<uint32_t>(names.size());
+        names.append(name);
+    }
+    _names = std::move(names);
+    _garbage = 0;
+}
+
+
+bool NameIndex::built() {
+    std::shared_lock lock(_mutex);
+    return _state == state::BUILT;
+}
+
+void NameIndex::build(const RootDir &root, BuildHandler handler) {
+    {
+        std::unique_lock lock(_mutex);
+        if (_state == state::BUILDING) {
+            _waiting.push_back(std::move(handler));
+            return;
+        }
+        if (_state == state::BUILT) {
+            lock.unlock();
+            handler(true);
+            return;
+        }
+        _state = state::BUILDING;
+        _pending.clear();
+    }
+    // walked without the lock, changes made meanwhile are kept in _pending
+    auto started = std::chrono::steady_clock::now();
+    Tree tree;
+    bool done = tree.walk(root, {}, 0, true);
+    if (!done) spdlog::error("name index: could not list {}: {}", root.path().string(), std::strerror(errno));
+
+    std::unique_lock lock(_mutex);
+    if (done) {
+        for (const auto &change : _pending) _apply(tree, change, &root);
+        _tree = std::move(tree);
+        _state = state::BUILT;
+        spdlog::debug("indexed {} names in {} ms", _tree.size() - 1,
+            std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count());
+    } else {
+        _state = state::EMPTY;
+    }
+    _pending.clear();
+    auto waiting = std::move(_waiting);
+    _waiting.clear();
+    lock.unlock();
+    handler(done);
+    for (auto &waiter : waiting) waiter(done);
+}
+
+std::vector<NameIndex::Match> NameIndex::find(const Query &query, bool &truncated) {
+    std::vector<Match> matches;
+    truncated = false;
+    {
+        std::shared_lock lock(_mutex);
+        if (_state != state::BUILT) return matches;
+        uint32_t under = _tree.lookup(query.under);
+        if (under == Tree::NONE) return matches;
+        _tree.find(under, query, matches, truncated);
+    }
+    std::sort_heap(matches.begin(), matches.end(), [](const Match &a, const Match &b) {return a.path < b.path;});
+    return matches;
+}
+
+size_t NameIndex::size() {
+    std::shared_lock lock(_mutex);
+    return _state == state::BUILT ? _tree.size() - 1 : 0;
+}
+
+void NameIndex::add(const fs::path &rel, bool dir) {
+    _change({Change::kind::ADD, rel, {}, dir}, nullptr);
+}
+
+void NameIndex::remove(const fs::path &rel) {
+    _change({Change::kind::REMOVE, rel, {}, false}, nullptr);
+}
+
+void NameIndex::move(const fs::path &from, const fs::path &to) {
+    _change({Change::kind::MOVE, from, to, false}, nullptr);
+}
+
+void NameIndex::addTree(const RootDir &root, const fs::path &rel) {
+    _change({Change::kind::ADD_TREE, rel, {}, true}, &root);
+}
+
+void NameIndex::_change(Change change, const RootDir *root) {
+    std::unique_lock lock(_mutex);
+    if (_state == state::BUILDING) _pending.push_back(std::move(change));
+    else if (_state == state::BUILT) _apply(_tree, change, root);
+}
+
+void NameIndex::_apply(Tree &tree, const Change &change, const RootDir *root) {
+    // replayed changes may already have been seen by the walk, each of them is fine to apply twice
+    switch (change.what) {
+    case Change::kind::ADD:
+        tree.add(change.from, change.dir);
+        break;
+    case Change::kind::REMOVE:
+        tree.remove(tree.lookup(change.from));
+        break;
+    case Change::kind::MOVE:
+        tree.move(change.from, change.to);
+        break;
+    case Change::kind::ADD_TREE: {
+        uint32_t id = tree.add(change.from, true);
+        if (id == Tree::NONE || !root) break;
+        tree.walk(*root, change.from, id, change.from.empty());
+        break;
+    }
+    }
+}
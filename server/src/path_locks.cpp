@@ -0,0 +1,103 @@
+#include "path_locks.hpp"
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string_view>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+size_t combine(size_t seed, size_t value) {
+    return seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+}
+
+} // namespace
+
+PathLocks::Guard::~Guard() {
+    unlock();
+}
+
+PathLocks::Guard::Guard(Guard &&other) noexcept : _locks(other._locks), _held(std::move(other._held)) {
+    other._locks = nullptr;
+    other._held.clear();
+}
+
+PathLocks::Guard& PathLocks::Guard::operator=(Guard &&other) noexcept {
+    if (this != &other) {
+        unlock();
+        _locks = other._locks;
+        _held = std::move(other._held);
+        other._locks = nullptr;
+        other._held.clear();
+    }
+    return *this;
+}
+
+void PathLocks::Guard::unlock() {
+    if (!_locks) return;
+    for (auto it = _held.rbegin(); it != _held.rend(); ++it) {
+        auto &mutex = _locks->_stripes[it->first].mutex;
+        it->second == mode::EXCLUSIVE ? mutex.unlock() : mutex.unlock_shared();
+    }
+    _held.clear();
+    _locks = nullptr;
+}
+
+void PathLocks::_collect(size_t rootHash, const fs::path &rel, mode target,
+        std::vector<std::pair<uint32_t, mode>> &stripes) {
+    // the hash of each prefix, so "a/b" and "a" land on their own stripes whatever the root
+    size_t hash = rootHash;
+    std::vector<size_t> prefixes{hash};
+    for (const auto &part : rel) {
+        hash = combine(hash, std::hash<std::string_view>{}(part.native()));
+        prefixes.push_back(hash);
+    }
+    for (size_t i = 0; i < prefixes.size(); ++i) {
+        mode wanted = i + 1 == prefixes.size() ? target : mode::SHARED;
+        stripes.emplace_back(static_cast<uint32_t>(prefixes[i] % STRIPES), wanted);
+    }
+}
+
+PathLocks::Guard PathLocks::lock(const fs::path &root, const std::vector<fs::path> &exclusive,
+        const std::vector<fs::path> &shared) {
+    size_t rootHash = std::hash<std::string_view>{}(root.native());
+    std::vector<std::pair<uint32_t, mode>> stripes;
+    for (const auto &rel : exclusive) _collect(rootHash, rel, mode::EXCLUSIVE, stripes);
+    for (const auto &rel : shared) _collect(rootHash, rel, mode::SHARED, stripes);
+    // one entry per stripe in ascending order, exclusive when any path wants it so
+    std::sort(stripes.begin(), stripes.end(), [](const auto &a, const auto &b) {
+        return a.first != b.first ? a.first < b.first : a.second > b.second;
+    });
+    stripes.erase(std::unique(stripes.begin(), stripes.end(),
+        [](const auto &a, const auto &b) {return a.first == b.first;}), stripes.end());
+
+    Guard guard;
+    guard._locks = this;
+    std::chrono::steady_clock::time_point waitStarted;
+    bool waited = false;
+    for (const auto &[index, wanted] : stripes) {
+        auto &mutex = _stripes[index].mutex;
+        bool taken = wanted == mode::EXCLUSIVE ? mutex.try_lock() : mutex.try_lock_shared();
+        if (!taken) {
+            if (!waited) waitStarted = std::chrono::steady_clock::now();
+            waited = true;
+            wanted == mode::EXCLUSIVE ? mutex.lock() : mutex.lock_shared();
+        }
+        guard._held.emplace_back(index, wanted);
+    }
+    ++_acquired;
+    if (waited) {
+        auto micros = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - waitStarted).count());
+        ++_contended;
+        _waitMicros += micros;
+        uint64_t max = _maxWaitMicros.load();
+        while (micros > max && !_maxWaitMicros.compare_exchange_weak(max, micros)) {}
+    }
+    return guard;
+}
+
+PathLocks::Stats PathLocks::stats() const {
+    return {_acquired.load(), _contended.load(), _waitMicros.load(), _maxWaitMicros.load()};
+}
@@ -5,218 +5,430 @@
 #include <chrono>
 #include <functional>
 #include <filesystem>
+#include <cstring>
+#include <cerrno>
 #include <spdlog/spdlog.h>
 #include <nlohmann/json.hpp>
 #include "session.hpp"
 #include "globals.hpp"
 #include "fs_module.hpp"
+#include "hash_tree.hpp"
+#include "minidrive/transfer.hpp"
+#include "minidrive/error_codes.hpp"
 
 using asio::ip::tcp;
 namespace fs = std::filesystem;
 using json = nlohmann::json;
 
 MiniDriveServer::MiniDriveServer(asio::io_context &io, uint16_t port)
-    : _port(port), _io(io), _acceptor(io/*, tcp::endpoint(tcp::v4(), port)*/),
-      _timer(io) {
-        
-    _timer.expires_after(std::chrono::seconds(TIMER_PERIOD));
-    _timerFunc = [this](const asio::error_code& ec) {_timerHandler(ec);};
+    : _port(port), _io(io), _storage(StorageEngine::create("posix")), _acceptor(io), _unixAcceptor(io), _fileIo(io), _nextTransferId(1),
+      _timers(io, TIMER_TICK), _idleTimeout(IDLE_TIMEOUT), _keepaliveInterval(KEEPALIVE_INTERVAL), _compression(true),
+      _nextSessionId(1), _rateEnabled(false),
+      _workers(std::max(1u, std::thread::hardware_concurrency())), _copyWorkers(COPY_THREADS) {
+
+}
+
+void MiniDriveServer::setLimits(const ServerLimits &limits) {
+    _limits = limits;
+}
+
+void MiniDriveServer::setTimeouts(std::chrono::seconds idle, std::chrono::seconds keepalive) {
+    _idleTimeout = idle;
+    _keepaliveInterval = keepalive;
 }
 
 void MiniDriveServer::start() {
     if (_running) return;
     _running = true;
-    if (!fs::exists(PUBLIC_DIR_PATH)) {
-        spdlog::info("creating public directory");
-        try {
-            fs::create_directories(PUBLIC_DIR_PATH);
-        } catch (const fs::filesystem_error &e) {
-            spdlog::error("create_directories: {}", e.what());
-            stop();
-            return;
-        }
+    if (!_storage->createRoot(PUBLIC_DIR_PATH) || !_storage->createRoot(USERDATA_DIR_PATH)) {
+        stop();
+        return;
+    }
+    // the users file stays on disk whatever keeps the roots
+    std::error_code ec;
+    fs::create_directories(ROOT_DIR_PATH, ec);
+    if (!_authModule.loadConfig()) {
+        stop();
+        return;
+    }
+    if (!_limits.global.unlimited()) _globalRate = std::make_unique<minidrive::RateBuckets>(_limits.global);
+    _rateEnabled = _globalRate || !_limits.perIp.unlimited() || !_limits.perUser.unlimited()
+        || _authModule.hasRateLimits();
+    _fileIo.start(URING_ENTRIES, URING_BUFFERS, minidrive::chunkFrameSize(minidrive::CHUNK_SIZE));
+    // nothing to sync and no usage to keep when the files are gone with the process
+    if (!_storage->durable()) _commitSync.setPolicy(CommitSync::policy::NONE);
+    _commitSync.start();
+    _usage.setStorage(_storage.get());
+    if (_storage->durable()) _usage.load(ROOT_DIR_PATH / USAGE_FILE);
+    _usage.start();
+    _reconcileUsage();
+    _storage->setFreedHandler([this](const fs::path &root, int64_t bytes, int64_t files) {
+        _usage.charge(root, -bytes, -files);
+    });
+    _storage->start();
+    _recoverRoots();
+
+    // open and bind the sockets
+    if (!_listen(_acceptor, tcp::endpoint(tcp::v4(), _port))) {
+        stop();
+        return;
     }
-    if (!fs::exists(USERDATA_DIR_PATH)) {
-        spdlog::info("creating user_data directory");
-        try {
-            fs::create_directories(USERDATA_DIR_PATH);
-        } catch (const fs::filesystem_error &e) {
-            spdlog::error("create_directories: {}", e.what());
+    if (!_unixPath.empty()) {
+        asio::local::stream_protocol::endpoint endpoint(_unixPath);
+        // a socket file left by an earlier run would fail the bind, one a running server answers on stays
+        asio::local::stream_protocol::socket probe(_io);
+        asio::error_code probeEc;
+        probe.connect(endpoint, probeEc);
+        if (probeEc == asio::error::connection_refused) {
+            std::error_code ec;
+            fs::remove(_unixPath, ec);
+        }
+        if (!_listen(_unixAcceptor, endpoint)) {
             stop();
             return;
         }
+        spdlog::info("listening on unix socket {}", _unixPath);
     }
-    if (!_authModule.loadConfig()) {
-        stop();
-        return;
+
+    _accept(_acceptor);
+    if (_unixAcceptor.is_open()) _accept(_unixAcceptor);
+    _timers.start();
+    _timers.schedule(TIMER_PERIOD, [this]() {_housekeeping();});
+}
+
+void MiniDriveServer::stop() {
+    if (!_running) return;
+    _running = false;
+    _authModule.saveConfig();
+    _io.stop();
+    _workers.stop();
+    _copyWorkers.stop();
+    _timers.stop();
+    _fileIo.stop();
+    _commitSync.stop();
+    _storage->stop();
+    _usage.stop();
+    _usage.save();
+    if (_unixAcceptor.is_open()) {
+        std::error_code ec;
+        fs::remove(_unixPath, ec);
     }
+}
 
-    // open and bind the socket
-    tcp::endpoint addr(tcp::v4(), _port);
+bool MiniDriveServer::_listen(Acceptor &acceptor, const Acceptor::endpoint_type &endpoint) {
     try {
-        _acceptor.open(addr.protocol());
+        acceptor.open(endpoint.protocol());
+        // the server closes idle connections itself, their TIME_WAIT must not block a restart
+        if (endpoint.protocol().family() != AF_UNIX) {
+            acceptor.set_option(Acceptor::reuse_address(true));
+            // accepted connections inherit the options, fixed buffer sizes then apply from the handshake on
+            minidrive::tuneSocket(acceptor.native_handle(), AsyncSocket::tuning());
+        }
     } catch (const asio::system_error &e) {
         spdlog::critical("open(): could not open socket: {}", e.what());
-        stop();
-        return;
+        return false;
     }
     try {
-        _acceptor.bind(addr);
+        acceptor.bind(endpoint);
     } catch (const asio::system_error &e) {
         spdlog::critical("bind(): could not bind socket: {}", e.what());
-        stop();
-        return;
+        return false;
     }
     try {
-        _acceptor.listen();
+        acceptor.listen();
     } catch (const asio::system_error &e) {
         spdlog::critical("listen(): could not start listening for connections: {}", e.what());
-        stop();
-        return;
+        return false;
     }
-
-    accept();
-    _timer.async_wait(_timerFunc);
-}
-
-void MiniDriveServer::stop() {
-    if (!_running) return;
-    _running = false;
-    _authModule.saveConfig();
-    _io.stop();
-    _timer.cancel();
+    return true;
 }
 
-void MiniDriveServer::accept() {
-    _acceptor.async_accept([this](const asio::error_code& ec, tcp::socket socket) {
+void MiniDriveServer::_accept(Acceptor &acceptor) {
+    acceptor.async_accept([this, &acceptor](const asio::error_code& ec, AsyncSocket::Stream socket) {
         if (ec) {
             spdlog::error("accept(): {}", ec.message());
-            accept();
+            _accept(acceptor);
             return;
         }
 
-        spdlog::info("new client connection: IP: {}, port: {}",
-            socket.remote_endpoint().address().to_string(),
-            socket.remote_endpoint().port());
+        asio::error_code endpointEc;
+        socket.remote_endpoint(endpointEc);
+        if (endpointEc) {
+            // reset before we got to it
+            _accept(acceptor);
+            return;
+        }
+        std::string address = AsyncSocket::peerAddress(socket);
+        spdlog::info("new client connection: {}", AsyncSocket::peerName(socket));
+
+        std::shared_ptr<minidrive::RateBuckets> addressRate;
+        if (!_admit(address, addressRate)) {
+            spdlog::warn("too many connections from {}", address);
+            // a short reply to a fresh socket doesn't block
+            json reply = { {"status", "FAIL"}, {"code", minidrive::error::TOO_MANY_CONNECTIONS.code()},
+                {"message", minidrive::error::TOO_MANY_CONNECTIONS.what()} };
+            std::string text = reply.dump();
+            MsgPayload frame = AsyncSocket::makeFrame(data_type::COMMAND, static_cast<uint32_t>(text.size()));
+            std::copy(text.begin(), text.end(), frame.begin() + MsgHeader::SIZE);
+            asio::error_code writeEc;
+            asio::write(socket, asio::buffer(frame), writeEc);
+            socket.shutdown(AsyncSocket::Stream::shutdown_both, writeEc);
+            _accept(acceptor);
+            return;
+        }
 
-        auto session = std::make_unique<Session>(this, std::move(socket));
+        uint64_t id = _nextSessionId++;
+        auto session = std::make_shared<Session>(this, id, std::move(socket));
+        session->setRateLimits(std::move(addressRate));
+        _sessions.add(id, session);
         session->start();
-        _addSession(std::move(session));
 
-        accept();
+        _accept(acceptor);
     });
 }
 
 
-std::pair<fs::path, bool> MiniDriveServer::fs_resolvePath(Session *session, std::string other) {
-    std::pair<fs::path, bool> result;
-    fs::path startPath, uwd;
-    if (session->getMode() == Session::mode::PUBLIC) {
-        startPath = PUBLIC_DIR_PATH;
-    } else if (session->getMode() == Session::mode::PRIVATE) {
-        startPath = USERDATA_DIR_PATH / session->getUsername();
-        uwd = session->getUWD();
+std::shared_ptr<RootDir> MiniDriveServer::fs_openRoot(const fs::path &path) {
+    std::lock_guard g(_rootsMutex);
+    auto &cached = _roots[path.string()];
+    if (auto root = cached.lock()) return root;
+    auto root = _storage->openRoot(path);
+    if (!root) return nullptr;
+    cached = root;
+    // forget handles of roots nobody uses anymore
+    for (auto it = _roots.begin(); it != _roots.end();) {
+        if (it->second.expired()) it = _roots.erase(it);
+        else ++it;
     }
-    else {
+    return root;
+}
+
+ResolvedPath MiniDriveServer::fs_resolvePath(Session *session, const std::string &other) {
+    if (session->getMode() == Session::mode::NOT_AUTHENTICATED) {
         spdlog::warn("NOT_AUTHENTICATED session tried to resolve a path");
-        return result;
+        return ResolvedPath();
     }
-    result.first = ::fs_resolvePath(startPath, uwd, other);
-    result.second = ::fs_validatePath(startPath, result.first);
-    return result;
+    auto rel = ::fs_resolveRelative(session->getUWD(), other);
+    if (!rel) {
+        return ResolvedPath();
+    }
+    return ResolvedPath(session->getRoot(), std::move(*rel));
 }
 
-json MiniDriveServer::fs_listFiles(fs::path path, bool includeHash) {
+FsEntry MiniDriveServer::fs_stat(const ResolvedPath &path) {
+    return _storage->stat(path);
+}
+
+json MiniDriveServer::fs_listFiles(const ResolvedPath &path, bool includeHash) {
     json result = json::array();
-    std::error_code ec;
-    for (const auto &entry : fs::directory_iterator(path, ec)) {
-        try {
-            auto status = entry.status();
-            json file;
-            file["name"] = entry.path();
-            file["type"] = status.type();
-            file["size"] = (status.type() == fs::file_type::regular ? entry.file_size() : 0);
-            result.push_back(file);
-        } catch (const fs::filesystem_error &e) {
-            spdlog::error("listFiles(): {}", e.what());
-        }
+    std::vector<StorageEngine::DirEntry> entries;
+    if (!_storage->list(*path.root(), path.rel(), entries, true)) {
+        spdlog::error("listFiles(): {}", std::strerror(errno));
+        return result;
     }
-    if (ec) {
-        spdlog::error("listFiles(): {}", ec.message());
+    fs::path base = path.absolute();
+    for (const auto &entry : entries) {
+        if (path.isRoot() && (entry.name == TRASH_DIR || entry.name == TREES_DIR)) continue;
+        // an upload that is not committed yet
+        if (Transfer::isTemporaryName(entry.name)) continue;
+        json file;
+        file["name"] = base / entry.name;
+        file["type"] = entry.entry.type;
+        file["size"] = (entry.entry.type == fs::file_type::regular ? entry.entry.size : 0);
+        result.push_back(file);
     }
     return result;
 }
 
-bool MiniDriveServer::fs_createDir(fs::path path, bool createParent) {
-    try {
-        createParent ? fs::create_directories(path) : fs::create_directory(path);
-    } catch (const fs::filesystem_error &e) {
-        return false;
-    }
-    return true;
+bool MiniDriveServer::fs_createDir(const fs::path &path) {
+    return _storage->createRoot(path);
 }
 
-bool MiniDriveServer::fs_removeDir(fs::path path) {
-    try {
-        fs::remove_all(path);
-    } catch (const fs::filesystem_error &e) {
-        return false;
-    }
+bool MiniDriveServer::fs_createDir(const ResolvedPath &path) {
+    if (!_storage->createDir(path)) return false;
+    path.root()->names().add(path.rel(), true);
     return true;
 }
 
-bool MiniDriveServer::fs_exists(fs::path path) {
-    return fs::exists(path);
+bool MiniDriveServer::fs_removeDir(const ResolvedPath &path) {
+    if (path.isRoot()) return false;
+    if (!_storage->removeDir(path)) return false;
+    path.root()->names().remove(path.rel());
+    return true;
 }
 
-bool MiniDriveServer::fs_remove(fs::path path) {
-    try {
-        fs::remove(path);
-    } catch (const fs::filesystem_error &e) {
-        return false;
+bool MiniDriveServer::fs_remove(const ResolvedPath &path) {
+    FsEntry removed;
+    if (!_storage->remove(path, removed)) return false;
+    path.root()->names().remove(path.rel());
+    if (removed.type != fs::file_type::regular) return true;
+    if (removed.links == 1) {
+        tree_remove(*path.root(), removed.ino);
+        _chunkCache.invalidate(removed.dev, removed.ino);
     }
+    _usage.charge(path.root()->path(), -static_cast<int64_t>(removed.size), -1);
     return true;
 }
 
-fs::file_type MiniDriveServer::fs_getFileType(fs::path path) {
-    try {
-        auto status = fs::status(path);
-        return status.type();
-    } catch (const fs::filesystem_error &e) {
-        
-    }
-    return fs::file_type::none;
+bool MiniDriveServer::fs_move(const ResolvedPath &src, const ResolvedPath &dst) {
+    if (!_storage->move(src, dst)) return false;
+    src.root()->names().move(src.rel(), dst.rel());
+    return true;
+}
+
+int MiniDriveServer::fs_openFile(const ResolvedPath &path, int flags) {
+    return _storage->open(path, flags);
+}
+
+
+uint64_t MiniDriveServer::usage_quota(const Session *session) const {
+    if (session->getMode() != Session::mode::PRIVATE) return 0;
+    return _authModule.quota(session->getUsername()).value_or(_limits.quota);
+}
+
+UsageTracker::Usage MiniDriveServer::usage_get(const Session *session) {
+    return _usage.usage(session->getRoot()->path());
+}
+
+std::shared_ptr<UsageTracker::Hold> MiniDriveServer::usage_reserve(const Session *session, int64_t bytes) {
+    return _usage.reserve(session->getRoot()->path(), bytes, usage_quota(session));
+}
+
+void MiniDriveServer::_reconcileUsage() {
+    _usage.reconcile(_allRoots());
 }
 
 
+uint32_t MiniDriveServer::tr_nextId() {
+    return _nextTransferId++;
+}
 
+void MiniDriveServer::tr_register(const std::shared_ptr<Transfer> &transfer, std::shared_ptr<minidrive::RateBuckets> rate) {
+    std::lock_guard g(_transferTokensMutex);
+    _transferTokens[transfer->token()] = TransferToken{transfer,
+        std::chrono::steady_clock::now() + std::chrono::seconds(TRANSFER_TOKEN_TTL), std::move(rate)};
+}
 
-void MiniDriveServer::_addSession(std::unique_ptr<Session> session) {
-    std::lock_guard g(_listMutex);
-    _sessions.push_back(std::move(session));
+void MiniDriveServer::tr_unregister(const std::string &token) {
+    std::lock_guard g(_transferTokensMutex);
+    _transferTokens.erase(token);
 }
 
-void MiniDriveServer::_cleanupSessions() {
-    std::lock_guard g(_listMutex);
-    spdlog::debug("list size: {}", _sessions.size());
-    for (auto it = _sessions.begin(); it != _sessions.end();) {
-        if ((*it)->isDead()) it = _sessions.erase(it);
+std::shared_ptr<Transfer> MiniDriveServer::tr_join(const std::string &token, std::shared_ptr<minidrive::RateBuckets> &rate) {
+    std::lock_guard g(_transferTokensMutex);
+    auto it = _transferTokens.find(token);
+    if (it == _transferTokens.end()) return nullptr;
+    auto now = std::chrono::steady_clock::now();
+    auto transfer = it->second.transfer.lock();
+    if (!transfer || it->second.expires < now || transfer->finished()) {
+        _transferTokens.erase(it);
+        return nullptr;
+    }
+    it->second.expires = now + std::chrono::seconds(TRANSFER_TOKEN_TTL);
+    rate = it->second.rate;
+    return transfer;
+}
+
+void MiniDriveServer::_purgeTransferTokens() {
+    std::lock_guard g(_transferTokensMutex);
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = _transferTokens.begin(); it != _transferTokens.end();) {
+        if (it->second.expires < now || it->second.transfer.expired()) it = _transferTokens.erase(it);
         else ++it;
     }
+}
+
+
+std::vector<fs::path> MiniDriveServer::_allRoots() {
+    std::vector<fs::path> roots{PUBLIC_DIR_PATH};
+    for (auto &root : _storage->roots(USERDATA_DIR_PATH)) roots.push_back(std::move(root));
+    return roots;
+}
+
+void MiniDriveServer::_recoverRoots() {
+    for (const auto &root : _allRoots()) _storage->recover(root);
+}
+
 
+void MiniDriveServer::removeSession(uint64_t id) {
+    asio::post(_io, [this, id]() {_reapSession(id);});
 }
 
-void MiniDriveServer::_timerHandler(const asio::error_code& ec) {
-    if (ec == asio::error::operation_aborted) {
-        spdlog::info("timer aborted: {}", ec.message());
+void MiniDriveServer::_reapSession(uint64_t id) {
+    auto session = _sessions.find(id);
+    if (!session) return;
+    // the handler that noticed the dead socket may still be returning
+    if (!session->isDead()) {
+        _timers.schedule(TIMER_TICK, [this, id]() {_reapSession(id);});
         return;
     }
-    else if (ec) {
-        spdlog::error("timer: {}", ec.message());
-        return;
+    _sessions.remove(id);
+    _release(session->peerAddress());
+    spdlog::debug("session {} removed, {} left", id, _sessions.size());
+}
+
+bool MiniDriveServer::_admit(const std::string &address, std::shared_ptr<minidrive::RateBuckets> &rate) {
+    if (_limits.connectionsPerIp == 0 && _limits.perIp.unlimited()) return true;
+    std::lock_guard g(_addressesMutex);
+    auto &entry = _addresses[address];
+    if (_limits.connectionsPerIp > 0 && entry.connections >= _limits.connectionsPerIp) return false;
+    ++entry.connections;
+    if (!entry.rate && !_limits.perIp.unlimited()) entry.rate = std::make_shared<minidrive::RateBuckets>(_limits.perIp);
+    rate = entry.rate;
+    return true;
+}
+
+void MiniDriveServer::_release(const std::string &address) {
+    if (_limits.connectionsPerIp == 0 && _limits.perIp.unlimited()) return;
+    std::lock_guard g(_addressesMutex);
+    auto it = _addresses.find(address);
+    // the entry and its buckets stay until housekeeping, reconnecting doesn't reset the rate
+    if (it != _addresses.end() && it->second.connections > 0) --it->second.connections;
+}
+
+std::shared_ptr<minidrive::RateBuckets> MiniDriveServer::rate_forUser(const std::string &username) {
+    auto limit = _authModule.rateLimit(username).value_or(_limits.perUser);
+    if (limit.unlimited()) return nullptr;
+    std::lock_guard g(_userRatesMutex);
+    auto &rate = _userRates[username];
+    if (!rate) rate = std::make_shared<minidrive::RateBuckets>(limit);
+    return rate;
+}
+
+void MiniDriveServer::_purgeRates() {
+    {
+        std::lock_guard g(_addressesMutex);
+        for (auto it = _addresses.begin(); it != _addresses.end();) {
+            if (it->second.connections == 0) it = _addresses.erase(it);
+            else ++it;
+        }
+    }
+    std::lock_guard g(_userRatesMutex);
+    for (auto it = _userRates.begin(); it != _userRates.end();) {
+        if (it->second.use_count() == 1) it = _userRates.erase(it);
+        else ++it;
     }
-    // spdlog::debug("timer!");
-    _cleanupSessions();
-    _timer.expires_after(std::chrono::seconds(TIMER_PERIOD));
-    _timer.async_wait(_timerFunc);
-}
\ No newline at end of file
+}
+
+void MiniDriveServer::setSessionUser(uint64_t id, const std::string &username) {
+    _sessions.setUser(id, username);
+}
+
+std::vector<std::shared_ptr<Session>> MiniDriveServer::sessionsOf(const std::string &username) {
+    return _sessions.forUser(username);
+}
+
+void MiniDriveServer::scheduleSessionTimer(uint64_t id, std::chrono::milliseconds delay) {
+    _timers.schedule(delay, [this, id]() {
+        if (auto session = _sessions.find(id)) session->onTimer();
+    });
+}
+
+void MiniDriveServer::_housekeeping() {
+    spdlog::debug("sessions: {}", _sessions.size());
+    _purgeTransferTokens();
+    _purgeRates();
+    _usage.save();
+    _reconcileUsage();
+    _timers.schedule(TIMER_PERIOD, [this]() {_housekeeping();});
+}
@@ -3,68 +3,177 @@
 #include <memory>
 #include <string>
 #include <filesystem>
+#include <chrono>
+#include <algorithm>
 #include <spdlog/spdlog.h>
 #include <nlohmann/json.hpp>
 #include <cstdint>
 
 #include "minidrive/error_codes.hpp"
+#include "minidrive/transfer.hpp"
 #include "server.hpp"
 #include "globals.hpp"
 
-using asio::ip::tcp;
 using nlohmann::json;
 namespace fs = std::filesystem;
 
-Session::Session(MiniDriveServer *server, tcp::socket &&cmdSocket)
-    :  _server(server), _cmdSocket(std::move(cmdSocket)), _mode(mode::NOT_AUTHENTICATED) {
-    
+namespace {
+
+int64_t steadyMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+Session::Session(MiniDriveServer *server, uint64_t id, AsyncSocket::Stream &&cmdSocket)
+    :  _mode(mode::NOT_AUTHENTICATED), _compression(false), _server(server), _id(id), _cmdSocket(std::move(cmdSocket)), _pendingOps(0),
+       _unregistered(false), _lastReceived(0), _lastSent(0), _transfers(nullptr) {
+    _peerAddress = AsyncSocket::peerAddress(_cmdSocket.getSocket());
+    _peerName = AsyncSocket::peerName(_cmdSocket.getSocket());
 }
 
 Session::~Session() {
     spdlog::debug("~Session()");
+    Transfers *state = _transfers.exchange(nullptr);
+    if (!state) return;
+    // a completion handler may be running and waiting for the mutex, abort outside of it
+    decltype(state->started) transfers;
+    {
+        std::lock_guard g(state->mutex);
+        transfers.swap(state->started);
+    }
+    for (auto &[id, transfer] : transfers) {
+        transfer->abort();
+        _server->tr_unregister(transfer->token());
+    }
+    delete state;
 }
 
 bool Session::isDead() const {
-    return _cmdSocket.isDead();
+    return _cmdSocket.isDead() && !_cmdSocket.ioPending() && _pendingOps == 0;
 }
 
 void Session::start() {
-    _cmdSocket.start(
-        [this](data_type type, std::shared_ptr<MsgPayload> payload) {
-            switch(type) {
-            case data_type::COMMAND:
-            {
-                const auto &endpoint = _cmdSocket.getSocket().remote_endpoint();
-                spdlog::debug("IP: {}, port: {}, msg type: {}, payload length: {}", endpoint.address().to_string(),
-                    endpoint.port(), static_cast<uint32_t>(type), payload->size());
-                processMessage(*payload);
-            }
-                break;
-            default:
-                break;
-            }
-        },
-        [this](const asio::error_code &ec) {
-            const auto &endpoint = _cmdSocket.getSocket().remote_endpoint();
-            if (ec == asio::error::eof) {
-                spdlog::info("client disconnected: IP: {}, port: {}",
-                    endpoint.address().to_string(), endpoint.port());
-            } else {
-                spdlog::error("client error occurred: IP: {}, port: {}, error: {}",
-                    endpoint.address().to_string(), endpoint.port(), ec.message());
-            }
-        },
-        [this](const asio::error_code &ec) {
-            const auto &endpoint = _cmdSocket.getSocket().remote_endpoint();
-            if (ec == asio::error::eof) {
-                spdlog::info("client disconnected: IP: {}, port: {}",
-                    endpoint.address().to_string(), endpoint.port());
-            } else {
-                spdlog::error("client (write) error occurred: IP: {}, port: {}, error: {}",
-                    endpoint.address().to_string(), endpoint.port(), ec.message());
-            }
+    _lastReceived = _lastSent = steadyMs();
+    if (_server->rate_enabled()) _cmdSocket.setLimiter(this);
+    // a DATA frame is one chunk, compressed ones are smaller
+    _cmdSocket.setFrameLimits(MAX_COMMAND, minidrive::ChunkHeader::SIZE + minidrive::CHUNK_SIZE);
+    _cmdSocket.start(*this);
+    auto first = std::min(_server->idleTimeout(), _server->keepaliveInterval());
+    if (first.count() == 0) first = std::max(_server->idleTimeout(), _server->keepaliveInterval());
+    if (first.count() > 0) _server->scheduleSessionTimer(_id, first);
+}
+
+void Session::onMessage(data_type type, std::shared_ptr<MsgPayload> payload) {
+    _lastReceived = steadyMs();
+    switch(type) {
+    case data_type::COMMAND:
+        spdlog::debug("client: {}, msg type: {}, payload length: {}", _peerName, static_cast<uint32_t>(type),
+            payload->size());
+        processMessage(*payload);
+        break;
+    case data_type::DATA:
+        processData(std::move(payload));
+        break;
+    default:
+        break;
+    }
+}
+
+void Session::onReadError(const asio::error_code &ec) {
+    if (ec == asio::error::eof) {
+        spdlog::info("client disconnected: {}", _peerName);
+    } else if (ec != asio::error::operation_aborted) {
+        spdlog::error("client error occurred: {}, error: {}", _peerName, ec.message());
+    }
+    _checkDead();
+}
+
+void Session::onWriteError(const asio::error_code &ec) {
+    if (ec == asio::error::eof) {
+        spdlog::info("client disconnected: {}", _peerName);
+    } else if (ec != asio::error::operation_aborted) {
+        spdlog::error("client (write) error occurred: {}, error: {}", _peerName, ec.message());
+    }
+    _checkDead();
+}
+
+void Session::onWriteDone() {
+    _lastSent = steadyMs();
+    _pumpDownloads();
+}
+
+void Session::setRateLimits(std::shared_ptr<minidrive::RateBuckets> addressRate) {
+    _addressRate = std::move(addressRate);
+}
+
+std::chrono::nanoseconds Session::chargeRead(data_type type, size_t bytes) {
+    return _chargeRates(type == data_type::COMMAND ? 1 : 0, bytes);
+}
+
+std::chrono::nanoseconds Session::chargeWrite(size_t bytes) {
+    return _chargeRates(0, bytes);
+}
+
+std::chrono::nanoseconds Session::_chargeRates(double commands, size_t bytes) {
+    // every scope is charged even when an earlier one already delays, so each one sees all the traffic
+    std::chrono::nanoseconds delay{0};
+    if (auto *global = _server->rate_global()) delay = std::max(delay, global->charge(commands, bytes));
+    if (_addressRate) delay = std::max(delay, _addressRate->charge(commands, bytes));
+    if (auto user = _userRate.load()) delay = std::max(delay, user->charge(commands, bytes));
+    return delay;
+}
+
+void Session::onTimer() {
+    if (_cmdSocket.isDead()) return;
+    auto idle = _server->idleTimeout();
+    auto keepalive = _server->keepaliveInterval();
+    std::chrono::milliseconds next = std::chrono::milliseconds::max();
+    if (idle.count() > 0) {
+        std::chrono::milliseconds quiet(steadyMs() - _lastReceived);
+        if (quiet >= idle && _isIdle()) {
+            spdlog::info("closing idle session: {}", _peerName);
+            _cmdSocket.close();
+            return;
+        }
+        // a busy session is looked at again after a whole period
+        next = quiet >= idle ? idle : idle - quiet;
+    }
+    // DATA connections carry only chunks and end with their transfer
+    if (keepalive.count() > 0 && _mode != mode::DATA) {
+        std::chrono::milliseconds silent(steadyMs() - _lastSent);
+        if (silent >= keepalive) {
+            sendEvent("KEEPALIVE", { {"status", "OK"}, {"code", minidrive::error::SUCCESS.code()} });
+            silent = std::chrono::milliseconds(0);
         }
-    );
+        next = std::min(next, keepalive - silent);
+    }
+    if (next != std::chrono::milliseconds::max()) _server->scheduleSessionTimer(_id, next);
+}
+
+bool Session::_isIdle() {
+    if (_pendingOps > 0) return false;
+    Transfers *state = _transfers;
+    if (!state) return true;
+    {
+        std::lock_guard g(state->mutex);
+        if (!state->started.empty() || (state->joined && !state->joined->finished())) return false;
+    }
+    std::lock_guard g(state->pumpMutex);
+    return state->downloads.empty();
+}
+
+void Session::_endPendingOp() {
+    if (--_pendingOps == 0) _checkDead();
+}
+
+void Session::_checkDead() {
+    if (!_cmdSocket.isDead() || _pendingOps > 0) return;
+    if (_unregistered.exchange(true)) return;
+    // one direction failed, stop the other one too
+    _cmdSocket.close();
+    _server->removeSession(_id);
 }
 
 
@@ -93,29 +202,223 @@ void Session::processMessage(const MsgPayload &payload) {
     const std::string &cmd = data["cmd"];
     const json &args = data.contains("args") ? data["args"] : json::object();
 
+    json reply;
     try {
         spdlog::info("command: {}", cmd);
-        if (cmd == "LIST") handleLIST(cmd, args, data);
-        else if (cmd == "REMOVE") handleREMOVE(cmd, args, data);
-        else if (cmd == "CD") handleCD(cmd, args, data);
-        else if (cmd == "MKDIR") handleMKDIR(cmd, args, data);
-        else if (cmd == "RMDIR") handleRMDIR(cmd, args, data);
-        else if (cmd == "AUTH") handleAUTH(cmd, args, data);
-        else if (cmd == "REGISTER") handleREGISTER(cmd, args, data);
-        else {
-            spdlog::error("unknown command: {}", cmd);
-            sendFailReply(minidrive::error::UNKNOWN_COMMAND.code(), cmd);
-        }
-
+        reply = dispatch(cmd, args, data);
     } catch (const json::type_error &e) {
         spdlog::error("type_error: {}", e.what());
-        sendFailReply(minidrive::error::JSON_TYPE_ERROR.code(), e.what());
+        reply = makeFailReply(minidrive::error::JSON_TYPE_ERROR.code(), e.what());
+    }
+    if (!reply.is_null()) {
+        sendReply(reply);
+    }
+}
+
+json Session::dispatch(const std::string &cmd, const json &args, const json &data) {
+    if (_mode == mode::DATA) {
+        spdlog::warn("command on a data connection: {}", cmd);
+        return makeFailReply(minidrive::error::ACCESS_DENIED, "data connection");
+    }
+    if (cmd == "LIST") return handleLIST(cmd, args, data);
+    else if (cmd == "REMOVE") return handleREMOVE(cmd, args, data);
+    else if (cmd == "CD") return handleCD(cmd, args, data);
+    else if (cmd == "MKDIR") return handleMKDIR(cmd, args, data);
+    else if (cmd == "RMDIR") return handleRMDIR(cmd, args, data);
+    else if (cmd == "MOVE") return handleMOVE(cmd, args, data);
+    else if (cmd == "COPY") return handleCOPY(cmd, args, data);
+    else if (cmd == "AUTH") return handleAUTH(cmd, args, data);
+    else if (cmd == "REGISTER") return handleREGISTER(cmd, args, data);
+    else if (cmd == "BATCH") return handleBATCH(cmd, args, data);
+    else if (cmd == "UPLOAD") return handleUPLOAD(cmd, args, data);
+    else if (cmd == "DOWNLOAD") return handleDOWNLOAD(cmd, args, data);
+    else if (cmd == "JOIN") return handleJOIN(cmd, args, data);
+    else if (cmd == "TREE") return handleTREE(cmd, args, data);
+    else if (cmd == "RESEND") return handleRESEND(cmd, args, data);
+    else if (cmd == "DONE") return handleDONE(cmd, args, data);
+    else if (cmd == "USAGE") return handleUSAGE(cmd, args, data);
+    else if (cmd == "FIND") return handleFIND(cmd, args, data);
+    else if (cmd == "STATS") return handleSTATS(cmd, args, data);
+
+    spdlog::error("unknown command: {}", cmd);
+    return makeFailReply(minidrive::error::UNKNOWN_COMMAND, cmd);
+}
+
+void Session::_beginAsync() {
+    ++_pendingOps;
+    _cmdSocket.pauseReading();
+}
+
+void Session::_endAsync(const json &reply) {
+    sendReply(reply);
+    _cmdSocket.resumeReading();
+    _endPendingOp();
+}
+
+
+void Session::processData(std::shared_ptr<MsgPayload> payload) {
+    if (payload->size() < minidrive::ChunkHeader::SIZE) {
+        spdlog::warn("DATA frame too short ({}B)", payload->size());
+        return;
+    }
+    auto header = minidrive::ChunkHeader::decode(payload->data());
+    auto transfer = _findTransfer(header.transferId);
+    if (!transfer || transfer->dir() != Transfer::direction::UPLOAD) {
+        spdlog::warn("DATA frame for unknown upload {}", header.transferId);
+        return;
+    }
+    // a payload without data is a chunk of zeros, not a compressed one
+    if (_compression && header.offset < transfer->size() && payload->size() > minidrive::ChunkHeader::SIZE) {
+        uint32_t len = minidrive::chunkLength(transfer->size(), transfer->chunkSize(), header.offset);
+        if (payload->size() - minidrive::ChunkHeader::SIZE < len) {
+            auto chunk = std::make_shared<MsgPayload>();
+            if (!minidrive::decompressChunk(payload->data(), payload->size(), len, *chunk)) {
+                spdlog::warn("transfer {}: corrupt compressed chunk at offset {}", header.transferId, header.offset);
+                return;
+            }
+            payload = std::move(chunk);
+        }
+    }
+    auto &fileIo = _server->getFileIo();
+    if (!fileIo.available()) {
+        auto err = transfer->writeChunk(fileIo, header, payload->data() + minidrive::ChunkHeader::SIZE,
+            payload->size() - minidrive::ChunkHeader::SIZE);
+        if (err == minidrive::error::CORRUPT_CHUNK) _requestResend(header);
+        return;
+    }
+    _beginChunkWrite();
+    transfer->writeChunk(fileIo, std::move(payload), [this, header](const minidrive::error_code &err) {
+        if (err == minidrive::error::CORRUPT_CHUNK) _requestResend(header);
+        _endChunkWrite();
+    });
+}
+
+void Session::_requestResend(const minidrive::ChunkHeader &header) {
+    // on the connection the chunk came in, whichever stream of the client reads it
+    sendEvent("RESEND", makeOkReply("damaged chunk", { {"id", header.transferId}, {"offset", header.offset} }));
+}
+
+void Session::_beginChunkWrite() {
+    ++_pendingOps;
+    auto &state = *_transfers.load();
+    std::lock_guard g(state.chunkWritesMutex);
+    if (++state.chunkWrites == minidrive::TRANSFER_WINDOW) _cmdSocket.pauseReading();
+}
+
+void Session::_endChunkWrite() {
+    {
+        auto &state = *_transfers.load();
+        std::lock_guard g(state.chunkWritesMutex);
+        if (state.chunkWrites-- == minidrive::TRANSFER_WINDOW) _cmdSocket.resumeReading();
+    }
+    _endPendingOp();
+}
+
+Session::Transfers& Session::_transfersState() {
+    Transfers *state = _transfers;
+    if (!state) {
+        state = new Transfers();
+        _transfers = state;
+    }
+    return *state;
+}
+
+void Session::_startTransfer(const std::shared_ptr<Transfer> &transfer, std::shared_ptr<UsageTracker::Hold> hold) {
+    auto &state = _transfersState();
+    // dropping the handler, when the transfer fails or is aborted, gives the quota back
+    transfer->setCompletionHandler([this, &state, hold](Transfer &t, const minidrive::error_code &err) {
+        if (!err && hold) hold->commit(static_cast<int64_t>(t.size()), 1);
+        _server->tr_unregister(t.token());
+        if (err) {
+            spdlog::warn("transfer {} failed: {}", t.id(), err.what());
+            json reply = makeFailReply(err, t.path().rel().string());
+            reply["data"] = { {"id", t.id()} };
+            sendEvent("TRANSFER", reply);
+        } else if (t.dir() == Transfer::direction::UPLOAD) {
+            sendEvent("TRANSFER", makeOkReply("upload complete", { {"id", t.id()}, {"hash", t.hash()} }));
+        }
+        // last: this may run on a joined session's thread, and until the entry is gone ~Session finds the
+        // transfer and waits in abort() for this handler to return
+        std::lock_guard g(state.mutex);
+        state.started.erase(t.id());
+    });
+    {
+        std::lock_guard g(state.mutex);
+        state.started[transfer->id()] = transfer;
+    }
+    _server->tr_register(transfer, _userRate.load());
+}
+
+std::shared_ptr<Transfer> Session::_findTransfer(uint32_t id) {
+    Transfers *state = _transfers;
+    if (!state) return nullptr;
+    std::lock_guard g(state->mutex);
+    if (state->joined && state->joined->id() == id) return state->joined;
+    auto it = state->started.find(id);
+    return it == state->started.end() ? nullptr : it->second;
+}
+
+void Session::_addDownload(const std::shared_ptr<Transfer> &transfer) {
+    {
+        auto &state = _transfersState();
+        std::lock_guard g(state.pumpMutex);
+        // a download asked to resend a chunk may still be pumped
+        if (std::find(state.downloads.begin(), state.downloads.end(), transfer) != state.downloads.end()) return;
+        state.downloads.push_back(transfer);
+    }
+    _pumpDownloads();
+}
+
+void Session::_pumpDownloads() {
+    Transfers *state = _transfers;
+    if (!state) return;
+    std::lock_guard g(state->pumpMutex);
+    auto &fileIo = _server->getFileIo();
+    auto &downloads = state->downloads;
+    while (!downloads.empty() && !_cmdSocket.isDead()
+            && _cmdSocket.queuedMessages() + state->chunkReads < minidrive::TRANSFER_WINDOW) {
+        size_t index = state->nextDownload++ % downloads.size();
+        auto transfer = downloads[index];
+        auto offset = transfer->finished() ? std::nullopt : transfer->nextChunk();
+        if (!offset) {
+            downloads.erase(downloads.begin() + static_cast<std::ptrdiff_t>(index));
+            continue;
+        }
+        // a cached chunk may be loading for another session, it is waited for without blocking
+        if (!fileIo.available() && !transfer->cached()) {
+            MsgPayload frame;
+            if (!transfer->readChunk(*offset, frame)) continue;
+            MsgPayload packed;
+            if (_compression && minidrive::compressChunkFrame(frame.data(), frame.size(), packed)) frame = std::move(packed);
+            _cmdSocket.sendFrame(std::move(frame), transfer->id());
+            continue;
+        }
+        // read straight into a registered buffer when one is free
+        size_t size = transfer->frameSize(*offset);
+        std::shared_ptr<uint8_t> frame = fileIo.acquireBuffer();
+        if (!frame) frame = std::shared_ptr<uint8_t>(new uint8_t[size], std::default_delete<uint8_t[]>());
+        ++state->chunkReads;
+        ++_pendingOps;
+        transfer->readChunk(fileIo, *offset, frame.get(), [this, state, frame, size, id = transfer->id()](const minidrive::error_code &err) {
+            MsgPayload packed;
+            if (!err && _compression && minidrive::compressChunkFrame(frame.get(), size, packed)) {
+                _cmdSocket.sendFrame(std::move(packed), id);
+            } else if (!err) {
+                _cmdSocket.sendFrame(frame, size, id);
+            }
+            {
+                std::lock_guard g(state->pumpMutex);
+                --state->chunkReads;
+            }
+            _pumpDownloads();
+            _endPendingOp();
+        });
     }
 }
 
 
 json Session::makeOkReply(const std::string &msg, const json &data) {
-    json reply = { {"status", "OK"}, {"code", minidrive::error::SUCCESS.code()}, {"message", msg}, {"data", data}, {"uwd", _uwd.string()}};
+    json reply = { {"status", "OK"}, {"code", minidrive::error::SUCCESS.code()}, {"message", msg}, {"data", data}, {"uwd", _uwd}};
     return reply;
 }
 
@@ -124,11 +427,24 @@ json Session::makeFailReply(uint32_t code, const std::string &msg) {
     return reply;
 }
 
+json Session::makeFailReply(const minidrive::error_code &err, const std::string &msg) {
+    return makeFailReply(err.code(), msg);
+}
+
+void Session::sendReply(const json &reply) {
+    _cmdSocket.sendMessage(reply.dump());
+}
+
+void Session::sendEvent(const std::string &event, json reply) {
+    reply["event"] = event;
+    sendReply(reply);
+}
+
 void Session::sendOkReply(const std::string &msg, const json &data) {
-    _cmdSocket.sendMessage(makeOkReply(msg, data).dump());
+    sendReply(makeOkReply(msg, data));
 }
 
 void Session::sendFailReply(uint32_t code, const std::string &msg) {
-    _cmdSocket.sendMessage(makeFailReply(code, msg).dump());
+    sendReply(makeFailReply(code, msg));
 }
 
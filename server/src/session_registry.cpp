@@ -0,0 +1,81 @@
+#include "session_registry.hpp"
+#include <string>
+#include <vector>
+#include <memory>
+#include "session.hpp"
+
+void SessionRegistry::add(uint64_t id, std::shared_ptr<Session> session) {
+    auto &shard = _shard(id);
+    std::lock_guard g(shard.mutex);
+    if (shard.sessions.emplace(id, std::move(session)).second) ++_size;
+}
+
+std::shared_ptr<Session> SessionRegistry::remove(uint64_t id) {
+    std::shared_ptr<Session> session;
+    std::string username;
+    {
+        auto &shard = _shard(id);
+        std::lock_guard g(shard.mutex);
+        auto it = shard.sessions.find(id);
+        if (it == shard.sessions.end()) return nullptr;
+        session = std::move(it->second);
+        shard.sessions.erase(it);
+        --_size;
+        auto user = shard.users.find(id);
+        if (user != shard.users.end()) {
+            username = std::move(user->second);
+            shard.users.erase(user);
+        }
+    }
+    if (!username.empty()) {
+        auto &shard = _userShard(username);
+        std::lock_guard g(shard.mutex);
+        auto it = shard.sessions.find(username);
+        if (it != shard.sessions.end()) {
+            it->second.erase(id);
+            if (it->second.empty()) shard.sessions.erase(it);
+        }
+    }
+    return session;
+}
+
+std::shared_ptr<Session> SessionRegistry::find(uint64_t id) {
+    auto &shard = _shard(id);
+    std::lock_guard g(shard.mutex);
+    auto it = shard.sessions.find(id);
+    return it == shard.sessions.end() ? nullptr : it->second;
+}
+
+void SessionRegistry::setUser(uint64_t id, const std::string &username) {
+    std::weak_ptr<Session> session;
+    {
+        auto &shard = _shard(id);
+        std::lock_guard g(shard.mutex);
+        auto it = shard.sessions.find(id);
+        if (it == shard.sessions.end()) return;
+        session = it->second;
+        shard.users[id] = username;
+    }
+    auto &shard = _userShard(username);
+    std::lock_guard g(shard.mutex);
+    shard.sessions[username][id] = std::move(session);
+}
+
+std::vector<std::shared_ptr<Session>> SessionRegistry::forUser(const std::string &username) {
+    std::vector<std::shared_ptr<Session>> result;
+    auto &shard = _userShard(username);
+    std::lock_guard g(shard.mutex);
+    auto it = shard.sessions.find(username);
+    if (it == shard.sessions.end()) return result;
+    // an entry can outlive its session when setUser() races with remove()
+    for (auto entry = it->second.begin(); entry != it->second.end();) {
+        if (auto session = entry->second.lock()) {
+            result.push_back(std::move(session));
+            ++entry;
+        } else {
+            entry = it->second.erase(entry);
+        }
+    }
+    if (it->second.empty()) shard.sessions.erase(it);
+    return result;
+}
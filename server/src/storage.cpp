@@ -0,0 +1,9 @@
+#include "storage.hpp"
+#include "storage_posix.hpp"
+#include "storage_memory.hpp"
+
+std::unique_ptr<StorageEngine> StorageEngine::create(std::string_view name) {
+    if (name == "posix") return std::make_unique<PosixStorage>();
+    if (name == "memory") return std::make_unique<MemoryStorage>();
+    return nullptr;
+}
@@ -0,0 +1,400 @@
+#include "storage_memory.hpp"
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <spdlog/spdlog.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// a descriptor of its own for a memfd, with the access mode asked for where /proc allows reopening it
+int reopen(int fd, int flags) {
+    std::string proc = "/proc/self/fd/" + std::to_string(fd);
+    int opened = ::open(proc.c_str(), flags | O_CLOEXEC);
+    if (opened >= 0) return opened;
+    return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+}
+
+timespec now() {
+    timespec ts{};
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts;
+}
+
+} // namespace
+
+
+MemoryStorage::Node::~Node() {
+    if (fd >= 0) close(fd);
+}
+
+bool MemoryStorage::createRoot(const fs::path &path) {
+    std::unique_lock lock(_mutex);
+    auto [it, created] = _roots.try_emplace(path.string());
+    if (created) {
+        it->second = std::make_unique<Root>();
+        Node &top = it->second->top;
+        top.dir = true;
+        top.mode = 0755;
+        top.ino = _nextIno++;
+        top.mtime = now();
+    }
+    return true;
+}
+
+std::shared_ptr<RootDir> MemoryStorage::openRoot(const fs::path &path) {
+    std::shared_lock lock(_mutex);
+    if (_roots.count(path.string()) == 0) {
+        spdlog::error("no root {} in memory", path.string());
+        errno = ENOENT;
+        return nullptr;
+    }
+    return std::make_shared<RootDir>(*this, path);
+}
+
+std::vector<fs::path> MemoryStorage::roots(const fs::path &parent) {
+    std::shared_lock lock(_mutex);
+    std::vector<fs::path> result;
+    for (const auto &[key, root] : _roots) {
+        fs::path path(key);
+        if (path.parent_path() == parent) result.push_back(std::move(path));
+    }
+    return result;
+}
+
+int MemoryStorage::openParent(const RootDir &root, const fs::path &rel, int &fd) {
+    fd = -1;
+    std::shared_lock lock(_mutex);
+    Node *node = _find(root, rel);
+    if (!node) return errno;
+    return node->dir ? 0 : ENOTDIR;
+}
+
+FsEntry MemoryStorage::stat(const ResolvedPath &path) {
+    std::shared_lock lock(_mutex);
+    if (!path.valid()) return FsEntry();
+    Node *node = path.isRoot() ? _find(*path.root(), {}) : _parent(path);
+    if (node && !path.isRoot()) {
+        auto it = node->children.find(path.name());
+        node = it == node->children.end() ? nullptr : it->second.get();
+    }
+    return node ? _entry(*node) : FsEntry();
+}
+
+bool MemoryStorage::list(const RootDir &root, const fs::path &rel, std::vector<DirEntry> &entries, bool details) {
+    std::shared_lock lock(_mutex);
+    Node *dir = _find(root, rel);
+    if (!dir) return false;
+    if (!dir->dir) {
+        errno = ENOTDIR;
+        return false;
+    }
+    entries.reserve(entries.size() + dir->children.size());
+    for (const auto &[name, child] : dir->children) {
+        DirEntry entry{name, {}};
+        if (details) entry.entry = _entry(*child);
+        else entry.entry.type = child->dir ? fs::file_type::directory : fs::file_type::regular;
+        entries.push_back(std::move(entry));
+    }
+    return true;
+}
+
+bool MemoryStorage::createDir(const ResolvedPath &path, mode_t mode) {
+    std::unique_lock lock(_mutex);
+    Node *parent = _parent(path);
+    if (!parent) return false;
+    auto [it, created] = parent->children.try_emplace(path.name());
+    if (!created) {
+        errno = EEXIST;
+        return false;
+    }
+    it->second = _makeDir(mode);
+    return true;
+}
+
+bool MemoryStorage::setMode(const ResolvedPath &path, mode_t mode) {
+    std::unique_lock lock(_mutex);
+    Node *parent = _parent(path);
+    if (!parent) return false;
+    auto it = parent->children.find(path.name());
+    if (it == parent->children.end()) {
+        errno = ENOENT;
+        return false;
+    }
+    if (!it->second->dir) return fchmod(it->second->fd, mode) == 0;
+    it->second->mode = mode;
+    return true;
+}
+
+bool MemoryStorage::remove(const ResolvedPath &path, FsEntry &removed) {
+    std::unique_ptr<Node> node;
+    {
+        std::unique_lock lock(_mutex);
+        Node *parent = _parent(path);
+        if (!parent) return false;
+        auto it = parent->children.find(path.name());
+        if (it == parent->children.end()) {
+            errno = ENOENT;
+            return false;
+        }
+        if (it->second->dir) {
+            errno = EISDIR;
+            return false;
+        }
+        removed = _entry(*it->second);
+        node = std::move(it->second);
+        parent->children.erase(it);
+    }
+    // open transfers keep the data until they close their descriptors
+    return true;
+}
+
+bool MemoryStorage::removeDir(const ResolvedPath &path) {
+    std::unique_ptr<Node> node;
+    int64_t bytes = 0;
+    int64_t files = 0;
+    {
+        std::unique_lock lock(_mutex);
+        Node *parent = _parent(path);
+        Root *root = parent ? _root(*path.root()) : nullptr;
+        if (!root) return false;
+        auto it = parent->children.find(path.name());
+        if (it == parent->children.end()) {
+            errno = ENOENT;
+            return false;
+        }
+        if (!it->second->dir) {
+            errno = ENOTDIR;
+            return false;
+        }
+        node = std::move(it->second);
+        parent->children.erase(it);
+        std::vector<uint64_t> inos;
+        _collect(*node, bytes, files, inos);
+        for (uint64_t ino : inos) root->trees.erase(ino);
+    }
+    // freed right away, there is no trash to reap
+    node.reset();
+    if (_freedHandler && files > 0) _freedHandler(path.root()->path(), bytes, files);
+    return true;
+}
+
+bool MemoryStorage::move(const ResolvedPath &src, const ResolvedPath &dst) {
+    std::unique_lock lock(_mutex);
+    Node *srcParent = _parent(src);
+    Node *dstParent = srcParent ? _parent(dst) : nullptr;
+    if (!dstParent) return false;
+    auto it = srcParent->children.find(src.name());
+    if (src.isRoot() || it == srcParent->children.end()) {
+        errno = src.isRoot() ? EBUSY : ENOENT;
+        return false;
+    }
+    if (dstParent->children.count(dst.name()) != 0) {
+        errno = EEXIST;
+        return false;
+    }
+    // like rename(), a directory can't move below itself
+    auto [mismatch, _] = std::mismatch(src.rel().begin(), src.rel().end(), dst.rel().begin(), dst.rel().end());
+    if (it->second->dir && mismatch == src.rel().end() && src.root()->path() == dst.root()->path()) {
+        errno = EINVAL;
+        return false;
+    }
+    auto node = std::move(it->second);
+    srcParent->children.erase(it);
+    dstParent->children.emplace(dst.name(), std::move(node));
+    return true;
+}
+
+bool MemoryStorage::copyLink(const ResolvedPath &, const ResolvedPath &) {
+    errno = EOPNOTSUPP;
+    return false;
+}
+
+int MemoryStorage::open(const ResolvedPath &path, int flags) {
+    std::shared_lock lock(_mutex);
+    Node *parent = _parent(path);
+    if (!parent) return -1;
+    auto it = parent->children.find(path.name());
+    if (it == parent->children.end()) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (it->second->dir) {
+        errno = EISDIR;
+        return -1;
+    }
+    return reopen(it->second->fd, flags);
+}
+
+int MemoryStorage::createFile(const ResolvedPath &path, mode_t mode) {
+    std::unique_lock lock(_mutex);
+    Node *parent = _parent(path);
+    if (!parent) return -1;
+    if (parent->children.count(path.name()) != 0) {
+        errno = EEXIST;
+        return -1;
+    }
+    int fd = memfd_create("minidrive", MFD_CLOEXEC);
+    if (fd < 0) return -1;
+    fchmod(fd, mode);
+    int own = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (own < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    parent->children.emplace(path.name(), _makeFile(own));
+    return fd;
+}
+
+int MemoryStorage::createTemporary(const ResolvedPath &target, uint32_t, std::string &tmpName) {
+    tmpName.clear();
+    {
+        // fail like the disk would for a directory that went away
+        std::shared_lock lock(_mutex);
+        if (!_parent(target)) return -1;
+    }
+    int fd = memfd_create("minidrive", MFD_CLOEXEC);
+    if (fd >= 0) fchmod(fd, 0644);
+    return fd;
+}
+
+int MemoryStorage::publish(int fd, const ResolvedPath &target, const std::string &) {
+    std::unique_lock lock(_mutex);
+    Node *parent = _parent(target);
+    if (!parent) return errno;
+    if (parent->children.count(target.name()) != 0) return EEXIST;
+    int own = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (own < 0) return errno;
+    parent->children.emplace(target.name(), _makeFile(own));
+    return 0;
+}
+
+void MemoryStorage::discard(const ResolvedPath &, const std::string &) {
+    // an unpublished memfd is gone with its descriptor
+}
+
+bool MemoryStorage::loadTree(const RootDir &root, uint64_t ino, std::string &data) {
+    std::shared_lock lock(_mutex);
+    Root *found = _root(root);
+    if (!found) return false;
+    auto it = found->trees.find(ino);
+    if (it == found->trees.end()) return false;
+    data = it->second;
+    return true;
+}
+
+bool MemoryStorage::storeTree(const RootDir &root, uint64_t ino, const std::string &data) {
+    std::unique_lock lock(_mutex);
+    Root *found = _root(root);
+    if (!found) return false;
+    found->trees[ino] = data;
+    return true;
+}
+
+void MemoryStorage::removeTree(const RootDir &root, uint64_t ino) {
+    std::unique_lock lock(_mutex);
+    if (Root *found = _root(root)) found->trees.erase(ino);
+}
+
+std::unique_ptr<MemoryStorage::Node> MemoryStorage::_makeDir(mode_t mode) {
+    auto node = std::make_unique<Node>();
+    node->dir = true;
+    node->mode = mode & 07777;
+    node->ino = _nextIno++;
+    node->mtime = now();
+    return node;
+}
+
+std::unique_ptr<MemoryStorage::Node> MemoryStorage::_makeFile(int fd) {
+    auto node = std::make_unique<Node>();
+    node->fd = fd;
+    return node;
+}
+
+MemoryStorage::Root* MemoryStorage::_root(const RootDir &root) {
+    auto it = _roots.find(root.path().string());
+    if (it == _roots.end()) {
+        errno = ENOENT;
+        return nullptr;
+    }
+    return it->second.get();
+}
+
+MemoryStorage::Node* MemoryStorage::_find(const RootDir &root, const fs::path &rel) {
+    Root *found = _root(root);
+    if (!found) return nullptr;
+    Node *node = &found->top;
+    for (const auto &part : rel) {
+        if (!node->dir) {
+            errno = ENOTDIR;
+            return nullptr;
+        }
+        auto it = node->children.find(part.native());
+        if (it == node->children.end()) {
+            errno = ENOENT;
+            return nullptr;
+        }
+        node = it->second.get();
+    }
+    return node;
+}
+
+MemoryStorage::Node* MemoryStorage::_parent(const ResolvedPath &path) {
+    if (!path.root()) {
+        errno = EBADF;
+        return nullptr;
+    }
+    Node *parent = _find(*path.root(), path.rel().parent_path());
+    if (parent && !parent->dir) {
+        errno = ENOTDIR;
+        return nullptr;
+    }
+    return parent;
+}
+
+FsEntry MemoryStorage::_entry(const Node &node) {
+    FsEntry entry;
+    entry.links = 1;
+    if (node.dir) {
+        entry.type = fs::file_type::directory;
+        entry.ino = node.ino;
+        entry.mode = static_cast<uint32_t>(node.mode);
+        entry.mtime = node.mtime;
+        return entry;
+    }
+    struct stat st;
+    if (fstat(node.fd, &st) != 0) {
+        entry.type = fs::file_type::none;
+        return entry;
+    }
+    entry.type = fs::file_type::regular;
+    entry.size = static_cast<uintmax_t>(st.st_size);
+    entry.dev = static_cast<uint64_t>(st.st_dev);
+    entry.ino = static_cast<uint64_t>(st.st_ino);
+    entry.mode = static_cast<uint32_t>(st.st_mode & 07777);
+    entry.mtime = st.st_mtim;
+    return entry;
+}
+
+void MemoryStorage::_collect(const Node &node, int64_t &bytes, int64_t &files, std::vector<uint64_t> &inos) {
+    for (const auto &[name, child] : node.children) {
+        if (child->dir) {
+            _collect(*child, bytes, files, inos);
+            continue;
+        }
+        FsEntry entry = _entry(*child);
+        bytes += static_cast<int64_t>(entry.size);
+        ++files;
+        inos.push_back(entry.ino);
+    }
+}
@@ -0,0 +1,387 @@
+#include "storage_posix.hpp"
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/openat2.h>
+#endif
+#include <sodium.h>
+#include <spdlog/spdlog.h>
+#include "globals.hpp"
+#include "transfer.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// readable rather than O_PATH, a commit fsyncs the directory through it
+constexpr int DIR_HANDLE_FLAGS = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+
+// opens rel below dirfd, the kernel refuses to resolve outside of dirfd (symlinks, ..)
+// where openat2() is available, otherwise we rely on the lexical check of fs_resolveRelative()
+int openBeneath(int dirfd, const fs::path &rel, int flags) {
+#ifdef SYS_openat2
+    static std::atomic<bool> openat2Supported = true;
+    if (openat2Supported) {
+        open_how how{};
+        how.flags = static_cast<__u64>(flags);
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        int fd = static_cast<int>(syscall(SYS_openat2, dirfd, rel.c_str(), &how, sizeof(how)));
+        if (fd >= 0 || errno != ENOSYS) return fd;
+        spdlog::warn("openat2() is not supported, falling back to openat()");
+        openat2Supported = false;
+    }
+#endif
+    return openat(dirfd, rel.c_str(), flags);
+}
+
+fs::file_type modeToType(mode_t mode) {
+    if (S_ISREG(mode)) return fs::file_type::regular;
+    if (S_ISDIR(mode)) return fs::file_type::directory;
+    if (S_ISLNK(mode)) return fs::file_type::symlink;
+    if (S_ISBLK(mode)) return fs::file_type::block;
+    if (S_ISCHR(mode)) return fs::file_type::character;
+    if (S_ISFIFO(mode)) return fs::file_type::fifo;
+    if (S_ISSOCK(mode)) return fs::file_type::socket;
+    return fs::file_type::unknown;
+}
+
+FsEntry entryOf(const struct stat &st) {
+    FsEntry entry;
+    entry.type = modeToType(st.st_mode);
+    entry.size = static_cast<uintmax_t>(st.st_size);
+    entry.dev = static_cast<uint64_t>(st.st_dev);
+    entry.ino = static_cast<uint64_t>(st.st_ino);
+    entry.links = static_cast<uint64_t>(st.st_nlink);
+    entry.mode = static_cast<uint32_t>(st.st_mode & 07777);
+#ifdef __APPLE__
+    entry.mtime = st.st_mtimespec;
+#else
+    entry.mtime = st.st_mtim;
+#endif
+    return entry;
+}
+
+bool writeAll(int fd, const char *data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, data + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+int openTrees(const RootDir &root) {
+    if (mkdirat(root.fd(), TREES_DIR.c_str(), 0700) != 0 && errno != EEXIST) return -1;
+    return openat(root.fd(), TREES_DIR.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+// deletes the directory `name` below dirFd and everything in it without leaving dirFd or following
+// symlinks, adding up the regular files it unlinked and dropping their hash trees from treesFd
+bool removeBeneath(int dirFd, const char *name, int treesFd, int64_t &bytes, int64_t &files) {
+    int fd = openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : nullptr;
+    if (!dir) {
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    bool removed = true;
+    while (dirent *entry = readdir(dir)) {
+        std::string_view entryName = entry->d_name;
+        if (entryName == "." || entryName == "..") continue;
+        struct stat st;
+        bool regular = fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode);
+        if (unlinkat(dirfd(dir), entry->d_name, 0) == 0) {
+            if (regular) {
+                bytes += static_cast<int64_t>(st.st_size);
+                ++files;
+                if (st.st_nlink == 1 && treesFd >= 0) unlinkat(treesFd, std::to_string(st.st_ino).c_str(), 0);
+            }
+            continue;
+        }
+        if (errno == ENOENT) continue;
+        if ((errno != EISDIR && errno != EPERM) || !removeBeneath(dirfd(dir), entry->d_name, treesFd, bytes, files)) {
+            spdlog::warn("removeDir(): {}: {}", entryName, std::strerror(errno));
+            removed = false;
+        }
+    }
+    closedir(dir);
+    return removed && unlinkat(dirFd, name, AT_REMOVEDIR) == 0;
+}
+
+// unlinks the hidden files of uploads a crash left in dirFd and below it, closes dirFd
+void removeTemporaries(int dirFd, bool top) {
+    DIR *dir = fdopendir(dirFd);
+    if (!dir) {
+        close(dirFd);
+        return;
+    }
+    while (dirent *entry = readdir(dir)) {
+        std::string_view name = entry->d_name;
+        if (name == "." || name == ".." || (top && (name == TRASH_DIR || name == TREES_DIR))) continue;
+        if (Transfer::isTemporaryName(name)) {
+            if (unlinkat(dirfd(dir), entry->d_name, 0) == 0) spdlog::info("removed unfinished upload {}", name);
+            continue;
+        }
+        struct stat st;
+        bool directory = entry->d_type == DT_DIR || (entry->d_type == DT_UNKNOWN
+            && fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode));
+        if (!directory) continue;
+        int sub = openat(dirfd(dir), entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (sub >= 0) removeTemporaries(sub, false);
+    }
+    closedir(dir);
+}
+
+} // namespace
+
+
+void PosixStorage::start() {
+    _reaper.setFreedHandler(_freedHandler);
+    _reaper.start();
+}
+
+void PosixStorage::stop() {
+    _reaper.stop();
+}
+
+bool PosixStorage::createRoot(const fs::path &path) {
+    std::error_code ec;
+    if (fs::is_directory(path, ec)) return true;
+    spdlog::info("creating directory {}", path.string());
+    fs::create_directories(path, ec);
+    if (ec) spdlog::error("create_directories: {}", ec.message());
+    return fs::is_directory(path, ec);
+}
+
+std::shared_ptr<RootDir> PosixStorage::openRoot(const fs::path &path) {
+    int fd = ::open(path.c_str(), DIR_HANDLE_FLAGS);
+    if (fd < 0) {
+        spdlog::error("could not open root directory {}: {}", path.string(), std::strerror(errno));
+        return nullptr;
+    }
+    return std::make_shared<RootDir>(*this, path, fd);
+}
+
+std::vector<fs::path> PosixStorage::roots(const fs::path &parent) {
+    std::vector<fs::path> result;
+    std::error_code ec;
+    for (const auto &entry : fs::directory_iterator(parent, ec)) {
+        if (entry.is_directory(ec)) result.push_back(entry.path());
+    }
+    return result;
+}
+
+void PosixStorage::recover(const fs::path &root) {
+    std::error_code ec;
+    if (fs::exists(root / TRASH_DIR, ec)) _reaper.reclaim(root);
+    // without O_TMPFILE uploads are written under a hidden name, nothing commits them after a restart
+    int fd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) removeTemporaries(fd, true);
+}
+
+int PosixStorage::openParent(const RootDir &root, const fs::path &rel, int &fd) {
+    fd = openBeneath(root.fd(), rel, DIR_HANDLE_FLAGS);
+    return fd < 0 ? errno : 0;
+}
+
+FsEntry PosixStorage::stat(const ResolvedPath &path) {
+    FsEntry entry;
+    if (!path.valid()) return entry;
+    struct stat st;
+    if (fstatat(path.parentFd(), path.name().c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        if (errno != ENOENT && errno != ENOTDIR) {
+            spdlog::error("fstatat({}): {}", path.rel().string(), std::strerror(errno));
+            entry.type = fs::file_type::none;
+        }
+        return entry;
+    }
+    return entryOf(st);
+}
+
+bool PosixStorage::list(const RootDir &root, const fs::path &rel, std::vector<DirEntry> &entries, bool details) {
+    int fd = rel.empty() ? openat(root.fd(), ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+        : openBeneath(root.fd(), rel, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : nullptr;
+    if (!dir) {
+        int err = errno;
+        if (fd >= 0) close(fd);
+        errno = err;
+        return false;
+    }
+    while (dirent *entry = readdir(dir)) {
+        std::string_view name = entry->d_name;
+        if (name == "." || name == "..") continue;
+        DirEntry listed{std::string(name), {}};
+        if (details || entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            // gone since readdir
+            if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+            listed.entry = entryOf(st);
+        } else {
+            listed.entry.type = entry->d_type == DT_DIR ? fs::file_type::directory
+                : entry->d_type == DT_REG ? fs::file_type::regular
+                : entry->d_type == DT_LNK ? fs::file_type::symlink : fs::file_type::unknown;
+        }
+        entries.push_back(std::move(listed));
+    }
+    closedir(dir);
+    return true;
+}
+
+bool PosixStorage::createDir(const ResolvedPath &path, mode_t mode) {
+    return mkdirat(path.parentFd(), path.name().c_str(), mode) == 0;
+}
+
+bool PosixStorage::setMode(const ResolvedPath &path, mode_t mode) {
+    return fchmodat(path.parentFd(), path.name().c_str(), mode, 0) == 0;
+}
+
+bool PosixStorage::remove(const ResolvedPath &path, FsEntry &removed) {
+    struct stat st;
+    if (fstatat(path.parentFd(), path.name().c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0) removed = entryOf(st);
+    return unlinkat(path.parentFd(), path.name().c_str(), 0) == 0;
+}
+
+bool PosixStorage::removeDir(const ResolvedPath &path) {
+    if (_reaper.moveToTrash(path)) return true;
+    if (errno != EXDEV) {
+        spdlog::error("removeDir(): {}", std::strerror(errno));
+        return false;
+    }
+    // a mount point can't be renamed into the trash, delete it in place
+    int64_t bytes = 0, files = 0;
+    int treesFd = openat(path.root()->fd(), TREES_DIR.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    bool removed = removeBeneath(path.parentFd(), path.name().c_str(), treesFd, bytes, files);
+    if (!removed) spdlog::error("removeDir(): {}", std::strerror(errno));
+    if (treesFd >= 0) close(treesFd);
+    if ((bytes != 0 || files != 0) && _freedHandler) _freedHandler(path.root()->path(), bytes, files);
+    return removed;
+}
+
+bool PosixStorage::move(const ResolvedPath &src, const ResolvedPath &dst) {
+#ifdef RENAME_NOREPLACE
+    if (renameat2(src.parentFd(), src.name().c_str(), dst.parentFd(), dst.name().c_str(), RENAME_NOREPLACE) == 0) {
+        return true;
+    }
+    if (errno != EINVAL) return false;
+#endif
+    // no RENAME_NOREPLACE on this filesystem, the caller already checked dst doesn't exist
+    return renameat(src.parentFd(), src.name().c_str(), dst.parentFd(), dst.name().c_str()) == 0;
+}
+
+bool PosixStorage::copyLink(const ResolvedPath &src, const ResolvedPath &dst) {
+    struct stat st;
+    if (fstatat(src.parentFd(), src.name().c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) return false;
+    std::vector<char> target(static_cast<size_t>(st.st_size) + 1);
+    ssize_t n = readlinkat(src.parentFd(), src.name().c_str(), target.data(), target.size() - 1);
+    if (n < 0) return false;
+    target[static_cast<size_t>(n)] = '\0';
+    return symlinkat(target.data(), dst.parentFd(), dst.name().c_str()) == 0;
+}
+
+int PosixStorage::open(const ResolvedPath &path, int flags) {
+    return openat(path.parentFd(), path.name().c_str(), flags | O_NOFOLLOW | O_CLOEXEC);
+}
+
+int PosixStorage::createFile(const ResolvedPath &path, mode_t mode) {
+    return openat(path.parentFd(), path.name().c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, mode);
+}
+
+int PosixStorage::createTemporary(const ResolvedPath &target, uint32_t id, std::string &tmpName) {
+    tmpName.clear();
+#ifdef O_TMPFILE
+    // no reader sees the file before it is linked, and a crash leaves nothing behind
+    int fd = openat(target.parentFd(), ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0666);
+    if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)) return fd;
+#endif
+    tmpName = Transfer::temporaryName(target.name(), id);
+    return openat(target.parentFd(), tmpName.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0666);
+}
+
+int PosixStorage::publish(int fd, const ResolvedPath &target, const std::string &tmpName) {
+    // never replace a file that appeared while we were uploading, linkat fails when the target exists
+    if (tmpName.empty()) {
+        if (linkat(fd, "", target.parentFd(), target.name().c_str(), AT_EMPTY_PATH) == 0) return 0;
+        // AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH, the descriptor's link in /proc does without
+        if (errno != ENOENT) return errno;
+        std::string proc = "/proc/self/fd/" + std::to_string(fd);
+        return linkat(AT_FDCWD, proc.c_str(), target.parentFd(), target.name().c_str(), AT_SYMLINK_FOLLOW) == 0 ? 0 : errno;
+    }
+#ifdef RENAME_NOREPLACE
+    if (renameat2(target.parentFd(), tmpName.c_str(), target.parentFd(), target.name().c_str(), RENAME_NOREPLACE) == 0) {
+        return 0;
+    }
+    if (errno != EINVAL) return errno;
+#endif
+    if (linkat(target.parentFd(), tmpName.c_str(), target.parentFd(), target.name().c_str(), 0) != 0) return errno;
+    unlinkat(target.parentFd(), tmpName.c_str(), 0);
+    return 0;
+}
+
+void PosixStorage::discard(const ResolvedPath &target, const std::string &tmpName) {
+    if (!tmpName.empty()) unlinkat(target.parentFd(), tmpName.c_str(), 0);
+}
+
+bool PosixStorage::loadTree(const RootDir &root, uint64_t ino, std::string &data) {
+    int dirFd = openat(root.fd(), TREES_DIR.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dirFd < 0) return false;
+    int fd = openat(dirFd, std::to_string(ino).c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    close(dirFd);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    data.resize(static_cast<size_t>(st.st_size));
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = pread(fd, data.data() + done, data.size() - done, static_cast<off_t>(done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += static_cast<size_t>(n);
+    }
+    close(fd);
+    return done == data.size();
+}
+
+bool PosixStorage::storeTree(const RootDir &root, uint64_t ino, const std::string &data) {
+    int dirFd = openTrees(root);
+    if (dirFd < 0) return false;
+    // written aside and renamed over the old tree, readers see one or the other
+    std::string name = std::to_string(ino);
+    std::string tmpName = name + "." + std::to_string(randombytes_random());
+    int fd = openat(dirFd, tmpName.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        int err = errno;
+        close(dirFd);
+        errno = err;
+        return false;
+    }
+    bool ok = writeAll(fd, data.data(), data.size());
+    close(fd);
+    ok = ok && renameat(dirFd, tmpName.c_str(), dirFd, name.c_str()) == 0;
+    int err = errno;
+    if (!ok) unlinkat(dirFd, tmpName.c_str(), 0);
+    close(dirFd);
+    errno = err;
+    return ok;
+}
+
+void PosixStorage::removeTree(const RootDir &root, uint64_t ino) {
+    int dirFd = openat(root.fd(), TREES_DIR.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dirFd < 0) return;
+    unlinkat(dirFd, std::to_string(ino).c_str(), 0);
+    close(dirFd);
+}
@@ -0,0 +1,74 @@
+#include "timer_wheel.hpp"
+#include <asio.hpp>
+#include <vector>
+#include <algorithm>
+#include <spdlog/spdlog.h>
+
+TimerWheel::TimerWheel(asio::io_context &io, std::chrono::milliseconds tick)
+    : _timer(io), _tickLength(tick), _now(0), _running(false) {
+
+}
+
+void TimerWheel::start() {
+    std::lock_guard g(_mutex);
+    if (_running) return;
+    _running = true;
+    _nextTick = std::chrono::steady_clock::now() + _tickLength;
+    _arm();
+}
+
+void TimerWheel::stop() {
+    std::lock_guard g(_mutex);
+    _running = false;
+    _timer.cancel();
+}
+
+void TimerWheel::schedule(std::chrono::milliseconds delay, Callback callback) {
+    auto ticks = static_cast<uint64_t>((std::max(delay.count(), int64_t(0)) + _tickLength.count() - 1) / _tickLength.count());
+    std::lock_guard g(_mutex);
+    _insert(Entry{_now + std::clamp<uint64_t>(ticks, 1, MAX_TICKS), std::move(callback)});
+}
+
+void TimerWheel::_insert(Entry &&entry) {
+    uint64_t delta = entry.deadline > _now ? entry.deadline - _now : 0;
+    unsigned level = 0;
+    while (level + 1 < LEVELS && delta >= (uint64_t(1) << (SLOT_BITS * (level + 1)))) ++level;
+    auto slot = static_cast<size_t>((entry.deadline >> (SLOT_BITS * level)) & (SLOTS - 1));
+    _slots[level][slot].push_back(std::move(entry));
+}
+
+void TimerWheel::_arm() {
+    _timer.expires_at(_nextTick);
+    _timer.async_wait([this](const asio::error_code &ec) {
+        if (ec) return;
+        std::vector<Callback> due;
+        {
+            std::lock_guard g(_mutex);
+            if (!_running) return;
+            // catch up on ticks missed while the io threads were busy
+            auto now = std::chrono::steady_clock::now();
+            while (_nextTick <= now) {
+                _advance(due);
+                _nextTick += _tickLength;
+            }
+            _arm();
+        }
+        for (auto &callback : due) callback();
+    });
+}
+
+void TimerWheel::_advance(std::vector<Callback> &due) {
+    ++_now;
+    // when a lower level wraps around, the next slot of the level above moves down
+    unsigned top = 0;
+    while (top + 1 < LEVELS && (_now & ((uint64_t(1) << (SLOT_BITS * (top + 1))) - 1)) == 0) ++top;
+    for (unsigned level = top; level > 0; --level) {
+        auto slot = static_cast<size_t>((_now >> (SLOT_BITS * level)) & (SLOTS - 1));
+        auto entries = std::move(_slots[level][slot]);
+        _slots[level][slot].clear();
+        for (auto &entry : entries) _insert(std::move(entry));
+    }
+    auto &current = _slots[0][_now & (SLOTS - 1)];
+    for (auto &entry : current) due.push_back(std::move(entry.callback));
+    current.clear();
+}
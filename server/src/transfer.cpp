@@ -0,0 +1,551 @@
+#include "transfer.hpp"
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <spdlog/spdlog.h>
+#include "minidrive/transfer.hpp"
+#include "hash_tree.hpp"
+#include "storage.hpp"
+
+using minidrive::ChunkHeader;
+namespace error = minidrive::error;
+
+namespace {
+
+constexpr std::string_view TEMPORARY_INFIX = ".minidrive-";
+
+ChunkCache::Key cacheKey(const struct stat &st) {
+    return {static_cast<uint64_t>(st.st_dev), static_cast<uint64_t>(st.st_ino),
+        static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec, 0};
+}
+
+bool preallocate(int fd, uint64_t size, const std::vector<uint64_t> &holes) {
+    if (size == 0) return true;
+    if (!holes.empty()) {
+        // blocks for the runs of data only, the holes stay unallocated
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0) return false;
+#ifdef __linux__
+        uint64_t start = 0;
+        for (size_t i = 0; i <= holes.size(); ++i) {
+            uint64_t end = i < holes.size() ? holes[i] * minidrive::CHUNK_SIZE : size;
+            if (end > start && fallocate(fd, 0, static_cast<off_t>(start), static_cast<off_t>(end - start)) != 0) {
+                return errno == EOPNOTSUPP;
+            }
+            if (i < holes.size()) start = end + minidrive::chunkLength(size, minidrive::CHUNK_SIZE, end);
+        }
+#endif
+        return true;
+    }
+#ifdef __linux__
+    // reserve the blocks up front so striped writes don't fragment the file
+    if (fallocate(fd, 0, 0, static_cast<off_t>(size)) == 0) return true;
+    if (errno != EOPNOTSUPP) return false;
+#endif
+    return ftruncate(fd, static_cast<off_t>(size)) == 0;
+}
+
+} // namespace
+
+
+Transfer::Transfer(uint32_t id, direction dir, ResolvedPath &&path, int fd, uint64_t size)
+    : _id(id), _direction(dir), _inPlace(false), _path(std::move(path)), _token(minidrive::makeTransferToken()), _fd(fd),
+      _size(size), _chunkSize(minidrive::CHUNK_SIZE), _cache(nullptr), _locks(nullptr), _commitSync(nullptr), _receivedCount(0), _nextChunk(0), _partial(false), _damagedCount(0),
+      _hasher(minidrive::chunkCount(size, minidrive::CHUNK_SIZE)), _finished(false), _committed(false) {
+    if (_direction == direction::UPLOAD) {
+        _received.resize(minidrive::chunkCount(_size, _chunkSize));
+    }
+}
+
+Transfer::~Transfer() {
+    // chunks written so far are kept, the tree tells the next repair which ones are still missing
+    if (_inPlace && !_committed && fdatasync(_fd) == 0) _saveTree();
+    if (_fd >= 0) close(_fd);
+    // an anonymous file is gone with its descriptor
+    if (_direction == direction::UPLOAD && !_inPlace && !_committed && !_tmpName.empty() && _path.valid()) {
+        _path.root()->storage().discard(_path, _tmpName);
+    }
+}
+
+std::string Transfer::temporaryName(const std::string &name, uint32_t id) {
+    return "." + name + std::string(TEMPORARY_INFIX) + std::to_string(id);
+}
+
+bool Transfer::isTemporaryName(std::string_view name) {
+    auto infix = name.rfind(TEMPORARY_INFIX);
+    if (name.empty() || name.front() != '.' || infix == std::string_view::npos || infix == 0) return false;
+    auto id = name.substr(infix + TEMPORARY_INFIX.size());
+    return !id.empty() && std::all_of(id.begin(), id.end(), [](char c) {return c >= '0' && c <= '9';});
+}
+
+std::shared_ptr<Transfer> Transfer::createUpload(uint32_t id, ResolvedPath &&target, uint64_t size,
+        const std::vector<uint64_t> &holes, minidrive::error_code &err) {
+    std::string tmpName;
+    int fd = target.root()->storage().createTemporary(target, id, tmpName);
+    if (fd < 0) {
+        spdlog::error("upload: could not create a file for {}: {}", target.rel().string(), std::strerror(errno));
+        err = error::FS_ERROR;
+        return nullptr;
+    }
+    std::shared_ptr<Transfer> transfer(new Transfer(id, direction::UPLOAD, std::move(target), fd, size));
+    transfer->_tmpName = std::move(tmpName);
+    if (!preallocate(fd, size, holes)) {
+        spdlog::error("upload: could not preallocate {}B: {}", size, std::strerror(errno));
+        err = error::FS_ERROR;
+        return nullptr;
+    }
+    for (uint64_t index : holes) {
+        transfer->_received[index] = true;
+        transfer->_hasher.add(index, minidrive::zeroTag(minidrive::chunkLength(size, minidrive::CHUNK_SIZE, index * minidrive::CHUNK_SIZE)));
+        ++transfer->_receivedCount;
+    }
+    err = error::SUCCESS;
+    return transfer;
+}
+
+std::shared_ptr<Transfer> Transfer::createRepair(uint32_t id, ResolvedPath &&target, uint64_t size,
+        const minidrive::MerkleTree &tree, const std::vector<uint64_t> &chunks, minidrive::error_code &err) {
+    uint64_t count = minidrive::chunkCount(size, minidrive::CHUNK_SIZE);
+    std::vector<bool> sent(count);
+    for (uint64_t index : chunks) {
+        if (index >= count) {
+            err = error::INVALID_CHUNK;
+            return nullptr;
+        }
+        sent[index] = true;
+    }
+    int fd = target.root()->storage().open(target, O_WRONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        spdlog::error("repair: could not open {}: {}", target.rel().string(), std::strerror(errno));
+        if (fd >= 0) close(fd);
+        err = error::FS_ERROR;
+        return nullptr;
+    }
+    uint64_t oldSize = static_cast<uint64_t>(st.st_size);
+    // a kept chunk must hold the same bytes before and after the resize
+    for (uint64_t i = 0; i < count; ++i) {
+        if (sent[i]) continue;
+        uint64_t offset = i * minidrive::CHUNK_SIZE;
+        if (offset >= oldSize || i >= tree.leaves().size()
+                || minidrive::chunkLength(oldSize, minidrive::CHUNK_SIZE, offset) != minidrive::chunkLength(size, minidrive::CHUNK_SIZE, offset)) {
+            spdlog::warn("repair: chunk {} of {} changes and must be sent", i, target.rel().string());
+            close(fd);
+            err = error::INVALID_CHUNK;
+            return nullptr;
+        }
+    }
+    std::shared_ptr<Transfer> transfer(new Transfer(id, direction::UPLOAD, std::move(target), fd, size));
+    transfer->_inPlace = true;
+    transfer->_cacheKey = cacheKey(st);
+    for (uint64_t i = 0; i < count; ++i) {
+        if (sent[i]) continue;
+        transfer->_received[i] = true;
+        transfer->_hasher.add(i, tree.leaves()[i]);
+        ++transfer->_receivedCount;
+    }
+    if (oldSize != size && ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        spdlog::error("repair: could not resize {}: {}", transfer->path().rel().string(), std::strerror(errno));
+        err = error::FS_ERROR;
+        return nullptr;
+    }
+    err = error::SUCCESS;
+    return transfer;
+}
+
+std::shared_ptr<Transfer> Transfer::createDownload(uint32_t id, ResolvedPath &&source,
+        minidrive::error_code &err) {
+    int fd = source.root()->storage().open(source, O_RDONLY);
+    if (fd < 0) {
+        spdlog::error("download: could not open {}: {}", source.rel().string(), std::strerror(errno));
+        err = errno == ENOENT ? error::TARGET_NOT_FOUND : error::FS_ERROR;
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        err = error::FS_ERROR;
+        return nullptr;
+    }
+    err = error::SUCCESS;
+    std::shared_ptr<Transfer> transfer(new Transfer(id, direction::DOWNLOAD, std::move(source), fd,
+        static_cast<uint64_t>(st.st_size)));
+    transfer->_cacheKey = cacheKey(st);
+    // chunks in holes are neither read nor sent, the client leaves them as holes too
+    transfer->_holes = minidrive::holeChunks(fd, transfer->_size, transfer->_chunkSize);
+    if (!transfer->_holes.empty()) {
+        for (uint64_t index : transfer->_holes) {
+            transfer->_hasher.add(index, minidrive::zeroTag(minidrive::chunkLength(transfer->_size, transfer->_chunkSize, index * transfer->_chunkSize)));
+        }
+        std::vector<uint64_t> all(minidrive::chunkCount(transfer->_size, transfer->_chunkSize));
+        for (uint64_t i = 0; i < all.size(); ++i) all[i] = i;
+        transfer->setChunks(std::move(all));
+    }
+    return transfer;
+}
+
+bool Transfer::finished() {
+    std::lock_guard g(_mutex);
+    return _finished;
+}
+
+std::string Transfer::hash() {
+    std::lock_guard g(_mutex);
+    return _hasher.hex();
+}
+
+void Transfer::setCompletionHandler(CompletionHandler handler) {
+    std::lock_guard g(_handlerMutex);
+    _completionHandler = std::move(handler);
+}
+
+void Transfer::abort() {
+    std::lock_guard g(_handlerMutex);
+    _completionHandler = nullptr;
+}
+
+void Transfer::begin(UringIo &io) {
+    if (_direction == direction::DOWNLOAD) {
+        if (_size == 0) _complete(error::SUCCESS);
+        return;
+    }
+    {
+        std::lock_guard g(_mutex);
+        if (_receivedCount < _received.size()) return;
+    }
+    _commit(io, [](const minidrive::error_code&) {});
+}
+
+bool Transfer::_validChunk(uint64_t offset, size_t len) {
+    if (offset % _chunkSize != 0 || offset >= _size || len != minidrive::chunkLength(_size, _chunkSize, offset)) {
+        spdlog::warn("transfer {}: invalid chunk at offset {} ({}B)", _id, offset, len);
+        return false;
+    }
+    return true;
+}
+
+bool Transfer::_writeZeros(uint64_t offset, uint32_t len) {
+    if (minidrive::punchHole(_fd, offset, len)) return true;
+    spdlog::error("transfer {}: could not punch a hole at offset {}: {}", _id, offset, std::strerror(errno));
+    _complete(error::FS_ERROR);
+    return false;
+}
+
+minidrive::error_code Transfer::_damaged(uint64_t offset) {
+    unsigned count;
+    {
+        std::lock_guard g(_mutex);
+        count = ++_damagedCount;
+    }
+    spdlog::warn("transfer {}: damaged chunk at offset {}", _id, offset);
+    if (count > minidrive::MAX_RESENDS) {
+        _complete(error::TRANSFER_FAILED);
+        return error::TRANSFER_FAILED;
+    }
+    return error::CORRUPT_CHUNK;
+}
+
+bool Transfer::_markReceived(size_t index, const minidrive::ChunkTag &tag) {
+    std::lock_guard g(_mutex);
+    if (_finished || _received[index]) return false;
+    _received[index] = true;
+    _hasher.add(index, tag);
+    return ++_receivedCount == _received.size();
+}
+
+minidrive::error_code Transfer::writeChunk(UringIo &io, const ChunkHeader &header, const uint8_t *data, size_t len) {
+    uint64_t offset = header.offset;
+    // a header without data stands for a chunk of zeros
+    bool sentZeros = len == 0 && offset < _size;
+    if (sentZeros) len = minidrive::chunkLength(_size, _chunkSize, offset);
+    if (!_validChunk(offset, len)) return error::INVALID_CHUNK;
+    size_t index = offset / _chunkSize;
+    {
+        std::lock_guard g(_mutex);
+        if (_finished || _received[index]) return error::SUCCESS;
+    }
+    auto tag = sentZeros ? minidrive::zeroTag(static_cast<uint32_t>(len)) : minidrive::chunkTag(data, len);
+    if (tag != header.tag) return _damaged(offset);
+
+    if (sentZeros || minidrive::isZero(data, len)) {
+        if (!_writeZeros(offset, static_cast<uint32_t>(len))) return error::FS_ERROR;
+        if (_markReceived(index, header.tag)) _commit(io, [](const minidrive::error_code&) {});
+        return error::SUCCESS;
+    }
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = pwrite(_fd, data + written, len - written, static_cast<off_t>(offset + written));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            spdlog::error("transfer {}: pwrite: {}", _id, std::strerror(errno));
+            _complete(error::FS_ERROR);
+            return error::FS_ERROR;
+        }
+        written += static_cast<size_t>(n);
+    }
+
+    // last chunk, every other writer already finished its pwrite
+    if (_markReceived(index, header.tag)) _commit(io, [](const minidrive::error_code&) {});
+    return error::SUCCESS;
+}
+
+void Transfer::writeChunk(UringIo &io, std::shared_ptr<MsgPayload> frame, ChunkHandler done) {
+    auto header = ChunkHeader::decode(frame->data());
+    const uint8_t *data = frame->data() + ChunkHeader::SIZE;
+    size_t len = frame->size() - ChunkHeader::SIZE;
+    bool sentZeros = len == 0 && header.offset < _size;
+    if (sentZeros) len = minidrive::chunkLength(_size, _chunkSize, header.offset);
+    if (!_validChunk(header.offset, len)) {
+        done(error::INVALID_CHUNK);
+        return;
+    }
+    size_t index = header.offset / _chunkSize;
+    {
+        std::lock_guard g(_mutex);
+        if (_finished || _received[index]) {
+            done(error::SUCCESS);
+            return;
+        }
+    }
+    auto tag = sentZeros ? minidrive::zeroTag(static_cast<uint32_t>(len)) : minidrive::chunkTag(data, len);
+    if (tag != header.tag) {
+        done(_damaged(header.offset));
+        return;
+    }
+    if (sentZeros || minidrive::isZero(data, len)) {
+        // punching a hole is a quick metadata change, not worth a trip through the ring
+        if (!_writeZeros(header.offset, static_cast<uint32_t>(len))) {
+            done(error::FS_ERROR);
+        } else if (_markReceived(index, header.tag)) {
+            _commit(io, std::move(done));
+        } else {
+            done(error::SUCCESS);
+        }
+        return;
+    }
+    io.write(_fd, data, static_cast<uint32_t>(len), header.offset,
+        [self = shared_from_this(), &io, frame, index, len, tag = header.tag, done = std::move(done)](int res) {
+            if (res < 0 || static_cast<size_t>(res) != len) {
+                spdlog::error("transfer {}: write: {}", self->_id, res < 0 ? std::strerror(-res) : "short write");
+                self->_complete(error::FS_ERROR);
+                done(error::FS_ERROR);
+                return;
+            }
+            if (self->_markReceived(index, tag)) {
+                self->_commit(io, std::move(done));
+                return;
+            }
+            done(error::SUCCESS);
+        });
+}
+
+bool Transfer::setChunks(std::vector<uint64_t> chunks) {
+    uint64_t count = minidrive::chunkCount(_size, _chunkSize);
+    for (uint64_t index : chunks) {
+        if (index >= count) return false;
+    }
+    std::erase_if(chunks, [this](uint64_t index) {return std::binary_search(_holes.begin(), _holes.end(), index);});
+    _chunks = std::move(chunks);
+    _partial = true;
+    return true;
+}
+
+std::optional<uint64_t> Transfer::nextChunk() {
+    {
+        std::lock_guard g(_mutex);
+        if (!_resend.empty()) {
+            uint64_t offset = _resend.front();
+            _resend.pop_front();
+            return offset;
+        }
+    }
+    uint64_t index = _nextChunk++;
+    if (_partial) {
+        if (index >= _chunks.size()) return std::nullopt;
+        return _chunks[index] * _chunkSize;
+    }
+    if (index >= minidrive::chunkCount(_size, _chunkSize)) return std::nullopt;
+    return index * _chunkSize;
+}
+
+bool Transfer::resend(uint64_t offset) {
+    if (_direction != direction::DOWNLOAD || offset % _chunkSize != 0 || offset >= _size) return false;
+    if (_damaged(offset) != error::CORRUPT_CHUNK) return false;
+    std::lock_guard g(_mutex);
+    if (_finished) return false;
+    _resend.push_back(offset);
+    return true;
+}
+
+void Transfer::acknowledge() {
+    if (_direction != direction::DOWNLOAD) return;
+    spdlog::debug("transfer {}: hash {}", _id, hash());
+    _complete(error::SUCCESS);
+}
+
+bool Transfer::readChunk(uint64_t offset, MsgPayload &frame) {
+    uint32_t len = minidrive::chunkLength(_size, _chunkSize, offset);
+    frame = minidrive::makeChunkFrame(ChunkHeader{_id, offset}, len);
+    if (!_read(offset, minidrive::chunkData(frame), len)) return false;
+    auto tag = minidrive::tagChunkFrame(frame.data(), frame.size());
+    std::lock_guard g(_mutex);
+    _hasher.add(offset / _chunkSize, tag);
+    return true;
+}
+
+void Transfer::readChunk(UringIo &io, uint64_t offset, uint8_t *frame, ChunkHandler done) {
+    uint32_t len = minidrive::chunkLength(_size, _chunkSize, offset);
+    if (_cache && _cache->enabled()) {
+        ChunkCache::Key key = _cacheKey;
+        key.offset = offset;
+        _cache->get(key, [self = shared_from_this(), &io, offset, len](ChunkCache::Ready ready) {
+            auto chunk = std::make_shared<ChunkCache::Chunk>();
+            chunk->data.resize(len);
+            if (!io.available()) {
+                if (!self->_read(offset, chunk->data.data(), len)) {
+                    ready(nullptr);
+                    return;
+                }
+                chunk->tag = minidrive::chunkTag(chunk->data.data(), len);
+                ready(std::move(chunk));
+                return;
+            }
+            uint8_t *out = chunk->data.data();
+            io.read(self->_fd, out, len, offset, [self, chunk = std::move(chunk), len, ready = std::move(ready)](int res) {
+                if (res < 0 || static_cast<uint32_t>(res) != len) {
+                    spdlog::error("transfer {}: read: {}", self->_id, res < 0 ? std::strerror(-res) : "unexpected end of file");
+                    ready(nullptr);
+                    return;
+                }
+                chunk->tag = minidrive::chunkTag(chunk->data.data(), len);
+                ready(chunk);
+            });
+        }, [self = shared_from_this(), &io, frame, offset, len, done = std::move(done)](ChunkCache::ChunkPtr chunk) mutable {
+            // a hit runs inside readChunk(), the caller may still hold its locks
+            if (!chunk) {
+                self->_complete(error::FS_ERROR);
+                asio::post(io.context(), [done = std::move(done)]() {done(error::FS_ERROR);});
+                return;
+            }
+            minidrive::encodeChunkFrame(frame, ChunkHeader{self->_id, offset, chunk->tag}, len);
+            std::memcpy(frame + minidrive::chunkFrameSize(0), chunk->data.data(), len);
+            {
+                std::lock_guard g(self->_mutex);
+                self->_hasher.add(offset / self->_chunkSize, chunk->tag);
+            }
+            asio::post(io.context(), [done = std::move(done)]() {done(error::SUCCESS);});
+        });
+        return;
+    }
+    minidrive::encodeChunkFrame(frame, ChunkHeader{_id, offset}, len);
+    io.read(_fd, frame + minidrive::chunkFrameSize(0), len, offset,
+        [self = shared_from_this(), frame, offset, len, done = std::move(done)](int res) {
+            if (res < 0 || static_cast<uint32_t>(res) != len) {
+                spdlog::error("transfer {}: read: {}", self->_id, res < 0 ? std::strerror(-res) : "unexpected end of file");
+                self->_complete(error::FS_ERROR);
+                done(error::FS_ERROR);
+                return;
+            }
+            auto tag = minidrive::tagChunkFrame(frame, minidrive::chunkFrameSize(len));
+            {
+                std::lock_guard g(self->_mutex);
+                self->_hasher.add(offset / self->_chunkSize, tag);
+            }
+            done(error::SUCCESS);
+        });
+}
+
+void Transfer::_commit(UringIo &io, ChunkHandler done) {
+    _sync(io, _fd, [self = shared_from_this(), &io, done = std::move(done)](int res) {
+        if (res != 0) {
+            spdlog::error("transfer {}: fsync: {}", self->_id, std::strerror(res));
+            self->_complete(error::FS_ERROR);
+            done(error::FS_ERROR);
+            return;
+        }
+        // the link runs here, with the target locked; a lock can't be held across a completion
+        auto err = self->_inPlace ? self->_commitInPlace() : self->_link();
+        if (err || self->_inPlace || self->_path.parentFd() < 0) {
+            self->_complete(err);
+            done(err);
+            return;
+        }
+        self->_sync(io, self->_path.parentFd(), [self, done](int res) {
+            if (res != 0) spdlog::error("transfer {}: fsync of the directory: {}", self->_id, std::strerror(res));
+            self->_complete(error::SUCCESS);
+            done(error::SUCCESS);
+        });
+    });
+}
+
+void Transfer::_sync(UringIo &io, int fd, std::function<void(int)> done) {
+    auto policy = _commitSync ? _commitSync->getPolicy() : CommitSync::policy::FILE;
+    if (policy == CommitSync::policy::FILE && io.available()) {
+        io.fsync(fd, [done = std::move(done)](int res) {done(res < 0 ? -res : 0);});
+    } else if (policy != CommitSync::policy::GROUP) {
+        // nothing to sync, or no ring to sync through: done on this thread
+        if (_commitSync) _commitSync->sync(fd, std::move(done));
+        else done(fsync(fd) == 0 ? 0 : errno);
+    } else {
+        // completes on the batching thread, no io thread waits for its batch
+        _commitSync->sync(fd, [&io, done = std::move(done)](int err) {
+            asio::post(io.context(), [done, err]() {done(err);});
+        });
+    }
+}
+
+minidrive::error_code Transfer::_link() {
+    PathLocks::Guard lock;
+    if (_locks) lock = _locks->lock(_path.root()->path(), {_path.rel()});
+    // never replaces a file that appeared while we were uploading
+    return _linked(_path.root()->storage().publish(_fd, _path, _tmpName));
+}
+
+minidrive::error_code Transfer::_commitInPlace() {
+    PathLocks::Guard lock;
+    if (_locks) lock = _locks->lock(_path.root()->path(), {_path.rel()});
+    _committed = true;
+    _saveTree();
+    if (_cache) _cache->invalidate(_cacheKey.dev, _cacheKey.ino);
+    spdlog::info("transfer {}: repaired {} ({}B)", _id, _path.rel().string(), _size);
+    return error::SUCCESS;
+}
+
+void Transfer::_saveTree() {
+    std::vector<minidrive::ChunkTag> leaves;
+    {
+        std::lock_guard g(_mutex);
+        leaves = _hasher.tags();
+    }
+    tree_save(*_path.root(), _fd, minidrive::MerkleTree(std::move(leaves)));
+}
+
+minidrive::error_code Transfer::_linked(int err) {
+    if (err != 0) {
+        spdlog::error("transfer {}: could not commit {}: {}", _id, _path.rel().string(), std::strerror(err));
+        return err == EEXIST ? error::TARGET_ALREADY_EXISTS : error::FS_ERROR;
+    }
+    _committed = true;
+    _saveTree();
+    _path.root()->names().add(_path.rel(), false);
+    spdlog::info("transfer {}: committed {} ({}B)", _id, _path.rel().string(), _size);
+    return error::SUCCESS;
+}
+
+void Transfer::_complete(const minidrive::error_code &err) {
+    {
+        std::lock_guard g(_mutex);
+        if (_finished) return;
+        _finished = true;
+    }
+    std::lock_guard g(_handlerMutex);
+    if (_completionHandler) {
+        auto handler = std::move(_completionHandler);
+        _completionHandler = nullptr;
+        handler(*this, err);
+    }
+}
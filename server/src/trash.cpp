@@ -0,0 +1,158 @@
+#include "trash.hpp"
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <spdlog/spdlog.h>
+#include "globals.hpp"
+
+namespace fs = std::filesystem;
+
+TrashReaper::~TrashReaper() {
+    stop();
+}
+
+void TrashReaper::setFreedHandler(FreedHandler handler) {
+    _freedHandler = std::move(handler);
+}
+
+void TrashReaper::start() {
+    std::lock_guard g(_mutex);
+    if (_running) return;
+    _running = true;
+    _thread = std::thread([this]() {_run();});
+}
+
+void TrashReaper::stop() {
+    {
+        std::lock_guard g(_mutex);
+        _running = false;
+    }
+    _cv.notify_all();
+    if (_thread.joinable()) _thread.join();
+}
+
+bool TrashReaper::moveToTrash(const ResolvedPath &path) {
+    int rootFd = path.root()->fd();
+    if (mkdirat(rootFd, TRASH_DIR.c_str(), 0700) != 0 && errno != EEXIST) return false;
+    int trashFd = openat(rootFd, TRASH_DIR.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (trashFd < 0) return false;
+
+    std::string name;
+    {
+        std::lock_guard g(_mutex);
+        auto now = std::chrono::system_clock::now().time_since_epoch();
+        name = std::to_string(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count()) + "-"
+            + std::to_string(_nextId++);
+    }
+    int rc = renameat(path.parentFd(), path.name().c_str(), trashFd, name.c_str());
+    int err = errno;
+    close(trashFd);
+    if (rc != 0) {
+        errno = err;
+        return false;
+    }
+    spdlog::debug("moved {} to the trash as {}", path.rel().string(), name);
+    reclaim(path.root()->path());
+    return true;
+}
+
+void TrashReaper::reclaim(const fs::path &root) {
+    {
+        std::lock_guard g(_mutex);
+        _queue.insert(root);
+    }
+    _cv.notify_one();
+}
+
+void TrashReaper::_run() {
+    std::unique_lock lock(_mutex);
+    while (_running) {
+        if (_queue.empty()) {
+            _cv.wait(lock);
+            continue;
+        }
+        fs::path root = *_queue.begin();
+        _queue.erase(_queue.begin());
+        lock.unlock();
+
+        fs::path trash = root / TRASH_DIR;
+        int fd = open(trash.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd >= 0) {
+            _treesFd = open((root / TREES_DIR).c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            auto started = std::chrono::steady_clock::now();
+            size_t unlinks = _unlinks;
+            if (_removeContents(fd)) {
+                spdlog::info("reclaimed trash of {}: {} entries in {} ms", root.string(), _unlinks - unlinks,
+                    std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count());
+            }
+            if (_freedHandler && _freedFiles > 0) _freedHandler(root, _freedBytes, _freedFiles);
+            _freedBytes = _freedFiles = 0;
+            if (_treesFd >= 0) close(_treesFd);
+            _treesFd = -1;
+        } else if (errno != ENOENT) {
+            spdlog::error("reaper: could not open {}: {}", trash.string(), std::strerror(errno));
+        }
+        lock.lock();
+    }
+}
+
+bool TrashReaper::_removeContents(int dirFd) {
+    DIR *dir = fdopendir(dirFd);
+    if (!dir) {
+        spdlog::error("reaper: fdopendir: {}", std::strerror(errno));
+        close(dirFd);
+        return true;
+    }
+    while (dirent *entry = readdir(dir)) {
+        std::string_view name = entry->d_name;
+        if (name == "." || name == "..") continue;
+        if (!_throttle()) {
+            closedir(dir);
+            return false;
+        }
+        struct stat st;
+        bool regular = fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode);
+        if (unlinkat(dirfd(dir), entry->d_name, 0) == 0) {
+            if (regular) {
+                _freedBytes += static_cast<int64_t>(st.st_size);
+                ++_freedFiles;
+                // the last link is gone, so is the file's hash tree (see PosixStorage::removeTree)
+                if (st.st_nlink == 1 && _treesFd >= 0) unlinkat(_treesFd, std::to_string(st.st_ino).c_str(), 0);
+            }
+            continue;
+        }
+        if (errno != EISDIR && errno != EPERM) {
+            if (errno != ENOENT) spdlog::warn("reaper: unlink {}: {}", name, std::strerror(errno));
+            continue;
+        }
+        int sub = openat(dirfd(dir), entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (sub < 0) {
+            spdlog::warn("reaper: open {}: {}", name, std::strerror(errno));
+            continue;
+        }
+        if (!_removeContents(sub)) {
+            closedir(dir);
+            return false;
+        }
+        if (unlinkat(dirfd(dir), entry->d_name, AT_REMOVEDIR) != 0) {
+            spdlog::warn("reaper: rmdir {}: {}", name, std::strerror(errno));
+        }
+    }
+    closedir(dir);
+    return true;
+}
+
+bool TrashReaper::_throttle() {
+    std::unique_lock lock(_mutex);
+    if (++_unlinks % REAP_BATCH == 0) {
+        _cv.wait_for(lock, REAP_PAUSE, [this]() {return !_running;});
+    }
+    return _running;
+}
@@ -0,0 +1,379 @@
+#include "uring_io.hpp"
+#include <asio.hpp>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <spdlog/spdlog.h>
+
+#ifdef MINIDRIVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+struct UringIo::Op {
+    uint8_t opcode = 0;
+    int fd = -1;
+    uint8_t *buf = nullptr;
+    uint32_t len = 0;
+    // bytes transferred by earlier submissions of a short read or write
+    uint32_t done = 0;
+    uint64_t offset = 0;
+    int bufIndex = -1;
+    Completion completion;
+};
+
+UringIo::UringIo(asio::io_context &io)
+    : _io(io), _ringFd(-1), _eventFd(io), _sqRing(nullptr), _cqRing(nullptr), _sqRingSize(0), _cqRingSize(0),
+      _sqes(nullptr), _sqesSize(0), _sqHead(nullptr), _sqTail(nullptr), _sqArray(nullptr), _sqMask(0),
+      _sqEntries(0), _cqHead(nullptr), _cqTail(nullptr), _cqMask(0), _cqes(nullptr), _toSubmit(0),
+      _flushScheduled(false), _arena(nullptr), _arenaSize(0), _bufferSize(0), _bufferCount(0) {
+
+}
+
+UringIo::~UringIo() {
+    _teardown();
+}
+
+#ifdef MINIDRIVE_IO_URING
+
+namespace {
+
+int uringSetup(unsigned entries, io_uring_params *params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int uringEnter(int fd, unsigned toSubmit) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, 0, 0, nullptr, 0));
+}
+
+int uringRegister(int fd, unsigned opcode, const void *arg, unsigned count) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+}
+
+template<typename T>
+T* ringField(void *ring, uint32_t offset) {
+    return reinterpret_cast<T*>(static_cast<uint8_t*>(ring) + offset);
+}
+
+constexpr uint8_t REQUIRED_OPS[] = {
+    IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READ_FIXED, IORING_OP_FSYNC
+};
+
+} // namespace
+
+bool UringIo::start(unsigned entries, size_t buffers, size_t bufferSize) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CLAMP;
+    int fd = uringSetup(entries, &params);
+    if (fd < 0) {
+        spdlog::warn("io_uring_setup: {}, using synchronous file I/O", std::strerror(errno));
+        return false;
+    }
+    _ringFd = fd;
+
+    _sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    _cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap) _sqRingSize = _cqRingSize = std::max(_sqRingSize, _cqRingSize);
+    _sqRing = mmap(nullptr, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (_sqRing == MAP_FAILED) _sqRing = nullptr;
+    if (singleMmap) {
+        _cqRing = _sqRing;
+    } else if (_sqRing) {
+        _cqRing = mmap(nullptr, _cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (_cqRing == MAP_FAILED) _cqRing = nullptr;
+    }
+    _sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = mmap(nullptr, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (!_sqRing || !_cqRing || sqes == MAP_FAILED) {
+        spdlog::warn("io_uring: could not map the rings: {}, using synchronous file I/O", std::strerror(errno));
+        _teardown();
+        return false;
+    }
+    _sqes = static_cast<io_uring_sqe*>(sqes);
+    _sqHead = ringField<unsigned>(_sqRing, params.sq_off.head);
+    _sqTail = ringField<unsigned>(_sqRing, params.sq_off.tail);
+    _sqArray = ringField<unsigned>(_sqRing, params.sq_off.array);
+    _sqMask = *ringField<unsigned>(_sqRing, params.sq_off.ring_mask);
+    _sqEntries = params.sq_entries;
+    _cqHead = ringField<unsigned>(_cqRing, params.cq_off.head);
+    _cqTail = ringField<unsigned>(_cqRing, params.cq_off.tail);
+    _cqMask = *ringField<unsigned>(_cqRing, params.cq_off.ring_mask);
+    _cqes = ringField<io_uring_cqe>(_cqRing, params.cq_off.cqes);
+
+    // older kernels have a ring but not every operation we submit
+    std::vector<uint8_t> probeBuffer(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+    auto *probe = reinterpret_cast<io_uring_probe*>(probeBuffer.data());
+    if (uringRegister(fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        spdlog::warn("io_uring: probe failed: {}, using synchronous file I/O", std::strerror(errno));
+        _teardown();
+        return false;
+    }
+    for (uint8_t op : REQUIRED_OPS) {
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            spdlog::warn("io_uring: operation {} not supported, using synchronous file I/O", op);
+            _teardown();
+            return false;
+        }
+    }
+
+    int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd < 0 || uringRegister(fd, IORING_REGISTER_EVENTFD, &efd, 1) < 0) {
+        spdlog::warn("io_uring: could not register an eventfd: {}, using synchronous file I/O", std::strerror(errno));
+        if (efd >= 0) close(efd);
+        _teardown();
+        return false;
+    }
+    _eventFd.assign(efd);
+
+    // registered buffers count against RLIMIT_MEMLOCK, take as many as the limit allows
+    long page = sysconf(_SC_PAGESIZE);
+    _bufferSize = (bufferSize + static_cast<size_t>(page) - 1) / static_cast<size_t>(page) * static_cast<size_t>(page);
+    if (buffers > 0) {
+        _arenaSize = buffers * _bufferSize;
+        void *arena = mmap(nullptr, _arenaSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (arena == MAP_FAILED) {
+            _arenaSize = 0;
+        } else {
+            _arena = static_cast<uint8_t*>(arena);
+        }
+    }
+    size_t count = _arena ? buffers : 0;
+    while (count > 0) {
+        std::vector<iovec> iovecs(count);
+        for (size_t i = 0; i < count; ++i) iovecs[i] = iovec{_arena + i * _bufferSize, _bufferSize};
+        if (uringRegister(fd, IORING_REGISTER_BUFFERS, iovecs.data(), static_cast<unsigned>(count)) == 0) break;
+        count /= 2;
+    }
+    if (count < buffers && _arena) {
+        munmap(_arena + count * _bufferSize, _arenaSize - count * _bufferSize);
+        _arenaSize = count * _bufferSize;
+        if (count == 0) _arena = nullptr;
+    }
+    _bufferCount = count;
+    _freeBuffers.clear();
+    for (size_t i = count; i > 0; --i) _freeBuffers.push_back(static_cast<uint32_t>(i - 1));
+
+    spdlog::info("io_uring file I/O: {} entries, {} registered buffers of {}B", _sqEntries, _bufferCount, _bufferSize);
+    _waitCompletions();
+    return true;
+}
+
+void UringIo::stop() {
+    asio::error_code ec;
+    _eventFd.cancel(ec);
+}
+
+void UringIo::_teardown() {
+    // operations still in the kernel are cancelled with the ring, their completions never run
+    asio::error_code ec;
+    _eventFd.close(ec);
+    if (_sqes) munmap(_sqes, _sqesSize);
+    if (_cqRing && _cqRing != _sqRing) munmap(_cqRing, _cqRingSize);
+    if (_sqRing) munmap(_sqRing, _sqRingSize);
+    if (_ringFd >= 0) close(_ringFd);
+    if (_arena) munmap(_arena, _arenaSize);
+    _sqes = nullptr;
+    _sqRing = _cqRing = nullptr;
+    _ringFd = -1;
+    _arena = nullptr;
+    _bufferCount = 0;
+    _backlog.clear();
+}
+
+void UringIo::read(int fd, uint8_t *buf, uint32_t len, uint64_t offset, Completion completion) {
+    auto op = std::make_unique<Op>();
+    op->opcode = IORING_OP_READ;
+    if (_arena && buf >= _arena && buf < _arena + _arenaSize) {
+        size_t index = static_cast<size_t>(buf - _arena) / _bufferSize;
+        if (buf + len <= _arena + (index + 1) * _bufferSize) {
+            op->opcode = IORING_OP_READ_FIXED;
+            op->bufIndex = static_cast<int>(index);
+        }
+    }
+    op->fd = fd;
+    op->buf = buf;
+    op->len = len;
+    op->offset = offset;
+    op->completion = std::move(completion);
+    _submit(std::move(op));
+}
+
+void UringIo::write(int fd, const uint8_t *buf, uint32_t len, uint64_t offset, Completion completion) {
+    auto op = std::make_unique<Op>();
+    op->opcode = IORING_OP_WRITE;
+    op->fd = fd;
+    op->buf = const_cast<uint8_t*>(buf);
+    op->len = len;
+    op->offset = offset;
+    op->completion = std::move(completion);
+    _submit(std::move(op));
+}
+
+void UringIo::fsync(int fd, Completion completion) {
+    auto op = std::make_unique<Op>();
+    op->opcode = IORING_OP_FSYNC;
+    op->fd = fd;
+    op->completion = std::move(completion);
+    _submit(std::move(op));
+}
+
+void UringIo::_submit(std::unique_ptr<Op> op) {
+    std::lock_guard g(_sqMutex);
+    if (_backlog.empty() && _pushSqe(op.get())) {
+        op.release();
+    } else {
+        _backlog.push_back(std::move(op));
+    }
+    // everything queued until the flush runs goes to the kernel with one syscall
+    if (!_flushScheduled) {
+        _flushScheduled = true;
+        asio::post(_io, [this]() {_flush();});
+    }
+}
+
+bool UringIo::_pushSqe(Op *op) {
+    unsigned tail = *_sqTail;
+    if (tail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries) {
+        _enter();
+        if (tail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries) return false;
+    }
+    unsigned index = tail & _sqMask;
+    io_uring_sqe *sqe = &_sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op->opcode;
+    sqe->fd = op->fd;
+    sqe->user_data = reinterpret_cast<uint64_t>(op);
+    switch (op->opcode) {
+    case IORING_OP_READ_FIXED:
+        sqe->buf_index = static_cast<uint16_t>(op->bufIndex);
+        [[fallthrough]];
+    case IORING_OP_READ:
+    case IORING_OP_WRITE:
+        sqe->addr = reinterpret_cast<uint64_t>(op->buf + op->done);
+        sqe->len = op->len - op->done;
+        sqe->off = op->offset + op->done;
+        break;
+    default:
+        break;
+    }
+    _sqArray[index] = index;
+    __atomic_store_n(_sqTail, tail + 1, __ATOMIC_RELEASE);
+    ++_toSubmit;
+    return true;
+}
+
+void UringIo::_enter() {
+    while (_toSubmit > 0) {
+        int n = uringEnter(_ringFd, _toSubmit);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            // EAGAIN/EBUSY: the kernel is out of resources, retried after the next completions
+            if (errno != EAGAIN && errno != EBUSY) spdlog::error("io_uring_enter: {}", std::strerror(errno));
+            return;
+        }
+        if (n == 0) return;
+        _toSubmit -= static_cast<unsigned>(n);
+    }
+}
+
+void UringIo::_flush() {
+    std::lock_guard g(_sqMutex);
+    _flushScheduled = false;
+    if (_ringFd >= 0) _enter();
+}
+
+void UringIo::_waitCompletions() {
+    _eventFd.async_wait(asio::posix::stream_descriptor::wait_read, [this](const asio::error_code &ec) {
+        if (ec) return;
+        uint64_t count;
+        while (::read(_eventFd.native_handle(), &count, sizeof(count)) < 0 && errno == EINTR) {}
+        _reap();
+        _waitCompletions();
+    });
+}
+
+void UringIo::_reap() {
+    // only one completion wait is outstanding, nobody else touches the completion queue
+    std::vector<std::pair<Op*, int>> completed;
+    unsigned head = *_cqHead;
+    unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+    completed.reserve(tail - head);
+    for (; head != tail; ++head) {
+        const io_uring_cqe &cqe = _cqes[head & _cqMask];
+        completed.emplace_back(reinterpret_cast<Op*>(cqe.user_data), cqe.res);
+    }
+    __atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+
+    {
+        std::lock_guard g(_sqMutex);
+        while (!_backlog.empty() && _pushSqe(_backlog.front().get())) {
+            _backlog.front().release();
+            _backlog.pop_front();
+        }
+        _enter();
+    }
+    for (auto [op, res] : completed) _finish(op, res);
+}
+
+void UringIo::_finish(Op *op, int res) {
+    bool transfer = op->opcode == IORING_OP_READ || op->opcode == IORING_OP_READ_FIXED
+        || op->opcode == IORING_OP_WRITE;
+    if (transfer && res > 0) {
+        op->done += static_cast<uint32_t>(res);
+        if (op->done < op->len) {
+            // short read or write, continue where the kernel stopped
+            _submit(std::unique_ptr<Op>(op));
+            return;
+        }
+    }
+    std::unique_ptr<Op> owner(op);
+    if (transfer && res >= 0) res = static_cast<int>(op->done);
+    owner->completion(res);
+}
+
+std::shared_ptr<uint8_t> UringIo::acquireBuffer() {
+    std::lock_guard g(_buffersMutex);
+    if (_freeBuffers.empty()) return nullptr;
+    uint32_t index = _freeBuffers.back();
+    _freeBuffers.pop_back();
+    return std::shared_ptr<uint8_t>(_arena + index * _bufferSize, [this, index](uint8_t*) {
+        std::lock_guard g(_buffersMutex);
+        _freeBuffers.push_back(index);
+    });
+}
+
+#else
+
+bool UringIo::start(unsigned, size_t, size_t) {
+    spdlog::info("built without io_uring, using synchronous file I/O");
+    return false;
+}
+
+void UringIo::stop() {}
+
+void UringIo::_teardown() {}
+
+void UringIo::read(int, uint8_t*, uint32_t, uint64_t, Completion completion) {
+    asio::post(_io, [completion = std::move(completion)]() {completion(-ENOSYS);});
+}
+
+void UringIo::write(int, const uint8_t*, uint32_t, uint64_t, Completion completion) {
+    asio::post(_io, [completion = std::move(completion)]() {completion(-ENOSYS);});
+}
+
+void UringIo::fsync(int, Completion completion) {
+    asio::post(_io, [completion = std::move(completion)]() {completion(-ENOSYS);});
+}
+
+std::shared_ptr<uint8_t> UringIo::acquireBuffer() {
+    return nullptr;
+}
+
+#endif
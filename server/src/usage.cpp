@@ -0,0 +1,258 @@
+#include "usage.hpp"
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <chrono>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <spdlog/spdlog.h>
+#include <nlohmann/json.hpp>
+#include "globals.hpp"
+#include "transfer.hpp"
+#include "storage.hpp"
+
+namespace fs = std::filesystem;
+using json = nlohmann::json;
+
+UsageTracker::Hold::Hold(UsageTracker &tracker, std::string key, int64_t bytes, uint64_t quota)
+    : _tracker(tracker), _key(std::move(key)), _bytes(bytes), _quota(quota), _committed(false) {}
+
+UsageTracker::Hold::~Hold() {
+    if (_committed || _bytes == 0) return;
+    std::lock_guard g(_tracker._mutex);
+    _tracker._entries[_key].held -= _bytes;
+}
+
+bool UsageTracker::Hold::grow(int64_t bytes) {
+    std::lock_guard g(_tracker._mutex);
+    if (_committed) return false;
+    auto &entry = _tracker._entries[_key];
+    if (_quota > 0 && entry.usage.bytes + entry.held + bytes > static_cast<int64_t>(_quota)) return false;
+    entry.held += bytes;
+    _bytes += bytes;
+    return true;
+}
+
+void UsageTracker::Hold::commit(int64_t bytes, int64_t files) {
+    if (_committed) return;
+    _committed = true;
+    std::lock_guard g(_tracker._mutex);
+    _tracker._entries[_key].held -= _bytes;
+    _tracker._chargeLocked(_key, bytes, files);
+}
+
+UsageTracker::~UsageTracker() {
+    stop();
+}
+
+bool UsageTracker::load(const fs::path &file) {
+    _file = file;
+    std::ifstream in(file);
+    if (!in) return true;
+    json data;
+    try {
+        data = json::parse(in);
+    } catch (const json::parse_error &e) {
+        // the counters are rebuilt by scanning
+        spdlog::error("usage file is damaged, every root is scanned again: {}", e.what());
+        return false;
+    }
+    if (!data.contains("roots") || !data["roots"].is_object()) return false;
+    std::lock_guard g(_mutex);
+    for (const auto &[key, value] : data["roots"].items()) {
+        if (!value.is_object()) continue;
+        auto &entry = _entries[key];
+        entry.usage.bytes = value.value("bytes", int64_t(0));
+        entry.usage.files = value.value("files", int64_t(0));
+        entry.scanned = value.value("scanned", int64_t(0));
+    }
+    spdlog::info("usage of {} roots loaded", _entries.size());
+    return true;
+}
+
+bool UsageTracker::save() {
+    json roots = json::object();
+    {
+        std::lock_guard g(_mutex);
+        if (!_dirty || _file.empty()) return true;
+        _dirty = false;
+        for (const auto &[key, entry] : _entries) {
+            roots[key] = { {"bytes", entry.usage.bytes}, {"files", entry.usage.files}, {"scanned", entry.scanned} };
+        }
+    }
+    // a crash leaves the old file or the new one, never half of it
+    fs::path tmp = _file;
+    tmp += ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        out << json{ {"roots", std::move(roots)} }.dump() << '\n';
+        out.close();
+        if (out.fail()) {
+            spdlog::error("usage file could not be written");
+            std::lock_guard g(_mutex);
+            _dirty = true;
+            return false;
+        }
+    }
+    if (std::rename(tmp.c_str(), _file.c_str()) != 0) {
+        spdlog::error("usage file could not be replaced: {}", std::strerror(errno));
+        std::lock_guard g(_mutex);
+        _dirty = true;
+        return false;
+    }
+    return true;
+}
+
+void UsageTracker::start() {
+    std::lock_guard g(_mutex);
+    if (_running) return;
+    _running = true;
+    _thread = std::thread([this]() {_run();});
+}
+
+void UsageTracker::stop() {
+    {
+        std::lock_guard g(_mutex);
+        _running = false;
+    }
+    _cv.notify_all();
+    if (_thread.joinable()) _thread.join();
+}
+
+std::string UsageTracker::_key(const fs::path &root) {
+    return root.lexically_relative(ROOT_DIR_PATH).generic_string();
+}
+
+UsageTracker::Usage UsageTracker::usage(const fs::path &root) {
+    std::lock_guard g(_mutex);
+    auto it = _entries.find(_key(root));
+    return it == _entries.end() ? Usage{} : it->second.usage;
+}
+
+void UsageTracker::charge(const fs::path &root, int64_t bytes, int64_t files) {
+    _charge(_key(root), bytes, files);
+}
+
+void UsageTracker::_charge(const std::string &key, int64_t bytes, int64_t files) {
+    std::lock_guard g(_mutex);
+    _chargeLocked(key, bytes, files);
+}
+
+void UsageTracker::_chargeLocked(const std::string &key, int64_t bytes, int64_t files) {
+    if (bytes == 0 && files == 0) return;
+    auto &entry = _entries[key];
+    entry.usage.bytes += bytes;
+    entry.usage.files += files;
+    if (entry.scanning) {
+        entry.sinceScan.bytes += bytes;
+        entry.sinceScan.files += files;
+    }
+    _dirty = true;
+}
+
+std::shared_ptr<UsageTracker::Hold> UsageTracker::reserve(const fs::path &root, int64_t bytes, uint64_t quota) {
+    std::string key = _key(root);
+    bytes = std::max<int64_t>(bytes, 0);
+    {
+        std::lock_guard g(_mutex);
+        auto &entry = _entries[key];
+        if (quota > 0 && entry.usage.bytes + entry.held + bytes > static_cast<int64_t>(quota)) return nullptr;
+        entry.held += bytes;
+    }
+    return std::make_shared<Hold>(*this, std::move(key), bytes, quota);
+}
+
+void UsageTracker::reconcile(const std::vector<fs::path> &roots) {
+    auto now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch());
+    int64_t due = (now - RESCAN_PERIOD).count();
+    {
+        std::lock_guard g(_mutex);
+        for (const auto &root : roots) {
+            std::string key = _key(root);
+            auto &entry = _entries[key];
+            if (entry.queued || entry.scanning || entry.scanned > due) continue;
+            entry.queued = true;
+            _queue.push_back(std::move(key));
+        }
+        if (_queue.empty()) return;
+    }
+    _cv.notify_one();
+}
+
+void UsageTracker::_run() {
+    std::unique_lock lock(_mutex);
+    while (_running) {
+        if (_queue.empty()) {
+            _cv.wait(lock);
+            continue;
+        }
+        std::string key = std::move(_queue.front());
+        _queue.pop_front();
+        lock.unlock();
+        _scan(key);
+        lock.lock();
+    }
+}
+
+void UsageTracker::_scan(const std::string &key) {
+    {
+        std::lock_guard g(_mutex);
+        auto &entry = _entries[key];
+        entry.queued = false;
+        entry.scanning = true;
+        entry.sinceScan = Usage{};
+    }
+    auto started = std::chrono::steady_clock::now();
+    auto root = _storage->openRoot(ROOT_DIR_PATH / key);
+    Usage scanned;
+    bool done = root && _scanDir(*root, {}, scanned);
+
+    std::lock_guard g(_mutex);
+    auto &entry = _entries[key];
+    entry.scanning = false;
+    if (!done) return;
+    // a change during the scan may have been seen by it or not, the next scan settles that
+    Usage usage{scanned.bytes + entry.sinceScan.bytes, scanned.files + entry.sinceScan.files};
+    if (usage.bytes != entry.usage.bytes || usage.files != entry.usage.files) {
+        spdlog::info("usage of {} corrected by {}B and {} files", key, usage.bytes - entry.usage.bytes,
+            usage.files - entry.usage.files);
+    }
+    entry.usage = usage;
+    entry.scanned = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    _dirty = true;
+    spdlog::debug("scanned {}: {}B in {} files, {} ms", key, usage.bytes, usage.files,
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count());
+}
+
+bool UsageTracker::_scanDir(const RootDir &root, const fs::path &rel, Usage &usage) {
+    std::vector<StorageEngine::DirEntry> entries;
+    if (!root.storage().list(root, rel, entries, true)) {
+        spdlog::error("usage: could not list {}: {}", (root.path() / rel).string(), std::strerror(errno));
+        return true;
+    }
+    for (const auto &entry : entries) {
+        // trees are the server's own, uploads in progress are held by their transfer
+        if ((rel.empty() && entry.name == TREES_DIR) || Transfer::isTemporaryName(entry.name)) continue;
+        if (!_throttle()) return false;
+        if (entry.entry.type == fs::file_type::regular) {
+            usage.bytes += static_cast<int64_t>(entry.entry.size);
+            ++usage.files;
+            continue;
+        }
+        if (entry.entry.type != fs::file_type::directory) continue;
+        if (!_scanDir(root, rel / entry.name, usage)) return false;
+    }
+    return true;
+}
+
+bool UsageTracker::_throttle() {
+    std::unique_lock lock(_mutex);
+    if (++_visited % SCAN_BATCH == 0) {
+        _cv.wait_for(lock, SCAN_PAUSE, [this]() {return !_running;});
+    }
+    return _running;
+}
@@ -1,56 +1,195 @@
 #pragma once
 #include <asio.hpp>
 #include <string>
-#include <queue>
+#include <deque>
+#include <array>
+#include <vector>
 #include <mutex>
 #include <memory>
-#include <functional>
+#include <atomic>
+#include <chrono>
+#include "minidrive/socket_tuning.hpp"
 
 enum class data_type {COMMAND = 0, DATA};
 
 struct MsgHeader {
+    static constexpr size_t SIZE = 5;
+
     MsgHeader();
     void setType(data_type t);
     void setLen(uint32_t len);
-    data_type getType();
-    uint32_t getLen();
-    inline std::vector<uint8_t>& getBuffer() {return buffer;}
+    data_type getType() const;
+    uint32_t getLen() const;
+    inline std::array<uint8_t, SIZE>& getBuffer() {return buffer;}
 
     private:
-        std::vector<uint8_t> buffer;
+        std::array<uint8_t, SIZE> buffer;
 };
 
 using MsgPayload = std::vector<uint8_t>;
 
-using MessageHandler = std::function<void(data_type, std::shared_ptr<MsgPayload>)>;
-using ReadErrorHandler = std::function<void(const asio::error_code&)>;
-using WriteErrorHandler = std::function<void(const asio::error_code&)>;
+// receives the events of an AsyncSocket on the io threads; messages arrive one at a time. the socket reads
+// the next payload into the same buffer unless the listener kept a reference to it
+class SocketListener {
+public:
+    virtual void onMessage(data_type type, std::shared_ptr<MsgPayload> payload) = 0;
+    virtual void onReadError(const asio::error_code &ec) = 0;
+    virtual void onWriteError(const asio::error_code &ec) = 0;
+    // a queued message was written
+    virtual void onWriteDone() {}
+
+protected:
+    ~SocketListener() = default;
+};
+
+// throttles a socket: it charges each message it read and each frame it is about to write, and waits
+// the returned time before reading or writing on. the peer sees a slow connection, not an error
+class SocketLimiter {
+public:
+    virtual std::chrono::nanoseconds chargeRead(data_type type, size_t bytes) = 0;
+    virtual std::chrono::nanoseconds chargeWrite(size_t bytes) = 0;
+
+protected:
+    ~SocketLimiter() = default;
+};
 
 class AsyncSocket {
 public:
-    AsyncSocket(asio::ip::tcp::socket &&socket);
+    // any connected stream socket: TCP, or a Unix domain socket for clients on the same host
+    using Stream = asio::generic::stream_protocol::socket;
+
+    AsyncSocket(Stream &&socket);
     ~AsyncSocket();
+    // true once a read or a write failed, the error handler has been called by then
     bool isDead() const;
-    void start(MessageHandler msgH, ReadErrorHandler readErrH, WriteErrorHandler writeErrH);
-    void doWrite();
+    // a read or write is in flight and its handler still refers to the socket
+    bool ioPending() const;
+    // shuts the connection down, pending operations complete with an error
+    void close();
+    // the listener must outlive the socket's pending operations
+    void start(SocketListener &listener);
+    // set before start(), the limiter must outlive the socket's pending operations
+    void setLimiter(SocketLimiter *limiter);
+    // set before start(): a frame announcing a longer payload fails the socket with message_size before any
+    // buffer is sized for it; unlimited by default
+    void setFrameLimits(size_t command, size_t data);
+    // for every TCP socket of the process started after the call
+    static void setTuning(const minidrive::SocketTuning &tuning);
+    static const minidrive::SocketTuning& tuning();
     void sendMessage(data_type type, MsgPayload &&payload);
     void sendMessage(const std::string &msg);
+    // COMMAND frames are written before any queued DATA frame. DATA frames of one flow (e.g. a transfer)
+    // keep their order, concurrent flows share the connection by deficit round robin
 
-    inline const asio::ip::tcp::socket& getSocket() const {return _socket;}
+    // queues a frame built by makeFrame(), avoids moving large payloads to make room for the header
+    void sendFrame(MsgPayload &&frame, uint32_t flow = 0);
+    // queues a complete frame in memory the socket doesn't own, the reference is dropped once it was written
+    void sendFrame(std::shared_ptr<const uint8_t> frame, size_t size, uint32_t flow = 0);
+    // messages queued or being written
+    size_t queuedMessages();
+
+    static MsgPayload makeFrame(data_type type, uint32_t payloadLength);
+    // stop issuing reads after the current message handler returns; pauses nest,
+    // reading restarts after the matching number of resumeReading() calls; both are safe from any thread
+    void pauseReading();
+    void resumeReading();
+
+    inline const Stream& getSocket() const {return _socket;}
+    // "address:port" of a TCP peer, "unix" for a local one
+    static std::string peerName(const Stream &socket);
+    // what per-address limits count a peer by: its IP address, or "unix" for every local peer
+    static std::string peerAddress(const Stream &socket);
     
 private:
-    void _readHeader();
-    void _readPayload(data_type type, uint32_t payloadLength);
+    // runs a read or write loop on the socket's executor, counted in _pendingIo until it returns
+    void _spawn(asio::awaitable<void> loop);
+    // reads whatever the kernel has into the receive buffer and hands every complete frame in it to the
+    // listener, while data keeps arriving, until an error or until a handler paused reading. `readable`
+    // when started on readiness: the loop reads at least once, which is how it sees the peer's EOF
+    asio::awaitable<void> _readLoop(bool readable);
+    // an idle connection waits for readable data without a coroutine frame, the read loop starts on it;
+    // only on the socket's executor
+    void _awaitData();
+
+    struct OutFrame {
+        MsgPayload payload;
+        std::shared_ptr<const uint8_t> external{};
+        size_t externalSize = 0;
+
+        inline size_t size() const {return external ? externalSize : payload.size();}
+    };
+
+    // frames waiting behind _writing
+    struct WriteQueue {
+        struct Flow {
+            uint32_t id = 0;
+            std::deque<OutFrame> frames;
+            size_t deficit = 0;
+            // got its quantum for the current turn
+            bool credited = false;
+        };
+
+        std::deque<OutFrame> commands;
+        // flows with queued frames, the front one is being served
+        std::deque<Flow> flows;
+        size_t size = 0;
+
+        void push(data_type type, uint32_t flow, OutFrame &&frame);
+        OutFrame pop();
+    };
+
+    // bytes a flow may send per turn; frames are never split, a larger one waits for more turns
+    inline static const size_t FLOW_QUANTUM = 1024 * 1024;
+    inline static const int NOTSENT_LOWAT = 128 * 1024;
+    // a larger payload buffer is dropped when no more data is waiting, a connection going idle keeps none
+    inline static const size_t KEEP_READ_BUFFER = 64 * 1024;
+    // small frames are parsed out of one receive buffer, many per read
+    inline static const size_t RECEIVE_BUFFER = 64 * 1024;
+    // larger payloads skip the receive buffer and are read into the payload buffer directly
+    inline static const size_t DIRECT_PAYLOAD = 16 * 1024;
+
+    void _enqueue(data_type type, uint32_t flow, OutFrame &&frame);
+    // writes _writing and the backlog behind it, each after the limiter's delay if there is one
+    asio::awaitable<void> _writeLoop();
 
+    // an idle connection holds no large buffer: the receive buffer exists while data arrives, payloads are
+    // copied or read into _inbound, the frame being written lives in _writing and frames queued behind it
+    // in a backlog created on demand
+    std::atomic<bool> _isDead;
+    std::atomic<int> _pendingIo;
+    Stream _socket;
+    SocketListener *_listener;
+    MsgHeader _header;
+    std::unique_ptr<uint8_t[]> _received;
+    // unparsed bytes of the receive buffer
+    size_t _receivedStart;
+    size_t _receivedEnd;
+    // reused for the next payload unless the listener kept a reference
+    std::shared_ptr<MsgPayload> _inbound;
+    // TCP only: a Unix domain socket has no segments to cork or window to size
+    bool _tcp;
+    // set when the buffers follow the measured bandwidth-delay product
+    bool _sizeBuffers;
+    minidrive::BufferSizer _sendSizer;
+    minidrive::BufferSizer _receiveSizer;
+    int _readPauses;
+    // the read loop stopped while paused and waits for resumeReading()
+    bool _readParked;
+    bool _writeBusy;
 
-    bool _isDead;
-    asio::ip::tcp::socket _socket;
+    OutFrame _writing;
+    std::unique_ptr<WriteQueue> _backlog;
 
-    std::queue<MsgPayload> _writeQueue;
-    std::mutex _writeQueueMutex;
-    std::atomic<bool> _writeBusy;
+    SocketLimiter *_limiter;
+    // longest payload accepted per frame type
+    size_t _maxCommand;
+    size_t _maxData;
+    std::chrono::steady_clock::time_point _readResumeAt;
+    // only throttled sockets get timers
+    std::unique_ptr<asio::steady_timer> _readTimer;
+    std::unique_ptr<asio::steady_timer> _writeTimer;
+    // guards the read pause state and the write queue
+    std::mutex _mutex;
 
-    MessageHandler _messageHandler;
-    ReadErrorHandler _readErrorHandler;
-    WriteErrorHandler _writeErrorHandler;
+    inline static minidrive::SocketTuning _tuning;
 };
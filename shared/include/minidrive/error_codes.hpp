@@ -34,6 +34,15 @@ namespace error {
     inline const error_code TARGET_NOT_FOUND(1201, "target does not exist");
     inline const error_code FS_ERROR(1202, "filesystem error");
     inline const error_code TARGET_ALREADY_EXISTS(1203, "target already exists");
+    inline const error_code QUOTA_EXCEEDED(1204, "storage quota exceeded");
+
+    inline const error_code TRANSFER_NOT_FOUND(1300, "transfer not found");
+    inline const error_code INVALID_TOKEN(1301, "invalid or expired token");
+    inline const error_code TRANSFER_FAILED(1302, "transfer failed");
+    inline const error_code INVALID_CHUNK(1303, "invalid chunk");
+    inline const error_code CORRUPT_CHUNK(1304, "chunk failed its integrity check");
+
+    inline const error_code TOO_MANY_CONNECTIONS(1400, "too many connections");
     
 }
 
@@ -0,0 +1,19 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+// small LZ77 block codec for DATA chunks, in the spirit of LZ4: byte aligned sequences of literals
+// and 64 KiB back references, no entropy coding. fast enough to run on the io threads
+namespace minidrive::lz {
+
+// compresses `size` bytes (less than 4 GiB) into at most `capacity` bytes of `dst`,
+// returns the compressed size or 0 when it doesn't fit
+size_t compress(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity);
+// true when `src` decoded to exactly `size` bytes; input from the network is checked, never trusted
+bool decompress(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t size);
+
+// estimates the byte entropy of a few samples spread over the data, false for what looks compressed
+// or encrypted already, so that media costs a few microseconds instead of a failed compression
+bool worthCompressing(const uint8_t *src, size_t size);
+
+} // namespace minidrive::lz
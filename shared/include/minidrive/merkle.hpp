@@ -0,0 +1,59 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <optional>
+#include "minidrive/transfer.hpp"
+
+namespace minidrive {
+
+// hash tree over the chunk tags of a file. level 0 holds the tags, a node above is BLAKE2b-128 of its
+// two children and a node without a sibling is carried up as it is, the last level holds the root.
+// trees of two files with the same number of chunks differ exactly on the paths down to differing chunks
+class MerkleTree {
+public:
+    MerkleTree();
+    explicit MerkleTree(std::vector<ChunkTag> leaves);
+
+    inline size_t levels() const {return _levels.size();}
+    inline size_t width(size_t level) const {return _levels[level].size();}
+    inline const ChunkTag& node(size_t level, size_t index) const {return _levels[level][index];}
+    inline const std::vector<ChunkTag>& leaves() const {return _levels.front();}
+    // zero for an empty file
+    ChunkTag root() const;
+
+private:
+    std::vector<std::vector<ChunkTag>> _levels;
+};
+
+std::string tagToHex(const ChunkTag &tag);
+std::optional<ChunkTag> tagFromHex(const std::string &hex);
+
+// nodes one TREE request may ask for
+inline constexpr size_t MAX_TREE_QUERY = 16384;
+
+// finds the chunks where `local` differs from the other side's tree of the same width. starts at the
+// root and only descends into differing nodes, so a few bad chunks of a huge file cost a few small
+// queries: ask the other side for the nodes at suspects() of level() and pass them to next() until done()
+class TreeDiff {
+public:
+    explicit TreeDiff(const MerkleTree &local);
+
+    inline bool done() const {return _done;}
+    inline size_t level() const {return _level;}
+    inline const std::vector<uint64_t>& suspects() const {return _suspects;}
+    // false when `hashes` can't be the answer for suspects()
+    bool next(const std::vector<ChunkTag> &hashes);
+    // in order, once done()
+    inline const std::vector<uint64_t>& differing() const {return _differing;}
+
+private:
+    const MerkleTree &_local;
+    size_t _level;
+    std::vector<uint64_t> _suspects;
+    std::vector<uint64_t> _differing;
+    bool _done;
+};
+
+} // namespace minidrive
@@ -0,0 +1,57 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+namespace minidrive {
+
+// token bucket kept as a theoretical arrival time (GCRA), so charging is a single CAS. a charge larger
+// than what is available is still granted and answered with the time to wait, which the caller turns
+// into backpressure instead of an error
+class TokenBucket {
+public:
+    // `rate` tokens per second, up to `burst` of them without waiting; rate 0 is unlimited
+    TokenBucket(double rate, double burst);
+    std::chrono::nanoseconds charge(double tokens);
+    inline bool unlimited() const {return _nsPerToken <= 0;}
+
+private:
+    double _nsPerToken;
+    int64_t _burstNs;
+    std::atomic<int64_t> _tat;
+};
+
+// commands and bytes per second of one scope, 0 is unlimited
+struct RateLimit {
+    double commands = 0;
+    double bytes = 0;
+
+    inline bool unlimited() const {return commands <= 0 && bytes <= 0;}
+};
+
+// "COMMANDS:BYTES" with an optional K, M or G suffix on the bytes, e.g. "20:10M"
+std::optional<RateLimit> parseRateLimit(const std::string &text);
+// a number of bytes with an optional K, M or G suffix, e.g. "16M"
+std::optional<double> parseBytes(const std::string &text);
+
+// the buckets of one scope: the whole server, one address or one user
+class RateBuckets {
+public:
+    explicit RateBuckets(const RateLimit &limit);
+    // commands count against the command bucket, bytes in both directions against the byte bucket
+    std::chrono::nanoseconds charge(double commands, size_t bytes);
+
+private:
+    // commands may come in bursts of one second, bytes of a quarter second but at least a chunk
+    inline static const double COMMAND_BURST_SECONDS = 1.0;
+    inline static const double BYTE_BURST_SECONDS = 0.25;
+    inline static const double MIN_BYTE_BURST = 1024 * 1024;
+
+    TokenBucket _commands;
+    TokenBucket _bytes;
+};
+
+} // namespace minidrive
@@ -0,0 +1,36 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+
+namespace minidrive {
+
+// options of TCP connections: replies go out at once with TCP_NODELAY, a backlog of frames is written
+// corked so it leaves in full segments, and the kernel buffers follow the measured bandwidth-delay product
+struct SocketTuning {
+    // fixed SO_SNDBUF and SO_RCVBUF; 0 leaves them to the kernel's autotuning and only grows them further
+    // when a measured bandwidth-delay product needs more than that
+    size_t bufferBytes = 0;
+};
+
+// TCP_NODELAY, keepalive and the fixed buffer sizes; on a listening socket the accepted ones inherit them
+void tuneSocket(int fd, const SocketTuning &tuning);
+void setCork(int fd, bool corked);
+
+// measures one direction of a connection and grows its kernel buffer to twice the bandwidth-delay
+// product, within net.core.wmem_max / rmem_max. never shrinks it: setting the size turns off the
+// kernel's own autotuning, so it only happens once the kernel's size is not enough
+class BufferSizer {
+public:
+    explicit BufferSizer(bool send);
+    // counts bytes moved, every MEASURE_BYTES the rate and TCP_INFO's rtt are checked
+    void account(int fd, size_t bytes);
+
+private:
+    inline static const size_t MEASURE_BYTES = 8 * 1024 * 1024;
+
+    bool _send;
+    size_t _bytes;
+    std::chrono::steady_clock::time_point _since;
+};
+
+} // namespace minidrive
@@ -0,0 +1,106 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <array>
+#include <string>
+#include <vector>
+#include <utility>
+#include <sodium.h>
+#include "minidrive/async_socket.hpp"
+
+namespace minidrive {
+
+// BLAKE2b-128 of a chunk's bytes before compression; a chunk whose tag doesn't match is asked for again
+inline constexpr size_t CHUNK_TAG_BYTES = 16;
+using ChunkTag = std::array<uint8_t, CHUNK_TAG_BYTES>;
+ChunkTag chunkTag(const uint8_t *data, size_t len);
+
+// every DATA frame starts with this header, followed by the chunk bytes
+struct ChunkHeader {
+    static constexpr size_t SIZE = 12 + CHUNK_TAG_BYTES;
+
+    uint32_t transferId = 0;
+    uint64_t offset = 0;
+    ChunkTag tag{};
+
+    void encode(uint8_t *out) const;
+    static ChunkHeader decode(const uint8_t *in);
+};
+
+inline constexpr uint32_t CHUNK_SIZE = 1024 * 1024;
+// DATA frames a connection keeps queued before waiting for its writes to finish
+inline constexpr size_t TRANSFER_WINDOW = 4;
+// a transfer fails once this many of its chunks arrived damaged
+inline constexpr unsigned MAX_RESENDS = 16;
+inline constexpr size_t TRANSFER_TOKEN_BYTES = 16;
+
+inline uint64_t chunkCount(uint64_t size, uint32_t chunkSize) {
+    return (size + chunkSize - 1) / chunkSize;
+}
+
+inline uint32_t chunkLength(uint64_t size, uint32_t chunkSize, uint64_t offset) {
+    return static_cast<uint32_t>(std::min<uint64_t>(chunkSize, size - offset));
+}
+
+inline size_t chunkFrameSize(uint32_t len) {return MsgHeader::SIZE + ChunkHeader::SIZE + len;}
+// writes the frame and chunk headers for `len` bytes of file data to the start of `frame`
+void encodeChunkFrame(uint8_t *frame, const ChunkHeader &header, uint32_t len);
+// frame with a chunk header for `len` bytes of file data, to be filled after ChunkHeader::SIZE
+MsgPayload makeChunkFrame(const ChunkHeader &header, uint32_t len);
+inline uint8_t* chunkData(MsgPayload &frame) {return frame.data() + MsgHeader::SIZE + ChunkHeader::SIZE;}
+// tags the filled chunk frame of `frameSize` bytes at `frame` and returns the tag
+ChunkTag tagChunkFrame(uint8_t *frame, size_t frameSize);
+
+// hash of a whole file: BLAKE2b-256 over the tags of its chunks in file order. chunks come in any
+// order, a tag is folded in as soon as every earlier one was, so the hash is ready with the last chunk
+// and the file is never read twice
+class FileHasher {
+public:
+    explicit FileHasher(uint64_t chunks = 0);
+    // starts over for a file of `chunks` chunks
+    void reset(uint64_t chunks);
+    // tags of chunks added before are ignored
+    void add(uint64_t index, const ChunkTag &tag);
+    inline bool complete() const {return _next == _tags.size();}
+    // hex digest, empty until complete
+    std::string hex();
+    // tags by chunk index, zero for chunks not added yet
+    inline const std::vector<ChunkTag>& tags() const {return _tags;}
+
+private:
+    std::vector<ChunkTag> _tags;
+    std::vector<bool> _have;
+    uint64_t _next;
+    crypto_generichash_state _state;
+    std::string _hex;
+};
+
+// once a connection negotiated compression, a DATA payload shorter than its chunk holds the chunk
+// lz compressed; chunks that don't shrink are sent as they are
+inline constexpr const char* COMPRESSION_LZ = "lz";
+// `frame` is a whole chunk frame (frame header, chunk header, data), true when `out` got a smaller one
+bool compressChunkFrame(const uint8_t *frame, size_t frameSize, MsgPayload &out);
+// `payload` is a compressed DATA payload, `out` gets the chunk header and the `len` bytes of the chunk
+bool decompressChunk(const uint8_t *payload, size_t payloadSize, uint32_t len, MsgPayload &out);
+
+// sparse files: chunks that lie entirely in holes of the source are announced as "holes" in UPLOAD and DOWNLOAD
+// and never sent, and a DATA payload of just the chunk header stands for a chunk of zeros found while reading.
+// receivers leave both as holes
+bool isZero(const uint8_t *data, size_t len);
+// tag of a chunk of `len` zeros
+ChunkTag zeroTag(uint32_t len);
+// indices of the chunks that hold no data, found with SEEK_DATA/SEEK_HOLE; empty when the filesystem can't tell
+std::vector<uint64_t> holeChunks(int fd, uint64_t size, uint32_t chunkSize);
+// sorted indices as [first, count] runs, the form "holes" takes on the wire
+using ChunkRanges = std::vector<std::pair<uint64_t, uint64_t>>;
+ChunkRanges toRanges(const std::vector<uint64_t> &indices);
+// the indices of `ranges`, in order; false when they overlap, are unsorted or reach past `count` chunks
+bool fromRanges(const ChunkRanges &ranges, uint64_t count, std::vector<uint64_t> &indices);
+// makes the range read as zeros, punching a hole where the filesystem can and writing zeros where it can't
+bool punchHole(int fd, uint64_t offset, uint64_t len);
+
+// hex encoded random token the extra data connections present in JOIN
+std::string makeTransferToken();
+
+} // namespace minidrive
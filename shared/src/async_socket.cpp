@@ -2,10 +2,14 @@
 #include <asio.hpp>
 #include <spdlog/spdlog.h>
 #include <limits>
+#include <optional>
+#include <cstring>
+#include <algorithm>
+#include <netinet/tcp.h>
 
 using asio::ip::tcp;
 
-MsgHeader::MsgHeader() : buffer(5) {}
+MsgHeader::MsgHeader() : buffer{} {}
 
 // void MsgHeader::parse() {
 //     type = static_cast<data_type>(buffer[0]);
@@ -32,17 +36,20 @@ void MsgHeader::setLen(uint32_t len) {
     buffer[3] = (len >> 16) & 0xff;
     buffer[4] = (len >> 24) & 0xff;
 }
-data_type MsgHeader::getType() {
+data_type MsgHeader::getType() const {
     return static_cast<data_type>(buffer[0]);
 }
-uint32_t MsgHeader::getLen() {
+uint32_t MsgHeader::getLen() const {
     return buffer[1] << 0  | buffer[2] << 8 |
            buffer[3] << 16 | buffer[4] << 24;
 }
 
 
-AsyncSocket::AsyncSocket(tcp::socket &&socket)
-    :_isDead(false), _socket(std::move(socket)) {
+AsyncSocket::AsyncSocket(Stream &&socket)
+    :_isDead(false), _pendingIo(0), _socket(std::move(socket)), _listener(nullptr), _receivedStart(0),
+     _receivedEnd(0), _tcp(false), _sizeBuffers(false), _sendSizer(true), _receiveSizer(false), _readPauses(0),
+     _readParked(false), _writeBusy(false), _limiter(nullptr), _maxCommand(std::numeric_limits<uint32_t>::max()),
+     _maxData(std::numeric_limits<uint32_t>::max()) {
     
 }
 
@@ -50,90 +57,345 @@ AsyncSocket::~AsyncSocket() {
     spdlog::debug("~AsyncSocket()");
 }
 
+namespace {
+
+std::optional<tcp::endpoint> tcpPeer(const AsyncSocket::Stream &socket) {
+    asio::error_code ec;
+    auto endpoint = socket.remote_endpoint(ec);
+    int family = endpoint.protocol().family();
+    if (ec || (family != AF_INET && family != AF_INET6)) return std::nullopt;
+    tcp::endpoint peer;
+    std::memcpy(peer.data(), endpoint.data(), endpoint.size());
+    peer.resize(endpoint.size());
+    return peer;
+}
+
+} // namespace
+
+std::string AsyncSocket::peerName(const Stream &socket) {
+    auto peer = tcpPeer(socket);
+    return peer ? peer->address().to_string() + ":" + std::to_string(peer->port()) : "unix";
+}
+
+std::string AsyncSocket::peerAddress(const Stream &socket) {
+    auto peer = tcpPeer(socket);
+    return peer ? peer->address().to_string() : "unix";
+}
+
 bool AsyncSocket::isDead() const {
     return _isDead;
 }
 
-void AsyncSocket::start(MessageHandler msgH, ReadErrorHandler readErrH, WriteErrorHandler writeErrH) {
-    _messageHandler = msgH;
-    _readErrorHandler = readErrH;
-    _writeErrorHandler = writeErrH;
-    _readHeader();
+bool AsyncSocket::ioPending() const {
+    return _pendingIo > 0;
 }
 
-void AsyncSocket::_readHeader() {
-    auto header = std::make_shared<MsgHeader>();
-    asio::async_read(
-        _socket,
-        asio::buffer(header->getBuffer()),
-        [this, header](const asio::error_code &ec, size_t) {
-            if (!ec) {
-                _readPayload(header->getType(), header->getLen());
-            }
-            else if (ec == asio::error::eof) {
-                _readErrorHandler(ec);
-                _isDead = true;
+void AsyncSocket::close() {
+    {
+        std::lock_guard lock(_mutex);
+        if (_readTimer) _readTimer->cancel();
+        if (_writeTimer) _writeTimer->cancel();
+    }
+    asio::error_code ec;
+    _socket.shutdown(Stream::shutdown_both, ec);
+    _socket.close(ec);
+}
+
+void AsyncSocket::start(SocketListener &listener) {
+    _listener = &listener;
+    // the read and write loops try the kernel directly before suspending
+    asio::error_code blockingEc;
+    _socket.non_blocking(true, blockingEc);
+    _tcp = tcpPeer(_socket).has_value();
+    if (_tcp) {
+        minidrive::tuneSocket(_socket.native_handle(), _tuning);
+        _sizeBuffers = _tuning.bufferBytes == 0;
+#ifdef TCP_NOTSENT_LOWAT
+        // keep the unsent part of the kernel buffer short, a reply queued behind DATA
+        // would otherwise wait for megabytes already handed to the kernel
+        asio::error_code ec;
+        _socket.set_option(asio::detail::socket_option::integer<IPPROTO_TCP, TCP_NOTSENT_LOWAT>(NOTSENT_LOWAT), ec);
+#endif
+    }
+    _awaitData();
+}
+
+void AsyncSocket::setLimiter(SocketLimiter *limiter) {
+    _limiter = limiter;
+}
+
+void AsyncSocket::setFrameLimits(size_t command, size_t data) {
+    _maxCommand = command;
+    _maxData = data;
+}
+
+void AsyncSocket::setTuning(const minidrive::SocketTuning &tuning) {
+    _tuning = tuning;
+}
+
+const minidrive::SocketTuning& AsyncSocket::tuning() {
+    return _tuning;
+}
+
+void AsyncSocket::_spawn(asio::awaitable<void> loop) {
+    ++_pendingIo;
+    asio::co_spawn(_socket.get_executor(), std::move(loop), [](std::exception_ptr e) {
+        if (e) std::rethrow_exception(e);
+    });
+}
+
+asio::awaitable<void> AsyncSocket::_readLoop(bool readable) {
+    asio::error_code ec;
+    if (!_received) _received = std::make_unique_for_overwrite<uint8_t[]>(RECEIVE_BUFFER);
+    bool parked = false;
+    while (!ec && !parked) {
+        // hand over every complete frame in the buffer
+        while (_receivedEnd - _receivedStart >= MsgHeader::SIZE) {
+            std::memcpy(_header.getBuffer().data(), _received.get() + _receivedStart, MsgHeader::SIZE);
+            data_type type = _header.getType();
+            size_t len = _header.getLen();
+            size_t buffered = _receivedEnd - _receivedStart - MsgHeader::SIZE;
+            // the length comes from the peer, nothing is allocated for a frame no peer may send
+            if (len > (type == data_type::DATA ? _maxData : _maxCommand)) {
+                spdlog::warn("{} frame of {}B is over the limit", type == data_type::DATA ? "DATA" : "COMMAND", len);
+                ec = asio::error::message_size;
+                break;
             }
-            else {
-                _readErrorHandler(ec);
-                _isDead = true;
+            // the rest of a small frame comes with the next read
+            if (len > buffered && len <= DIRECT_PAYLOAD) break;
+
+            // charged before its payload is sized or read, a frame over the budget waits below
+            if (_limiter) {
+                auto delay = _limiter->chargeRead(type, MsgHeader::SIZE + len);
+                if (delay.count() > 0) _readResumeAt = std::chrono::steady_clock::now() + delay;
             }
-        }
-    );
-}
-
-void AsyncSocket::_readPayload(data_type type, uint32_t payloadLength) {
-    auto payload = std::make_shared<MsgPayload>(payloadLength);
-    asio::async_read(
-        _socket,
-        asio::buffer(*payload),
-        [this, type, payload](const asio::error_code &ec, size_t) {
-            if (!ec) {
-                _messageHandler(type, payload);
-                _readHeader();
+            if (_limiter && _readResumeAt > std::chrono::steady_clock::now()) {
+                // leave the data in the kernel, the peer's window fills up and it slows down
+                {
+                    std::lock_guard lock(_mutex);
+                    if (!_readTimer) _readTimer = std::make_unique<asio::steady_timer>(_socket.get_executor());
+                    _readTimer->expires_at(_readResumeAt);
+                }
+                // close() cancels the wait
+                co_await _readTimer->async_wait(asio::redirect_error(asio::use_awaitable, ec));
+                if (ec) break;
             }
-            else if (ec == asio::error::eof) {
-                _readErrorHandler(ec);
-                _isDead = true;
+
+            if (!_inbound || _inbound.use_count() > 1) _inbound = std::make_shared<MsgPayload>();
+            _inbound->resize(len);
+            size_t copied = std::min(len, buffered);
+            std::memcpy(_inbound->data(), _received.get() + _receivedStart + MsgHeader::SIZE, copied);
+            _receivedStart += MsgHeader::SIZE + copied;
+            if (copied < len) {
+                // a large payload goes from the kernel straight into its own buffer
+                asio::mutable_buffer rest = asio::buffer(*_inbound) + copied;
+                if (_socket.available(ec) >= rest.size()) asio::read(_socket, rest, ec);
+                else co_await asio::async_read(_socket, rest, asio::redirect_error(asio::use_awaitable, ec));
+                if (ec) break;
+                if (_sizeBuffers) _receiveSizer.account(_socket.native_handle(), rest.size());
             }
-            else {
-                _readErrorHandler(ec);
-                _isDead = true;
+
+            _listener->onMessage(type, _inbound);
+
+            // the handler may have paused reading, park the loop until resumeReading()
+            {
+                std::lock_guard lock(_mutex);
+                if (_readPauses > 0) _readParked = parked = true;
             }
+            if (parked) break;
         }
-    );
+        if (ec || parked) break;
+
+        // a partial frame moves to the front, there is always room for the rest of it behind
+        size_t partial = _receivedEnd - _receivedStart;
+        if (partial > 0 && _receivedStart > 0) std::memmove(_received.get(), _received.get() + _receivedStart, partial);
+        _receivedStart = 0;
+        _receivedEnd = partial;
+
+        asio::error_code availableEc;
+        if (!readable && partial == 0 && _socket.available(availableEc) == 0) {
+            // the peer has nothing more queued, an idle connection keeps no buffer
+            _received.reset();
+            if (_inbound && _inbound->capacity() > KEEP_READ_BUFFER) _inbound.reset();
+            _awaitData();
+            break;
+        }
+        // bytes already in the kernel are taken without suspending, every co_await allocates a frame
+        asio::mutable_buffer space(_received.get() + _receivedEnd, RECEIVE_BUFFER - _receivedEnd);
+        size_t n = _socket.read_some(space, ec);
+        if (ec == asio::error::would_block || ec == asio::error::try_again) {
+            ec.clear();
+            n = co_await _socket.async_read_some(space, asio::redirect_error(asio::use_awaitable, ec));
+        }
+        _receivedEnd += n;
+        if (_sizeBuffers) _receiveSizer.account(_socket.native_handle(), n);
+        readable = false;
+    }
+    if (ec) {
+        _isDead = true;
+        _listener->onReadError(ec);
+    }
+    // the owner may be freed once no operation is pending, nothing touches `this` after this
+    --_pendingIo;
 }
 
+void AsyncSocket::_awaitData() {
+    ++_pendingIo;
+    _socket.async_wait(Stream::wait_read, [this](const asio::error_code &ec) {
+        if (!ec) {
+            _spawn(_readLoop(true));
+        }
+        else {
+            _isDead = true;
+            _listener->onReadError(ec);
+        }
+        --_pendingIo;
+    });
+}
 
-void AsyncSocket::doWrite() {
-    _writeQueueMutex.lock();
-    if (_writeBusy) {
-        _writeQueueMutex.unlock();
-        return;
+void AsyncSocket::pauseReading() {
+    std::lock_guard lock(_mutex);
+    ++_readPauses;
+}
+
+void AsyncSocket::resumeReading() {
+    {
+        std::lock_guard lock(_mutex);
+        if (_readPauses == 0 || --_readPauses > 0 || !_readParked) return;
+        _readParked = false;
     }
-    if (_writeQueue.empty()) {
-        _writeQueueMutex.unlock();
+    // may be called from a worker thread, the socket is only touched on its executor
+    ++_pendingIo;
+    asio::post(_socket.get_executor(), [this]() {
+        // frames read before the pause are handed over first
+        if (_receivedEnd > _receivedStart) _spawn(_readLoop(false));
+        else _awaitData();
+        --_pendingIo;
+    });
+}
+
+void AsyncSocket::WriteQueue::push(data_type type, uint32_t flow, OutFrame &&frame) {
+    ++size;
+    if (type != data_type::DATA) {
+        commands.push_back(std::move(frame));
         return;
     }
-    auto payload = std::make_shared<MsgPayload>(std::move(_writeQueue.front()));
-    _writeQueue.pop();
-    _writeBusy = true;
-    _writeQueueMutex.unlock();
-
-    asio::async_write(
-        _socket,
-        asio::buffer(*payload),
-        [this, payload](const asio::error_code &ec, size_t) {
-            if (!ec) {
-                _writeBusy = false;
-                doWrite();
+    for (auto &f : flows) {
+        if (f.id == flow) {
+            f.frames.push_back(std::move(frame));
+            return;
+        }
+    }
+    auto &added = flows.emplace_back();
+    added.id = flow;
+    added.frames.push_back(std::move(frame));
+}
+
+AsyncSocket::OutFrame AsyncSocket::WriteQueue::pop() {
+    --size;
+    OutFrame frame;
+    if (!commands.empty()) {
+        frame = std::move(commands.front());
+        commands.pop_front();
+        return frame;
+    }
+    for (;;) {
+        Flow &flow = flows.front();
+        if (!flow.credited) {
+            flow.deficit += FLOW_QUANTUM;
+            flow.credited = true;
+        }
+        if (flow.deficit >= flow.frames.front().size()) {
+            flow.deficit -= flow.frames.front().size();
+            frame = std::move(flow.frames.front());
+            flow.frames.pop_front();
+            // a flow that ran dry leaves the rotation and its credit
+            if (flow.frames.empty()) flows.pop_front();
+            return frame;
+        }
+        // turn over, the next flow is served
+        flow.credited = false;
+        flows.push_back(std::move(flow));
+        flows.pop_front();
+    }
+}
+
+void AsyncSocket::_enqueue(data_type type, uint32_t flow, OutFrame &&frame) {
+    {
+        std::lock_guard lock(_mutex);
+        if (_isDead) return;
+        if (_writeBusy) {
+            if (!_backlog) _backlog = std::make_unique<WriteQueue>();
+            _backlog->push(type, flow, std::move(frame));
+            return;
+        }
+        _writing = std::move(frame);
+        _writeBusy = true;
+    }
+    _spawn(_writeLoop());
+}
+
+asio::awaitable<void> AsyncSocket::_writeLoop() {
+    asio::error_code ec;
+    bool corked = false;
+    while (true) {
+        asio::const_buffer buffer = _writing.external ? asio::buffer(_writing.external.get(), _writing.externalSize)
+                                                      : asio::const_buffer(asio::buffer(_writing.payload));
+        if (_tcp) {
+            // frames queued behind this one go out in full segments, the last one is flushed by uncorking
+            bool behind;
+            {
+                std::lock_guard lock(_mutex);
+                behind = _backlog != nullptr;
+            }
+            if (behind != corked) minidrive::setCork(_socket.native_handle(), corked = behind);
+        }
+        auto delay = _limiter ? _limiter->chargeWrite(buffer.size()) : std::chrono::nanoseconds(0);
+        if (delay.count() > 0) {
+            {
+                std::lock_guard lock(_mutex);
+                if (!_writeTimer) _writeTimer = std::make_unique<asio::steady_timer>(_socket.get_executor());
+                _writeTimer->expires_after(delay);
+            }
+            co_await _writeTimer->async_wait(asio::redirect_error(asio::use_awaitable, ec));
+        }
+        if (!ec) {
+            // the socket is non-blocking, whatever the kernel doesn't take at once is written asynchronously
+            buffer += _socket.write_some(buffer, ec);
+            if (ec == asio::error::would_block || ec == asio::error::try_again) ec.clear();
+            if (!ec && buffer.size() > 0) {
+                co_await asio::async_write(_socket, buffer, asio::redirect_error(asio::use_awaitable, ec));
+            }
+            if (!ec && _sizeBuffers) _sendSizer.account(_socket.native_handle(), _writing.size());
+        }
+
+        OutFrame written;
+        bool more = false;
+        {
+            std::lock_guard lock(_mutex);
+            written = std::move(_writing);
+            if (!ec && _backlog) {
+                _writing = _backlog->pop();
+                // a connection that caught up keeps no queue around
+                if (_backlog->size == 0) _backlog.reset();
+                more = true;
             }
             else {
-                _writeErrorHandler(ec);
-                _isDead = true;
+                _writeBusy = false;
             }
         }
-    );
+        // free the frame before writing the next one
+        written = OutFrame();
+        if (ec) break;
+        _listener->onWriteDone();
+        if (!more) break;
+    }
+    if (corked && !ec) minidrive::setCork(_socket.native_handle(), false);
+    if (ec) {
+        _isDead = true;
+        _listener->onWriteError(ec);
+    }
+    --_pendingIo;
 }
 
 void AsyncSocket::sendMessage(data_type type, MsgPayload &&payload) {
@@ -144,18 +406,36 @@ void AsyncSocket::sendMessage(data_type type, MsgPayload &&payload) {
 
     MsgHeader header;
     header.setType(type);
-    header.setLen(payload.size());
-    payload.reserve(payload.size() + header.getBuffer().size());
+    header.setLen(static_cast<uint32_t>(payload.size()));
     payload.insert(payload.begin(), header.getBuffer().begin(), header.getBuffer().end());
+    _enqueue(type, 0, OutFrame{std::move(payload)});
+}
 
-    {
-        std::lock_guard lock(_writeQueueMutex);
-        _writeQueue.push(std::move(payload));
-    }
-    doWrite();
+void AsyncSocket::sendFrame(MsgPayload &&frame, uint32_t flow) {
+    auto type = static_cast<data_type>(frame.at(0));
+    _enqueue(type, flow, OutFrame{std::move(frame)});
+}
+
+void AsyncSocket::sendFrame(std::shared_ptr<const uint8_t> frame, size_t size, uint32_t flow) {
+    auto type = static_cast<data_type>(frame.get()[0]);
+    _enqueue(type, flow, OutFrame{MsgPayload(), std::move(frame), size});
+}
+
+size_t AsyncSocket::queuedMessages() {
+    std::lock_guard lock(_mutex);
+    return (_backlog ? _backlog->size : 0) + (_writeBusy ? 1 : 0);
+}
+
+MsgPayload AsyncSocket::makeFrame(data_type type, uint32_t payloadLength) {
+    MsgHeader header;
+    header.setType(type);
+    header.setLen(payloadLength);
+    MsgPayload frame(MsgHeader::SIZE + payloadLength);
+    std::copy(header.getBuffer().begin(), header.getBuffer().end(), frame.begin());
+    return frame;
 }
 
 void AsyncSocket::sendMessage(const std::string &msg) {
     MsgPayload p(msg.begin(), msg.end());
     sendMessage(data_type::COMMAND, std::move(p));
-}
\ No newline at end of file
+}
@@ -0,0 +1,192 @@
+#include "minidrive/lz.hpp"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstring>
+
+namespace minidrive::lz {
+
+namespace {
+
+// a sequence is a token (literal count << 4 | match length - MIN_MATCH), more length bytes when a
+// nibble is 15, the literals, a little endian 16 bit offset and more match length bytes; the last
+// sequence has literals only
+constexpr size_t MIN_MATCH = 4;
+// no match starts in the last MATCH_LIMIT bytes or reaches into the last LAST_LITERALS
+constexpr size_t MATCH_LIMIT = 12;
+constexpr size_t LAST_LITERALS = 5;
+constexpr size_t MAX_OFFSET = 65535;
+constexpr int HASH_BITS = 14;
+// after 2^SKIP_SHIFT misses in a row the search advances two bytes at a time, then three...
+constexpr unsigned SKIP_SHIFT = 6;
+
+constexpr size_t SAMPLE_WINDOWS = 16;
+constexpr size_t SAMPLE_WINDOW = 256;
+// bits per byte; 4 KiB of random data measure about 7.95
+constexpr double MAX_ENTROPY = 7.5;
+
+uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint32_t hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// bytes equal from `a` and `b` on, reading `a` no further than `end`
+size_t matchLength(const uint8_t *a, const uint8_t *b, const uint8_t *end) {
+    const uint8_t *start = a;
+    if constexpr (std::endian::native == std::endian::little) {
+        while (a + sizeof(uint64_t) <= end) {
+            uint64_t diff = read64(a) ^ read64(b);
+            if (diff != 0) return static_cast<size_t>(a - start) + static_cast<size_t>(std::countr_zero(diff)) / 8;
+            a += sizeof(uint64_t);
+            b += sizeof(uint64_t);
+        }
+    }
+    while (a < end && *a == *b) {
+        ++a;
+        ++b;
+    }
+    return static_cast<size_t>(a - start);
+}
+
+void putLength(uint8_t *&op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = static_cast<uint8_t>(len);
+}
+
+// matchLen 0 writes the final literal-only sequence
+bool putSequence(uint8_t *&op, const uint8_t *end, const uint8_t *literals, size_t literalLen,
+        size_t offset, size_t matchLen) {
+    size_t need = 1 + literalLen / 255 + 1 + literalLen + (matchLen > 0 ? 2 + matchLen / 255 + 1 : 0);
+    if (static_cast<size_t>(end - op) < need) return false;
+    uint8_t *token = op++;
+    *token = static_cast<uint8_t>(std::min<size_t>(literalLen, 15) << 4);
+    if (literalLen >= 15) putLength(op, literalLen - 15);
+    if (literalLen > 0) std::memcpy(op, literals, literalLen);
+    op += literalLen;
+    if (matchLen == 0) return true;
+    *op++ = static_cast<uint8_t>(offset & 0xff);
+    *op++ = static_cast<uint8_t>(offset >> 8);
+    size_t extra = matchLen - MIN_MATCH;
+    *token = static_cast<uint8_t>(*token | std::min<size_t>(extra, 15));
+    if (extra >= 15) putLength(op, extra - 15);
+    return true;
+}
+
+bool getLength(const uint8_t *&ip, const uint8_t *end, size_t &len) {
+    uint8_t b;
+    do {
+        if (ip == end) return false;
+        b = *ip++;
+        len += b;
+    } while (b == 255 && len < (SIZE_MAX >> 1));
+    return b != 255;
+}
+
+} // namespace
+
+size_t compress(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity) {
+    uint8_t *op = dst;
+    const uint8_t *const oend = dst + capacity;
+    const uint8_t *anchor = src;
+    if (size > MATCH_LIMIT) {
+        // positions of the last 4 byte sequences seen by hash; stale or colliding ones fail the compare
+        thread_local std::array<uint32_t, 1 << HASH_BITS> table;
+        table.fill(0);
+        const uint8_t *const matchLimit = src + size - MATCH_LIMIT;
+        const uint8_t *const matchEnd = src + size - LAST_LITERALS;
+        const uint8_t *ip = src + 1;
+        unsigned misses = 0;
+        while (ip < matchLimit) {
+            uint32_t sequence = read32(ip);
+            uint32_t h = hash(sequence);
+            const uint8_t *ref = src + table[h];
+            table[h] = static_cast<uint32_t>(ip - src);
+            if (ref >= ip || static_cast<size_t>(ip - ref) > MAX_OFFSET || read32(ref) != sequence) {
+                ip += 1 + (misses++ >> SKIP_SHIFT);
+                continue;
+            }
+            misses = 0;
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                --ip;
+                --ref;
+            }
+            size_t len = MIN_MATCH + matchLength(ip + MIN_MATCH, ref + MIN_MATCH, matchEnd);
+            if (!putSequence(op, oend, anchor, static_cast<size_t>(ip - anchor), static_cast<size_t>(ip - ref), len)) {
+                return 0;
+            }
+            ip += len;
+            anchor = ip;
+            // the end of a match often starts the next one
+            if (ip < matchLimit) table[hash(read32(ip - 2))] = static_cast<uint32_t>(ip - 2 - src);
+        }
+    }
+    if (!putSequence(op, oend, anchor, static_cast<size_t>(src + size - anchor), 0, 0)) return 0;
+    return static_cast<size_t>(op - dst);
+}
+
+bool decompress(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t size) {
+    const uint8_t *ip = src;
+    const uint8_t *const iend = src + srcSize;
+    uint8_t *op = dst;
+    uint8_t *const oend = dst + size;
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t literalLen = token >> 4;
+        if (literalLen == 15 && !getLength(ip, iend, literalLen)) return false;
+        if (literalLen > static_cast<size_t>(iend - ip) || literalLen > static_cast<size_t>(oend - op)) return false;
+        if (literalLen > 0) std::memcpy(op, ip, literalLen);
+        op += literalLen;
+        ip += literalLen;
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return false;
+        size_t offset = static_cast<size_t>(ip[0]) | static_cast<size_t>(ip[1]) << 8;
+        ip += 2;
+        if (offset == 0 || offset > static_cast<size_t>(op - dst)) return false;
+        size_t matchLen = token & 15;
+        if (matchLen == 15 && !getLength(ip, iend, matchLen)) return false;
+        matchLen += MIN_MATCH;
+        if (matchLen > static_cast<size_t>(oend - op)) return false;
+        const uint8_t *ref = op - offset;
+        uint8_t *matchEnd = op + matchLen;
+        // an overlapping match repeats the last `offset` bytes, every copy doubles what can be copied next
+        while (op < matchEnd) {
+            size_t n = std::min(static_cast<size_t>(op - ref), static_cast<size_t>(matchEnd - op));
+            std::memcpy(op, ref, n);
+            op += n;
+        }
+    }
+    return op == oend;
+}
+
+bool worthCompressing(const uint8_t *src, size_t size) {
+    if (size < SAMPLE_WINDOWS * SAMPLE_WINDOW) return true;
+    std::array<uint32_t, 256> counts{};
+    size_t stride = size / SAMPLE_WINDOWS;
+    for (size_t w = 0; w < SAMPLE_WINDOWS; ++w) {
+        const uint8_t *window = src + w * stride;
+        for (size_t i = 0; i < SAMPLE_WINDOW; ++i) ++counts[window[i]];
+    }
+    const double total = SAMPLE_WINDOWS * SAMPLE_WINDOW;
+    double entropy = 0;
+    for (uint32_t count : counts) {
+        if (count == 0) continue;
+        double p = count / total;
+        entropy -= p * std::log2(p);
+    }
+    return entropy < MAX_ENTROPY;
+}
+
+} // namespace minidrive::lz
@@ -0,0 +1,75 @@
+#include "minidrive/merkle.hpp"
+#include <sodium.h>
+
+namespace minidrive {
+
+MerkleTree::MerkleTree() : _levels(1) {
+}
+
+MerkleTree::MerkleTree(std::vector<ChunkTag> leaves) {
+    _levels.push_back(std::move(leaves));
+    while (_levels.back().size() > 1) {
+        const auto &below = _levels.back();
+        std::vector<ChunkTag> level((below.size() + 1) / 2);
+        for (size_t i = 0; i < level.size(); ++i) {
+            if (2 * i + 1 == below.size()) {
+                level[i] = below[2 * i];
+                continue;
+            }
+            crypto_generichash_state state;
+            crypto_generichash_init(&state, nullptr, 0, level[i].size());
+            crypto_generichash_update(&state, below[2 * i].data(), below[2 * i].size());
+            crypto_generichash_update(&state, below[2 * i + 1].data(), below[2 * i + 1].size());
+            crypto_generichash_final(&state, level[i].data(), level[i].size());
+        }
+        _levels.push_back(std::move(level));
+    }
+}
+
+ChunkTag MerkleTree::root() const {
+    return _levels.back().empty() ? ChunkTag{} : _levels.back().front();
+}
+
+std::string tagToHex(const ChunkTag &tag) {
+    char hex[CHUNK_TAG_BYTES * 2 + 1];
+    sodium_bin2hex(hex, sizeof(hex), tag.data(), tag.size());
+    return std::string(hex);
+}
+
+std::optional<ChunkTag> tagFromHex(const std::string &hex) {
+    ChunkTag tag;
+    size_t len = 0;
+    if (sodium_hex2bin(tag.data(), tag.size(), hex.data(), hex.size(), nullptr, &len, nullptr) != 0
+            || len != tag.size()) {
+        return std::nullopt;
+    }
+    return tag;
+}
+
+TreeDiff::TreeDiff(const MerkleTree &local) : _local(local), _level(local.levels() - 1), _done(false) {
+    for (uint64_t i = 0; i < local.width(_level); ++i) _suspects.push_back(i);
+    // an empty file has nothing to compare
+    _done = _suspects.empty();
+}
+
+bool TreeDiff::next(const std::vector<ChunkTag> &hashes) {
+    if (_done || hashes.size() != _suspects.size()) return false;
+    _differing.clear();
+    for (size_t i = 0; i < _suspects.size(); ++i) {
+        if (hashes[i] != _local.node(_level, _suspects[i])) _differing.push_back(_suspects[i]);
+    }
+    if (_level == 0 || _differing.empty()) {
+        _done = true;
+        _suspects.clear();
+        return true;
+    }
+    --_level;
+    _suspects.clear();
+    for (uint64_t i : _differing) {
+        _suspects.push_back(2 * i);
+        if (2 * i + 1 < _local.width(_level)) _suspects.push_back(2 * i + 1);
+    }
+    return true;
+}
+
+} // namespace minidrive
@@ -0,0 +1,86 @@
+#include "minidrive/rate_limit.hpp"
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <cctype>
+
+namespace minidrive {
+
+namespace {
+
+int64_t steadyNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+TokenBucket::TokenBucket(double rate, double burst)
+    : _nsPerToken(rate > 0 ? 1e9 / rate : 0), _burstNs(static_cast<int64_t>(std::max(burst, 1.0) * _nsPerToken)),
+      _tat(0) {
+
+}
+
+std::chrono::nanoseconds TokenBucket::charge(double tokens) {
+    if (unlimited() || tokens <= 0) return std::chrono::nanoseconds(0);
+    int64_t now = steadyNs();
+    auto cost = static_cast<int64_t>(tokens * _nsPerToken);
+    int64_t tat = _tat.load(std::memory_order_relaxed);
+    int64_t next;
+    do {
+        next = std::max(tat, now) + cost;
+    } while (!_tat.compare_exchange_weak(tat, next, std::memory_order_relaxed));
+    return std::chrono::nanoseconds(std::max<int64_t>(0, next - now - _burstNs));
+}
+
+std::optional<RateLimit> parseRateLimit(const std::string &text) {
+    auto colon = text.find(':');
+    if (colon == std::string::npos) return std::nullopt;
+    RateLimit limit;
+    try {
+        size_t used = 0;
+        limit.commands = std::stod(text.substr(0, colon), &used);
+        if (used != colon) return std::nullopt;
+    } catch (const std::exception&) {
+        return std::nullopt;
+    }
+    auto bytes = parseBytes(text.substr(colon + 1));
+    if (!bytes) return std::nullopt;
+    limit.bytes = *bytes;
+    if (limit.commands < 0) return std::nullopt;
+    return limit;
+}
+
+std::optional<double> parseBytes(const std::string &text) {
+    double bytes = 0;
+    try {
+        size_t used = 0;
+        bytes = std::stod(text, &used);
+        if (used + 1 == text.size()) {
+            switch (std::toupper(static_cast<unsigned char>(text.back()))) {
+            case 'K': bytes *= 1024; break;
+            case 'M': bytes *= 1024 * 1024; break;
+            case 'G': bytes *= 1024 * 1024 * 1024; break;
+            default: return std::nullopt;
+            }
+        } else if (used != text.size()) {
+            return std::nullopt;
+        }
+    } catch (const std::exception&) {
+        return std::nullopt;
+    }
+    if (bytes < 0) return std::nullopt;
+    return bytes;
+}
+
+RateBuckets::RateBuckets(const RateLimit &limit)
+    : _commands(limit.commands, limit.commands * COMMAND_BURST_SECONDS),
+      _bytes(limit.bytes, std::max(limit.bytes * BYTE_BURST_SECONDS, MIN_BYTE_BURST)) {
+
+}
+
+std::chrono::nanoseconds RateBuckets::charge(double commands, size_t bytes) {
+    return std::max(_commands.charge(commands), _bytes.charge(static_cast<double>(bytes)));
+}
+
+} // namespace minidrive
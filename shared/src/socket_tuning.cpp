@@ -0,0 +1,91 @@
+#include "minidrive/socket_tuning.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <spdlog/spdlog.h>
+
+namespace minidrive {
+
+namespace {
+
+// idle time before the first probe, the server's keepalive messages cover the common case
+const int KEEPALIVE_IDLE_SECONDS = 60;
+const int KEEPALIVE_INTERVAL_SECONDS = 10;
+const int KEEPALIVE_PROBES = 6;
+
+void setInt(int fd, int level, int option, int value) {
+    ::setsockopt(fd, level, option, &value, sizeof(value));
+}
+
+int getInt(int fd, int level, int option) {
+    int value = 0;
+    socklen_t len = sizeof(value);
+    if (::getsockopt(fd, level, option, &value, &len) != 0) return 0;
+    return value;
+}
+
+// the largest size setsockopt accepts without CAP_NET_ADMIN
+size_t systemMax(bool send) {
+    static const size_t sendMax = [] {
+        size_t value = 0;
+        std::ifstream("/proc/sys/net/core/wmem_max") >> value;
+        return value;
+    }();
+    static const size_t receiveMax = [] {
+        size_t value = 0;
+        std::ifstream("/proc/sys/net/core/rmem_max") >> value;
+        return value;
+    }();
+    return send ? sendMax : receiveMax;
+}
+
+} // namespace
+
+void tuneSocket(int fd, const SocketTuning &tuning) {
+    setInt(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+    setInt(fd, SOL_SOCKET, SO_KEEPALIVE, 1);
+    setInt(fd, IPPROTO_TCP, TCP_KEEPIDLE, KEEPALIVE_IDLE_SECONDS);
+    setInt(fd, IPPROTO_TCP, TCP_KEEPINTVL, KEEPALIVE_INTERVAL_SECONDS);
+    setInt(fd, IPPROTO_TCP, TCP_KEEPCNT, KEEPALIVE_PROBES);
+    if (tuning.bufferBytes > 0) {
+        int bytes = static_cast<int>(std::min<size_t>(tuning.bufferBytes, INT32_MAX));
+        setInt(fd, SOL_SOCKET, SO_SNDBUF, bytes);
+        setInt(fd, SOL_SOCKET, SO_RCVBUF, bytes);
+    }
+}
+
+void setCork(int fd, bool corked) {
+    setInt(fd, IPPROTO_TCP, TCP_CORK, corked ? 1 : 0);
+}
+
+BufferSizer::BufferSizer(bool send) : _send(send), _bytes(0), _since(std::chrono::steady_clock::now()) {}
+
+void BufferSizer::account(int fd, size_t bytes) {
+    if (_bytes == 0) _since = std::chrono::steady_clock::now();
+    _bytes += bytes;
+    if (_bytes < MEASURE_BYTES) return;
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - _since).count();
+    double rate = static_cast<double>(_bytes) / std::max(seconds, 1e-6);
+    _bytes = 0;
+
+    tcp_info info{};
+    socklen_t len = sizeof(info);
+    if (::getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0) return;
+    double rtt = (_send ? info.tcpi_rtt : info.tcpi_rcv_rtt) / 1e6;
+    if (rtt <= 0) return;
+
+    // the kernel reports and caps twice the requested size, half of it is bookkeeping
+    int option = _send ? SO_SNDBUF : SO_RCVBUF;
+    auto current = static_cast<size_t>(getInt(fd, SOL_SOCKET, option));
+    auto wanted = std::min(static_cast<size_t>(4 * rate * rtt), 2 * systemMax(_send));
+    if (wanted <= current + current / 4) return;
+    setInt(fd, SOL_SOCKET, option, static_cast<int>(std::min<size_t>(wanted / 2, INT32_MAX)));
+    spdlog::debug("{} buffer {} -> {} KiB (rtt {:.1f} ms, {:.1f} MiB/s)", _send ? "send" : "receive", current / 1024,
+        static_cast<size_t>(getInt(fd, SOL_SOCKET, option)) / 1024, rtt * 1e3, rate / (1024 * 1024));
+}
+
+} // namespace minidrive
@@ -0,0 +1,190 @@
+#include "minidrive/transfer.hpp"
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sodium.h>
+#include "minidrive/lz.hpp"
+
+namespace minidrive {
+
+ChunkTag chunkTag(const uint8_t *data, size_t len) {
+    ChunkTag tag;
+    crypto_generichash(tag.data(), tag.size(), data, len, nullptr, 0);
+    return tag;
+}
+
+void ChunkHeader::encode(uint8_t *out) const {
+    for (int i = 0; i < 4; ++i) out[i] = (transferId >> (8 * i)) & 0xff;
+    for (int i = 0; i < 8; ++i) out[4 + i] = (offset >> (8 * i)) & 0xff;
+    std::memcpy(out + 12, tag.data(), tag.size());
+}
+
+ChunkHeader ChunkHeader::decode(const uint8_t *in) {
+    ChunkHeader header;
+    for (int i = 0; i < 4; ++i) header.transferId |= static_cast<uint32_t>(in[i]) << (8 * i);
+    for (int i = 0; i < 8; ++i) header.offset |= static_cast<uint64_t>(in[4 + i]) << (8 * i);
+    std::memcpy(header.tag.data(), in + 12, header.tag.size());
+    return header;
+}
+
+void encodeChunkFrame(uint8_t *frame, const ChunkHeader &header, uint32_t len) {
+    uint32_t payloadLength = static_cast<uint32_t>(ChunkHeader::SIZE) + len;
+    frame[0] = static_cast<uint8_t>(data_type::DATA);
+    for (int i = 0; i < 4; ++i) frame[1 + i] = (payloadLength >> (8 * i)) & 0xff;
+    header.encode(frame + MsgHeader::SIZE);
+}
+
+MsgPayload makeChunkFrame(const ChunkHeader &header, uint32_t len) {
+    MsgPayload frame(chunkFrameSize(len));
+    encodeChunkFrame(frame.data(), header, len);
+    return frame;
+}
+
+ChunkTag tagChunkFrame(uint8_t *frame, size_t frameSize) {
+    const size_t headers = MsgHeader::SIZE + ChunkHeader::SIZE;
+    ChunkTag tag = chunkTag(frame + headers, frameSize - headers);
+    std::memcpy(frame + headers - tag.size(), tag.data(), tag.size());
+    return tag;
+}
+
+FileHasher::FileHasher(uint64_t chunks) {
+    reset(chunks);
+}
+
+void FileHasher::reset(uint64_t chunks) {
+    _tags.assign(chunks, ChunkTag{});
+    _have.assign(chunks, false);
+    _next = 0;
+    _hex.clear();
+    crypto_generichash_init(&_state, nullptr, 0, crypto_generichash_BYTES);
+}
+
+void FileHasher::add(uint64_t index, const ChunkTag &tag) {
+    if (index >= _tags.size() || _have[index]) return;
+    _tags[index] = tag;
+    _have[index] = true;
+    while (_next < _tags.size() && _have[_next]) {
+        crypto_generichash_update(&_state, _tags[_next].data(), _tags[_next].size());
+        ++_next;
+    }
+}
+
+std::string FileHasher::hex() {
+    if (!complete()) return {};
+    if (_hex.empty()) {
+        unsigned char digest[crypto_generichash_BYTES];
+        crypto_generichash_final(&_state, digest, sizeof(digest));
+        char hex[sizeof(digest) * 2 + 1];
+        sodium_bin2hex(hex, sizeof(hex), digest, sizeof(digest));
+        _hex = hex;
+    }
+    return _hex;
+}
+
+bool compressChunkFrame(const uint8_t *frame, size_t frameSize, MsgPayload &out) {
+    const size_t headers = MsgHeader::SIZE + ChunkHeader::SIZE;
+    const uint8_t *data = frame + headers;
+    size_t len = frameSize - headers;
+    if (len == 0 || !lz::worthCompressing(data, len)) return false;
+    out.resize(frameSize);
+    // anything not smaller than the chunk would be taken for a raw chunk
+    size_t packed = lz::compress(data, len, out.data() + headers, len - 1);
+    if (packed == 0) return false;
+    out.resize(headers + packed);
+    encodeChunkFrame(out.data(), ChunkHeader::decode(frame + MsgHeader::SIZE), static_cast<uint32_t>(packed));
+    return true;
+}
+
+bool decompressChunk(const uint8_t *payload, size_t payloadSize, uint32_t len, MsgPayload &out) {
+    out.resize(ChunkHeader::SIZE + len);
+    std::memcpy(out.data(), payload, ChunkHeader::SIZE);
+    return lz::decompress(payload + ChunkHeader::SIZE, payloadSize - ChunkHeader::SIZE, out.data() + ChunkHeader::SIZE, len);
+}
+
+bool isZero(const uint8_t *data, size_t len) {
+    // every byte equals the one before it and the first is zero
+    return len == 0 || (data[0] == 0 && std::memcmp(data, data + 1, len - 1) == 0);
+}
+
+ChunkTag zeroTag(uint32_t len) {
+    static const std::vector<uint8_t> zeros(CHUNK_SIZE);
+    static const ChunkTag full = chunkTag(zeros.data(), CHUNK_SIZE);
+    if (len == CHUNK_SIZE) return full;
+    if (len < CHUNK_SIZE) return chunkTag(zeros.data(), len);
+    return chunkTag(std::vector<uint8_t>(len).data(), len);
+}
+
+std::vector<uint64_t> holeChunks(int fd, uint64_t size, uint32_t chunkSize) {
+    std::vector<uint64_t> holes;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    uint64_t pos = 0;
+    while (pos < size) {
+        off_t data = lseek(fd, static_cast<off_t>(pos), SEEK_DATA);
+        // ENXIO: nothing but holes up to the end
+        if (data < 0 && errno != ENXIO) return {};
+        uint64_t dataStart = data < 0 ? size : std::min<uint64_t>(static_cast<uint64_t>(data), size);
+        // whole chunks in [pos, dataStart), the last one may be short
+        uint64_t first = (pos + chunkSize - 1) / chunkSize;
+        uint64_t end = dataStart == size ? chunkCount(size, chunkSize) : dataStart / chunkSize;
+        for (uint64_t i = first; i < end; ++i) holes.push_back(i);
+        if (dataStart == size) break;
+        off_t hole = lseek(fd, static_cast<off_t>(dataStart), SEEK_HOLE);
+        if (hole < 0) return {};
+        pos = static_cast<uint64_t>(hole);
+    }
+#endif
+    return holes;
+}
+
+ChunkRanges toRanges(const std::vector<uint64_t> &indices) {
+    ChunkRanges ranges;
+    for (uint64_t index : indices) {
+        if (!ranges.empty() && ranges.back().first + ranges.back().second == index) {
+            ++ranges.back().second;
+        } else {
+            ranges.emplace_back(index, 1);
+        }
+    }
+    return ranges;
+}
+
+bool fromRanges(const ChunkRanges &ranges, uint64_t count, std::vector<uint64_t> &indices) {
+    indices.clear();
+    uint64_t next = 0;
+    for (const auto &[first, length] : ranges) {
+        if (first < next || length == 0 || length > count || first > count - length) return false;
+        for (uint64_t i = first; i < first + length; ++i) indices.push_back(i);
+        next = first + length;
+    }
+    return true;
+}
+
+bool punchHole(int fd, uint64_t offset, uint64_t len) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(offset), static_cast<off_t>(len)) == 0) {
+        return true;
+    }
+    if (errno != EOPNOTSUPP) return false;
+#endif
+    static const std::vector<uint8_t> zeros(CHUNK_SIZE);
+    while (len > 0) {
+        size_t n = static_cast<size_t>(std::min<uint64_t>(len, zeros.size()));
+        ssize_t written = pwrite(fd, zeros.data(), n, static_cast<off_t>(offset));
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        offset += static_cast<uint64_t>(written);
+        len -= static_cast<uint64_t>(written);
+    }
+    return true;
+}
+
+std::string makeTransferToken() {
+    unsigned char raw[TRANSFER_TOKEN_BYTES];
+    randombytes_buf(raw, sizeof(raw));
+    char hex[TRANSFER_TOKEN_BYTES * 2 + 1];
+    sodium_bin2hex(hex, sizeof(hex), raw, sizeof(raw));
+    return std::string(hex);
+}
+
+} // namespace minidrive
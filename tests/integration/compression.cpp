@@ -0,0 +1,163 @@
+#include "minidrive/lz.hpp"
+#include "minidrive/transfer.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Benchmarks DATA chunk compression on a few kinds of files and checks that chunks round-trip,
+// that incompressible data is skipped by the entropy check and that corrupt input is rejected.
+// Prints the modelled transfer speedup on links of a few bandwidths.
+
+namespace {
+
+constexpr size_t CORPUS_BYTES = 32 * 1024 * 1024;
+constexpr double LINKS_MIB[] = {10, 100, 1000};
+
+using Clock = std::chrono::steady_clock;
+
+std::vector<uint8_t> makeLogs(std::mt19937_64 &rng) {
+    static const char *levels[] = {"INFO", "INFO", "INFO", "WARN", "DEBUG"};
+    std::string out;
+    char line[256];
+    while (out.size() < CORPUS_BYTES) {
+        int n = std::snprintf(line, sizeof(line),
+            "2026-10-19T04:%02u:%02u.%03u %s [worker-%u] request id=%08x path=/api/v1/items/%u status=%u took=%ums\n",
+            unsigned(rng() % 60), unsigned(rng() % 60), unsigned(rng() % 1000), levels[rng() % 5], unsigned(rng() % 16),
+            unsigned(rng()), unsigned(rng() % 100000), rng() % 10 ? 200u : 404u, unsigned(rng() % 500));
+        out.append(line, static_cast<size_t>(n));
+    }
+    return std::vector<uint8_t>(out.begin(), out.begin() + CORPUS_BYTES);
+}
+
+std::vector<uint8_t> makeCsv(std::mt19937_64 &rng) {
+    static const char *cities[] = {"Bratislava", "Kosice", "Zilina", "Nitra", "Presov"};
+    std::string out = "id,date,city,amount,quantity\n";
+    char line[128];
+    for (unsigned id = 1; out.size() < CORPUS_BYTES; ++id) {
+        int n = std::snprintf(line, sizeof(line), "%u,2026-%02u-%02u,%s,%u.%02u,%u\n", id, unsigned(rng() % 12 + 1),
+            unsigned(rng() % 28 + 1), cities[rng() % 5], unsigned(rng() % 10000), unsigned(rng() % 100), unsigned(rng() % 50));
+        out.append(line, static_cast<size_t>(n));
+    }
+    return std::vector<uint8_t>(out.begin(), out.begin() + CORPUS_BYTES);
+}
+
+// stands in for compressed media and archives
+std::vector<uint8_t> makeRandom(std::mt19937_64 &rng) {
+    std::vector<uint8_t> out(CORPUS_BYTES);
+    for (size_t i = 0; i < out.size(); i += sizeof(uint64_t)) {
+        uint64_t v = rng();
+        std::memcpy(out.data() + i, &v, sizeof(v));
+    }
+    return out;
+}
+
+struct Result {
+    size_t chunks = 0;
+    size_t compressed = 0;
+    size_t wireBytes = 0;
+    double compressSeconds = 0;
+    double decompressSeconds = 0;
+    bool ok = true;
+};
+
+Result run(const std::vector<uint8_t> &corpus) {
+    Result result;
+    const uint32_t chunkSize = minidrive::CHUNK_SIZE;
+    for (uint64_t offset = 0; offset < corpus.size(); offset += chunkSize) {
+        uint32_t len = minidrive::chunkLength(corpus.size(), chunkSize, offset);
+        MsgPayload frame = minidrive::makeChunkFrame(minidrive::ChunkHeader{1, offset}, len);
+        std::memcpy(minidrive::chunkData(frame), corpus.data() + offset, len);
+        auto tag = minidrive::tagChunkFrame(frame.data(), frame.size());
+        ++result.chunks;
+
+        MsgPayload packed;
+        auto start = Clock::now();
+        bool compressed = minidrive::compressChunkFrame(frame.data(), frame.size(), packed);
+        result.compressSeconds += std::chrono::duration<double>(Clock::now() - start).count();
+        if (!compressed) {
+            result.wireBytes += len;
+            continue;
+        }
+        ++result.compressed;
+        const uint8_t *payload = packed.data() + MsgHeader::SIZE;
+        size_t payloadSize = packed.size() - MsgHeader::SIZE;
+        result.wireBytes += payloadSize - minidrive::ChunkHeader::SIZE;
+
+        MsgPayload chunk;
+        start = Clock::now();
+        bool decoded = minidrive::decompressChunk(payload, payloadSize, len, chunk);
+        result.decompressSeconds += std::chrono::duration<double>(Clock::now() - start).count();
+        if (!decoded || std::memcmp(chunk.data() + minidrive::ChunkHeader::SIZE, corpus.data() + offset, len) != 0
+                || minidrive::ChunkHeader::decode(chunk.data()).offset != offset
+                || minidrive::ChunkHeader::decode(chunk.data()).tag != tag) {
+            std::cerr << "chunk at " << offset << " did not round-trip" << std::endl;
+            result.ok = false;
+        }
+
+        // a damaged stream must fail or stay inside the buffer, never read or write past it
+        MsgPayload damaged(payload, payload + payloadSize);
+        damaged[minidrive::ChunkHeader::SIZE + (offset / chunkSize * 7919) % (payloadSize - minidrive::ChunkHeader::SIZE)] ^= 0x5a;
+        minidrive::decompressChunk(damaged.data(), damaged.size(), len, chunk);
+        if (minidrive::decompressChunk(payload, payloadSize - 1, len, chunk)) {
+            std::cerr << "truncated chunk at " << offset << " was accepted" << std::endl;
+            result.ok = false;
+        }
+    }
+    return result;
+}
+
+void report(const char *name, const Result &r) {
+    const double mib = static_cast<double>(CORPUS_BYTES) / (1024 * 1024);
+    double ratio = static_cast<double>(r.wireBytes) / static_cast<double>(CORPUS_BYTES);
+    double compressSpeed = mib / std::max(r.compressSeconds, 1e-9);
+    double decompressSpeed = r.compressed
+        ? mib * static_cast<double>(r.compressed) / static_cast<double>(r.chunks) / std::max(r.decompressSeconds, 1e-9)
+        : 0;
+    std::printf("%-8s ratio %.3f  %zu/%zu chunks compressed  compress %7.0f MiB/s  decompress %6.0f MiB/s\n",
+        name, ratio, r.compressed, r.chunks, compressSpeed, decompressSpeed);
+    // sender, link and receiver work as a pipeline, the slowest stage sets the rate
+    for (double link : LINKS_MIB) {
+        double rate = std::min(link / ratio, compressSpeed);
+        if (r.compressed) rate = std::min(rate, decompressSpeed / (static_cast<double>(r.compressed) / static_cast<double>(r.chunks)));
+        std::printf("         %5.0f MiB/s link: %7.1f MiB/s effective (%.2fx)\n", link, rate, rate / link);
+    }
+}
+
+} // namespace
+
+int main() {
+    std::mt19937_64 rng(42);
+    struct Corpus {const char *name; std::vector<uint8_t> data;};
+    std::vector<Corpus> corpora;
+    corpora.push_back({"logs", makeLogs(rng)});
+    corpora.push_back({"csv", makeCsv(rng)});
+    corpora.push_back({"random", makeRandom(rng)});
+    corpora.push_back({"zeros", std::vector<uint8_t>(CORPUS_BYTES)});
+
+    bool ok = true;
+    for (const auto &corpus : corpora) {
+        Result r = run(corpus.data);
+        report(corpus.name, r);
+        ok = ok && r.ok;
+        bool text = std::strcmp(corpus.name, "logs") == 0 || std::strcmp(corpus.name, "csv") == 0;
+        if (text && r.wireBytes > CORPUS_BYTES * 6 / 10) {
+            std::cerr << corpus.name << " shrank by less than 40%" << std::endl;
+            ok = false;
+        }
+        // random data goes out raw, the entropy check skips it for a few microseconds per chunk
+        if (std::strcmp(corpus.name, "random") == 0 && r.compressed != 0) {
+            std::cerr << "random data was compressed" << std::endl;
+            ok = false;
+        }
+    }
+
+    if (!ok) return 1;
+    std::cout << "\nCompression benchmark passed" << std::endl;
+    return 0;
+}
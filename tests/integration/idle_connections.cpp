@@ -0,0 +1,169 @@
+#include "server.hpp"
+#include "globals.hpp"
+#include "storage.hpp"
+#include "minidrive/async_socket.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <asio.hpp>
+#include <sodium.h>
+#include <spdlog/spdlog.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Guards the footprint of idle connections: runs a server in this process, opens many connections
+// to its Unix socket and measures how much the resident set grew per accepted session.
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// budget for one idle session in user space, its socket, registry entry and asio's reactor state included
+constexpr size_t MAX_BYTES_PER_CONNECTION = 1536;
+constexpr size_t MAX_CONNECTIONS = 10000;
+constexpr size_t WARMUP = 64;
+// connections opened before waiting for the server to accept them, below the listen backlog
+constexpr size_t BATCH = 128;
+
+size_t residentBytes() {
+    long pages = 0, resident = 0;
+    FILE *f = std::fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    if (std::fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+    std::fclose(f);
+    return static_cast<size_t>(resident) * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+// plain sockets for the client side, so that only the server side is measured
+int connectTo(const std::string &path) {
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool readFully(int fd, uint8_t *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t n = ::read(fd, buffer, length);
+        if (n <= 0) return false;
+        buffer += n;
+        length -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+} // namespace
+
+int main() {
+    spdlog::set_level(spdlog::level::off);
+
+    // two descriptors per connection, WARMUP more connections and some spare
+    rlimit limit{};
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    size_t connections = std::min<size_t>(MAX_CONNECTIONS, (static_cast<size_t>(limit.rlim_cur) - 256) / 2 - WARMUP);
+    if (connections < 1000) {
+        std::cout << "descriptor limit too low (" << limit.rlim_cur << "), skipping" << std::endl;
+        return 0;
+    }
+    if (sodium_init() < 0) return 1;
+
+    // the roots are kept in memory, only the users file is written
+    fs::path root = fs::temp_directory_path() / ("minidrive-idle-" + std::to_string(getpid()));
+    std::string socketPath = root.string() + ".sock";
+    ROOT_DIR_PATH = root;
+    USERS_FILE_PATH = ROOT_DIR_PATH / USERS_FILE;
+    PUBLIC_DIR_PATH = ROOT_DIR_PATH / PUBLIC_DIR;
+    USERDATA_DIR_PATH = ROOT_DIR_PATH / USERDATA_DIR;
+
+    asio::io_context io;
+    auto guard = asio::make_work_guard(io);
+    MiniDriveServer server(io, 0);
+    server.setUnixSocket(socketPath);
+    server.setStorage(StorageEngine::create("memory"));
+    server.start();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 2; ++i) threads.emplace_back([&io] {io.run();});
+
+    std::vector<int> clients;
+    clients.reserve(connections + WARMUP);
+    bool failed = false;
+    auto open = [&](size_t count) {
+        for (size_t done = 0; done < count && !failed;) {
+            size_t batch = std::min(BATCH, count - done);
+            for (size_t i = 0; i < batch; ++i) {
+                int fd = connectTo(socketPath);
+                if (fd < 0) {
+                    std::cerr << "connect failed" << std::endl;
+                    failed = true;
+                    return;
+                }
+                clients.push_back(fd);
+            }
+            done += batch;
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+            while (server.sessionCount() < clients.size()) {
+                if (std::chrono::steady_clock::now() > deadline) {
+                    std::cerr << "server accepted " << server.sessionCount() << " of " << clients.size()
+                        << " connections" << std::endl;
+                    failed = true;
+                    return;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+    };
+
+    // warm up the allocator and the reactor before measuring
+    open(WARMUP);
+    size_t before = residentBytes();
+    open(connections);
+    size_t after = residentBytes();
+    size_t perConnection = (after > before ? after - before : 0) / connections;
+    if (!failed) std::cout << connections << " idle sessions, " << perConnection << "B resident per session" << std::endl;
+
+    // the sessions still answer
+    std::string command = R"({"cmd":"AUTH","mode":"public","args":{}})";
+    MsgPayload message = AsyncSocket::makeFrame(data_type::COMMAND, static_cast<uint32_t>(command.size()));
+    std::copy(command.begin(), command.end(), message.begin() + MsgHeader::SIZE);
+    for (size_t i = 0; i < 16 && !failed; ++i) {
+        uint8_t header[MsgHeader::SIZE];
+        if (::write(clients[i], message.data(), message.size()) != static_cast<ssize_t>(message.size())
+            || !readFully(clients[i], header, sizeof(header))) {
+            std::cerr << "session " << i << " did not answer" << std::endl;
+            failed = true;
+        }
+    }
+
+    for (int fd : clients) ::close(fd);
+    server.stop();
+    for (auto &thread : threads) thread.join();
+    std::error_code ec;
+    fs::remove_all(root, ec);
+
+    if (failed) return 1;
+    if (perConnection > MAX_BYTES_PER_CONNECTION) {
+        std::cerr << "idle sessions use more than " << MAX_BYTES_PER_CONNECTION << "B each" << std::endl;
+        return 1;
+    }
+    std::cout << "\nIdle session footprint within budget" << std::endl;
+    return 0;
+}
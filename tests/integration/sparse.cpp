@@ -0,0 +1,108 @@
+#include "minidrive/transfer.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sodium.h>
+
+// Checks the sparse file helpers: zero detection, hole ranges on the wire, and that the chunks found in holes
+// of a sparse file are the ones without data. Filesystems without SEEK_HOLE report no holes, which is skipped.
+
+namespace {
+
+bool fail(const std::string &message) {
+    std::cerr << message << std::endl;
+    return false;
+}
+
+bool checkZeros() {
+    std::vector<uint8_t> chunk(minidrive::CHUNK_SIZE);
+    if (!minidrive::isZero(chunk.data(), chunk.size())) return fail("zero chunk not detected");
+    chunk.back() = 1;
+    if (minidrive::isZero(chunk.data(), chunk.size())) return fail("last byte missed");
+    chunk.back() = 0;
+    chunk.front() = 1;
+    if (minidrive::isZero(chunk.data(), chunk.size())) return fail("first byte missed");
+    chunk.front() = 0;
+    if (minidrive::zeroTag(minidrive::CHUNK_SIZE) != minidrive::chunkTag(chunk.data(), chunk.size())) {
+        return fail("zero tag differs from the tag of zeros");
+    }
+    if (minidrive::zeroTag(1000) != minidrive::chunkTag(chunk.data(), 1000)) return fail("short zero tag differs");
+    return true;
+}
+
+bool checkRanges() {
+    std::vector<uint64_t> indices = {0, 1, 2, 5, 7, 8};
+    auto ranges = minidrive::toRanges(indices);
+    if (ranges != minidrive::ChunkRanges{{0, 3}, {5, 1}, {7, 2}}) return fail("unexpected ranges");
+    std::vector<uint64_t> back;
+    if (!minidrive::fromRanges(ranges, 9, back) || back != indices) return fail("ranges did not round-trip");
+    if (minidrive::fromRanges(ranges, 8, back)) return fail("range past the end was accepted");
+    if (minidrive::fromRanges({{5, 1}, {0, 3}}, 9, back)) return fail("unsorted ranges were accepted");
+    if (minidrive::fromRanges({{0, 3}, {2, 1}}, 9, back)) return fail("overlapping ranges were accepted");
+    if (minidrive::fromRanges({{1, 0}}, 9, back)) return fail("empty range was accepted");
+    if (minidrive::fromRanges({{1, UINT64_MAX}}, 9, back)) return fail("overflowing range was accepted");
+    return true;
+}
+
+bool checkHoles() {
+    char path[] = "/tmp/minidrive-sparse-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) return fail("mkstemp failed");
+    unlink(path);
+    const uint64_t chunk = minidrive::CHUNK_SIZE;
+    // data in chunks 2 and 5, the last chunk is short and a hole
+    const uint64_t size = 8 * chunk + 1000;
+    std::vector<uint8_t> data(chunk, 0xab);
+    bool ok = ftruncate(fd, static_cast<off_t>(size)) == 0
+        && pwrite(fd, data.data(), chunk, static_cast<off_t>(2 * chunk)) == static_cast<ssize_t>(chunk)
+        && pwrite(fd, data.data(), 10, static_cast<off_t>(5 * chunk + 100)) == 10;
+    if (!ok) {
+        close(fd);
+        return fail("could not write the test file");
+    }
+    auto holes = minidrive::holeChunks(fd, size, minidrive::CHUNK_SIZE);
+    if (holes.empty()) {
+        std::cout << "filesystem reports no holes, skipped" << std::endl;
+    } else if (holes != std::vector<uint64_t>{0, 1, 3, 4, 6, 7, 8}) {
+        close(fd);
+        return fail("unexpected hole chunks");
+    }
+
+    // punching the data of chunk 2 leaves zeros, and a hole where supported
+    struct stat before, after;
+    fstat(fd, &before);
+    if (!minidrive::punchHole(fd, 2 * chunk, chunk)) {
+        close(fd);
+        return fail("punchHole failed");
+    }
+    fstat(fd, &after);
+    std::vector<uint8_t> read(chunk);
+    ok = pread(fd, read.data(), chunk, static_cast<off_t>(2 * chunk)) == static_cast<ssize_t>(chunk)
+        && minidrive::isZero(read.data(), read.size()) && after.st_size == before.st_size;
+    close(fd);
+    if (!ok) return fail("punched range does not read as zeros");
+    std::cout << "blocks: " << before.st_blocks << " before punching, " << after.st_blocks << " after" << std::endl;
+    return true;
+}
+
+} // namespace
+
+int main() {
+    if (sodium_init() < 0) {
+        std::cerr << "libsodium initialization failed" << std::endl;
+        return 1;
+    }
+    bool ok = checkZeros();
+    ok = checkRanges() && ok;
+    ok = checkHoles() && ok;
+    if (!ok) return 1;
+    std::cout << "Sparse file checks passed" << std::endl;
+    return 0;
+}